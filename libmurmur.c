@@ -1,19 +1,37 @@
 #define _GNU_SOURCE
 
+#include <ctype.h>
+#include <dirent.h>
 #include <endian.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "libmurmur.h"
 
 #ifdef COMPILE_TEST
-	time_t time(void *ptr) {
+	time_t time(time_t *ptr) {
 		return mmr_test_time;
 	}
-#else
-	#include <time.h>
 #endif
 
 /**
@@ -94,33 +112,185 @@ struct archive_header {
 	uint32_t points;
 } __attribute__ ((packed));
 
-static int _murmur_validate_archives_sort(const void *a, const void *b) {
-	return ((struct archive_header*)a)->seconds_per_point - ((struct archive_header*)b)->seconds_per_point;
+/**
+ * Identifies the extension block, which follows the last archive. Files created before it existed
+ * don't have one, and work as they always have.
+ */
+#define MURMUR_EXT_MAGIC "MMRX"
+#define MURMUR_EXT_VERSION 1
+
+/**
+ * The file has a prefix block, after the extension records: see murmur_prefix_enable().
+ */
+#define MURMUR_EXT_PREFIX 0x1
+
+/**
+ * The file gives each archive its own aggregation method, one byte each, right after the
+ * extension records and before the prefix block.
+ */
+#define MURMUR_EXT_AGGREGATION 0x2
+
+/**
+ * The start of the extension block.
+ */
+struct murmur_ext_header {
+	char magic[4];
+	uint32_t version;
+	
+	/**
+	 * Optional parts of the file that follow the extension records: some of MURMUR_EXT_*.
+	 */
+	uint32_t features;
+	uint32_t reserved;
+} __attribute__ ((packed));
+
+/**
+ * What the extension block knows about each archive. There is one of these for every archive,
+ * in the same order, right after the extension header.
+ */
+struct murmur_ext_archive {
+	/**
+	 * The range of points written to this archive whose propagation hasn't finished: if the
+	 * writer died, these are the buckets to propogate again. Both 0 when there's nothing to do.
+	 */
+	int64_t dirty_from;
+	int64_t dirty_until;
+} __attribute__ ((packed));
+
+/**
+ * The running totals of an archive's points, at the start of the prefix block. There is one of
+ * these for every archive, in the same order, followed by every archive's records.
+ */
+struct murmur_prefix_archive {
+	/**
+	 * The oldest and newest intervals with records, both 0 when the archive is empty.
+	 */
+	int64_t first;
+	int64_t last;
+	
+	/**
+	 * The sum (a double) and count of every point through the newest.
+	 */
+	uint64_t sum;
+	uint64_t count;
+} __attribute__ ((packed));
+
+/**
+ * The record for a slot of an archive, for every interval from the oldest point to the newest.
+ */
+struct murmur_prefix_point {
+	int64_t interval;
+	
+	/**
+	 * The point at this interval (a double), NAN if there isn't one.
+	 */
+	uint64_t value;
+	
+	/**
+	 * The sum (a double) and count of every point through this interval.
+	 */
+	uint64_t sum;
+	uint64_t count;
+} __attribute__ ((packed));
+
+/**
+ * Names for each aggregation method, indexed by (method - 1).
+ */
+static const char * const AGGREGATION_NAMES[] = {
+	"average",
+	"sum",
+	"last",
+	"max",
+	"min",
+};
+
+/**
+ * Finds the aggregation method with the given name.
+ *
+ * @return The method, 0 if the name isn't known.
+ */
+static enum aggregation_method _murmur_parse_aggregation(const char *name) {
+	for (uint32_t i = 0; i < sizeof(AGGREGATION_NAMES)/sizeof(*AGGREGATION_NAMES); i++) {
+		if (strcmp(AGGREGATION_NAMES[i], name) == 0) {
+			return i + 1;
+		}
+	}
+	
+	return 0;
+}
+
+const char* murmur_aggregation_name(const enum aggregation_method aggregation) {
+	if (aggregation < 1 || aggregation > sizeof(AGGREGATION_NAMES)/sizeof(*AGGREGATION_NAMES)) {
+		return "unknown";
+	}
+	
+	return AGGREGATION_NAMES[aggregation - 1];
 }
 
 /**
- * Given the archive spec, validates that it is okay to use as a murmur archive.
+ * Given the archive spec, validates that it is okay to use as a murmur archive, sorting the
+ * archives from most to least precise. Archives with the same precision keep the order they
+ * were given in, and the first is the one the others hang off of.
+ *
+ * @param aggregation The file's aggregation method.
+ * @param aggregations Each archive's own method, 0 for the file's. May be NULL.
  */
-static char _murmur_validate_archives(const uint32_t archive_count, struct archive_header *archive_headers) {
+static char _murmur_validate_archives(const uint32_t archive_count, struct archive_header *archive_headers, const enum aggregation_method aggregation, char *aggregations) {
 	if (archive_headers == NULL || archive_count == 0) {
 		M_ERROR("Can't create a database without archives...");
 		return -1;
 	}
 	
-	qsort(archive_headers, archive_count, sizeof(*archive_headers), _murmur_validate_archives_sort);
+	// Stable, so that siblings stay in order; there are only ever a handful of archives
+	for (uint32_t i = 1; i < archive_count; i++) {
+		for (uint32_t j = i; j > 0 && archive_headers[j - 1].seconds_per_point > archive_headers[j].seconds_per_point; j--) {
+			struct archive_header tmp = archive_headers[j];
+			archive_headers[j] = archive_headers[j - 1];
+			archive_headers[j - 1] = tmp;
+			
+			if (aggregations != NULL) {
+				char agg = aggregations[j];
+				aggregations[j] = aggregations[j - 1];
+				aggregations[j - 1] = agg;
+			}
+		}
+	}
+	
+	// The first archive at the current precision
+	uint32_t first = 0;
 	
 	for (uint32_t i = 0; i < archive_count - 1; i++) {
-		struct archive_header arch = archive_headers[i];
+		struct archive_header arch = archive_headers[first];
 		struct archive_header next_arch = archive_headers[i+1];
 		
 		uint32_t spp = arch.seconds_per_point;
 		uint32_t next_spp = next_arch.seconds_per_point;
 		
 		if (spp == next_spp) {
-			M_ERROR("A murmur database may not have two archives with the same precision (%d == %d).", spp, next_spp);
-			return -1;
+			if (first == 0) {
+				M_ERROR("The most precise archive holds points as written, so it can't share its precision (%d).", spp);
+				return -1;
+			}
+			
+			for (uint32_t j = first; j <= i; j++) {
+				char a = aggregations == NULL || aggregations[j] == 0 ? aggregation : aggregations[j];
+				char b = aggregations == NULL || aggregations[i+1] == 0 ? aggregation : aggregations[i+1];
+				if (a == b) {
+					M_ERROR("A murmur database may not have two archives with the same precision and aggregation (%d == %d).", spp, next_spp);
+					return -1;
+				}
+			}
+			
+			if (next_arch.points > arch.points) {
+				M_ERROR("Archives may not hold more points than the first at their precision (%d > %d).", next_arch.points, arch.points);
+				return -1;
+			}
+			
+			continue;
 		}
 		
+		first = i + 1;
+		
 		if (next_spp % spp != 0) {
 			M_ERROR("Lower precision archives must evenly divide higher precision archives (%d %% %d != 0).", next_spp, spp);
 			return -1;
@@ -196,11 +366,17 @@ static int _murmur_spec_to_seconds(long *precision, const char *unit, uint32_t c
  *
  * @param spec The string spec to parse.
  * @param[out] archives The archives found in the spec. This MUST ALWAYS be free'd when finished.
+ * @param[out] aggregations Each archive's own aggregation method, 0 where it doesn't give one,
+ * or NULL if none do. This MUST ALWAYS be free'd when finished. If this is NULL, archives may
+ * not give methods.
  *
  * @return The number of archives parsed.
  */
-static uint32_t _murmur_parse_archive_spec(const uint32_t specc, char **specv, struct archive_header **archive_headers) {
+static uint32_t _murmur_parse_archive_spec(const uint32_t specc, char **specv, struct archive_header **archive_headers, char **aggregations) {
 	*archive_headers = NULL;
+	if (aggregations != NULL) {
+		*aggregations = NULL;
+	}
 	
 	if (specc == 0) {
 		M_ERROR("There is no spec to parse...");
@@ -208,6 +384,7 @@ static uint32_t _murmur_parse_archive_spec(const uint32_t specc, char **specv, s
 	}
 	
 	struct archive_header *arch_headers = malloc(specc * sizeof(*arch_headers));
+	char *aggs = NULL;
 	
 	for (uint32_t i = 0; i < specc; i++) {
 		const char *curr = *(specv + i);
@@ -225,9 +402,13 @@ static uint32_t _murmur_parse_archive_spec(const uint32_t specc, char **specv, s
 			goto error;
 		}
 		
+		// An optional method, after a second colon
+		char *method = strchr(colon + 1, ':');
+		const char *points_end = method == NULL ? colon + 1 + strlen(colon + 1) : method;
+		
 		long points = strtol(colon + 1, &end, 10);
-		if (*end != '\0') {
-			if (_murmur_spec_to_seconds(&points, end, 0) == -1) {
+		if (end != points_end) {
+			if (_murmur_spec_to_seconds(&points, end, points_end - end) == -1) {
 				M_DEBUG("2");
 				goto error;
 			}
@@ -235,20 +416,56 @@ static uint32_t _murmur_parse_archive_spec(const uint32_t specc, char **specv, s
 			points /= seconds_per_point;
 		}
 		
+		if (method != NULL) {
+			enum aggregation_method agg = _murmur_parse_aggregation(method + 1);
+			if (agg == 0 || aggregations == NULL) {
+				goto error;
+			}
+			
+			if (aggs == NULL && (aggs = calloc(specc, sizeof(*aggs))) == NULL) {
+				M_PERROR("Could not allocate aggregation methods");
+				goto error;
+			}
+			aggs[i] = agg;
+		}
+		
 		struct archive_header *ah = &arch_headers[i];
 		ah->seconds_per_point = seconds_per_point;
 		ah->points = points;
 	}
 	
 	*archive_headers = arch_headers;
+	if (aggregations != NULL) {
+		*aggregations = aggs;
+	}
 	return specc;
 
 error:
 	M_ERROR("Invalid archive spec");
 	free(arch_headers);
+	free(aggs);
 	return 0;
 }
 
+/**
+ * Whether an archive is a sibling of the archive before it, at the same precision.
+ */
+static inline int _murmur_arch_is_sibling(const struct murmur *mmr, const struct murmur_archive *arch) {
+	return arch > mmr->archives && (arch - 1)->seconds_per_point == arch->seconds_per_point;
+}
+
+/**
+ * The least precise archive that isn't a sibling.
+ */
+static inline struct murmur_archive* _murmur_arch_coarsest(const struct murmur *mmr) {
+	struct murmur_archive *arch = mmr->archives + mmr->archive_count - 1;
+	while (_murmur_arch_is_sibling(mmr, arch)) {
+		arch--;
+	}
+	
+	return arch;
+}
+
 /**
  * Given the list of archives, goes through and finds the most-precise archive to use for the given timestamp.
  *
@@ -269,9 +486,14 @@ static int _murmur_get_archive(struct murmur *mmr, const int64_t timestamp, stru
 		return -1;
 	}
 	
-	// Find the highest-precision archive that covers timestamp
+	// Find the highest-precision archive that covers timestamp. Siblings are only ever written
+	// by propagation.
 	struct murmur_archive *arch = NULL;
 	for (uint32_t i = 0; i < mmr->archive_count; i++) {
+		if (_murmur_arch_is_sibling(mmr, &mmr->archives[i])) {
+			continue;
+		}
+		
 		arch = &mmr->archives[i];
 		if (arch->retention > diff) {
 			break;
@@ -283,424 +505,11956 @@ static int _murmur_get_archive(struct murmur *mmr, const int64_t timestamp, stru
 }
 
 /**
- * Moves the offset of the file description in mmr to the start of the point's location in the file.
+ * Finds where the point for a timestamp lives in the file, without touching the file.
  *
- * @param mmr Obvious
- * @param arch The archive to move relative to
- * @param timestamp The timestamp to seek to
+ * @param arch The archive the point lives in
+ * @param timestamp The timestamp to locate
  * @param[out] interval The time that should be written to disk
+ *
+ * @return The offset of the point in the file.
  */
-static int _murmur_seek_to_point(struct murmur *mmr, struct murmur_archive *arch, const int64_t timestamp, int64_t *interval) {
+static inline uint64_t _murmur_point_offset(struct murmur_archive *arch, const int64_t timestamp, int64_t *interval) {
 	*interval = timestamp - (timestamp % arch->seconds_per_point);
-	
-	int seeked = lseek(mmr->fd, arch->offset + (sizeof(struct point) * ((*interval % arch->retention) / arch->seconds_per_point)), SEEK_SET);
-	if (seeked == -1) {
-		M_PERROR("Could not seek to record");
-	}
-	
-	return seeked;
+	return arch->offset + (sizeof(struct point) * ((*interval % arch->retention) / arch->seconds_per_point));
 }
 
 /**
- * Given an aggregation method and a series of points, read directly from disk,
- * this aggregates the points into 1 point using the supplied method.
+ * Converts a value into the on-disk point format.
  */
-static double _murmur_aggregate(enum aggregation_method aggregation, uint64_t pointsc, struct point *pointsv) {
-	int64_t last_interval, last_i;
-	double val = PTVAL(pointsv);
-	
-	switch (aggregation) {
-		case agg_average:
-		default:
-			for (uint64_t i = 1; i < pointsc; i++) {
-				val += PTVAL(pointsv + i);
-			}
-			val /= pointsc;
-			break;
-			
-		case agg_sum:
-			for (uint64_t i = 1; i < pointsc; i++) {
-				val += PTVAL(pointsv + i);
-			}
-			break;
-		
-		case agg_last:
-			last_interval = PTINT(pointsv);
-			last_i = 0;
-			
-			for (uint64_t i = 1; i < pointsc; i++) {
-				uint64_t l = PTINT(pointsv + i);
-				if (l > last_interval) {
-					last_interval = i;
-					last_i = i;
-				}
-			}
-			
-			val = PTVAL(pointsv + last_i);
-			
-			break;
-		
-		case agg_max:
-			for (uint64_t i = 1; i < pointsc; i++) {
-				double v = PTVAL(pointsv + i);
-				if (v > val) {
-					val = v;
-				}
-			}
-			break;
-		
-		case agg_min:
-			for (uint64_t i = 1; i < pointsc; i++) {
-				double v = PTVAL(pointsv + i);
-				if (v < val) {
-					val = v;
-				}
-			}
-			break;
-	}
+static inline void _murmur_make_point(struct point *pt, const int64_t interval, const double value) {
+	double integral;
+	double fractional = modf(value, &integral);
 	
-	return val;
+	pt->interval = htobe64(interval);
+	pt->integral = htobe64((int64_t)integral);
+	pt->fractional = htobe32((uint32_t)(fractional*0xFFFFFFFF));
 }
 
-// Forward declaration: _murmur_propogate and _murmur_arch_set rely on each other
-static int _murmur_propogate(struct murmur *mmr, struct murmur_archive *arch, int64_t timestamp);
-
 /**
- * Given an archive, sets a value in it.
- *
- * @param mmr Obvious
- * @param arch The archive to set the value in.
- * @param timestamp The timestamp of the data to be set
- * @param value The value of the data to be set
+ * Shares the disk between classes of I/O. Until murmur_io_configure() is called, everything
+ * goes straight to the disk and only the stats are kept.
  */
-static int _murmur_arch_set(struct murmur *mmr, struct murmur_archive *arch, const int64_t timestamp, const double value) {
-	int64_t interval = 0;
-	if (_murmur_seek_to_point(mmr, arch, timestamp, &interval) == -1) {
-		return -1;
-	}
+static struct {
+	pthread_mutex_t lock;
 	
-	double integral;
-	double fractional = modf(value, &integral);
+	/**
+	 * Waiters sleep on their class's condition, so only the class that's next gets woken.
+	 */
+	pthread_cond_t cond[MURMUR_IO_CLASSES];
 	
-	struct point pt = {
-		.interval = htobe64(interval),
-		.integral = htobe64((int64_t)integral),
-		.fractional = htobe32((uint32_t)(fractional*0xFFFFFFFF)),
-	};
+	/**
+	 * Read without the lock, so that nothing is taken when scheduling is off.
+	 */
+	int enabled;
+	uint32_t depth;
+	struct murmur_io_class_opts classes[MURMUR_IO_CLASSES];
 	
-	if (write(mmr->fd, &pt, sizeof(pt)) != sizeof(pt)) {
-		M_PERROR("Could not write record");
-		return -1;
-	}
+	uint32_t inflight_total;
+	uint32_t inflight[MURMUR_IO_CLASSES];
+	uint32_t waiting[MURMUR_IO_CLASSES];
 	
-	return _murmur_propogate(mmr, arch, timestamp);
-}
+	/**
+	 * How much each class has been given, in bytes divided by its weight. The class that has
+	 * been given the least goes next, so over time each gets its weight's share.
+	 */
+	double vtime[MURMUR_IO_CLASSES];
+	
+	/**
+	 * The vtime of whatever was last let through, so that a class that was idle can't bank
+	 * credit and then hog the disk.
+	 */
+	double vclock;
+	
+	/**
+	 * Counted atomically, scheduled or not.
+	 */
+	uint64_t ops[MURMUR_IO_CLASSES];
+	uint64_t bytes[MURMUR_IO_CLASSES];
+	
+	uint64_t wait_ns[MURMUR_IO_CLASSES];
+} _murmur_io = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = { [0 ... MURMUR_IO_CLASSES - 1] = PTHREAD_COND_INITIALIZER },
+};
 
 /**
- * Given an archive, gets a value from it.
+ * The class the calling thread has claimed for its I/O, -1 to let each operation decide.
  */
-static inline int _murmur_arch_get(struct murmur *mmr, struct murmur_archive *arch, const int64_t timestamp, double * const value) {
-	int64_t interval = 0;
-	if (_murmur_seek_to_point(mmr, arch, timestamp, &interval) == -1) {
+static __thread int _murmur_io_current = -1;
+
+int murmur_io_configure(const uint32_t depth, const struct murmur_io_class_opts *classes) {
+	if (depth > 0 && classes == NULL) {
+		M_ERROR("I/O classes must be given with a queue depth");
 		return -1;
 	}
 	
-	struct point pt;
-	if (read(mmr->fd, &pt, sizeof(pt)) != sizeof(pt)) {
-		M_PERROR("Could not read record");
-		return -1;
+	pthread_mutex_lock(&_murmur_io.lock);
+	
+	__atomic_store_n(&_murmur_io.enabled, depth > 0, __ATOMIC_RELEASE);
+	_murmur_io.depth = depth;
+	
+	for (uint32_t i = 0; classes != NULL && i < MURMUR_IO_CLASSES; i++) {
+		_murmur_io.classes[i] = classes[i];
+		if (_murmur_io.classes[i].weight == 0) {
+			_murmur_io.classes[i].weight = 1;
+		}
 	}
 	
-	// Verify the data point we get back is in the right range
-	int64_t ptinterval = PTINT(&pt);
-	if (ptinterval < interval || ptinterval > (interval + arch->seconds_per_point)) {
-		return -1;
+	// Anyone waiting under the old rules might be able to go now
+	for (int i = 0; i < MURMUR_IO_CLASSES; i++) {
+		pthread_cond_broadcast(&_murmur_io.cond[i]);
 	}
 	
-	*value = PTVAL(&pt);
+	pthread_mutex_unlock(&_murmur_io.lock);
 	
 	return 0;
 }
 
+int murmur_io_set_class(const int cls) {
+	int prev = _murmur_io_current;
+	_murmur_io_current = cls >= 0 && cls < MURMUR_IO_CLASSES ? cls : -1;
+	return prev;
+}
+
+void murmur_io_stats(struct murmur_io_stats *stats) {
+	pthread_mutex_lock(&_murmur_io.lock);
+	
+	for (uint32_t i = 0; i < MURMUR_IO_CLASSES; i++) {
+		stats[i].ops = __atomic_load_n(&_murmur_io.ops[i], __ATOMIC_RELAXED);
+		stats[i].bytes = __atomic_load_n(&_murmur_io.bytes[i], __ATOMIC_RELAXED);
+		stats[i].wait_ns = _murmur_io.wait_ns[i];
+		stats[i].inflight = _murmur_io.inflight[i];
+		stats[i].waiting = _murmur_io.waiting[i];
+	}
+	
+	pthread_mutex_unlock(&_murmur_io.lock);
+}
+
 /**
- * Takes the values from the more-precise archive and propogates them, recursively, to the less-precise
- * archives.
+ * Finds the class whose waiters may go now: the one that has been given the least, of those
+ * with room. The lock must be held.
  *
- * @param mmr Obvious
- * @param arch The higher-precision archive
- * @param timestamp The timestamp of the data to be propogated down.
+ * @return The class, or -1 if nobody may go.
  */
-static int _murmur_propogate(struct murmur *mmr, struct murmur_archive *arch, const int64_t timestamp) {
-	if (arch->lower == NULL) {
-		return 0;
-	}
-	
-	int64_t interval_start = 0;
-	struct murmur_archive *lower = arch->lower;
-	
-	// So that the error jumps work
-	struct point points[lower->seconds_per_point / arch->seconds_per_point];
-	
-	uint64_t record_start = _murmur_seek_to_point(mmr, arch, timestamp, &interval_start);
-	if (record_start == -1) {
-		M_PERROR("In propogation: could not seek to offset");
-		goto error;
+static int _murmur_io_next(void) {
+	if (_murmur_io.inflight_total >= _murmur_io.depth) {
+		return -1;
 	}
 	
-	// uint64_t interval_end = interval_start + lower->seconds_per_point;
-	uint64_t archive_end = arch->offset + arch->size;
+	int next = -1;
 	
-	// If the points wrap back to the start of the archive, we can only read a
-	// few before having to go back to the beginning. More file seeking!
-	if (record_start + sizeof(points) > archive_end) {
-		uint64_t to_read = archive_end - record_start;
-		
-		if (read(mmr->fd, points, to_read) != to_read) {
-			M_PERROR("In propogation: could not read points");
-			goto error;
-		}
+	// Ties go to the lower class, so ingest wins when everyone is even
+	for (int i = 0; i < MURMUR_IO_CLASSES; i++) {
+		uint32_t depth = _murmur_io.classes[i].depth;
+		int eligible = _murmur_io.waiting[i] > 0 && (depth == 0 || _murmur_io.inflight[i] < depth);
 		
-		if (lseek(mmr->fd, arch->offset, SEEK_SET) == -1) {
-			M_PERROR("In propogation: could not seek to start of archive");
-			goto error;
-		}
-		
-		uint64_t points_read = to_read / sizeof(*points);
-		to_read = sizeof(points) - to_read;
-		
-		if (read(mmr->fd, points + points_read, to_read) != to_read) {
-			M_PERROR("In propogation: could not read wrapped points");
-			goto error;
-		}
-	} else {
-		if (read(mmr->fd, points, sizeof(points)) != sizeof(points)) {
-			M_PERROR("In propogation: could not read points");
+		if (eligible && (next == -1 || _murmur_io.vtime[i] < _murmur_io.vtime[next])) {
+			next = i;
 		}
 	}
 	
-	double val = _murmur_aggregate(mmr->aggregation, sizeof(points)/sizeof(*points), points);
-	
-	if (_murmur_arch_set(mmr, arch->lower, timestamp, val) != 0) {
-		goto error;
-	}
-	
-	return 0;
+	return next;
+}
 
-error:
-	M_ERROR("Propogation failing. This is really bad. Your archive will probably be inconsistent.");
-	return -1;
+/**
+ * Wakes one waiter of whichever class may go now, if any. The lock must be held.
+ */
+static void _murmur_io_wake(void) {
+	int next = _murmur_io_next();
+	if (next != -1) {
+		pthread_cond_signal(&_murmur_io.cond[next]);
+	}
 }
 
-int murmur_create(const char *path, const uint specc, char **specv, const enum aggregation_method aggregation, const char x_files_factor) {
-	int fd = open(path, O_CREAT|O_TRUNC|O_WRONLY, S_IRUSR|S_IWUSR|S_IRGRP);
-	if (fd == -1) {
-		M_PERROR("Could not open file for writing");
+/**
+ * Waits for a turn at the disk.
+ *
+ * @param cls The class the operation belongs to, unless the thread has claimed one.
+ *
+ * @return The class that was used, to be handed to _murmur_io_end(), or -1 if nothing was
+ *     scheduled.
+ */
+static int _murmur_io_begin(int cls, const size_t bytes) {
+	if (_murmur_io_current != -1) {
+		cls = _murmur_io_current;
+	}
+	
+	__atomic_add_fetch(&_murmur_io.ops[cls], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&_murmur_io.bytes[cls], bytes, __ATOMIC_RELAXED);
+	
+	if (!__atomic_load_n(&_murmur_io.enabled, __ATOMIC_ACQUIRE)) {
 		return -1;
 	}
 	
-	struct archive_header *arch_headers;
-	uint32_t archive_count = _murmur_parse_archive_spec(specc, specv, &arch_headers);
+	pthread_mutex_lock(&_murmur_io.lock);
 	
-	if (!archive_count || _murmur_validate_archives(archive_count, arch_headers) == -1) {
+	// It might have been turned off while taking the lock
+	if (!_murmur_io.enabled) {
+		pthread_mutex_unlock(&_murmur_io.lock);
 		return -1;
 	}
 	
-	uint64_t max_retention = 0;
-	uint32_t offset = sizeof(struct murmur_header) + (archive_count * sizeof(*arch_headers));
+	if (_murmur_io.waiting[cls] == 0 && _murmur_io.inflight[cls] == 0 && _murmur_io.vtime[cls] < _murmur_io.vclock) {
+		_murmur_io.vtime[cls] = _murmur_io.vclock;
+	}
 	
-	for (uint32_t i = 0; i < archive_count; i++) {
-		struct archive_header *ah = &arch_headers[i];
+	_murmur_io.waiting[cls]++;
+	
+	if (_murmur_io_next() != cls) {
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
 		
-		uint64_t retention = ah->seconds_per_point * ah->points;
-		if (retention > max_retention) {
-			max_retention = retention;
+		while (_murmur_io.enabled && _murmur_io_next() != cls) {
+			pthread_cond_wait(&_murmur_io.cond[cls], &_murmur_io.lock);
 		}
 		
-		// Prepare the struct for writing to disk
-		ah->offset = htobe32(offset);
-		
-		// Can't work with a number in the wrong endianess
-		offset += ah->points * sizeof(struct point);
-		
-		ah->seconds_per_point = htobe32(ah->seconds_per_point);
-		ah->points = htobe32(ah->points);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		_murmur_io.wait_ns[cls] += ((end.tv_sec - start.tv_sec) * 1000000000LL) + (end.tv_nsec - start.tv_nsec);
 	}
 	
-	struct murmur_header header = {
-		.aggregation = (aggregation == 0 ? agg_average : aggregation),
-		.max_retention = htobe64(max_retention),
-		.x_files_factor = x_files_factor,
-		.archive_count = htobe32(archive_count),
-	};
+	_murmur_io.waiting[cls]--;
+	_murmur_io.inflight_total++;
+	_murmur_io.inflight[cls]++;
+	_murmur_io.vclock = _murmur_io.vtime[cls];
+	_murmur_io.vtime[cls] += (double)bytes / _murmur_io.classes[cls].weight;
 	
-	int ret = 0;
+	// With this one gone, another class might be the furthest behind, or there might be room
+	// for another of this one
+	_murmur_io_wake();
+	pthread_mutex_unlock(&_murmur_io.lock);
 	
-	int len = sizeof(header);
-	int curr_pos = len;
-	if (write(fd, &header, len) != len) {
-		M_PERROR("Could not write murmur header");
-		ret = -1;
-		goto done;
+	return cls;
+}
+
+static void _murmur_io_end(const int cls) {
+	if (cls == -1) {
+		return;
 	}
 	
-	len = archive_count * sizeof(*arch_headers);
-	curr_pos += len;
-	if (write(fd, arch_headers, len) != len) {
-		M_PERROR("Could not write archive headers");
-		ret = -1;
-		goto done;
-	}
+	pthread_mutex_lock(&_murmur_io.lock);
 	
-	if (fallocate(fd, 0, curr_pos, offset - curr_pos) != 0) {
-		M_PERROR("Could not allocate archive area");
-		ret = -1;
-		goto done;
+	_murmur_io.inflight_total--;
+	_murmur_io.inflight[cls]--;
+	_murmur_io_wake();
+	
+	pthread_mutex_unlock(&_murmur_io.lock);
+}
+
+static ssize_t _murmur_io_pread(const int cls, const int fd, void *buf, const size_t len, const off_t offset) {
+	int used = _murmur_io_begin(cls, len);
+	ssize_t ret = pread(fd, buf, len, offset);
+	_murmur_io_end(used);
+	
+	return ret;
+}
+
+static ssize_t _murmur_io_pwrite(const int cls, const int fd, const void *buf, const size_t len, const off_t offset) {
+	int used = _murmur_io_begin(cls, len);
+	ssize_t ret = pwrite(fd, buf, len, offset);
+	_murmur_io_end(used);
+	
+	return ret;
+}
+
+static ssize_t _murmur_io_pwritev(const int cls, const int fd, const struct iovec *iov, const int iovc, const off_t offset) {
+	size_t len = 0;
+	for (int i = 0; i < iovc; i++) {
+		len += iov[i].iov_len;
 	}
 	
-done:
-	close(fd);
-	free(arch_headers);
+	int used = _murmur_io_begin(cls, len);
+	ssize_t ret = pwritev(fd, iov, iovc, offset);
+	_murmur_io_end(used);
+	
 	return ret;
 }
 
-struct murmur* murmur_open(const char *path) {
-	// So that the goto error's work
-	struct murmur *mmr = NULL;
+/**
+ * How big the first chunk of each thread's arena is. Later chunks double.
+ */
+#define MURMUR_ARENA_CHUNK (64 * 1024)
+
+/**
+ * The smallest pooled series buffer, in values, as a power of 2.
+ */
+#define MURMUR_POOL_MIN_SHIFT 6
+
+/**
+ * The number of sizes of pooled buffers: the largest holds 2^(MIN_SHIFT + CLASSES - 1)
+ * values. Anything bigger goes straight to malloc.
+ */
+#define MURMUR_POOL_CLASSES 16
+
+/**
+ * How many bytes of free buffers the pool keeps for each size.
+ */
+#define MURMUR_POOL_CLASS_BYTES (16 * 1024 * 1024)
+
+/**
+ * A block of memory that the arena hands out pieces of.
+ */
+struct _murmur_arena_chunk {
+	struct _murmur_arena_chunk *next;
+	size_t size;
+	size_t used;
+	char data[] __attribute__ ((aligned (16)));
+};
+
+/**
+ * A thread's scratch memory, for things that only live as long as a call. Memory is handed
+ * out from the front of the current chunk and taken back all at once, back to a mark, so
+ * chunks are only allocated until the thread's busiest call fits.
+ */
+struct _murmur_arena {
+	struct _murmur_arena_chunk *head;
+	struct _murmur_arena_chunk *curr;
 	
-	int fd = open(path, O_RDWR, O_DIRECT|O_SYNC);
-	if (fd == -1) {
-		M_PERROR("Could not open murmur file");
-		goto error;
+	/**
+	 * How much is handed out right now, and the most there's ever been.
+	 */
+	size_t in_use;
+	size_t high_water;
+};
+
+/**
+ * Where an arena was, to go back to.
+ */
+struct _murmur_arena_mark {
+	struct _murmur_arena_chunk *chunk;
+	size_t used;
+	size_t in_use;
+};
+
+static __thread struct _murmur_arena _murmur_arena;
+
+/**
+ * Frees a thread's arena when the thread exits.
+ */
+static pthread_key_t _murmur_arena_key;
+static pthread_once_t _murmur_arena_once = PTHREAD_ONCE_INIT;
+
+/**
+ * A series buffer, as it sits in the pool.
+ */
+struct _murmur_pool_buf {
+	struct _murmur_pool_buf *next;
+	
+	/**
+	 * The buffer's size class, or MURMUR_POOL_CLASSES if it's too big to pool.
+	 */
+	uint32_t cls;
+	
+	double values[] __attribute__ ((aligned (16)));
+};
+
+/**
+ * Free series buffers, for every size.
+ */
+static struct {
+	pthread_mutex_t lock;
+	struct _murmur_pool_buf *free[MURMUR_POOL_CLASSES];
+	uint32_t free_count[MURMUR_POOL_CLASSES];
+} _murmur_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * Process-wide memory counters, updated atomically.
+ */
+static struct murmur_mem_stats _murmur_mem;
+
+static void _murmur_arena_destroy(void *arg) {
+	struct _murmur_arena *arena = arg;
+	
+	while (arena->head != NULL) {
+		struct _murmur_arena_chunk *next = arena->head->next;
+		__atomic_sub_fetch(&_murmur_mem.arena_reserved, arena->head->size, __ATOMIC_RELAXED);
+		free(arena->head);
+		arena->head = next;
 	}
 	
-	mmr = malloc(sizeof(*mmr));
-	memset(mmr, 0, sizeof(*mmr));
-	mmr->fd = fd;
+	arena->curr = NULL;
+}
+
+static void _murmur_arena_key_create() {
+	pthread_key_create(&_murmur_arena_key, _murmur_arena_destroy);
+}
+
+static struct _murmur_arena_mark _murmur_arena_mark() {
+	struct _murmur_arena_mark mark = {
+		.chunk = _murmur_arena.curr,
+		.used = _murmur_arena.curr == NULL ? 0 : _murmur_arena.curr->used,
+		.in_use = _murmur_arena.in_use,
+	};
 	
-	struct murmur_header h;
-	if (read(fd, &h, sizeof(h)) != sizeof(h)) {
-		M_ERROR("Could not read murmur header: file is corrupted");
-		goto error;
+	return mark;
+}
+
+/**
+ * Takes back everything handed out since the mark. The chunks are kept for next time.
+ */
+static void _murmur_arena_release(const struct _murmur_arena_mark mark) {
+	struct _murmur_arena *arena = &_murmur_arena;
+	
+	arena->curr = mark.chunk == NULL ? arena->head : mark.chunk;
+	if (arena->curr != NULL) {
+		arena->curr->used = mark.used;
 	}
 	
-	mmr->aggregation = h.aggregation;
-	mmr->max_retention = be64toh(h.max_retention);
-	mmr->x_files_factor = h.x_files_factor;
-	mmr->archive_count = be32toh(h.archive_count);
+	arena->in_use = mark.in_use;
+}
+
+/**
+ * Gets scratch memory that lives until the arena is released past it.
+ *
+ * @return The memory, aligned to 16 bytes, or NULL on failure.
+ */
+static void* _murmur_arena_alloc(size_t len) {
+	struct _murmur_arena *arena = &_murmur_arena;
+	len = (len + 15) & ~(size_t)15;
 	
-	if (mmr->archive_count == 0) {
-		M_ERROR("Murmur file corrupted: no archives specified");
-		goto error;
+	// Move on through chunks kept from before, as long as they're big enough
+	while (arena->curr != NULL && arena->curr->used + len > arena->curr->size) {
+		struct _murmur_arena_chunk *next = arena->curr->next;
+		if (next == NULL || next->size < len) {
+			break;
+		}
+		
+		next->used = 0;
+		arena->curr = next;
 	}
 	
-	mmr->archives = malloc(mmr->archive_count * sizeof(*mmr->archives));
-	struct murmur_archive *prev_archive = NULL;
-	for (uint32_t i = 0; i < mmr->archive_count; i++) {
-		struct murmur_archive *arch = mmr->archives + i;
-		struct archive_header ah;
+	if (arena->curr == NULL || arena->curr->used + len > arena->curr->size) {
+		pthread_once(&_murmur_arena_once, _murmur_arena_key_create);
 		
-		if (read(fd, &ah, sizeof(ah)) != sizeof(ah)) {
-			M_ERROR("Could not read archive header: file is corrupted");
-			goto error;
+		size_t size = arena->curr == NULL ? MURMUR_ARENA_CHUNK : arena->curr->size * 2;
+		while (size < len) {
+			size *= 2;
 		}
 		
-		arch->offset = be32toh(ah.offset);
-		arch->seconds_per_point = be32toh(ah.seconds_per_point);
-		arch->points = be32toh(ah.points);
-		arch->retention = arch->seconds_per_point * arch->points;
-		arch->size = arch->points * sizeof(struct point);
-		arch->lower = NULL;
+		struct _murmur_arena_chunk *chunk = malloc(sizeof(*chunk) + size);
+		if (chunk == NULL) {
+			M_PERROR("Could not grow arena");
+			return NULL;
+		}
 		
-		if (prev_archive != NULL) {
-			prev_archive->lower = arch;
+		chunk->size = size;
+		chunk->used = 0;
+		
+		// New chunks go right after the current one, so that anything after it is still reused
+		if (arena->curr == NULL) {
+			chunk->next = arena->head;
+			arena->head = chunk;
+			pthread_setspecific(_murmur_arena_key, arena);
+		} else {
+			chunk->next = arena->curr->next;
+			arena->curr->next = chunk;
 		}
-		prev_archive = arch;
+		arena->curr = chunk;
 		
-		M_DEBUG("Archive header: offset=%u, spp=%u, points=%u",
-			arch->offset,
-			arch->seconds_per_point,
-			arch->points
-		);
+		__atomic_add_fetch(&_murmur_mem.arena_chunks, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&_murmur_mem.arena_reserved, size, __ATOMIC_RELAXED);
 	}
 	
-	return mmr;
+	void *ptr = arena->curr->data + arena->curr->used;
+	arena->curr->used += len;
+	arena->in_use += len;
 	
-error:
-	if (mmr == NULL) {
-		close(fd);
+	if (arena->in_use > arena->high_water) {
+		arena->high_water = arena->in_use;
+		
+		uint64_t seen = __atomic_load_n(&_murmur_mem.arena_high_water, __ATOMIC_RELAXED);
+		while (arena->high_water > seen &&
+			!__atomic_compare_exchange_n(&_murmur_mem.arena_high_water, &seen, arena->high_water, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 	}
-	murmur_close(mmr);
-	return NULL;
+	
+	return ptr;
 }
 
-void murmur_close(struct murmur *mmr) {
-	if (mmr != NULL) {
-		close(mmr->fd);
-		free(mmr->archives);
-		free(mmr);
+/**
+ * Gives a series a buffer for its values from the pool.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int _murmur_series_alloc(struct murmur_series *series, const uint32_t count) {
+	uint32_t cls = 0;
+	while (cls < MURMUR_POOL_CLASSES && ((uint64_t)1 << (cls + MURMUR_POOL_MIN_SHIFT)) < count) {
+		cls++;
+	}
+	
+	struct _murmur_pool_buf *buf = NULL;
+	
+	if (cls < MURMUR_POOL_CLASSES) {
+		pthread_mutex_lock(&_murmur_pool.lock);
+		buf = _murmur_pool.free[cls];
+		if (buf != NULL) {
+			_murmur_pool.free[cls] = buf->next;
+			_murmur_pool.free_count[cls]--;
+			_murmur_mem.pool_free_bytes -= sizeof(*buf->values) << (cls + MURMUR_POOL_MIN_SHIFT);
+		}
+		pthread_mutex_unlock(&_murmur_pool.lock);
+	}
+	
+	if (buf != NULL) {
+		__atomic_add_fetch(&_murmur_mem.pool_hits, 1, __ATOMIC_RELAXED);
+	} else {
+		uint64_t values = cls < MURMUR_POOL_CLASSES ? (uint64_t)1 << (cls + MURMUR_POOL_MIN_SHIFT) : count;
+		
+		buf = malloc(sizeof(*buf) + (values * sizeof(*buf->values)));
+		if (buf == NULL) {
+			M_PERROR("Could not allocate series");
+			return -1;
+		}
+		
+		buf->cls = cls;
+		__atomic_add_fetch(&_murmur_mem.pool_misses, 1, __ATOMIC_RELAXED);
 	}
+	
+	series->values = buf->values;
+	return 0;
 }
 
-int murmur_set(struct murmur *mmr, const int64_t timestamp, const double value) {
-	struct murmur_archive *arch = NULL;
-	if (_murmur_get_archive(mmr, timestamp, &arch) != 0) {
-		M_ERROR("Could not locate suitable archive for item at timestamp: %ld", timestamp);
-		return -1;
+void murmur_series_free(struct murmur_series *series) {
+	if (series->values != NULL) {
+		struct _murmur_pool_buf *buf = (struct _murmur_pool_buf*)((char*)series->values - offsetof(struct _murmur_pool_buf, values));
+		uint32_t cls = buf->cls;
+		uint64_t size = cls < MURMUR_POOL_CLASSES ? sizeof(*buf->values) << (cls + MURMUR_POOL_MIN_SHIFT) : 0;
+		
+		if (cls < MURMUR_POOL_CLASSES) {
+			pthread_mutex_lock(&_murmur_pool.lock);
+			
+			// Always keep at least one of each size, however big
+			if (_murmur_pool.free_count[cls] == 0 || (_murmur_pool.free_count[cls] + 1) * size <= MURMUR_POOL_CLASS_BYTES) {
+				buf->next = _murmur_pool.free[cls];
+				_murmur_pool.free[cls] = buf;
+				_murmur_pool.free_count[cls]++;
+				_murmur_mem.pool_free_bytes += size;
+				buf = NULL;
+			}
+			
+			pthread_mutex_unlock(&_murmur_pool.lock);
+		}
+		
+		free(buf);
 	}
 	
-	return _murmur_arch_set(mmr, arch, timestamp, value);
+	memset(series, 0, sizeof(*series));
 }
 
-int murmur_get(struct murmur *mmr, const int64_t timestamp, double * const value) {
-	struct murmur_archive *arch = NULL;
-	if (_murmur_get_archive(mmr, timestamp, &arch) != 0) {
-		M_ERROR("Could not locate suitable archive for item at timestamp: %ld", timestamp);
-		return -1;
+void murmur_mem_stats(struct murmur_mem_stats *stats) {
+	pthread_mutex_lock(&_murmur_pool.lock);
+	stats->pool_free_bytes = _murmur_mem.pool_free_bytes;
+	pthread_mutex_unlock(&_murmur_pool.lock);
+	
+	stats->arena_high_water = __atomic_load_n(&_murmur_mem.arena_high_water, __ATOMIC_RELAXED);
+	stats->arena_reserved = __atomic_load_n(&_murmur_mem.arena_reserved, __ATOMIC_RELAXED);
+	stats->arena_chunks = __atomic_load_n(&_murmur_mem.arena_chunks, __ATOMIC_RELAXED);
+	stats->pool_hits = __atomic_load_n(&_murmur_mem.pool_hits, __ATOMIC_RELAXED);
+	stats->pool_misses = __atomic_load_n(&_murmur_mem.pool_misses, __ATOMIC_RELAXED);
+}
+
+/**
+ * The bodies of each aggregation method. These are always inlined into the functions below,
+ * so that when pointsc is a constant, the loops are unrolled and the average's divide is by
+ * a constant.
+ */
+static inline __attribute__((always_inline)) double _murmur_agg_average(const struct point *pointsv, const uint64_t pointsc) {
+	double val = PTVAL(pointsv);
+	for (uint64_t i = 1; i < pointsc; i++) {
+		val += PTVAL(pointsv + i);
 	}
 	
-	return _murmur_arch_get(mmr, arch, timestamp, value);
+	return val / pointsc;
 }
 
-int murmur_dump_info(struct murmur *mmr) {
-	static const char * const AGGREGATION_NAMES[] = {
-		"average",
-		"sum",
-		"last",
-		"max",
-		"min",
-	};
+static inline __attribute__((always_inline)) double _murmur_agg_sum(const struct point *pointsv, const uint64_t pointsc) {
+	double val = PTVAL(pointsv);
+	for (uint64_t i = 1; i < pointsc; i++) {
+		val += PTVAL(pointsv + i);
+	}
 	
-	M_INFO("Max data age: %lu seconds", mmr->max_retention);
-	M_INFO("Accumulation factor: %d", mmr->x_files_factor);
-	M_INFO("Aggregation method: %s", AGGREGATION_NAMES[mmr->aggregation-1]);
+	return val;
+}
+
+static inline __attribute__((always_inline)) double _murmur_agg_last(const struct point *pointsv, const uint64_t pointsc) {
+	int64_t last_interval = PTINT(pointsv);
+	uint64_t last_i = 0;
 	
-	M_INFO("Number of archives: %u", mmr->archive_count);
-	M_INFO("");
+	for (uint64_t i = 1; i < pointsc; i++) {
+		int64_t l = PTINT(pointsv + i);
+		if (l > last_interval) {
+			last_interval = l;
+			last_i = i;
+		}
+	}
 	
-	for (uint32_t i = 0; i < mmr->archive_count; i++) {
-		struct murmur_archive *arch = mmr->archives + i;
-		
-		M_INFO("Archive %u:", i);
-		M_INFO("  Seconds per point: %u", arch->seconds_per_point);
-		M_INFO("  Points: %u", arch->points);
-		M_INFO("");
+	return PTVAL(pointsv + last_i);
+}
+
+static inline __attribute__((always_inline)) double _murmur_agg_max(const struct point *pointsv, const uint64_t pointsc) {
+	double val = PTVAL(pointsv);
+	for (uint64_t i = 1; i < pointsc; i++) {
+		double v = PTVAL(pointsv + i);
+		if (v > val) {
+			val = v;
+		}
 	}
 	
-	return 0;
+	return val;
 }
 
-int murmur_dump(struct murmur *mmr) {
-	if (murmur_dump_info(mmr) != 0) {
+static inline __attribute__((always_inline)) double _murmur_agg_min(const struct point *pointsv, const uint64_t pointsc) {
+	double val = PTVAL(pointsv);
+	for (uint64_t i = 1; i < pointsc; i++) {
+		double v = PTVAL(pointsv + i);
+		if (v < val) {
+			val = v;
+		}
+	}
+	
+	return val;
+}
+
+/**
+ * Defines an aggregation function for every method, named by suffix, that aggregates count points.
+ */
+#define _MURMUR_AGG_DEFINE(suffix, count) \
+	static double _murmur_agg_average_##suffix(const struct point *pointsv, const uint64_t pointsc) { return _murmur_agg_average(pointsv, count); } \
+	static double _murmur_agg_sum_##suffix(const struct point *pointsv, const uint64_t pointsc) { return _murmur_agg_sum(pointsv, count); } \
+	static double _murmur_agg_last_##suffix(const struct point *pointsv, const uint64_t pointsc) { return _murmur_agg_last(pointsv, count); } \
+	static double _murmur_agg_max_##suffix(const struct point *pointsv, const uint64_t pointsc) { return _murmur_agg_max(pointsv, count); } \
+	static double _murmur_agg_min_##suffix(const struct point *pointsv, const uint64_t pointsc) { return _murmur_agg_min(pointsv, count); }
+
+/**
+ * The functions for every method, in the order of enum aggregation_method.
+ */
+#define _MURMUR_AGG_FNS(suffix) \
+	{ _murmur_agg_average_##suffix, _murmur_agg_sum_##suffix, _murmur_agg_last_##suffix, _murmur_agg_max_##suffix, _murmur_agg_min_##suffix }
+
+/**
+ * Any number of points, for ratios that aren't common enough to have their own.
+ */
+_MURMUR_AGG_DEFINE(any, pointsc)
+
+/**
+ * The usual ratios between archives: 10s:1m (6), 1m:5m (5), 1m:10m (10), 5m:1h (12),
+ * 1h:1d (24) and 1m:1h (60).
+ */
+_MURMUR_AGG_DEFINE(5, 5)
+_MURMUR_AGG_DEFINE(6, 6)
+_MURMUR_AGG_DEFINE(10, 10)
+_MURMUR_AGG_DEFINE(12, 12)
+_MURMUR_AGG_DEFINE(24, 24)
+_MURMUR_AGG_DEFINE(60, 60)
+
+static const struct {
+	uint32_t ratio;
+	murmur_aggregate_fn fns[5];
+} _murmur_agg_table[] = {
+	{ 5, _MURMUR_AGG_FNS(5) },
+	{ 6, _MURMUR_AGG_FNS(6) },
+	{ 10, _MURMUR_AGG_FNS(10) },
+	{ 12, _MURMUR_AGG_FNS(12) },
+	{ 24, _MURMUR_AGG_FNS(24) },
+	{ 60, _MURMUR_AGG_FNS(60) },
+};
+
+/**
+ * Finds the function that aggregates points of an archive into one point of the archive below,
+ * so that propogation doesn't have to look at the aggregation method or divide the archives'
+ * steps every time.
+ *
+ * @param aggregation How the file is aggregated
+ * @param ratio How many points go into each point below
+ */
+static murmur_aggregate_fn _murmur_agg_select(const enum aggregation_method aggregation, const uint32_t ratio) {
+	// Unknown methods have always been averaged
+	uint32_t method = aggregation >= agg_average && aggregation <= agg_min ? aggregation - agg_average : 0;
+	
+	for (size_t i = 0; i < sizeof(_murmur_agg_table) / sizeof(*_murmur_agg_table); i++) {
+		if (_murmur_agg_table[i].ratio == ratio) {
+			return _murmur_agg_table[i].fns[method];
+		}
+	}
+	
+	static const murmur_aggregate_fn any[] = _MURMUR_AGG_FNS(any);
+	
+	return any[method];
+}
+
+/**
+ * Reads a run of points out of an archive, wrapping around to the start of the archive if needed.
+ *
+ * @param cls The class of I/O the read is for
+ * @param fd The file to read from
+ * @param arch The archive to read from
+ * @param interval The timestamp of the first point to read
+ * @param[out] pointsv Where the points should be read into
+ * @param pointsc The number of points to read; no more than the archive holds
+ */
+static int _murmur_read_points(const int cls, const int fd, struct murmur_archive *arch, const int64_t interval, struct point *pointsv, const uint64_t pointsc) {
+	int64_t start;
+	uint64_t record_start = _murmur_point_offset(arch, interval, &start);
+	uint64_t archive_end = arch->offset + arch->size;
+	
+	ssize_t len = pointsc * sizeof(*pointsv);
+	ssize_t to_read = len;
+	
+	// If the points wrap back to the start of the archive, we can only read a
+	// few before having to go back to the beginning.
+	if (record_start + len > archive_end) {
+		to_read = archive_end - record_start;
+	}
+	
+	if (_murmur_io_pread(cls, fd, pointsv, to_read, record_start) != to_read) {
+		M_PERROR("Could not read points");
 		return -1;
 	}
 	
-	M_INFO("============= BEGIN DUMP =============");
-	M_INFO("");
+	if (to_read < len && _murmur_io_pread(cls, fd, ((char*)pointsv) + to_read, len - to_read, arch->offset) != len - to_read) {
+		M_PERROR("Could not read wrapped points");
+		return -1;
+	}
 	
-	struct point p;
-	while (read(mmr->fd, &p, sizeof(p)) != 0) {
-		M_INFO("%12lu = %f", PTINT(&p), PTVAL(&p));
+	return 0;
+}
+
+/**
+ * Reads all of the points in an archive that consolidate into a single point in the archive
+ * below it.
+ *
+ * @param fd The file to read from
+ * @param arch The higher-precision archive
+ * @param timestamp Any timestamp inside of the lower archive's interval
+ * @param[out] pointsv Where the points should be read into
+ * @param pointsc The number of points that consolidate into one lower point
+ */
+static int _murmur_read_bucket(const int fd, struct murmur_archive *arch, const int64_t timestamp, struct point *pointsv, const uint64_t pointsc) {
+	int64_t bucket_start = timestamp - (timestamp % arch->lower->seconds_per_point);
+	
+	if (_murmur_read_points(io_propagation, fd, arch, bucket_start, pointsv, pointsc) != 0) {
+		M_ERROR("In propogation: could not read points");
+		return -1;
 	}
 	
 	return 0;
 }
+
+// Forward declaration: _murmur_propogate and _murmur_arch_set rely on each other
+static int _murmur_propogate(struct murmur *mmr, struct murmur_archive *arch, int64_t timestamp);
+static int _murmur_prefix_set(const int cls, struct murmur *mmr, const struct murmur_archive *arch, const int64_t interval, const double value);
+
+/**
+ * Given an archive, sets a value in it.
+ *
+ * @param cls The class of I/O the write is for
+ * @param mmr Obvious
+ * @param arch The archive to set the value in.
+ * @param timestamp The timestamp of the data to be set
+ * @param value The value of the data to be set
+ */
+static int _murmur_arch_set(const int cls, struct murmur *mmr, struct murmur_archive *arch, const int64_t timestamp, const double value) {
+	int64_t interval = 0;
+	uint64_t offset = _murmur_point_offset(arch, timestamp, &interval);
+	
+	struct point pt;
+	_murmur_make_point(&pt, interval, value);
+	
+	if (_murmur_io_pwrite(cls, mmr->fd, &pt, sizeof(pt), offset) != sizeof(pt)) {
+		M_PERROR("Could not write record");
+		return -1;
+	}
+	
+	if (_murmur_prefix_set(cls, mmr, arch, interval, value) != 0) {
+		return -1;
+	}
+	
+	return _murmur_propogate(mmr, arch, timestamp);
+}
+
+/**
+ * Given an archive, gets a value from it.
+ */
+static inline int _murmur_arch_get(struct murmur *mmr, struct murmur_archive *arch, const int64_t timestamp, double * const value) {
+	int64_t interval = 0;
+	uint64_t offset = _murmur_point_offset(arch, timestamp, &interval);
+	
+	struct point pt;
+	if (_murmur_io_pread(io_query, mmr->fd, &pt, sizeof(pt), offset) != sizeof(pt)) {
+		M_PERROR("Could not read record");
+		return -1;
+	}
+	
+	// Verify the data point we get back is in the right range
+	int64_t ptinterval = PTINT(&pt);
+	if (ptinterval < interval || ptinterval > (interval + arch->seconds_per_point)) {
+		return -1;
+	}
+	
+	*value = PTVAL(&pt);
+	
+	return 0;
+}
+
+/**
+ * Takes the values from the more-precise archive and propogates them, recursively, to the less-precise
+ * archives.
+ *
+ * @param mmr Obvious
+ * @param arch The higher-precision archive
+ * @param timestamp The timestamp of the data to be propogated down.
+ */
+static int _murmur_propogate(struct murmur *mmr, struct murmur_archive *arch, const int64_t timestamp) {
+	if (arch->lower == NULL) {
+		return 0;
+	}
+	
+	struct murmur_archive *lower = arch->lower;
+	struct point points[arch->ratio];
+	
+	if (_murmur_read_bucket(mmr->fd, arch, timestamp, points, sizeof(points)/sizeof(*points)) != 0) {
+		goto error;
+	}
+	
+	double val = arch->aggregate(points, arch->ratio);
+	
+	if (_murmur_arch_set(io_propagation, mmr, lower, timestamp, val) != 0) {
+		goto error;
+	}
+	
+	// The same points feed every sibling, each its own way
+	for (struct murmur_archive *sib = lower->sibling; sib != NULL; sib = sib->sibling) {
+		if (_murmur_arch_set(io_propagation, mmr, sib, timestamp, sib->gather(points, arch->ratio)) != 0) {
+			goto error;
+		}
+	}
+	
+	return 0;
+
+error:
+	M_ERROR("Propogation failing. This is really bad. Your archive will probably be inconsistent.");
+	return -1;
+}
+
+static void _murmur_index_journal(const char *path);
+
+/**
+ * Creates a file, like murmur_create(), without telling any store about it.
+ */
+static int _murmur_create(const char *path, const uint specc, char **specv, const enum aggregation_method aggregation, const char x_files_factor) {
+	int fd = open(path, O_CREAT|O_TRUNC|O_WRONLY, S_IRUSR|S_IWUSR|S_IRGRP);
+	if (fd == -1) {
+		M_PERROR("Could not open file for writing");
+		return -1;
+	}
+	
+	struct archive_header *arch_headers;
+	char *aggregations;
+	uint32_t archive_count = _murmur_parse_archive_spec(specc, specv, &arch_headers, &aggregations);
+	enum aggregation_method file_aggregation = aggregation == 0 ? agg_average : aggregation;
+	
+	if (!archive_count || _murmur_validate_archives(archive_count, arch_headers, file_aggregation, aggregations) == -1) {
+		close(fd);
+		free(arch_headers);
+		free(aggregations);
+		return -1;
+	}
+	
+	// Every archive's method is spelled out, so that the file doesn't depend on the header's
+	for (uint32_t i = 0; aggregations != NULL && i < archive_count; i++) {
+		if (aggregations[i] == 0) {
+			aggregations[i] = file_aggregation;
+		}
+	}
+	
+	uint64_t max_retention = 0;
+	uint32_t offset = sizeof(struct murmur_header) + (archive_count * sizeof(*arch_headers));
+	
+	for (uint32_t i = 0; i < archive_count; i++) {
+		struct archive_header *ah = &arch_headers[i];
+		
+		uint64_t retention = ah->seconds_per_point * ah->points;
+		if (retention > max_retention) {
+			max_retention = retention;
+		}
+		
+		// Prepare the struct for writing to disk
+		ah->offset = htobe32(offset);
+		
+		// Can't work with a number in the wrong endianess
+		offset += ah->points * sizeof(struct point);
+		
+		ah->seconds_per_point = htobe32(ah->seconds_per_point);
+		ah->points = htobe32(ah->points);
+	}
+	
+	struct murmur_header header = {
+		.aggregation = file_aggregation,
+		.max_retention = htobe64(max_retention),
+		.x_files_factor = x_files_factor,
+		.archive_count = htobe32(archive_count),
+	};
+	
+	int ret = 0;
+	
+	int len = sizeof(header);
+	int curr_pos = len;
+	if (write(fd, &header, len) != len) {
+		M_PERROR("Could not write murmur header");
+		ret = -1;
+		goto done;
+	}
+	
+	len = archive_count * sizeof(*arch_headers);
+	curr_pos += len;
+	if (write(fd, arch_headers, len) != len) {
+		M_PERROR("Could not write archive headers");
+		ret = -1;
+		goto done;
+	}
+	
+	// The extension records start out clean, which is all zeros
+	len = sizeof(struct murmur_ext_header) + (archive_count * sizeof(struct murmur_ext_archive));
+	if (aggregations != NULL) {
+		len += archive_count;
+	}
+	
+	if (fallocate(fd, 0, curr_pos, (offset - curr_pos) + len) != 0) {
+		M_PERROR("Could not allocate archive area");
+		ret = -1;
+		goto done;
+	}
+	
+	struct murmur_ext_header ext = {
+		.magic = MURMUR_EXT_MAGIC,
+		.version = htobe32(MURMUR_EXT_VERSION),
+		.features = htobe32(aggregations != NULL ? MURMUR_EXT_AGGREGATION : 0),
+	};
+	
+	if (pwrite(fd, &ext, sizeof(ext), offset) != sizeof(ext)) {
+		M_PERROR("Could not write extension header");
+		ret = -1;
+		goto done;
+	}
+	
+	uint64_t aggregations_offset = offset + sizeof(ext) + (archive_count * sizeof(struct murmur_ext_archive));
+	if (aggregations != NULL && pwrite(fd, aggregations, archive_count, aggregations_offset) != archive_count) {
+		M_PERROR("Could not write aggregation methods");
+		ret = -1;
+		goto done;
+	}
+	
+done:
+	close(fd);
+	free(arch_headers);
+	free(aggregations);
+	return ret;
+}
+
+int murmur_create(const char *path, const uint specc, char **specv, const enum aggregation_method aggregation, const char x_files_factor) {
+	if (_murmur_create(path, specc, specv, aggregation, x_files_factor) != 0) {
+		return -1;
+	}
+	
+	// A file made inside a store is one of its metrics, however it was made
+	_murmur_index_journal(path);
+	
+	return 0;
+}
+
+/**
+ * FNV-1a, used for hashing names, segments and archive headers.
+ */
+static inline uint32_t _murmur_hash(const char *str, const size_t len) {
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)str[i]) * 16777619u;
+	}
+	
+	return h;
+}
+
+/**
+ * The archives of every distinct kind of file that has been opened. Most files share a handful
+ * of schemas, so open files point into here rather than each having their own copy.
+ */
+struct _murmur_shape {
+	uint32_t hash;
+	enum aggregation_method aggregation;
+	uint32_t archive_count;
+	
+	/**
+	 * The headers as they are on disk, to tell shapes with the same hash apart.
+	 */
+	struct archive_header *headers;
+	
+	/**
+	 * Each archive's own aggregation method, NULL if the file only has the one.
+	 */
+	char *aggregations;
+	
+	struct murmur_archive archives[];
+};
+
+/**
+ * Shapes are never free'd: there are only ever as many as there are schemas, and handing out
+ * pointers that live forever means open files don't need to track anything.
+ */
+static struct {
+	pthread_mutex_t lock;
+	
+	/**
+	 * A hash table of shapes, sized to a power of 2.
+	 */
+	struct _murmur_shape **slots;
+	uint32_t count;
+	uint32_t mask;
+} _murmur_shapes = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/**
+ * Builds the archives for a shape, linking each to the archive below it. Where archives share a
+ * precision, the first is linked from above and the rest hang off of it as siblings.
+ */
+static struct _murmur_shape* _murmur_shape_new(const uint32_t hash, const enum aggregation_method aggregation, const char *aggregations, const struct archive_header *headers, const uint32_t count) {
+	size_t headers_len = count * sizeof(*headers);
+	size_t aggregations_len = aggregations == NULL ? 0 : count;
+	struct _murmur_shape *shape = malloc(sizeof(*shape) + (count * sizeof(*shape->archives)) + headers_len + aggregations_len);
+	if (shape == NULL) {
+		M_PERROR("Could not allocate archives");
+		return NULL;
+	}
+	
+	shape->hash = hash;
+	shape->aggregation = aggregation;
+	shape->archive_count = count;
+	shape->headers = (struct archive_header*)(shape->archives + count);
+	memcpy(shape->headers, headers, headers_len);
+	shape->aggregations = NULL;
+	if (aggregations != NULL) {
+		shape->aggregations = (char*)shape->headers + headers_len;
+		memcpy(shape->aggregations, aggregations, aggregations_len);
+	}
+	
+	// The first archive at the precision above, which feeds this one, and the first and last
+	// archives at this precision
+	struct murmur_archive *feeder = NULL;
+	struct murmur_archive *first = NULL;
+	struct murmur_archive *last = NULL;
+	
+	for (uint32_t i = 0; i < count; i++) {
+		struct murmur_archive *arch = shape->archives + i;
+		
+		arch->offset = be32toh(headers[i].offset);
+		arch->seconds_per_point = be32toh(headers[i].seconds_per_point);
+		arch->points = be32toh(headers[i].points);
+		arch->retention = arch->seconds_per_point * arch->points;
+		arch->size = arch->points * sizeof(struct point);
+		arch->lower = NULL;
+		arch->ratio = 0;
+		arch->aggregate = NULL;
+		arch->aggregation = aggregations == NULL ? aggregation : aggregations[i];
+		arch->sibling = NULL;
+		arch->gather = NULL;
+		
+		if (first != NULL && first->seconds_per_point == arch->seconds_per_point) {
+			last->sibling = arch;
+			last = arch;
+			
+			if (feeder != NULL) {
+				arch->gather = _murmur_agg_select(arch->aggregation, feeder->ratio);
+			}
+		} else {
+			if (first != NULL) {
+				first->lower = arch;
+				first->ratio = arch->seconds_per_point / first->seconds_per_point;
+				first->aggregate = _murmur_agg_select(arch->aggregation, first->ratio);
+				arch->gather = first->aggregate;
+			}
+			
+			feeder = first;
+			first = arch;
+			last = arch;
+		}
+		
+		M_DEBUG("Archive header: offset=%u, spp=%u, points=%u",
+			arch->offset,
+			arch->seconds_per_point,
+			arch->points
+		);
+	}
+	
+	return shape;
+}
+
+/**
+ * Doubles the shape table.
+ */
+static int _murmur_shapes_grow() {
+	uint32_t mask = _murmur_shapes.mask == 0 ? 15 : (_murmur_shapes.mask * 2) + 1;
+	struct _murmur_shape **slots = calloc(mask + 1, sizeof(*slots));
+	if (slots == NULL) {
+		M_PERROR("Could not grow archive table");
+		return -1;
+	}
+	
+	for (uint32_t i = 0; _murmur_shapes.slots != NULL && i <= _murmur_shapes.mask; i++) {
+		struct _murmur_shape *shape = _murmur_shapes.slots[i];
+		if (shape == NULL) {
+			continue;
+		}
+		
+		uint32_t slot = shape->hash & mask;
+		while (slots[slot] != NULL) {
+			slot = (slot + 1) & mask;
+		}
+		slots[slot] = shape;
+	}
+	
+	free(_murmur_shapes.slots);
+	_murmur_shapes.slots = slots;
+	_murmur_shapes.mask = mask;
+	
+	return 0;
+}
+
+/**
+ * Finds the archives for a file's headers, building them the first time they're seen.
+ *
+ * @param aggregation How the file is aggregated
+ * @param aggregations Each archive's own aggregation method, NULL if the file only has the one
+ * @param headers The archive headers, as read from disk
+ * @param count The number of archives
+ *
+ * @return The archives, shared with every other file like it, or NULL on failure.
+ */
+static struct murmur_archive* _murmur_shape_intern(const enum aggregation_method aggregation, const char *aggregations, const struct archive_header *headers, const uint32_t count) {
+	size_t headers_len = count * sizeof(*headers);
+	uint32_t hash = _murmur_hash((const char*)headers, headers_len) ^ ((uint32_t)aggregation * 0x9E3779B1u);
+	if (aggregations != NULL) {
+		hash ^= _murmur_hash(aggregations, count);
+	}
+	struct murmur_archive *archives = NULL;
+	
+	pthread_mutex_lock(&_murmur_shapes.lock);
+	
+	if ((_murmur_shapes.count + 1) * 2 > _murmur_shapes.mask && _murmur_shapes_grow() != 0) {
+		goto done;
+	}
+	
+	uint32_t slot = hash & _murmur_shapes.mask;
+	while (_murmur_shapes.slots[slot] != NULL) {
+		struct _murmur_shape *shape = _murmur_shapes.slots[slot];
+		if (shape->hash == hash &&
+			shape->aggregation == aggregation &&
+			shape->archive_count == count &&
+			memcmp(shape->headers, headers, headers_len) == 0 &&
+			(shape->aggregations == NULL) == (aggregations == NULL) &&
+			(aggregations == NULL || memcmp(shape->aggregations, aggregations, count) == 0)) {
+			archives = shape->archives;
+			goto done;
+		}
+		
+		slot = (slot + 1) & _murmur_shapes.mask;
+	}
+	
+	struct _murmur_shape *shape = _murmur_shape_new(hash, aggregation, aggregations, headers, count);
+	if (shape != NULL) {
+		_murmur_shapes.slots[slot] = shape;
+		_murmur_shapes.count++;
+		archives = shape->archives;
+	}
+	
+done:
+	pthread_mutex_unlock(&_murmur_shapes.lock);
+	return archives;
+}
+
+/**
+ * Finds where the extension block is, or would be: right after the last archive.
+ */
+static inline uint64_t _murmur_ext_offset(const struct murmur *mmr) {
+	const struct murmur_archive *last = mmr->archives + mmr->archive_count - 1;
+	return last->offset + last->size;
+}
+
+/**
+ * Propagates every bucket of the lower archive that a range of an archive touches.
+ *
+ * @param from The first timestamp that was written
+ * @param until The last timestamp that was written
+ */
+static int _murmur_repair(struct murmur *mmr, const struct murmur_archive *arch, const int64_t from, const int64_t until) {
+	M_WARN("Repairing propagation of %ld to %ld from archive %ld", from, until, (long)(arch - mmr->archives));
+	
+	// Never more buckets than the lower archive holds, however wide the range
+	uint32_t spp = arch->lower->seconds_per_point;
+	int64_t bucket = from - (from % spp);
+	if (until >= from && (until - bucket) / spp >= arch->lower->points) {
+		bucket = until - (until % spp) - ((int64_t)(arch->lower->points - 1) * spp);
+	}
+	
+	int failed = 0;
+	for (; bucket <= until; bucket += spp) {
+		failed |= _murmur_propogate(mmr, (struct murmur_archive *)arch, bucket) != 0;
+	}
+	
+	return failed ? -1 : 0;
+}
+
+/**
+ * Records that points in an archive are being written, and that their propagation might not
+ * finish. Files without an extension block can't record anything. While anything is recorded,
+ * the handle holds a shared lock on the file, so nobody opening it takes the record for a crash.
+ *
+ * A range still recorded from a write that failed is repaired first. If it can't be, the record
+ * grows to cover both, and this fails: the caller must leave it for the next open.
+ *
+ * @param arch The archive being written
+ * @param from The first timestamp being written
+ * @param until The last timestamp being written
+ */
+static int _murmur_intent_mark(struct murmur *mmr, const struct murmur_archive *arch, const int64_t from, const int64_t until) {
+	if (!(mmr->flags & MURMUR_FLAG_EXT) || arch->lower == NULL) {
+		return 0;
+	}
+	
+	if (mmr->intents == NULL) {
+		mmr->intents = calloc(mmr->archive_count, sizeof(*mmr->intents));
+		if (mmr->intents == NULL) {
+			M_PERROR("Could not allocate write intents");
+			return -1;
+		}
+	}
+	
+	if (mmr->intent_count == 0 && flock(mmr->fd, LOCK_SH) != 0) {
+		M_PERROR("Could not lock file to record write intent");
+		return -1;
+	}
+	
+	int ret = 0;
+	uint32_t i = arch - mmr->archives;
+	struct murmur_ext_archive rec;
+	uint64_t offset = _murmur_ext_offset(mmr) + sizeof(struct murmur_ext_header) + (i * sizeof(rec));
+	
+	if (_murmur_io_pread(io_ingest, mmr->fd, &rec, sizeof(rec), offset) != sizeof(rec)) {
+		M_PERROR("Could not read write intent");
+		ret = -1;
+		goto done;
+	}
+	
+	int64_t mark_from = from;
+	int64_t mark_until = until;
+	int64_t dirty_from = be64toh(rec.dirty_from);
+	int64_t dirty_until = be64toh(rec.dirty_until);
+	
+	if (!(dirty_from == 0 && dirty_until == 0) && _murmur_repair(mmr, arch, dirty_from, dirty_until) != 0) {
+		mark_from = dirty_from < from ? dirty_from : from;
+		mark_until = dirty_until > until ? dirty_until : until;
+		ret = -1;
+	}
+	
+	// An empty record means there's nothing to repair, so a write at 0 is recorded as a touch
+	// wider: the same buckets get repaired either way
+	rec.dirty_from = htobe64(mark_from);
+	rec.dirty_until = htobe64(mark_from == 0 && mark_until == 0 ? 1 : mark_until);
+	
+	if (_murmur_io_pwrite(io_ingest, mmr->fd, &rec, sizeof(rec), offset) != sizeof(rec)) {
+		M_PERROR("Could not record write intent");
+		ret = -1;
+		goto done;
+	}
+	
+	if (!mmr->intents[i]) {
+		mmr->intents[i] = 1;
+		mmr->intent_count++;
+	}
+	
+done:
+	if (mmr->intent_count == 0) {
+		flock(mmr->fd, LOCK_UN);
+	}
+	
+	return ret;
+}
+
+/**
+ * Records that everything written to an archive has propogated, dropping the handle's lock on
+ * the file once nothing else is recorded.
+ */
+static int _murmur_intent_clear(struct murmur *mmr, const struct murmur_archive *arch) {
+	if (!(mmr->flags & MURMUR_FLAG_EXT) || arch->lower == NULL) {
+		return 0;
+	}
+	
+	struct murmur_ext_archive rec;
+	memset(&rec, 0, sizeof(rec));
+	
+	uint32_t i = arch - mmr->archives;
+	uint64_t offset = _murmur_ext_offset(mmr) + sizeof(struct murmur_ext_header) + (i * sizeof(rec));
+	if (_murmur_io_pwrite(io_ingest, mmr->fd, &rec, sizeof(rec), offset) != sizeof(rec)) {
+		M_PERROR("Could not clear write intent");
+		return -1;
+	}
+	
+	if (mmr->intents != NULL && mmr->intents[i]) {
+		mmr->intents[i] = 0;
+		if (--mmr->intent_count == 0) {
+			flock(mmr->fd, LOCK_UN);
+		}
+	}
+	
+	return 0;
+}
+
+/**
+ * Finishes any propagation that was in flight when the file was last written to, one bucket of
+ * the lower archive at a time. Nothing is touched while another handle holds the file locked:
+ * its writes are still in flight, not crashed.
+ *
+ * @return The number of archives repaired, -1 on failure.
+ */
+static int _murmur_recover(struct murmur *mmr) {
+	if (!(mmr->flags & MURMUR_FLAG_EXT)) {
+		return 0;
+	}
+	
+	if (flock(mmr->fd, LOCK_EX | LOCK_NB) != 0) {
+		if (errno != EWOULDBLOCK) {
+			M_PERROR("Could not lock file to repair it");
+			return -1;
+		}
+		
+		M_DEBUG("Not repairing a file that's being written to");
+		return 0;
+	}
+	
+	int repaired = 0;
+	struct murmur_ext_archive recs[mmr->archive_count];
+	uint64_t offset = _murmur_ext_offset(mmr) + sizeof(struct murmur_ext_header);
+	if (_murmur_io_pread(io_maintenance, mmr->fd, recs, sizeof(recs), offset) != sizeof(recs)) {
+		M_PERROR("Could not read write intents");
+		repaired = -1;
+		goto done;
+	}
+	
+	for (uint32_t i = 0; i < mmr->archive_count; i++) {
+		struct murmur_archive *arch = mmr->archives + i;
+		int64_t from = be64toh(recs[i].dirty_from);
+		int64_t until = be64toh(recs[i].dirty_until);
+		
+		if ((from == 0 && until == 0) || arch->lower == NULL) {
+			continue;
+		}
+		
+		if (_murmur_repair(mmr, arch, from, until) != 0 || _murmur_intent_clear(mmr, arch) != 0) {
+			repaired = -1;
+			goto done;
+		}
+		
+		repaired++;
+	}
+	
+done:
+	// Back to how the handle had it: shared, if it still has intents of its own
+	flock(mmr->fd, mmr->intent_count > 0 ? LOCK_SH : LOCK_UN);
+	return repaired;
+}
+
+/**
+ * Finds where the prefix block is, or would be: right after the extension records and any
+ * aggregation methods.
+ */
+static inline uint64_t _murmur_prefix_offset(const struct murmur *mmr) {
+	uint64_t offset = _murmur_ext_offset(mmr) + sizeof(struct murmur_ext_header) + (mmr->archive_count * sizeof(struct murmur_ext_archive));
+	
+	// Past the aggregation methods, if the file has them
+	if (mmr->flags & MURMUR_FLAG_AGGREGATION) {
+		offset += mmr->archive_count;
+	}
+	
+	return offset;
+}
+
+/**
+ * Finds where the record for an archive's first slot is in the prefix block. The records mirror
+ * the archives, slot for slot, after every archive's totals.
+ */
+static inline uint64_t _murmur_prefix_records_offset(const struct murmur *mmr, const struct murmur_archive *arch) {
+	uint64_t slots = (arch->offset - mmr->archives->offset) / sizeof(struct point);
+	return _murmur_prefix_offset(mmr) + (mmr->archive_count * sizeof(struct murmur_prefix_archive)) + (slots * sizeof(struct murmur_prefix_point));
+}
+
+static inline uint64_t _murmur_dbl_to_be(const double d) {
+	uint64_t u;
+	memcpy(&u, &d, sizeof(u));
+	return htobe64(u);
+}
+
+static inline double _murmur_be_to_dbl(const uint64_t u) {
+	uint64_t h = be64toh(u);
+	double d;
+	memcpy(&d, &h, sizeof(d));
+	return d;
+}
+
+/**
+ * An archive's running totals, in host byte order.
+ */
+struct _murmur_prefix_totals {
+	int64_t first;
+	int64_t last;
+	double sum;
+	uint64_t count;
+};
+
+/**
+ * A slot's record, in host byte order.
+ */
+struct _murmur_prefix {
+	int64_t interval;
+	double value;
+	double sum;
+	uint64_t count;
+};
+
+static int _murmur_prefix_read_totals(const int cls, struct murmur *mmr, const struct murmur_archive *arch, struct _murmur_prefix_totals *t) {
+	struct murmur_prefix_archive disk;
+	uint64_t offset = _murmur_prefix_offset(mmr) + ((arch - mmr->archives) * sizeof(disk));
+	
+	if (_murmur_io_pread(cls, mmr->fd, &disk, sizeof(disk), offset) != sizeof(disk)) {
+		M_PERROR("Could not read prefix totals");
+		return -1;
+	}
+	
+	t->first = be64toh(disk.first);
+	t->last = be64toh(disk.last);
+	t->sum = _murmur_be_to_dbl(disk.sum);
+	t->count = be64toh(disk.count);
+	
+	return 0;
+}
+
+static int _murmur_prefix_write_totals(const int cls, struct murmur *mmr, const struct murmur_archive *arch, const struct _murmur_prefix_totals *t) {
+	struct murmur_prefix_archive disk = {
+		.first = htobe64(t->first),
+		.last = htobe64(t->last),
+		.sum = _murmur_dbl_to_be(t->sum),
+		.count = htobe64(t->count),
+	};
+	
+	uint64_t offset = _murmur_prefix_offset(mmr) + ((arch - mmr->archives) * sizeof(disk));
+	if (_murmur_io_pwrite(cls, mmr->fd, &disk, sizeof(disk), offset) != sizeof(disk)) {
+		M_PERROR("Could not write prefix totals");
+		return -1;
+	}
+	
+	return 0;
+}
+
+/**
+ * Reads or writes the records for a run of intervals, which may wrap around the end of the
+ * archive: at most two reads or writes.
+ *
+ * @param from The first interval
+ * @param count How many intervals, no more than the archive has points
+ * @param disk Where the records are read to or written from, in disk format
+ * @param write If this is a write
+ */
+static int _murmur_prefix_io(const int cls, struct murmur *mmr, const struct murmur_archive *arch, const int64_t from, const uint64_t count, struct murmur_prefix_point *disk, const int write) {
+	uint64_t base = _murmur_prefix_records_offset(mmr, arch);
+	uint64_t slot = (from % arch->retention) / arch->seconds_per_point;
+	uint64_t first = count < arch->points - slot ? count : arch->points - slot;
+	
+	struct {
+		uint64_t offset;
+		uint64_t count;
+		struct murmur_prefix_point *recs;
+	} runs[2] = {
+		{ base + (slot * sizeof(*disk)), first, disk },
+		{ base, count - first, disk + first },
+	};
+	
+	for (int i = 0; i < 2; i++) {
+		if (runs[i].count == 0) {
+			continue;
+		}
+		
+		ssize_t len = runs[i].count * sizeof(*disk);
+		ssize_t done = write ?
+			_murmur_io_pwrite(cls, mmr->fd, runs[i].recs, len, runs[i].offset) :
+			_murmur_io_pread(cls, mmr->fd, runs[i].recs, len, runs[i].offset);
+		
+		if (done != len) {
+			M_PERROR("Could not %s prefix records", write ? "write" : "read");
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+static inline void _murmur_prefix_decode(const struct murmur_prefix_point *disk, struct _murmur_prefix *rec) {
+	rec->interval = be64toh(disk->interval);
+	rec->value = _murmur_be_to_dbl(disk->value);
+	rec->sum = _murmur_be_to_dbl(disk->sum);
+	rec->count = be64toh(disk->count);
+}
+
+static inline void _murmur_prefix_encode(const struct _murmur_prefix *rec, struct murmur_prefix_point *disk) {
+	disk->interval = htobe64(rec->interval);
+	disk->value = _murmur_dbl_to_be(rec->value);
+	disk->sum = _murmur_dbl_to_be(rec->sum);
+	disk->count = htobe64(rec->count);
+}
+
+/**
+ * Keeps an archive's prefix records up to date with a point that was just written to it.
+ *
+ * Points written after the newest one (nearly all of them) only write their own record, along
+ * with one for each empty interval skipped over, carrying the totals forward. A point written at
+ * or before the newest one has to update every record after it, since they all include it.
+ *
+ * @param interval The point's interval
+ * @param value The point's value
+ */
+static int _murmur_prefix_set(const int cls, struct murmur *mmr, const struct murmur_archive *arch, const int64_t interval, const double value) {
+	if (!(mmr->flags & MURMUR_FLAG_PREFIX) || isnan(value)) {
+		return 0;
+	}
+	
+	int64_t spp = arch->seconds_per_point;
+	struct _murmur_prefix_totals t;
+	if (_murmur_prefix_read_totals(cls, mmr, arch, &t) != 0) {
+		return -1;
+	}
+	
+	int64_t from;
+	uint64_t count;
+	int appending = t.last == 0 || interval > t.last;
+	
+	if (appending) {
+		// Only the newest points' worth of slots are ever kept
+		from = t.last == 0 ? interval : t.last + spp;
+		if ((uint64_t)((interval - from) / spp) >= arch->points) {
+			from = interval - ((int64_t)(arch->points - 1) * spp);
+		}
+		count = ((interval - from) / spp) + 1;
+	} else {
+		// Overwritten in the ring already: nothing to keep
+		if (interval <= t.last - (int64_t)arch->retention) {
+			return 0;
+		}
+		from = interval;
+		count = ((t.last - interval) / spp) + 1;
+	}
+	
+	int ret = -1;
+	struct murmur_prefix_point *disk = malloc(count * sizeof(*disk));
+	if (disk == NULL) {
+		M_PERROR("Could not allocate prefix records");
+		return -1;
+	}
+	
+	if (appending) {
+		struct _murmur_prefix rec = { 0, NAN, t.sum, t.count };
+		for (uint64_t k = 0; k + 1 < count; k++) {
+			rec.interval = from + ((int64_t)k * spp);
+			_murmur_prefix_encode(&rec, disk + k);
+		}
+		
+		t.sum += value;
+		t.count++;
+		t.last = interval;
+		if (t.first == 0) {
+			t.first = interval;
+		}
+		
+		rec = (struct _murmur_prefix){ interval, value, t.sum, t.count };
+		_murmur_prefix_encode(&rec, disk + count - 1);
+	} else {
+		if (_murmur_prefix_io(cls, mmr, arch, from, count, disk, 0) != 0) {
+			goto done;
+		}
+		
+		double dsum = value;
+		uint64_t dcount = 1;
+		
+		for (uint64_t k = 0; k < count; k++) {
+			struct _murmur_prefix rec;
+			_murmur_prefix_decode(disk + k, &rec);
+			
+			int64_t at = from + ((int64_t)k * spp);
+			
+			if (at < t.first) {
+				// Before anything that was there: these start the totals over
+				rec = (struct _murmur_prefix){ at, k == 0 ? value : NAN, value, 1 };
+			} else if (k == 0) {
+				// Replacing a point takes its old value back out
+				if (rec.interval == at && !isnan(rec.value)) {
+					dsum = value - rec.value;
+					dcount = 0;
+				}
+				rec = (struct _murmur_prefix){ at, value, rec.sum + dsum, rec.count + dcount };
+			} else {
+				rec.sum += dsum;
+				rec.count += dcount;
+			}
+			
+			_murmur_prefix_encode(&rec, disk + k);
+		}
+		
+		t.sum += dsum;
+		t.count += dcount;
+		if (interval < t.first) {
+			t.first = interval;
+		}
+	}
+	
+	if (_murmur_prefix_io(cls, mmr, arch, from, count, disk, 1) == 0 &&
+		_murmur_prefix_write_totals(cls, mmr, arch, &t) == 0) {
+		ret = 0;
+	}
+	
+done:
+	free(disk);
+	return ret;
+}
+
+/**
+ * Reads the headers of an already-open murmur file. The file is closed on failure.
+ */
+static struct murmur* _murmur_open_fd(const int fd) {
+	struct murmur *mmr = malloc(sizeof(*mmr));
+	if (mmr == NULL) {
+		M_PERROR("Could not allocate murmur file");
+		close(fd);
+		return NULL;
+	}
+	
+	memset(mmr, 0, sizeof(*mmr));
+	mmr->fd = fd;
+	
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		M_PERROR("Could not stat murmur file");
+		goto error;
+	}
+	
+	mmr->dev = st.st_dev;
+	mmr->ino = st.st_ino;
+	
+	struct murmur_header h;
+	if (read(fd, &h, sizeof(h)) != sizeof(h)) {
+		M_ERROR("Could not read murmur header: file is corrupted");
+		goto error;
+	}
+	
+	mmr->aggregation = h.aggregation;
+	mmr->max_retention = be64toh(h.max_retention);
+	mmr->x_files_factor = h.x_files_factor;
+	mmr->archive_count = be32toh(h.archive_count);
+	
+	if (mmr->archive_count == 0) {
+		M_ERROR("Murmur file corrupted: no archives specified");
+		goto error;
+	}
+	
+	struct archive_header *headers = malloc(mmr->archive_count * sizeof(*headers));
+	if (headers == NULL) {
+		M_PERROR("Could not allocate archive headers");
+		goto error;
+	}
+	
+	if (read(fd, headers, mmr->archive_count * sizeof(*headers)) != mmr->archive_count * sizeof(*headers)) {
+		M_ERROR("Could not read archive headers: file is corrupted");
+		free(headers);
+		goto error;
+	}
+	
+	// The extension block comes right after the last archive, and may say how to build them
+	const struct archive_header *last = headers + mmr->archive_count - 1;
+	uint64_t ext_offset = be32toh(last->offset) + ((uint64_t)be32toh(last->points) * sizeof(struct point));
+	uint64_t records_len = mmr->archive_count * sizeof(struct murmur_ext_archive);
+	struct murmur_ext_header ext;
+	if ((uint64_t)st.st_size >= ext_offset + sizeof(ext) + records_len &&
+		pread(fd, &ext, sizeof(ext), ext_offset) == sizeof(ext) &&
+		memcmp(ext.magic, MURMUR_EXT_MAGIC, sizeof(ext.magic)) == 0 &&
+		be32toh(ext.version) >= 1) {
+		mmr->flags |= MURMUR_FLAG_EXT;
+	}
+	
+	if ((mmr->flags & MURMUR_FLAG_EXT) && (be32toh(ext.features) & MURMUR_EXT_PREFIX)) {
+		mmr->flags |= MURMUR_FLAG_PREFIX;
+	}
+	
+	char *aggregations = NULL;
+	if ((mmr->flags & MURMUR_FLAG_EXT) && (be32toh(ext.features) & MURMUR_EXT_AGGREGATION)) {
+		aggregations = malloc(mmr->archive_count);
+		if (aggregations == NULL ||
+			pread(fd, aggregations, mmr->archive_count, ext_offset + sizeof(ext) + records_len) != (ssize_t)mmr->archive_count) {
+			M_ERROR("Could not read aggregation methods: file is corrupted");
+			free(aggregations);
+			free(headers);
+			goto error;
+		}
+		
+		mmr->flags |= MURMUR_FLAG_AGGREGATION;
+	}
+	
+	mmr->archives = _murmur_shape_intern(mmr->aggregation, aggregations, headers, mmr->archive_count);
+	free(aggregations);
+	free(headers);
+	
+	if (mmr->archives == NULL) {
+		goto error;
+	}
+	
+	return mmr;
+	
+error:
+	murmur_close(mmr);
+	return NULL;
+}
+
+struct murmur* murmur_open(const char *path) {
+	int fd = open(path, O_RDWR, O_DIRECT|O_SYNC);
+	if (fd == -1) {
+		M_PERROR("Could not open murmur file");
+		return NULL;
+	}
+	
+	struct murmur *mmr = _murmur_open_fd(fd);
+	if (mmr != NULL && _murmur_recover(mmr) < 0) {
+		M_WARN("Could not repair %s: lower archives may be inconsistent", path);
+	}
+	
+	return mmr;
+}
+
+struct murmur* murmur_open_readonly(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		M_PERROR("Could not open murmur file");
+		return NULL;
+	}
+	
+	return _murmur_open_fd(fd);
+}
+
+void murmur_close(struct murmur *mmr) {
+	if (mmr != NULL) {
+		close(mmr->fd);
+		free(mmr->intents);
+		free(mmr);
+	}
+}
+
+int murmur_set(struct murmur *mmr, const int64_t timestamp, const double value) {
+	struct murmur_archive *arch = NULL;
+	if (_murmur_get_archive(mmr, timestamp, &arch) != 0) {
+		M_ERROR("Could not locate suitable archive for item at timestamp: %ld", timestamp);
+		return -1;
+	}
+	
+	// If this doesn't make it all the way down, the next open finishes it
+	int protect = mmr->flags & MURMUR_FLAG_PROTECT;
+	if (protect && _murmur_intent_mark(mmr, arch, timestamp, timestamp) != 0) {
+		M_WARN("Writing without crash protection");
+		protect = 0;
+	}
+	
+	if (_murmur_arch_set(io_ingest, mmr, arch, timestamp, value) != 0) {
+		return -1;
+	}
+	
+	// A point too old for the most precise archive is written as-is to every archive at the
+	// precision it lands on, however each aggregates
+	for (struct murmur_archive *sib = arch->sibling; sib != NULL; sib = sib->sibling) {
+		if (_murmur_arch_set(io_ingest, mmr, sib, timestamp, value) != 0) {
+			return -1;
+		}
+	}
+	
+	return protect ? _murmur_intent_clear(mmr, arch) : 0;
+}
+
+void murmur_protect(struct murmur *mmr, const int protect) {
+	if (protect) {
+		mmr->flags |= MURMUR_FLAG_PROTECT;
+	} else {
+		mmr->flags &= ~MURMUR_FLAG_PROTECT;
+	}
+}
+
+int murmur_get(struct murmur *mmr, const int64_t timestamp, double * const value) {
+	struct murmur_archive *arch = NULL;
+	if (_murmur_get_archive(mmr, timestamp, &arch) != 0) {
+		M_ERROR("Could not locate suitable archive for item at timestamp: %ld", timestamp);
+		return -1;
+	}
+	
+	return _murmur_arch_get(mmr, arch, timestamp, value);
+}
+
+/**
+ * Works out which archive a fetch reads from, and which of its points.
+ *
+ * @param min_step Only archives at least this coarse are read from, unless there are none.
+ * @param aggregation Only archives aggregated this way are read from, 0 for any.
+ * @param[out] arch_out The archive to read.
+ * @param[out] from_out The first interval to read.
+ * @param[out] count_out How many points to read.
+ *
+ * @return 0 if there's something to read, 1 if the range is entirely outside of what the
+ * file holds, -1 on error.
+ */
+static int _murmur_fetch_plan_aggregation(const struct murmur *mmr, int64_t from, int64_t until, const uint32_t min_step, const enum aggregation_method aggregation, struct murmur_archive **arch_out, int64_t *from_out, uint64_t *count_out) {
+	if (from > until) {
+		M_ERROR("Invalid time range: %ld > %ld", from, until);
+		return -1;
+	}
+	
+	int64_t now = time(NULL);
+	int64_t oldest = now - mmr->max_retention;
+	
+	if (until > now) {
+		until = now;
+	}
+	
+	if (from < oldest) {
+		from = oldest;
+	}
+	
+	// Entirely outside of what the file holds
+	if (from > until) {
+		return 1;
+	}
+	
+	// The most precise archive that reaches back far enough
+	struct murmur_archive *arch = _murmur_arch_coarsest(mmr);
+	for (uint32_t i = 0; i < mmr->archive_count; i++) {
+		if (_murmur_arch_is_sibling(mmr, mmr->archives + i)) {
+			continue;
+		}
+		
+		if (mmr->archives[i].retention >= now - from && mmr->archives[i].seconds_per_point >= min_step) {
+			arch = mmr->archives + i;
+			break;
+		}
+	}
+	
+	// The first archive from there down with the method. The most precise archive holds the
+	// points as written, so it's every method at once.
+	if (aggregation != 0 && arch != mmr->archives) {
+		struct murmur_archive *match = NULL;
+		for (struct murmur_archive *p = arch; match == NULL && p != NULL; p = p->lower) {
+			for (struct murmur_archive *a = p; match == NULL && a != NULL; a = a->sibling) {
+				if (a->aggregation == aggregation) {
+					match = a;
+				}
+			}
+		}
+		
+		if (match == NULL) {
+			M_ERROR("No archive of at least %us per point is aggregated by %s", arch->seconds_per_point, murmur_aggregation_name(aggregation));
+			return -1;
+		}
+		
+		arch = match;
+	}
+	
+	int64_t step = arch->seconds_per_point;
+	int64_t from_interval = from - (from % step) + step;
+	int64_t until_interval = until - (until % step) + step;
+	
+	if (until_interval == from_interval) {
+		until_interval += step;
+	}
+	
+	uint64_t count = (until_interval - from_interval) / step;
+	if (count > arch->points) {
+		count = arch->points;
+		from_interval = until_interval - (count * step);
+	}
+	
+	*arch_out = arch;
+	*from_out = from_interval;
+	*count_out = count;
+	
+	return 0;
+}
+
+static int _murmur_fetch_plan(const struct murmur *mmr, const int64_t from, const int64_t until, const uint32_t min_step, struct murmur_archive **arch_out, int64_t *from_out, uint64_t *count_out) {
+	return _murmur_fetch_plan_aggregation(mmr, from, until, min_step, 0, arch_out, from_out, count_out);
+}
+
+uint64_t murmur_fetch_cost(const struct murmur *mmr, const int64_t from, const int64_t until, const uint32_t min_step) {
+	struct murmur_archive *arch;
+	int64_t from_interval;
+	uint64_t count;
+	
+	if (_murmur_fetch_plan(mmr, from, until, min_step, &arch, &from_interval, &count) != 0) {
+		return 0;
+	}
+	
+	return count * sizeof(struct point);
+}
+
+int murmur_fetch(struct murmur *mmr, int64_t from, int64_t until, struct murmur_series *series) {
+	return murmur_fetch_step(mmr, from, until, 0, series);
+}
+
+/**
+ * Reads the points a fetch has planned into a series.
+ */
+static int _murmur_fetch_arch(struct murmur *mmr, struct murmur_archive *arch, const int64_t from_interval, const uint64_t count, struct murmur_series *series) {
+	int64_t step = arch->seconds_per_point;
+	struct _murmur_arena_mark mark = _murmur_arena_mark();
+	
+	struct point *points = _murmur_arena_alloc(count * sizeof(*points));
+	if (points == NULL || _murmur_series_alloc(series, count) != 0) {
+		goto error;
+	}
+	
+	if (_murmur_read_points(io_query, mmr->fd, arch, from_interval, points, count) != 0) {
+		goto error;
+	}
+	
+	for (uint64_t i = 0; i < count; i++) {
+		struct point *pt = points + i;
+		series->values[i] = PTINT(pt) == from_interval + (int64_t)(i * step) ? PTVAL(pt) : NAN;
+	}
+	
+	series->from = from_interval;
+	series->step = step;
+	series->count = count;
+	
+	_murmur_arena_release(mark);
+	return 0;
+
+error:
+	_murmur_arena_release(mark);
+	murmur_series_free(series);
+	return -1;
+}
+
+int murmur_fetch_step(struct murmur *mmr, const int64_t from, const int64_t until, const uint32_t min_step, struct murmur_series *series) {
+	struct murmur_archive *arch;
+	int64_t from_interval;
+	uint64_t count;
+	
+	memset(series, 0, sizeof(*series));
+	
+	int plan = _murmur_fetch_plan(mmr, from, until, min_step, &arch, &from_interval, &count);
+	if (plan != 0) {
+		return plan == 1 ? 0 : -1;
+	}
+	
+	return _murmur_fetch_arch(mmr, arch, from_interval, count, series);
+}
+
+int murmur_fetch_aggregation(struct murmur *mmr, const int64_t from, const int64_t until, const uint32_t min_step, const enum aggregation_method aggregation, struct murmur_series *series) {
+	struct murmur_archive *arch;
+	int64_t from_interval;
+	uint64_t count;
+	
+	memset(series, 0, sizeof(*series));
+	
+	int plan = _murmur_fetch_plan_aggregation(mmr, from, until, min_step, aggregation, &arch, &from_interval, &count);
+	if (plan != 0) {
+		return plan == 1 ? 0 : -1;
+	}
+	
+	return _murmur_fetch_arch(mmr, arch, from_interval, count, series);
+}
+
+int murmur_fetch_progressive(struct murmur *mmr, const int64_t from, const int64_t until, const uint32_t min_step, murmur_progress_cb cb, void *ctx) {
+	struct murmur_archive *finest;
+	int64_t from_interval;
+	uint64_t count;
+	
+	int plan = _murmur_fetch_plan(mmr, from, until, min_step, &finest, &from_interval, &count);
+	if (plan != 0) {
+		return plan == 1 ? 0 : -1;
+	}
+	
+	// Coarser archives always reach back further, so each one covers the range by itself
+	for (struct murmur_archive *arch = _murmur_arch_coarsest(mmr); arch >= finest; arch--) {
+		if (_murmur_arch_is_sibling(mmr, arch)) {
+			continue;
+		}
+		
+		struct murmur_series series;
+		if (murmur_fetch_step(mmr, from, until, arch->seconds_per_point, &series) != 0) {
+			return -1;
+		}
+		
+		int stop = cb(ctx, &series, arch == finest);
+		murmur_series_free(&series);
+		
+		if (stop != 0) {
+			break;
+		}
+	}
+	
+	return 0;
+}
+
+/**
+ * How many points murmur_fetch_into() reads at a time.
+ */
+#define MURMUR_FETCH_CHUNK 256
+
+int murmur_fetch_into(struct murmur *mmr, const int64_t from, const int64_t until, const uint32_t min_step, double *values, const uint32_t capacity, struct murmur_series *series) {
+	struct murmur_archive *arch;
+	int64_t from_interval;
+	uint64_t count;
+	
+	memset(series, 0, sizeof(*series));
+	
+	int plan = _murmur_fetch_plan(mmr, from, until, min_step, &arch, &from_interval, &count);
+	if (plan != 0) {
+		return plan == 1 ? 0 : -1;
+	}
+	
+	int64_t step = arch->seconds_per_point;
+	series->from = from_interval;
+	series->step = step;
+	series->count = count;
+	
+	// Let the caller know how much room it needs
+	if (count > capacity) {
+		return -1;
+	}
+	
+	series->values = values;
+	
+	// Points are bigger than values, so they go through a small buffer a piece at a time
+	struct point points[MURMUR_FETCH_CHUNK];
+	
+	for (uint64_t done = 0; done < count; ) {
+		uint64_t n = count - done < MURMUR_FETCH_CHUNK ? count - done : MURMUR_FETCH_CHUNK;
+		int64_t at = from_interval + (int64_t)(done * step);
+		
+		if (_murmur_read_points(io_query, mmr->fd, arch, at, points, n) != 0) {
+			series->values = NULL;
+			return -1;
+		}
+		
+		for (uint64_t i = 0; i < n; i++) {
+			values[done + i] = PTINT(points + i) == at + (int64_t)(i * step) ? PTVAL(points + i) : NAN;
+		}
+		
+		done += n;
+	}
+	
+	return 0;
+}
+
+/**
+ * A single write waiting in the scheduler.
+ */
+struct _murmur_sched_write {
+	/**
+	 * Where the point lives on disk: these are what the writes are sorted by.
+	 */
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t offset;
+	
+	/**
+	 * The order the write was queued in, so that the last write to a point wins.
+	 */
+	uint64_t seq;
+	
+	/**
+	 * The file the point belongs to.
+	 */
+	struct murmur *mmr;
+	
+	/**
+	 * The archive being written to.
+	 */
+	struct murmur_archive *arch;
+	
+	/**
+	 * The archive the point is aggregated from. NULL for points queued directly.
+	 */
+	struct murmur_archive *src;
+	
+	/**
+	 * The timestamp the point was written for.
+	 */
+	int64_t timestamp;
+	
+	/**
+	 * The point, ready to go to disk.
+	 */
+	struct point pt;
+};
+
+/**
+ * An archive with points being written to it, and the range they cover.
+ */
+struct _murmur_sched_intent {
+	struct murmur *mmr;
+	struct murmur_archive *arch;
+	int64_t from;
+	int64_t until;
+	
+	/**
+	 * Set when the record couldn't be made, or still covers a range an earlier flush left
+	 * behind: clearing it would lose that range.
+	 */
+	int keep;
+};
+
+struct murmur_sched {
+	/**
+	 * The writes waiting for the next flush.
+	 */
+	struct _murmur_sched_write *writes;
+	
+	/**
+	 * The number of writes waiting.
+	 */
+	size_t count;
+	
+	/**
+	 * The number of writes there is room for.
+	 */
+	size_t alloc;
+	
+	/**
+	 * The sequence number to give the next write.
+	 */
+	uint64_t seq;
+	
+	/**
+	 * The archives being written to in the current flush, kept between flushes so that their
+	 * room is reused.
+	 */
+	struct _murmur_sched_intent *intents;
+	size_t intents_count;
+	size_t intents_alloc;
+};
+
+static int _murmur_sched_sort(const void *a, const void *b) {
+	const struct _murmur_sched_write *wa = a;
+	const struct _murmur_sched_write *wb = b;
+	
+	if (wa->dev != wb->dev) {
+		return wa->dev < wb->dev ? -1 : 1;
+	}
+	
+	if (wa->ino != wb->ino) {
+		return wa->ino < wb->ino ? -1 : 1;
+	}
+	
+	if (wa->offset != wb->offset) {
+		return wa->offset < wb->offset ? -1 : 1;
+	}
+	
+	return wa->seq < wb->seq ? -1 : (wa->seq > wb->seq);
+}
+
+/**
+ * Puts the writes in disk order and drops any that are overwritten by a later write
+ * to the same point.
+ *
+ * @return The number of writes left.
+ */
+static size_t _murmur_sched_sort_writes(struct _murmur_sched_write *writes, const size_t count) {
+	if (count == 0) {
+		return 0;
+	}
+	
+	qsort(writes, count, sizeof(*writes), _murmur_sched_sort);
+	
+	size_t kept = 0;
+	for (size_t i = 0; i < count; i++) {
+		struct _murmur_sched_write *w = writes + i;
+		struct _murmur_sched_write *next = i + 1 < count ? w + 1 : NULL;
+		
+		if (next != NULL && next->dev == w->dev && next->ino == w->ino && next->offset == w->offset) {
+			continue;
+		}
+		
+		writes[kept++] = *w;
+	}
+	
+	return kept;
+}
+
+/**
+ * Writes sorted points to disk, merging runs of adjacent points into a single write.
+ */
+static int _murmur_sched_issue(const int cls, struct _murmur_sched_write *writes, const size_t count) {
+	int ret = 0;
+	struct iovec iov[IOV_MAX];
+	
+	size_t i = 0;
+	while (i < count) {
+		struct _murmur_sched_write *first = writes + i;
+		int iovc = 0;
+		
+		do {
+			iov[iovc].iov_base = &writes[i].pt;
+			iov[iovc].iov_len = sizeof(writes[i].pt);
+			iovc++;
+			i++;
+		} while (i < count &&
+			iovc < IOV_MAX &&
+			writes[i].dev == first->dev &&
+			writes[i].ino == first->ino &&
+			writes[i].offset == first->offset + (iovc * sizeof(struct point)));
+		
+		ssize_t len = iovc * sizeof(struct point);
+		if (_murmur_io_pwritev(cls, first->mmr->fd, iov, iovc, first->offset) != len) {
+			M_PERROR("Could not write scheduled records");
+			ret = -1;
+			continue;
+		}
+		
+		for (struct _murmur_sched_write *w = first; w < writes + i; w++) {
+			if (_murmur_prefix_set(cls, w->mmr, w->arch, PTINT(&w->pt), PTVAL(&w->pt)) != 0) {
+				ret = -1;
+			}
+		}
+	}
+	
+	return ret;
+}
+
+/**
+ * Queues a write, growing the queue if necessary.
+ */
+static struct _murmur_sched_write* _murmur_sched_push(struct _murmur_sched_write **writes, size_t *count, size_t *alloc) {
+	if (*count == *alloc) {
+		size_t alloc_to = *alloc == 0 ? 64 : *alloc * 2;
+		struct _murmur_sched_write *w = realloc(*writes, alloc_to * sizeof(**writes));
+		if (w == NULL) {
+			M_PERROR("Could not grow write queue");
+			return NULL;
+		}
+		
+		*writes = w;
+		*alloc = alloc_to;
+	}
+	
+	return *writes + (*count)++;
+}
+
+struct murmur_sched* murmur_sched_new() {
+	struct murmur_sched *sched = malloc(sizeof(*sched));
+	if (sched == NULL) {
+		M_PERROR("Could not allocate write scheduler");
+		return NULL;
+	}
+	
+	memset(sched, 0, sizeof(*sched));
+	return sched;
+}
+
+void murmur_sched_free(struct murmur_sched *sched) {
+	if (sched != NULL) {
+		free(sched->writes);
+		free(sched->intents);
+		free(sched);
+	}
+}
+
+int murmur_sched_set(struct murmur_sched *sched, struct murmur *mmr, const int64_t timestamp, const double value) {
+	struct murmur_archive *arch = NULL;
+	if (_murmur_get_archive(mmr, timestamp, &arch) != 0) {
+		M_ERROR("Could not locate suitable archive for item at timestamp: %ld", timestamp);
+		return -1;
+	}
+	
+	// The point goes as-is to the archive it lands on and to any siblings of it, just like
+	// murmur_set()
+	for (; arch != NULL; arch = arch->sibling) {
+		struct _murmur_sched_write *w = _murmur_sched_push(&sched->writes, &sched->count, &sched->alloc);
+		if (w == NULL) {
+			return -1;
+		}
+		
+		int64_t interval;
+		w->dev = mmr->dev;
+		w->ino = mmr->ino;
+		w->offset = _murmur_point_offset(arch, timestamp, &interval);
+		w->seq = sched->seq++;
+		w->mmr = mmr;
+		w->arch = arch;
+		w->src = NULL;
+		w->timestamp = timestamp;
+		_murmur_make_point(&w->pt, interval, value);
+	}
+	
+	return 0;
+}
+
+/**
+ * Records the range of points about to be written to each archive, before any of them are. The
+ * writes are sorted, so each archive's writes are all together.
+ */
+static int _murmur_sched_mark(struct murmur_sched *sched, const struct _murmur_sched_write *writes, const size_t count) {
+	int ret = 0;
+	sched->intents_count = 0;
+	
+	for (size_t i = 0; i < count; i++) {
+		const struct _murmur_sched_write *w = writes + i;
+		if (!(w->mmr->flags & MURMUR_FLAG_EXT) || w->arch->lower == NULL) {
+			continue;
+		}
+		
+		struct _murmur_sched_intent *in = sched->intents_count == 0 ? NULL : sched->intents + sched->intents_count - 1;
+		if (in != NULL && in->mmr->dev == w->mmr->dev && in->mmr->ino == w->mmr->ino && in->arch == w->arch) {
+			in->from = w->timestamp < in->from ? w->timestamp : in->from;
+			in->until = w->timestamp > in->until ? w->timestamp : in->until;
+			continue;
+		}
+		
+		if (sched->intents_count == sched->intents_alloc) {
+			size_t alloc = sched->intents_alloc == 0 ? 64 : sched->intents_alloc * 2;
+			struct _murmur_sched_intent *intents = realloc(sched->intents, alloc * sizeof(*intents));
+			if (intents == NULL) {
+				M_PERROR("Could not grow intent list");
+				return -1;
+			}
+			
+			sched->intents = intents;
+			sched->intents_alloc = alloc;
+		}
+		
+		in = sched->intents + sched->intents_count++;
+		in->mmr = w->mmr;
+		in->arch = w->arch;
+		in->from = w->timestamp;
+		in->until = w->timestamp;
+		in->keep = 0;
+	}
+	
+	for (size_t i = 0; i < sched->intents_count; i++) {
+		struct _murmur_sched_intent *in = sched->intents + i;
+		if (_murmur_intent_mark(in->mmr, in->arch, in->from, in->until) != 0) {
+			in->keep = 1;
+			ret = -1;
+		}
+	}
+	
+	return ret;
+}
+
+int murmur_sched_flush(struct murmur_sched *sched) {
+	int ret = 0;
+	
+	struct _murmur_sched_write *writes = sched->writes;
+	size_t count = sched->count;
+	size_t alloc = sched->alloc;
+	
+	struct _murmur_sched_write *lower = NULL;
+	size_t lower_count = 0;
+	size_t lower_alloc = 0;
+	
+	// Only the first level is what was queued; everything after is propogation
+	int cls = io_ingest;
+	
+	while (count > 0) {
+		count = _murmur_sched_sort_writes(writes, count);
+		
+		if (cls == io_ingest && _murmur_sched_mark(sched, writes, count) != 0) {
+			M_WARN("Flushing without crash protection");
+		}
+		
+		// Points being propogated have to be aggregated from what's on disk now that the
+		// level above has been written. Since they're sorted, these reads are in disk order, too.
+		for (size_t i = 0; i < count; i++) {
+			struct _murmur_sched_write *w = writes + i;
+			if (w->src == NULL) {
+				continue;
+			}
+			
+			uint64_t pointsc = w->src->ratio;
+			struct point points[pointsc];
+			
+			if (_murmur_read_bucket(w->mmr->fd, w->src, w->timestamp, points, pointsc) != 0) {
+				M_ERROR("Propogation failing. This is really bad. Your archive will probably be inconsistent.");
+				ret = -1;
+				w->arch = NULL;
+				continue;
+			}
+			
+			int64_t interval;
+			_murmur_point_offset(w->arch, w->timestamp, &interval);
+			_murmur_make_point(&w->pt, interval, w->arch->gather(points, pointsc));
+		}
+		
+		// Anything that failed to aggregate can't be written
+		size_t kept = 0;
+		for (size_t i = 0; i < count; i++) {
+			if (writes[i].arch != NULL) {
+				writes[kept++] = writes[i];
+			}
+		}
+		count = kept;
+		
+		if (_murmur_sched_issue(cls, writes, count) != 0) {
+			ret = -1;
+		}
+		
+		lower_count = 0;
+		for (size_t i = 0; i < count; i++) {
+			struct _murmur_sched_write *w = writes + i;
+			
+			// The archive below, and any siblings of it
+			for (struct murmur_archive *to = w->arch->lower; to != NULL; to = to->sibling) {
+				struct _murmur_sched_write *l = _murmur_sched_push(&lower, &lower_count, &lower_alloc);
+				if (l == NULL) {
+					ret = -1;
+					break;
+				}
+				
+				int64_t interval;
+				*l = *w;
+				l->offset = _murmur_point_offset(to, w->timestamp, &interval);
+				l->arch = to;
+				l->src = w->arch;
+			}
+		}
+		
+		// The next level of propogation becomes the current set of writes
+		struct _murmur_sched_write *tmp = writes;
+		size_t tmp_alloc = alloc;
+		writes = lower;
+		count = lower_count;
+		alloc = lower_alloc;
+		lower = tmp;
+		lower_alloc = tmp_alloc;
+		cls = io_propagation;
+	}
+	
+	// Hang on to the larger queue so that steady-state flushes don't allocate
+	if (lower_alloc > alloc) {
+		free(writes);
+		writes = lower;
+		alloc = lower_alloc;
+	} else {
+		free(lower);
+	}
+	
+	sched->writes = writes;
+	sched->count = 0;
+	sched->alloc = alloc;
+	
+	// If anything failed, the intents stay behind for the next open to finish
+	for (size_t i = 0; ret == 0 && i < sched->intents_count; i++) {
+		struct _murmur_sched_intent *in = sched->intents + i;
+		if (!in->keep && _murmur_intent_clear(in->mmr, in->arch) != 0) {
+			ret = -1;
+		}
+	}
+	sched->intents_count = 0;
+	
+	return ret;
+}
+
+/**
+ * A pool of threads that runs blocking calls for callers that can't block.
+ */
+struct murmur_engine {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	
+	/**
+	 * Jobs waiting to run, oldest first.
+	 */
+	struct murmur_job *head;
+	struct murmur_job *tail;
+	
+	int stopping;
+	
+	uint32_t thread_count;
+	pthread_t threads[];
+};
+
+static void* _murmur_engine_worker(void *arg) {
+	struct murmur_engine *engine = arg;
+	
+	while (1) {
+		pthread_mutex_lock(&engine->lock);
+		while (engine->head == NULL && !engine->stopping) {
+			pthread_cond_wait(&engine->cond, &engine->lock);
+		}
+		
+		// Everything queued still runs before stopping
+		struct murmur_job *job = engine->head;
+		if (job == NULL) {
+			pthread_mutex_unlock(&engine->lock);
+			break;
+		}
+		
+		engine->head = job->next;
+		if (engine->head == NULL) {
+			engine->tail = NULL;
+		}
+		
+		pthread_mutex_unlock(&engine->lock);
+		
+		// The job belongs to the caller again once done is called, so it can't be touched after
+		job->next = NULL;
+		job->ret = job->run(job);
+		job->done(job);
+	}
+	
+	return NULL;
+}
+
+struct murmur_engine* murmur_engine_new(const uint32_t threads) {
+	uint32_t thread_count = threads == 0 ? 1 : threads;
+	
+	struct murmur_engine *engine = malloc(sizeof(*engine) + (thread_count * sizeof(*engine->threads)));
+	if (engine == NULL) {
+		M_PERROR("Could not allocate engine");
+		return NULL;
+	}
+	
+	memset(engine, 0, sizeof(*engine));
+	pthread_mutex_init(&engine->lock, NULL);
+	pthread_cond_init(&engine->cond, NULL);
+	
+	for (; engine->thread_count < thread_count; engine->thread_count++) {
+		if (pthread_create(engine->threads + engine->thread_count, NULL, _murmur_engine_worker, engine) != 0) {
+			M_PERROR("Could not start engine thread");
+			murmur_engine_free(engine);
+			return NULL;
+		}
+	}
+	
+	return engine;
+}
+
+void murmur_engine_free(struct murmur_engine *engine) {
+	if (engine == NULL) {
+		return;
+	}
+	
+	pthread_mutex_lock(&engine->lock);
+	engine->stopping = 1;
+	pthread_cond_broadcast(&engine->cond);
+	pthread_mutex_unlock(&engine->lock);
+	
+	for (uint32_t i = 0; i < engine->thread_count; i++) {
+		pthread_join(engine->threads[i], NULL);
+	}
+	
+	pthread_cond_destroy(&engine->cond);
+	pthread_mutex_destroy(&engine->lock);
+	free(engine);
+}
+
+int murmur_engine_submit(struct murmur_engine *engine, struct murmur_job *job) {
+	pthread_mutex_lock(&engine->lock);
+	
+	if (engine->stopping) {
+		pthread_mutex_unlock(&engine->lock);
+		M_ERROR("Engine is stopping: not accepting jobs");
+		return -1;
+	}
+	
+	job->next = NULL;
+	if (engine->tail == NULL) {
+		engine->head = job;
+	} else {
+		engine->tail->next = job;
+	}
+	engine->tail = job;
+	
+	pthread_cond_signal(&engine->cond);
+	pthread_mutex_unlock(&engine->lock);
+	
+	return 0;
+}
+
+/**
+ * A point, for building an archive's prefix records from what's in it.
+ */
+struct _murmur_prefix_src {
+	int64_t interval;
+	double value;
+};
+
+static int _murmur_prefix_src_sort(const void *a, const void *b) {
+	int64_t ia = ((const struct _murmur_prefix_src*)a)->interval;
+	int64_t ib = ((const struct _murmur_prefix_src*)b)->interval;
+	return (ia > ib) - (ia < ib);
+}
+
+/**
+ * Writes an archive's prefix records and totals from the points it already has.
+ */
+static int _murmur_prefix_build(struct murmur *mmr, const struct murmur_archive *arch) {
+	int ret = -1;
+	int64_t spp = arch->seconds_per_point;
+	struct point *points = malloc(arch->size);
+	struct _murmur_prefix_src *src = malloc(arch->points * sizeof(*src));
+	struct murmur_prefix_point *disk = malloc(arch->points * sizeof(*disk));
+	
+	if (points == NULL || src == NULL || disk == NULL) {
+		M_PERROR("Could not allocate prefix records");
+		goto done;
+	}
+	
+	if (_murmur_io_pread(io_maintenance, mmr->fd, points, arch->size, arch->offset) != (ssize_t)arch->size) {
+		M_PERROR("Could not read archive");
+		goto done;
+	}
+	
+	// Only points that are where they belong, which an empty slot's zeros aren't
+	uint64_t count = 0;
+	int64_t last = 0;
+	for (uint64_t i = 0; i < arch->points; i++) {
+		int64_t interval = PTINT(points + i);
+		if (interval <= 0 || interval % spp != 0 || (uint64_t)((interval % arch->retention) / spp) != i) {
+			continue;
+		}
+		
+		src[count].interval = interval;
+		src[count].value = PTVAL(points + i);
+		last = interval > last ? interval : last;
+		count++;
+	}
+	
+	qsort(src, count, sizeof(*src), _murmur_prefix_src_sort);
+	
+	// Anything a whole ring older than the newest point was left over from an earlier lap
+	uint64_t skip = 0;
+	while (skip < count && src[skip].interval <= last - (int64_t)arch->retention) {
+		skip++;
+	}
+	
+	struct _murmur_prefix_totals t = { 0, 0, 0, 0 };
+	
+	if (skip < count) {
+		t.first = src[skip].interval;
+		t.last = last;
+		
+		uint64_t n = ((t.last - t.first) / spp) + 1;
+		uint64_t next = skip;
+		
+		for (uint64_t k = 0; k < n; k++) {
+			struct _murmur_prefix rec = { t.first + ((int64_t)k * spp), NAN, t.sum, t.count };
+			
+			if (next < count && src[next].interval == rec.interval) {
+				rec.value = src[next++].value;
+				t.sum += rec.value;
+				t.count++;
+				rec.sum = t.sum;
+				rec.count = t.count;
+			}
+			
+			_murmur_prefix_encode(&rec, disk + k);
+		}
+		
+		if (_murmur_prefix_io(io_maintenance, mmr, arch, t.first, n, disk, 1) != 0) {
+			goto done;
+		}
+	}
+	
+	ret = _murmur_prefix_write_totals(io_maintenance, mmr, arch, &t);
+	
+done:
+	free(points);
+	free(src);
+	free(disk);
+	return ret;
+}
+
+int murmur_prefix_enable(const char *path) {
+	struct murmur *mmr = murmur_open(path);
+	if (mmr == NULL) {
+		return -1;
+	}
+	
+	int ret = -1;
+	
+	if (!(mmr->flags & MURMUR_FLAG_EXT)) {
+		M_ERROR("%s was created before extension blocks, so it can't have prefix sums", path);
+		goto done;
+	}
+	
+	if (mmr->flags & MURMUR_FLAG_PREFIX) {
+		ret = 0;
+		goto done;
+	}
+	
+	uint64_t points = 0;
+	for (uint32_t i = 0; i < mmr->archive_count; i++) {
+		points += mmr->archives[i].points;
+	}
+	
+	uint64_t len = (mmr->archive_count * sizeof(struct murmur_prefix_archive)) + (points * sizeof(struct murmur_prefix_point));
+	if (fallocate(mmr->fd, 0, _murmur_prefix_offset(mmr), len) != 0) {
+		M_PERROR("Could not allocate prefix block");
+		goto done;
+	}
+	
+	for (uint32_t i = 0; i < mmr->archive_count; i++) {
+		if (_murmur_prefix_build(mmr, mmr->archives + i) != 0) {
+			goto done;
+		}
+	}
+	
+	// Only marked once it's all there, so that a file is never opened with half of a block
+	struct murmur_ext_header ext;
+	uint64_t ext_offset = _murmur_ext_offset(mmr);
+	if (pread(mmr->fd, &ext, sizeof(ext), ext_offset) != sizeof(ext)) {
+		M_PERROR("Could not read extension header");
+		goto done;
+	}
+	
+	ext.features = htobe32(be32toh(ext.features) | MURMUR_EXT_PREFIX);
+	if (pwrite(mmr->fd, &ext, sizeof(ext), ext_offset) != sizeof(ext)) {
+		M_PERROR("Could not write extension header");
+		goto done;
+	}
+	
+	ret = 0;
+	
+done:
+	murmur_close(mmr);
+	return ret;
+}
+
+/**
+ * Finds the totals of every point before an interval, from its record.
+ */
+static int _murmur_prefix_before(struct murmur *mmr, const struct murmur_archive *arch, const int64_t interval, double *sum, uint64_t *count) {
+	struct murmur_prefix_point disk;
+	if (_murmur_prefix_io(io_query, mmr, arch, interval, 1, &disk, 0) != 0) {
+		return -1;
+	}
+	
+	struct _murmur_prefix rec;
+	_murmur_prefix_decode(&disk, &rec);
+	
+	if (rec.interval != interval) {
+		M_ERROR("Prefix record for %ld holds %ld", interval, rec.interval);
+		return -1;
+	}
+	
+	int has = !isnan(rec.value);
+	*sum = rec.sum - (has ? rec.value : 0);
+	*count = rec.count - has;
+	
+	return 0;
+}
+
+int murmur_range_sum(struct murmur *mmr, const int64_t from, const int64_t until, double *sum, uint64_t *count) {
+	*sum = 0;
+	*count = 0;
+	
+	struct murmur_archive *arch;
+	int64_t from_interval;
+	uint64_t n;
+	
+	int plan = _murmur_fetch_plan(mmr, from, until, 0, &arch, &from_interval, &n);
+	if (plan != 0) {
+		return plan == 1 ? 0 : -1;
+	}
+	
+	// Without prefix sums, every point has to be read
+	if (!(mmr->flags & MURMUR_FLAG_PREFIX)) {
+		struct murmur_series series;
+		if (murmur_fetch(mmr, from, until, &series) != 0) {
+			return -1;
+		}
+		
+		for (uint32_t i = 0; i < series.count; i++) {
+			if (!isnan(series.values[i])) {
+				*sum += series.values[i];
+				(*count)++;
+			}
+		}
+		
+		murmur_series_free(&series);
+		return 0;
+	}
+	
+	struct _murmur_prefix_totals t;
+	if (_murmur_prefix_read_totals(io_query, mmr, arch, &t) != 0) {
+		return -1;
+	}
+	
+	int64_t a = from_interval;
+	int64_t b = from_interval + ((int64_t)(n - 1) * arch->seconds_per_point);
+	
+	if (t.last == 0 || b < t.first || a > t.last) {
+		return 0;
+	}
+	
+	// Everything up to and including b is everything before the interval after it
+	double hi_sum = t.sum;
+	uint64_t hi_count = t.count;
+	if (b < t.last && _murmur_prefix_before(mmr, arch, b + arch->seconds_per_point, &hi_sum, &hi_count) != 0) {
+		return -1;
+	}
+	
+	double lo_sum = 0;
+	uint64_t lo_count = 0;
+	if (a > t.first && _murmur_prefix_before(mmr, arch, a, &lo_sum, &lo_count) != 0) {
+		return -1;
+	}
+	
+	*sum = hi_sum - lo_sum;
+	*count = hi_count - lo_count;
+	
+	return 0;
+}
+
+/**
+ * How far a sketch's quantiles may be from the true value, relative to it.
+ */
+#define MURMUR_SKETCH_ALPHA 0.01
+
+/**
+ * How many buckets each side of a sketch has. Each is 2% wider than the last, so this covers
+ * values from x to about 10^17 x.
+ */
+#define MURMUR_SKETCH_BINS 2048
+
+/**
+ * Values closer to zero than this are counted as zero.
+ */
+#define MURMUR_SKETCH_MIN 1e-9
+
+/**
+ * One side of a sketch: counts of values in logarithmically-sized buckets, starting at offset.
+ * The buckets slide to follow the values, and only when they span more than all of them are the
+ * lowest buckets merged to make room, so only the smallest values lose accuracy.
+ */
+struct _murmur_sketch_store {
+	int32_t offset;
+	uint32_t used;
+	uint64_t count;
+	uint64_t bins[MURMUR_SKETCH_BINS];
+};
+
+/**
+ * A DDSketch: quantiles to within MURMUR_SKETCH_ALPHA of their value, from counts alone.
+ */
+struct _murmur_sketch {
+	double gamma_ln;
+	struct _murmur_sketch_store pos;
+	struct _murmur_sketch_store neg;
+	uint64_t zeros;
+};
+
+static void _murmur_sketch_init(struct _murmur_sketch *sk) {
+	memset(sk, 0, sizeof(*sk));
+	sk->gamma_ln = log((1 + MURMUR_SKETCH_ALPHA) / (1 - MURMUR_SKETCH_ALPHA));
+}
+
+static void _murmur_sketch_store_add(struct _murmur_sketch_store *st, const int32_t idx) {
+	if (!st->used) {
+		st->offset = idx - (MURMUR_SKETCH_BINS / 2);
+		st->used = 1;
+	}
+	
+	int64_t at = (int64_t)idx - st->offset;
+	
+	// Too small: slide everything up as far as the highest bucket allows, and lump in with the
+	// lowest whatever still doesn't fit
+	if (at < 0) {
+		int64_t top = MURMUR_SKETCH_BINS - 1;
+		while (top >= 0 && st->bins[top] == 0) {
+			top--;
+		}
+		
+		int64_t shift = MURMUR_SKETCH_BINS - 1 - top;
+		if (shift > -at) {
+			shift = -at;
+		}
+		
+		if (shift > 0) {
+			memmove(st->bins + shift, st->bins, (MURMUR_SKETCH_BINS - shift) * sizeof(*st->bins));
+			memset(st->bins, 0, shift * sizeof(*st->bins));
+			st->offset -= shift;
+			at += shift;
+		}
+		
+		if (at < 0) {
+			at = 0;
+		}
+	}
+	
+	// Too big: slide everything down, merging what falls off the bottom
+	if (at >= MURMUR_SKETCH_BINS) {
+		uint64_t shift = at - MURMUR_SKETCH_BINS + 1;
+		
+		if (shift >= MURMUR_SKETCH_BINS) {
+			st->bins[0] = st->count;
+			memset(st->bins + 1, 0, (MURMUR_SKETCH_BINS - 1) * sizeof(*st->bins));
+		} else {
+			uint64_t lost = 0;
+			for (uint64_t i = 1; i <= shift; i++) {
+				lost += st->bins[i];
+			}
+			
+			st->bins[0] += lost;
+			memmove(st->bins + 1, st->bins + shift + 1, (MURMUR_SKETCH_BINS - shift - 1) * sizeof(*st->bins));
+			memset(st->bins + MURMUR_SKETCH_BINS - shift, 0, shift * sizeof(*st->bins));
+		}
+		
+		st->offset += shift;
+		at = MURMUR_SKETCH_BINS - 1;
+	}
+	
+	st->bins[at]++;
+	st->count++;
+}
+
+static void _murmur_sketch_add(struct _murmur_sketch *sk, const double v) {
+	double mag = fabs(v);
+	
+	if (mag < MURMUR_SKETCH_MIN) {
+		sk->zeros++;
+		return;
+	}
+	
+	int32_t idx = (int32_t)ceil(log(mag) / sk->gamma_ln);
+	_murmur_sketch_store_add(v > 0 ? &sk->pos : &sk->neg, idx);
+}
+
+/**
+ * The middle of a bucket, by relative error.
+ */
+static double _murmur_sketch_value(const struct _murmur_sketch *sk, const struct _murmur_sketch_store *st, const uint32_t at) {
+	double gamma = exp(sk->gamma_ln);
+	return 2 * exp((st->offset + (int64_t)at) * sk->gamma_ln) / (gamma + 1);
+}
+
+static double _murmur_sketch_quantile(const struct _murmur_sketch *sk, const double q) {
+	uint64_t total = sk->pos.count + sk->neg.count + sk->zeros;
+	if (total == 0) {
+		return NAN;
+	}
+	
+	double clamped = q < 0 ? 0 : (q > 1 ? 1 : q);
+	uint64_t rank = (uint64_t)(clamped * (total - 1));
+	uint64_t seen = 0;
+	
+	// Most negative first: the largest magnitudes on that side
+	for (int64_t at = MURMUR_SKETCH_BINS - 1; at >= 0 && sk->neg.count > 0; at--) {
+		seen += sk->neg.bins[at];
+		if (seen > rank) {
+			return -_murmur_sketch_value(sk, &sk->neg, at);
+		}
+	}
+	
+	seen += sk->zeros;
+	if (seen > rank) {
+		return 0;
+	}
+	
+	for (uint32_t at = 0; at < MURMUR_SKETCH_BINS; at++) {
+		seen += sk->pos.bins[at];
+		if (seen > rank) {
+			return _murmur_sketch_value(sk, &sk->pos, at);
+		}
+	}
+	
+	return NAN;
+}
+
+int murmur_range_stats(struct murmur *mmr, const int64_t from, const int64_t until, const double *quantiles, const uint32_t quantile_count, struct murmur_stats *stats, double *quantile_values) {
+	stats->count = 0;
+	stats->min = NAN;
+	stats->max = NAN;
+	stats->sum = NAN;
+	stats->mean = NAN;
+	stats->stddev = NAN;
+	
+	for (uint32_t i = 0; i < quantile_count; i++) {
+		quantile_values[i] = NAN;
+	}
+	
+	struct murmur_archive *arch;
+	int64_t from_interval;
+	uint64_t count;
+	
+	int plan = _murmur_fetch_plan(mmr, from, until, 0, &arch, &from_interval, &count);
+	if (plan != 0) {
+		return plan == 1 ? 0 : -1;
+	}
+	
+	struct _murmur_arena_mark mark = _murmur_arena_mark();
+	struct _murmur_sketch *sk = NULL;
+	
+	if (quantile_count > 0) {
+		sk = _murmur_arena_alloc(sizeof(*sk));
+		if (sk == NULL) {
+			return -1;
+		}
+		_murmur_sketch_init(sk);
+	}
+	
+	int64_t step = arch->seconds_per_point;
+	struct point points[MURMUR_FETCH_CHUNK];
+	
+	uint64_t n = 0;
+	double min = INFINITY;
+	double max = -INFINITY;
+	double sum = 0;
+	double mean = 0;
+	double m2 = 0;
+	
+	for (uint64_t done = 0; done < count; ) {
+		uint64_t c = count - done < MURMUR_FETCH_CHUNK ? count - done : MURMUR_FETCH_CHUNK;
+		int64_t at = from_interval + (int64_t)(done * step);
+		
+		if (_murmur_read_points(io_query, mmr->fd, arch, at, points, c) != 0) {
+			_murmur_arena_release(mark);
+			return -1;
+		}
+		
+		for (uint64_t i = 0; i < c; i++) {
+			if (PTINT(points + i) != at + (int64_t)(i * step)) {
+				continue;
+			}
+			
+			// Welford's, so that the deviation stays accurate however large the values
+			double v = PTVAL(points + i);
+			double delta = v - mean;
+			n++;
+			mean += delta / n;
+			m2 += delta * (v - mean);
+			
+			sum += v;
+			min = v < min ? v : min;
+			max = v > max ? v : max;
+			
+			if (sk != NULL) {
+				_murmur_sketch_add(sk, v);
+			}
+		}
+		
+		done += c;
+	}
+	
+	if (n > 0) {
+		stats->count = n;
+		stats->min = min;
+		stats->max = max;
+		stats->sum = sum;
+		stats->mean = mean;
+		stats->stddev = sqrt(m2 / n);
+		
+		for (uint32_t i = 0; i < quantile_count; i++) {
+			// The sketch's buckets are wider than the true range at the ends
+			double v = _murmur_sketch_quantile(sk, quantiles[i]);
+			quantile_values[i] = v < min ? min : (v > max ? max : v);
+		}
+	}
+	
+	_murmur_arena_release(mark);
+	return 0;
+}
+
+/**
+ * Makes room for some downsampled points. The timestamps and values share one allocation.
+ */
+static int _murmur_points_alloc(struct murmur_points *points, const uint64_t capacity) {
+	memset(points, 0, sizeof(*points));
+	
+	if (capacity == 0) {
+		return 0;
+	}
+	
+	points->timestamps = malloc(capacity * (sizeof(*points->timestamps) + sizeof(*points->values)));
+	if (points->timestamps == NULL) {
+		M_PERROR("Could not allocate downsampled points");
+		return -1;
+	}
+	
+	points->values = (double*)(points->timestamps + capacity);
+	return 0;
+}
+
+void murmur_points_free(struct murmur_points *points) {
+	free(points->timestamps);
+	memset(points, 0, sizeof(*points));
+}
+
+static void _murmur_points_add(struct murmur_points *points, const struct murmur_series *series, const uint32_t i) {
+	points->timestamps[points->count] = series->from + ((int64_t)i * series->step);
+	points->values[points->count] = series->values[i];
+	points->count++;
+}
+
+/**
+ * Adds a pixel's first, smallest, largest and last points, in order and without repeats.
+ */
+static void _murmur_m4_emit(struct murmur_points *points, const struct murmur_series *series, const uint32_t *idx) {
+	uint32_t sorted[4];
+	memcpy(sorted, idx, sizeof(sorted));
+	
+	for (uint32_t i = 1; i < 4; i++) {
+		for (uint32_t j = i; j > 0 && sorted[j - 1] > sorted[j]; j--) {
+			uint32_t tmp = sorted[j];
+			sorted[j] = sorted[j - 1];
+			sorted[j - 1] = tmp;
+		}
+	}
+	
+	for (uint32_t i = 0; i < 4; i++) {
+		if (i == 0 || sorted[i] != sorted[i - 1]) {
+			_murmur_points_add(points, series, sorted[i]);
+		}
+	}
+}
+
+/**
+ * M4: every pixel keeps its first, smallest, largest and last points. Pixels split the range
+ * evenly by time, and empty ones are skipped.
+ */
+static int _murmur_downsample_m4(const struct murmur_series *series, const uint32_t width, struct murmur_points *points) {
+	// Every pixel that's drawn has a point of its own, so there are never more than the points
+	uint64_t pixels = width < series->count ? width : series->count;
+	if (_murmur_points_alloc(points, pixels * 4) != 0) {
+		return -1;
+	}
+	
+	// first, min, max, last
+	uint32_t idx[4] = { 0, 0, 0, 0 };
+	uint64_t pixel = 0;
+	int have = 0;
+	
+	for (uint32_t i = 0; i < series->count; i++) {
+		double v = series->values[i];
+		if (isnan(v)) {
+			continue;
+		}
+		
+		uint64_t p = ((uint64_t)i * width) / series->count;
+		if (have && p != pixel) {
+			_murmur_m4_emit(points, series, idx);
+			have = 0;
+		}
+		
+		if (!have) {
+			idx[0] = idx[1] = idx[2] = idx[3] = i;
+			pixel = p;
+			have = 1;
+			continue;
+		}
+		
+		if (v < series->values[idx[1]]) {
+			idx[1] = i;
+		}
+		if (v > series->values[idx[2]]) {
+			idx[2] = i;
+		}
+		idx[3] = i;
+	}
+	
+	if (have) {
+		_murmur_m4_emit(points, series, idx);
+	}
+	
+	return 0;
+}
+
+/**
+ * LTTB: keeps the first and last points, then splits everything between into width - 2 buckets
+ * and keeps the point from each that makes the largest triangle with the point kept before it
+ * and the average of the next bucket.
+ */
+static int _murmur_downsample_lttb(const struct murmur_series *series, const uint32_t width, struct murmur_points *points) {
+	struct _murmur_arena_mark mark = _murmur_arena_mark();
+	
+	// Only points with values take part
+	uint32_t *idx = _murmur_arena_alloc(((uint64_t)series->count + 1) * sizeof(*idx));
+	if (idx == NULL) {
+		return -1;
+	}
+	
+	uint32_t n = 0;
+	for (uint32_t i = 0; i < series->count; i++) {
+		if (!isnan(series->values[i])) {
+			idx[n++] = i;
+		}
+	}
+	
+	uint32_t keep = n < width ? n : width;
+	if (_murmur_points_alloc(points, keep) != 0) {
+		_murmur_arena_release(mark);
+		return -1;
+	}
+	
+	if (n <= width || width < 3) {
+		for (uint32_t k = 0; k < keep; k++) {
+			// With too few pixels for buckets, at least keep both ends
+			uint32_t at = n <= width ? k : (k == 0 ? 0 : n - 1);
+			_murmur_points_add(points, series, idx[at]);
+		}
+		
+		_murmur_arena_release(mark);
+		return 0;
+	}
+	
+	const double *values = series->values;
+	double buckets = (double)(n - 2) / (width - 2);
+	uint32_t a = 0;
+	
+	_murmur_points_add(points, series, idx[0]);
+	
+	for (uint32_t b = 0; b < width - 2; b++) {
+		uint32_t start = (uint32_t)(b * buckets) + 1;
+		uint32_t end = (uint32_t)((b + 1) * buckets) + 1;
+		
+		// The next bucket's average, or the last point after the last bucket
+		uint32_t next_start = end;
+		uint32_t next_end = (uint32_t)((b + 2) * buckets) + 1;
+		if (next_end > n - 1 || b == width - 3) {
+			next_start = n - 1;
+			next_end = n;
+		}
+		
+		double avg_x = 0;
+		double avg_y = 0;
+		for (uint32_t j = next_start; j < next_end; j++) {
+			avg_x += idx[j];
+			avg_y += values[idx[j]];
+		}
+		avg_x /= next_end - next_start;
+		avg_y /= next_end - next_start;
+		
+		// Indexes stand in for time: the series is evenly spaced
+		double ax = idx[a];
+		double ay = values[idx[a]];
+		double best_area = -1;
+		uint32_t best = start;
+		
+		for (uint32_t j = start; j < end; j++) {
+			double area = fabs(((ax - avg_x) * (values[idx[j]] - ay)) - ((ax - idx[j]) * (avg_y - ay)));
+			if (area > best_area) {
+				best_area = area;
+				best = j;
+			}
+		}
+		
+		_murmur_points_add(points, series, idx[best]);
+		a = best;
+	}
+	
+	_murmur_points_add(points, series, idx[n - 1]);
+	
+	_murmur_arena_release(mark);
+	return 0;
+}
+
+/**
+ * Shrinks a series to what's needed to draw it width pixels wide.
+ */
+static int _murmur_downsample(const struct murmur_series *series, const enum murmur_downsample mode, const uint32_t width, struct murmur_points *points) {
+	memset(points, 0, sizeof(*points));
+	
+	if (width == 0) {
+		M_ERROR("Can't downsample to nothing");
+		return -1;
+	}
+	
+	switch (mode) {
+		case ds_m4:
+			return _murmur_downsample_m4(series, width, points);
+		
+		case ds_lttb:
+			return _murmur_downsample_lttb(series, width, points);
+	}
+	
+	M_ERROR("Unknown downsampling mode: %d", mode);
+	return -1;
+}
+
+int murmur_fetch_downsample(struct murmur *mmr, const int64_t from, const int64_t until, const uint32_t min_step, const enum murmur_downsample mode, const uint32_t width, struct murmur_points *points) {
+	memset(points, 0, sizeof(*points));
+	
+	struct murmur_series series;
+	if (murmur_fetch_step(mmr, from, until, min_step, &series) != 0) {
+		return -1;
+	}
+	
+	int ret = _murmur_downsample(&series, mode, width, points);
+	murmur_series_free(&series);
+	
+	return ret;
+}
+
+int murmur_dump_info(struct murmur *mmr) {
+	M_INFO("Max data age: %lu seconds", mmr->max_retention);
+	M_INFO("Accumulation factor: %d", mmr->x_files_factor);
+	M_INFO("Aggregation method: %s", AGGREGATION_NAMES[mmr->aggregation-1]);
+	M_INFO("Crash recovery: %s", mmr->flags & MURMUR_FLAG_EXT ? "yes" : "no (created before extension blocks)");
+	M_INFO("Prefix sums: %s", mmr->flags & MURMUR_FLAG_PREFIX ? "yes" : "no");
+	
+	M_INFO("Number of archives: %u", mmr->archive_count);
+	M_INFO("");
+	
+	for (uint32_t i = 0; i < mmr->archive_count; i++) {
+		struct murmur_archive *arch = mmr->archives + i;
+		
+		M_INFO("Archive %u:", i);
+		M_INFO("  Seconds per point: %u", arch->seconds_per_point);
+		M_INFO("  Points: %u", arch->points);
+		if ((mmr->flags & MURMUR_FLAG_AGGREGATION) && i > 0) {
+			M_INFO("  Aggregation method: %s%s", murmur_aggregation_name(arch->aggregation), _murmur_arch_is_sibling(mmr, arch) ? " (sibling)" : "");
+		}
+		M_INFO("");
+	}
+	
+	return 0;
+}
+
+int murmur_dump(struct murmur *mmr) {
+	if (murmur_dump_info(mmr) != 0) {
+		return -1;
+	}
+	
+	M_INFO("============= BEGIN DUMP =============");
+	M_INFO("");
+	
+	// Anything past the last archive is the extension block, not points
+	uint64_t offset = mmr->archives->offset;
+	uint64_t end = _murmur_ext_offset(mmr);
+	
+	struct point p;
+	while (offset < end && pread(mmr->fd, &p, sizeof(p), offset) == sizeof(p)) {
+		M_INFO("%12lu = %f", PTINT(&p), PTVAL(&p));
+		offset += sizeof(p);
+	}
+	
+	return 0;
+}
+
+/**
+ * The kinds of segments that can appear in a name pattern.
+ */
+enum _murmur_seg_kind {
+	seg_literal = 0,
+	seg_star = 1,
+	seg_globstar = 2,
+};
+
+/**
+ * A single segment of a name pattern.
+ */
+struct _murmur_seg {
+	const char *label;
+	uint32_t len;
+	enum _murmur_seg_kind kind;
+};
+
+/**
+ * A pattern, split into its segments.
+ */
+struct _murmur_pattern {
+	struct _murmur_seg *segs;
+	uint32_t count;
+};
+
+/**
+ * A state in the compiled automaton.
+ */
+struct _murmur_dfa_state {
+	/**
+	 * The state to move to on a segment that has no edge of its own, -1 if nothing can match.
+	 */
+	int32_t other;
+	
+	/**
+	 * Where this state's accepted patterns begin in the accepts array.
+	 */
+	uint32_t accept_start;
+	
+	/**
+	 * The number of patterns that match a name ending in this state.
+	 */
+	uint32_t accept_count;
+};
+
+/**
+ * A transition on a literal segment. These live in a hash table keyed by (state, label).
+ */
+struct _murmur_dfa_edge {
+	/**
+	 * The state the edge leaves from, -1 for an empty slot.
+	 */
+	int32_t state;
+	
+	/**
+	 * The state the edge goes to, -1 if nothing can match.
+	 */
+	int32_t target;
+	
+	/**
+	 * Hash of the label, so that names only need to be hashed once per segment.
+	 */
+	uint32_t hash;
+	
+	uint32_t len;
+	const char *label;
+};
+
+/**
+ * A set of dotted name patterns compiled into a single deterministic automaton over name
+ * segments. Matching a name costs one hash lookup per segment, no matter how many patterns
+ * were compiled in.
+ *
+ * Each segment of a pattern is either a literal, `*` (exactly one segment) or, as the final
+ * segment only, `**` (one or more segments).
+ */
+struct _murmur_dfa {
+	/**
+	 * All of the states; state 0 is the start.
+	 */
+	struct _murmur_dfa_state *states;
+	uint32_t state_count;
+	
+	/**
+	 * Hash table of all edges, sized to a power of 2.
+	 */
+	struct _murmur_dfa_edge *edges;
+	uint32_t edge_mask;
+	
+	/**
+	 * Pattern indexes accepted by each state, in pattern order.
+	 */
+	uint32_t *accepts;
+	
+	/**
+	 * Copies of the patterns that edge labels point into.
+	 */
+	char *labels;
+};
+
+/**
+ * Mixes a state into a segment hash to find its slot in the edge table.
+ */
+static inline uint32_t _murmur_dfa_slot(const uint32_t hash, const int32_t state, const uint32_t mask) {
+	return (hash ^ ((uint32_t)state * 0x9E3779B1u)) & mask;
+}
+
+/**
+ * Splits a pattern into its segments, pointing into the given string.
+ */
+static int _murmur_pattern_parse(char *pattern, struct _murmur_pattern *pat) {
+	pat->count = 1;
+	for (char *c = pattern; *c != '\0'; c++) {
+		pat->count += *c == '.';
+	}
+	
+	pat->segs = malloc(pat->count * sizeof(*pat->segs));
+	
+	char *curr = pattern;
+	for (uint32_t i = 0; i < pat->count; i++) {
+		char *dot = strchr(curr, '.');
+		uint32_t len = dot == NULL ? strlen(curr) : (uint32_t)(dot - curr);
+		struct _murmur_seg *seg = pat->segs + i;
+		
+		seg->label = curr;
+		seg->len = len;
+		seg->kind = seg_literal;
+		
+		if (len == 0) {
+			M_ERROR("Pattern \"%s\" has an empty segment", pattern);
+			goto error;
+		}
+		
+		if (len == 1 && *curr == '*') {
+			seg->kind = seg_star;
+		} else if (len == 2 && curr[0] == '*' && curr[1] == '*') {
+			if (i != pat->count - 1) {
+				M_ERROR("Pattern \"%s\": ** may only be used as the last segment", pattern);
+				goto error;
+			}
+			seg->kind = seg_globstar;
+		}
+		
+		curr += len + 1;
+	}
+	
+	return 0;
+
+error:
+	free(pat->segs);
+	pat->segs = NULL;
+	return -1;
+}
+
+/**
+ * Used while compiling: a growable array of NFA positions, encoded as (pattern << 32 | segment).
+ */
+struct _murmur_dfa_build {
+	struct _murmur_pattern *pats;
+	uint32_t patc;
+	
+	/**
+	 * Every state's set of positions, back to back.
+	 */
+	uint64_t *pos;
+	size_t pos_count;
+	size_t pos_alloc;
+	
+	/**
+	 * Where each state's positions begin and how many there are.
+	 */
+	size_t *set_start;
+	uint32_t *set_count;
+	uint32_t state_alloc;
+	
+	/**
+	 * Hash table of state ids, keyed by their position sets, to find states that were
+	 * already built.
+	 */
+	int32_t *lookup;
+	uint32_t lookup_mask;
+	
+	struct _murmur_dfa *dfa;
+	
+	struct _murmur_dfa_edge *edges;
+	size_t edge_count;
+	size_t edge_alloc;
+	
+	size_t accept_count;
+	size_t accept_alloc;
+};
+
+static int _murmur_dfa_pos_sort(const void *a, const void *b) {
+	uint64_t pa = *(const uint64_t*)a;
+	uint64_t pb = *(const uint64_t*)b;
+	return pa < pb ? -1 : (pa > pb);
+}
+
+static uint32_t _murmur_dfa_set_hash(const uint64_t *set, const uint32_t count) {
+	return _murmur_hash((const char*)set, count * sizeof(*set));
+}
+
+static int _murmur_dfa_lookup_grow(struct _murmur_dfa_build *b) {
+	uint32_t mask = (b->lookup_mask + 1) * 2 - 1;
+	int32_t *lookup = malloc((mask + 1) * sizeof(*lookup));
+	if (lookup == NULL) {
+		return -1;
+	}
+	
+	memset(lookup, 0xff, (mask + 1) * sizeof(*lookup));
+	
+	for (uint32_t i = 0; i < b->dfa->state_count; i++) {
+		uint32_t slot = _murmur_dfa_set_hash(b->pos + b->set_start[i], b->set_count[i]) & mask;
+		while (lookup[slot] != -1) {
+			slot = (slot + 1) & mask;
+		}
+		lookup[slot] = i;
+	}
+	
+	free(b->lookup);
+	b->lookup = lookup;
+	b->lookup_mask = mask;
+	
+	return 0;
+}
+
+/**
+ * Finds the state for the set of positions at the end of the position pool, creating it
+ * if it doesn't exist yet. The set is removed from the pool if the state already exists.
+ *
+ * @return The state id, -1 for the empty set, -2 on error.
+ */
+static int32_t _murmur_dfa_intern(struct _murmur_dfa_build *b, const size_t start) {
+	uint64_t *set = b->pos + start;
+	uint32_t count = b->pos_count - start;
+	
+	if (count == 0) {
+		return -1;
+	}
+	
+	qsort(set, count, sizeof(*set), _murmur_dfa_pos_sort);
+	
+	uint32_t kept = 1;
+	for (uint32_t i = 1; i < count; i++) {
+		if (set[i] != set[kept - 1]) {
+			set[kept++] = set[i];
+		}
+	}
+	count = kept;
+	b->pos_count = start + count;
+	
+	uint32_t slot = _murmur_dfa_set_hash(set, count) & b->lookup_mask;
+	while (b->lookup[slot] != -1) {
+		int32_t state = b->lookup[slot];
+		if (b->set_count[state] == count && memcmp(b->pos + b->set_start[state], set, count * sizeof(*set)) == 0) {
+			b->pos_count = start;
+			return state;
+		}
+		
+		slot = (slot + 1) & b->lookup_mask;
+	}
+	
+	if (b->dfa->state_count == b->state_alloc) {
+		b->state_alloc *= 2;
+		b->set_start = realloc(b->set_start, b->state_alloc * sizeof(*b->set_start));
+		b->set_count = realloc(b->set_count, b->state_alloc * sizeof(*b->set_count));
+		b->dfa->states = realloc(b->dfa->states, b->state_alloc * sizeof(*b->dfa->states));
+		if (b->set_start == NULL || b->set_count == NULL || b->dfa->states == NULL) {
+			M_PERROR("Could not grow pattern states");
+			return -2;
+		}
+	}
+	
+	int32_t state = b->dfa->state_count++;
+	b->set_start[state] = start;
+	b->set_count[state] = count;
+	b->lookup[slot] = state;
+	
+	if (b->dfa->state_count * 2 > b->lookup_mask && _murmur_dfa_lookup_grow(b) != 0) {
+		M_PERROR("Could not grow pattern state table");
+		return -2;
+	}
+	
+	return state;
+}
+
+static int _murmur_dfa_push_pos(struct _murmur_dfa_build *b, const uint64_t pos) {
+	if (b->pos_count == b->pos_alloc) {
+		b->pos_alloc *= 2;
+		uint64_t *p = realloc(b->pos, b->pos_alloc * sizeof(*b->pos));
+		if (p == NULL) {
+			M_PERROR("Could not grow pattern positions");
+			return -1;
+		}
+		b->pos = p;
+	}
+	
+	b->pos[b->pos_count++] = pos;
+	return 0;
+}
+
+/**
+ * Moves every position in a state across a segment. When label is NULL, the segment is one
+ * that no literal in the state matches.
+ *
+ * @return The state moved to, -1 for no state, -2 on error.
+ */
+static int32_t _murmur_dfa_step(struct _murmur_dfa_build *b, const int32_t state, const char *label, const uint32_t len) {
+	size_t start = b->pos_count;
+	
+	for (uint32_t i = 0; i < b->set_count[state]; i++) {
+		// The pool can move while pushing
+		uint64_t pos = b->pos[b->set_start[state] + i];
+		uint32_t p = pos >> 32;
+		uint32_t k = pos & 0xffffffff;
+		struct _murmur_pattern *pat = b->pats + p;
+		uint64_t next = pos + 1;
+		
+		if (k == pat->count) {
+			// Past the end, only a trailing ** keeps consuming
+			if (pat->segs[k - 1].kind != seg_globstar) {
+				continue;
+			}
+			next = pos;
+		} else {
+			struct _murmur_seg *seg = pat->segs + k;
+			if (seg->kind == seg_literal && (label == NULL || seg->len != len || memcmp(seg->label, label, len) != 0)) {
+				continue;
+			}
+		}
+		
+		if (_murmur_dfa_push_pos(b, next) != 0) {
+			return -2;
+		}
+	}
+	
+	return _murmur_dfa_intern(b, start);
+}
+
+static int _murmur_dfa_push_edge(struct _murmur_dfa_build *b, const int32_t state, const struct _murmur_seg *seg, const int32_t target) {
+	if (b->edge_count == b->edge_alloc) {
+		b->edge_alloc = b->edge_alloc == 0 ? 64 : b->edge_alloc * 2;
+		struct _murmur_dfa_edge *e = realloc(b->edges, b->edge_alloc * sizeof(*b->edges));
+		if (e == NULL) {
+			M_PERROR("Could not grow pattern edges");
+			return -1;
+		}
+		b->edges = e;
+	}
+	
+	struct _murmur_dfa_edge *e = b->edges + b->edge_count++;
+	e->state = state;
+	e->target = target;
+	e->hash = _murmur_hash(seg->label, seg->len);
+	e->len = seg->len;
+	e->label = seg->label;
+	
+	return 0;
+}
+
+static void _murmur_dfa_free(struct _murmur_dfa *dfa) {
+	if (dfa != NULL) {
+		free(dfa->states);
+		free(dfa->edges);
+		free(dfa->accepts);
+		free(dfa->labels);
+		free(dfa);
+	}
+}
+
+/**
+ * Compiles a list of patterns into one automaton. When more than one pattern matches a name,
+ * the one given first wins.
+ *
+ * @param patc The number of patterns
+ * @param patv The patterns
+ *
+ * @return The automaton, NULL on failure.
+ */
+static struct _murmur_dfa* _murmur_dfa_compile(const uint32_t patc, const char * const *patv) {
+	struct _murmur_dfa_build b;
+	memset(&b, 0, sizeof(b));
+	
+	struct _murmur_dfa *dfa = calloc(1, sizeof(*dfa));
+	if (dfa == NULL) {
+		M_PERROR("Could not allocate pattern compiler");
+		return NULL;
+	}
+	
+	b.dfa = dfa;
+	
+	size_t labels_len = 0;
+	for (uint32_t i = 0; i < patc; i++) {
+		labels_len += strlen(patv[i]) + 1;
+	}
+	
+	dfa->labels = malloc(labels_len + 1);
+	b.pats = calloc(patc + 1, sizeof(*b.pats));
+	b.patc = patc;
+	
+	b.pos_alloc = 64;
+	b.pos = malloc(b.pos_alloc * sizeof(*b.pos));
+	b.state_alloc = 16;
+	b.set_start = malloc(b.state_alloc * sizeof(*b.set_start));
+	b.set_count = malloc(b.state_alloc * sizeof(*b.set_count));
+	dfa->states = malloc(b.state_alloc * sizeof(*dfa->states));
+	b.lookup_mask = 31;
+	b.lookup = malloc((b.lookup_mask + 1) * sizeof(*b.lookup));
+	
+	if (dfa->labels == NULL || b.pats == NULL || b.pos == NULL || b.set_start == NULL ||
+		b.set_count == NULL || dfa->states == NULL || b.lookup == NULL) {
+		M_PERROR("Could not allocate pattern compiler");
+		goto error;
+	}
+	
+	memset(b.lookup, 0xff, (b.lookup_mask + 1) * sizeof(*b.lookup));
+	
+	char *label = dfa->labels;
+	for (uint32_t i = 0; i < patc; i++) {
+		strcpy(label, patv[i]);
+		if (_murmur_pattern_parse(label, b.pats + i) != 0) {
+			goto error;
+		}
+		
+		if (_murmur_dfa_push_pos(&b, ((uint64_t)i) << 32) != 0) {
+			goto error;
+		}
+		
+		label += strlen(label) + 1;
+	}
+	
+	// Even with no patterns, there needs to be a start state to match against
+	if (patc == 0) {
+		dfa->states[dfa->state_count++] = (struct _murmur_dfa_state){ .other = -1 };
+	} else if (_murmur_dfa_intern(&b, 0) != 0) {
+		goto error;
+	}
+	
+	for (uint32_t state = 0; state < dfa->state_count && patc > 0; state++) {
+		// Every literal segment that can be consumed here gets its own edge
+		for (uint32_t i = 0; i < b.set_count[state]; i++) {
+			uint64_t pos = b.pos[b.set_start[state] + i];
+			struct _murmur_pattern *pat = b.pats + (pos >> 32);
+			uint32_t k = pos & 0xffffffff;
+			
+			if (k == pat->count || pat->segs[k].kind != seg_literal) {
+				continue;
+			}
+			
+			struct _murmur_seg *seg = pat->segs + k;
+			
+			int dup = 0;
+			for (size_t e = b.edge_count; e > 0 && b.edges[e - 1].state == (int32_t)state; e--) {
+				if (b.edges[e - 1].len == seg->len && memcmp(b.edges[e - 1].label, seg->label, seg->len) == 0) {
+					dup = 1;
+					break;
+				}
+			}
+			
+			if (dup) {
+				continue;
+			}
+			
+			int32_t target = _murmur_dfa_step(&b, state, seg->label, seg->len);
+			if (target == -2 || _murmur_dfa_push_edge(&b, state, seg, target) != 0) {
+				goto error;
+			}
+		}
+		
+		int32_t other = _murmur_dfa_step(&b, state, NULL, 0);
+		if (other == -2) {
+			goto error;
+		}
+		
+		struct _murmur_dfa_state *st = dfa->states + state;
+		st->other = other;
+		st->accept_start = b.accept_count;
+		st->accept_count = 0;
+		
+		for (uint32_t i = 0; i < b.set_count[state]; i++) {
+			uint64_t pos = b.pos[b.set_start[state] + i];
+			uint32_t p = pos >> 32;
+			
+			if ((pos & 0xffffffff) != b.pats[p].count) {
+				continue;
+			}
+			
+			if (b.accept_count == b.accept_alloc) {
+				b.accept_alloc = b.accept_alloc == 0 ? 16 : b.accept_alloc * 2;
+				uint32_t *a = realloc(dfa->accepts, b.accept_alloc * sizeof(*dfa->accepts));
+				if (a == NULL) {
+					M_PERROR("Could not grow pattern accepts");
+					goto error;
+				}
+				dfa->accepts = a;
+			}
+			
+			dfa->accepts[b.accept_count++] = p;
+			st->accept_count++;
+		}
+	}
+	
+	// Pack the edges into a hash table
+	dfa->edge_mask = 7;
+	while (dfa->edge_mask + 1 < b.edge_count * 2) {
+		dfa->edge_mask = (dfa->edge_mask << 1) | 1;
+	}
+	
+	dfa->edges = malloc((dfa->edge_mask + 1) * sizeof(*dfa->edges));
+	if (dfa->edges == NULL) {
+		M_PERROR("Could not allocate pattern edges");
+		goto error;
+	}
+	
+	for (uint32_t i = 0; i <= dfa->edge_mask; i++) {
+		dfa->edges[i].state = -1;
+	}
+	
+	for (size_t i = 0; i < b.edge_count; i++) {
+		struct _murmur_dfa_edge *e = b.edges + i;
+		uint32_t slot = _murmur_dfa_slot(e->hash, e->state, dfa->edge_mask);
+		while (dfa->edges[slot].state != -1) {
+			slot = (slot + 1) & dfa->edge_mask;
+		}
+		dfa->edges[slot] = *e;
+	}
+	
+	M_DEBUG("Compiled %u patterns into %u states and %zu edges", patc, dfa->state_count, b.edge_count);
+	
+	goto done;
+
+error:
+	_murmur_dfa_free(dfa);
+	dfa = NULL;
+	
+done:
+	for (uint32_t i = 0; b.pats != NULL && i < patc; i++) {
+		free(b.pats[i].segs);
+	}
+	free(b.pats);
+	free(b.pos);
+	free(b.set_start);
+	free(b.set_count);
+	free(b.lookup);
+	free(b.edges);
+	
+	return dfa;
+}
+
+/**
+ * Runs a name through the automaton.
+ *
+ * @return The state the name ends in, -1 if no pattern can match it.
+ */
+static int32_t _murmur_dfa_run(const struct _murmur_dfa *dfa, const char *name, const size_t len) {
+	int32_t state = 0;
+	const char *curr = name;
+	const char *end = name + len;
+	
+	while (state >= 0) {
+		const char *dot = memchr(curr, '.', end - curr);
+		uint32_t seg_len = (dot == NULL ? end : dot) - curr;
+		uint32_t hash = _murmur_hash(curr, seg_len);
+		
+		int32_t next = dfa->states[state].other;
+		uint32_t slot = _murmur_dfa_slot(hash, state, dfa->edge_mask);
+		
+		while (dfa->edges[slot].state != -1) {
+			struct _murmur_dfa_edge *e = dfa->edges + slot;
+			if (e->state == state && e->hash == hash && e->len == seg_len && memcmp(e->label, curr, seg_len) == 0) {
+				next = e->target;
+				break;
+			}
+			slot = (slot + 1) & dfa->edge_mask;
+		}
+		
+		state = next;
+		
+		if (dot == NULL) {
+			break;
+		}
+		
+		curr = dot + 1;
+	}
+	
+	return state;
+}
+
+/**
+ * Finds the first pattern that matches a name.
+ *
+ * @return The index of the pattern, -1 if none match.
+ */
+static int32_t _murmur_dfa_match(const struct _murmur_dfa *dfa, const char *name, const size_t len) {
+	int32_t state = _murmur_dfa_run(dfa, name, len);
+	if (state < 0 || dfa->states[state].accept_count == 0) {
+		return -1;
+	}
+	
+	return dfa->accepts[dfa->states[state].accept_start];
+}
+
+/**
+ * Finds every pattern that matches a name.
+ *
+ * @param[out] accepts The indexes of the patterns, in pattern order, owned by the automaton.
+ *
+ * @return The number of patterns that match.
+ */
+static uint32_t _murmur_dfa_match_all(const struct _murmur_dfa *dfa, const char *name, const size_t len, const uint32_t **accepts) {
+	int32_t state = _murmur_dfa_run(dfa, name, len);
+	if (state < 0) {
+		return 0;
+	}
+	
+	*accepts = dfa->accepts + dfa->states[state].accept_start;
+	return dfa->states[state].accept_count;
+}
+
+/**
+ * Reads an entire file into memory.
+ *
+ * @return The contents, NUL terminated, which must be free'd. NULL on failure.
+ */
+static char* _murmur_read_file(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		M_PERROR("Could not open %s", path);
+		return NULL;
+	}
+	
+	char *buff = NULL;
+	size_t len = 0;
+	size_t alloc = 0;
+	
+	while (1) {
+		if (alloc - len < 4096) {
+			alloc = alloc == 0 ? 8192 : alloc * 2;
+			char *b = realloc(buff, alloc);
+			if (b == NULL) {
+				M_PERROR("Could not read %s", path);
+				goto error;
+			}
+			buff = b;
+		}
+		
+		ssize_t got = read(fd, buff + len, alloc - len - 1);
+		if (got == -1) {
+			M_PERROR("Could not read %s", path);
+			goto error;
+		}
+		
+		if (got == 0) {
+			break;
+		}
+		
+		len += got;
+	}
+	
+	buff[len] = '\0';
+	close(fd);
+	return buff;
+
+error:
+	close(fd);
+	free(buff);
+	return NULL;
+}
+
+/**
+ * Strips whitespace from both ends of a string, in place.
+ */
+static char* _murmur_trim(char *str) {
+	while (*str == ' ' || *str == '\t' || *str == '\r') {
+		str++;
+	}
+	
+	char *end = str + strlen(str);
+	while (end > str && (*(end - 1) == ' ' || *(end - 1) == '\t' || *(end - 1) == '\r')) {
+		*(--end) = '\0';
+	}
+	
+	return str;
+}
+
+struct murmur_schemas {
+	/**
+	 * The rules, in the order they appeared in the configuration.
+	 */
+	struct murmur_schema *schemas;
+	uint32_t count;
+	
+	/**
+	 * All of the rules' patterns, compiled together.
+	 */
+	struct _murmur_dfa *dfa;
+};
+
+/**
+ * Sets a single "key = value" option on a schema.
+ */
+static int _murmur_schema_option(struct murmur_schema *schema, const char *key, char *value) {
+	if (strcmp(key, "pattern") == 0) {
+		free(schema->pattern);
+		schema->pattern = strdup(value);
+	} else if (strcmp(key, "retentions") == 0) {
+		free(schema->specv);
+		free(schema->retentions);
+		
+		schema->retentions = strdup(value);
+		schema->specc = 1;
+		for (char *c = schema->retentions; *c != '\0'; c++) {
+			schema->specc += *c == ',';
+		}
+		
+		schema->specv = malloc(schema->specc * sizeof(*schema->specv));
+		
+		char *save = NULL;
+		char *spec = strtok_r(schema->retentions, ",", &save);
+		for (uint32_t i = 0; i < schema->specc; i++) {
+			if (spec == NULL) {
+				return -1;
+			}
+			
+			schema->specv[i] = _murmur_trim(spec);
+			spec = strtok_r(NULL, ",", &save);
+		}
+	} else if (strcmp(key, "aggregation") == 0 || strcmp(key, "aggregationMethod") == 0) {
+		schema->aggregation = _murmur_parse_aggregation(value);
+		if (schema->aggregation == 0) {
+			return -1;
+		}
+	} else if (strcmp(key, "x_files_factor") == 0 || strcmp(key, "xFilesFactor") == 0) {
+		char *end;
+		long xff = strtol(value, &end, 10);
+		if (*end != '\0' || xff < 0 || xff > 100) {
+			return -1;
+		}
+		schema->x_files_factor = xff;
+	} else {
+		return -1;
+	}
+	
+	return 0;
+}
+
+static void _murmur_schema_free(struct murmur_schema *schema) {
+	free(schema->name);
+	free(schema->pattern);
+	free(schema->retentions);
+	free(schema->specv);
+}
+
+struct murmur_schemas* murmur_schemas_parse(const char *conf) {
+	struct murmur_schemas *schemas = malloc(sizeof(*schemas));
+	memset(schemas, 0, sizeof(*schemas));
+	
+	const char **patv = NULL;
+	char *buff = strdup(conf);
+	char *save = NULL;
+	uint32_t alloc = 0;
+	uint32_t lineno = 0;
+	
+	for (char *line = strtok_r(buff, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+		lineno++;
+		line = _murmur_trim(line);
+		
+		if (*line == '\0' || *line == '#' || *line == ';') {
+			continue;
+		}
+		
+		if (*line == '[') {
+			char *close = strchr(line, ']');
+			if (close == NULL) {
+				M_ERROR("Schema line %u: unterminated section name", lineno);
+				goto error;
+			}
+			*close = '\0';
+			
+			if (schemas->count == alloc) {
+				alloc = alloc == 0 ? 16 : alloc * 2;
+				schemas->schemas = realloc(schemas->schemas, alloc * sizeof(*schemas->schemas));
+			}
+			
+			struct murmur_schema *schema = schemas->schemas + schemas->count++;
+			memset(schema, 0, sizeof(*schema));
+			schema->name = strdup(line + 1);
+			schema->aggregation = agg_average;
+			schema->x_files_factor = 50;
+			
+			continue;
+		}
+		
+		char *eq = strchr(line, '=');
+		if (eq == NULL || schemas->count == 0) {
+			M_ERROR("Schema line %u: expected \"key = value\" inside of a [section]", lineno);
+			goto error;
+		}
+		*eq = '\0';
+		
+		char *key = _murmur_trim(line);
+		char *value = _murmur_trim(eq + 1);
+		if (_murmur_schema_option(schemas->schemas + schemas->count - 1, key, value) != 0) {
+			M_ERROR("Schema line %u: invalid %s: %s", lineno, key, value);
+			goto error;
+		}
+	}
+	
+	patv = malloc((schemas->count + 1) * sizeof(*patv));
+	for (uint32_t i = 0; i < schemas->count; i++) {
+		struct murmur_schema *schema = schemas->schemas + i;
+		if (schema->pattern == NULL || schema->specc == 0) {
+			M_ERROR("Schema [%s] needs both a pattern and retentions", schema->name);
+			goto error;
+		}
+		
+		patv[i] = schema->pattern;
+	}
+	
+	schemas->dfa = _murmur_dfa_compile(schemas->count, patv);
+	if (schemas->dfa == NULL) {
+		goto error;
+	}
+	
+	free(patv);
+	free(buff);
+	return schemas;
+
+error:
+	free(patv);
+	free(buff);
+	murmur_schemas_free(schemas);
+	return NULL;
+}
+
+struct murmur_schemas* murmur_schemas_load(const char *path) {
+	char *conf = _murmur_read_file(path);
+	if (conf == NULL) {
+		return NULL;
+	}
+	
+	struct murmur_schemas *schemas = murmur_schemas_parse(conf);
+	free(conf);
+	
+	return schemas;
+}
+
+void murmur_schemas_free(struct murmur_schemas *schemas) {
+	if (schemas != NULL) {
+		for (uint32_t i = 0; i < schemas->count; i++) {
+			_murmur_schema_free(schemas->schemas + i);
+		}
+		
+		_murmur_dfa_free(schemas->dfa);
+		free(schemas->schemas);
+		free(schemas);
+	}
+}
+
+const struct murmur_schema* murmur_schemas_match(const struct murmur_schemas *schemas, const char *name) {
+	int32_t i = _murmur_dfa_match(schemas->dfa, name, strlen(name));
+	return i < 0 ? NULL : schemas->schemas + i;
+}
+
+int murmur_create_schema(const char *path, const struct murmur_schema *schema) {
+	return murmur_create(path, schema->specc, schema->specv, schema->aggregation, schema->x_files_factor);
+}
+
+/**
+ * What an ingest rule does with the names it matches.
+ */
+enum _murmur_rule_action {
+	rule_allow = 0,
+	rule_deny = 1,
+	rule_rewrite = 2,
+};
+
+/**
+ * A single ingest rule.
+ */
+struct _murmur_rule {
+	enum _murmur_rule_action action;
+	
+	/**
+	 * The pattern, split into segments, to find what each wildcard captured.
+	 */
+	char *pattern;
+	struct _murmur_pattern pat;
+	
+	/**
+	 * What the name is rewritten to, with $1..$9 replaced by what each wildcard matched.
+	 */
+	char *replacement;
+};
+
+struct murmur_rules {
+	/**
+	 * The rules, in the order they were given.
+	 */
+	struct _murmur_rule *rules;
+	uint32_t count;
+	
+	/**
+	 * All of the rules' patterns, compiled together.
+	 */
+	struct _murmur_dfa *dfa;
+};
+
+/**
+ * Makes sure every $N in a replacement refers to a wildcard in its pattern.
+ */
+static int _murmur_rule_validate(const struct _murmur_rule *rule) {
+	uint32_t wildcards = 0;
+	for (uint32_t i = 0; i < rule->pat.count; i++) {
+		wildcards += rule->pat.segs[i].kind != seg_literal;
+	}
+	
+	for (const char *c = rule->replacement; *c != '\0'; c++) {
+		if (*c == '$' && (*(c + 1) < '1' || *(c + 1) > '9' || (uint32_t)(*(c + 1) - '0') > wildcards)) {
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+struct murmur_rules* murmur_rules_parse(const char *conf) {
+	struct murmur_rules *rules = malloc(sizeof(*rules));
+	memset(rules, 0, sizeof(*rules));
+	
+	const char **patv = NULL;
+	char *buff = strdup(conf);
+	char *save = NULL;
+	uint32_t alloc = 0;
+	uint32_t lineno = 0;
+	
+	for (char *line = strtok_r(buff, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+		lineno++;
+		line = _murmur_trim(line);
+		
+		if (*line == '\0' || *line == '#' || *line == ';') {
+			continue;
+		}
+		
+		char *fields[4] = { NULL };
+		uint32_t fieldc = 0;
+		char *field_save = NULL;
+		for (char *f = strtok_r(line, " \t", &field_save); f != NULL && fieldc < 4; f = strtok_r(NULL, " \t", &field_save)) {
+			fields[fieldc++] = f;
+		}
+		
+		if (rules->count == alloc) {
+			alloc = alloc == 0 ? 16 : alloc * 2;
+			rules->rules = realloc(rules->rules, alloc * sizeof(*rules->rules));
+		}
+		
+		struct _murmur_rule *rule = rules->rules + rules->count;
+		memset(rule, 0, sizeof(*rule));
+		
+		if (strcmp(fields[0], "allow") == 0 && fieldc == 2) {
+			rule->action = rule_allow;
+		} else if (strcmp(fields[0], "deny") == 0 && fieldc == 2) {
+			rule->action = rule_deny;
+		} else if (strcmp(fields[0], "rewrite") == 0 && fieldc == 3) {
+			rule->action = rule_rewrite;
+		} else {
+			M_ERROR("Rule line %u: expected \"allow PATTERN\", \"deny PATTERN\" or \"rewrite PATTERN REPLACEMENT\"", lineno);
+			goto error;
+		}
+		
+		rules->count++;
+		rule->pattern = strdup(fields[1]);
+		rule->replacement = strdup(fieldc == 3 ? fields[2] : "");
+		
+		if (_murmur_pattern_parse(rule->pattern, &rule->pat) != 0) {
+			M_ERROR("Rule line %u: invalid pattern", lineno);
+			goto error;
+		}
+		
+		if (_murmur_rule_validate(rule) != 0) {
+			M_ERROR("Rule line %u: replacement refers to a wildcard that isn't in the pattern", lineno);
+			goto error;
+		}
+	}
+	
+	patv = malloc((rules->count + 1) * sizeof(*patv));
+	for (uint32_t i = 0; i < rules->count; i++) {
+		patv[i] = rules->rules[i].pattern;
+	}
+	
+	rules->dfa = _murmur_dfa_compile(rules->count, patv);
+	if (rules->dfa == NULL) {
+		goto error;
+	}
+	
+	free(patv);
+	free(buff);
+	return rules;
+
+error:
+	free(patv);
+	free(buff);
+	murmur_rules_free(rules);
+	return NULL;
+}
+
+struct murmur_rules* murmur_rules_load(const char *path) {
+	char *conf = _murmur_read_file(path);
+	if (conf == NULL) {
+		return NULL;
+	}
+	
+	struct murmur_rules *rules = murmur_rules_parse(conf);
+	free(conf);
+	
+	return rules;
+}
+
+void murmur_rules_free(struct murmur_rules *rules) {
+	if (rules != NULL) {
+		for (uint32_t i = 0; i < rules->count; i++) {
+			free(rules->rules[i].pattern);
+			free(rules->rules[i].pat.segs);
+			free(rules->rules[i].replacement);
+		}
+		
+		_murmur_dfa_free(rules->dfa);
+		free(rules->rules);
+		free(rules);
+	}
+}
+
+/**
+ * Rewrites a name with the replacement of the rule that matched it.
+ */
+static int _murmur_rule_rewrite(const struct _murmur_rule *rule, const char *name, char *out, const size_t len) {
+	// Each pattern segment consumes exactly one name segment, except for a trailing
+	// **, which takes the rest. That makes finding what the wildcards captured a single walk.
+	const char *caps[10];
+	uint32_t cap_lens[10];
+	uint32_t capc = 0;
+	
+	const char *curr = name;
+	for (uint32_t i = 0; i < rule->pat.count; i++) {
+		const char *dot = strchr(curr, '.');
+		uint32_t seg_len = dot == NULL ? strlen(curr) : (uint32_t)(dot - curr);
+		enum _murmur_seg_kind kind = rule->pat.segs[i].kind;
+		
+		if (kind == seg_globstar) {
+			seg_len = strlen(curr);
+		}
+		
+		if (kind != seg_literal && capc < 10) {
+			caps[capc] = curr;
+			cap_lens[capc] = seg_len;
+			capc++;
+		}
+		
+		curr += seg_len + 1;
+	}
+	
+	size_t o = 0;
+	for (const char *c = rule->replacement; *c != '\0'; c++) {
+		const char *from = c;
+		size_t from_len = 1;
+		
+		if (*c == '$') {
+			uint32_t cap = *(++c) - '1';
+			from = caps[cap];
+			from_len = cap_lens[cap];
+		}
+		
+		if (o + from_len >= len) {
+			M_ERROR("Rewritten name too long: %s", name);
+			return -1;
+		}
+		
+		memcpy(out + o, from, from_len);
+		o += from_len;
+	}
+	
+	out[o] = '\0';
+	return 1;
+}
+
+int murmur_rules_apply(const struct murmur_rules *rules, const char *name, char *out, const size_t len) {
+	size_t name_len = strlen(name);
+	int32_t i = _murmur_dfa_match(rules->dfa, name, name_len);
+	
+	if (i >= 0) {
+		const struct _murmur_rule *rule = rules->rules + i;
+		
+		switch (rule->action) {
+			case rule_deny:
+				return 0;
+			
+			case rule_rewrite:
+				return _murmur_rule_rewrite(rule, name, out, len);
+			
+			case rule_allow:
+				break;
+		}
+	}
+	
+	if (name_len >= len) {
+		M_ERROR("Name too long: %s", name);
+		return -1;
+	}
+	
+	memcpy(out, name, name_len + 1);
+	return 1;
+}
+
+/**
+ * Matches a string against a shell-style glob: `*`, `?`, `[abc]`, `[a-z]`, `[!abc]` and
+ * `{alt1,alt2}`, which may not be nested.
+ *
+ * @return 1 if the string matches, 0 if it doesn't.
+ */
+static int _murmur_glob_match(const char *p, const char *pe, const char *s, const char *se) {
+	while (p < pe) {
+		switch (*p) {
+			case '*':
+				p++;
+				for (const char *t = se; t >= s; t--) {
+					if (_murmur_glob_match(p, pe, t, se)) {
+						return 1;
+					}
+				}
+				return 0;
+			
+			case '?':
+				if (s == se) {
+					return 0;
+				}
+				p++;
+				s++;
+				break;
+			
+			case '[': {
+				const char *close = memchr(p + 1, ']', pe - p - 1);
+				if (close == NULL) {
+					goto literal;
+				}
+				
+				if (s == se) {
+					return 0;
+				}
+				
+				const char *c = p + 1;
+				int negate = *c == '!' || *c == '^';
+				int found = 0;
+				c += negate;
+				
+				while (c < close) {
+					if (c + 2 < close && *(c + 1) == '-') {
+						found |= *s >= *c && *s <= *(c + 2);
+						c += 3;
+					} else {
+						found |= *s == *c;
+						c++;
+					}
+				}
+				
+				if (found == negate) {
+					return 0;
+				}
+				
+				p = close + 1;
+				s++;
+				break;
+			}
+			
+			case '{': {
+				const char *close = memchr(p + 1, '}', pe - p - 1);
+				if (close == NULL) {
+					goto literal;
+				}
+				
+				// Try each alternative followed by the rest of the pattern
+				const char *alt = p + 1;
+				while (alt <= close) {
+					const char *alt_end = memchr(alt, ',', close - alt);
+					if (alt_end == NULL) {
+						alt_end = close;
+					}
+					
+					size_t alt_len = alt_end - alt;
+					size_t rest_len = pe - close - 1;
+					char pat[alt_len + rest_len + 1];
+					memcpy(pat, alt, alt_len);
+					memcpy(pat + alt_len, close + 1, rest_len);
+					
+					if (_murmur_glob_match(pat, pat + alt_len + rest_len, s, se)) {
+						return 1;
+					}
+					
+					alt = alt_end + 1;
+				}
+				
+				return 0;
+			}
+			
+			default:
+			literal:
+				if (s == se || *p != *s) {
+					return 0;
+				}
+				p++;
+				s++;
+				break;
+		}
+	}
+	
+	return s == se;
+}
+
+/**
+ * Checks if a glob has anything in it other than plain characters.
+ */
+static int _murmur_glob_is_literal(const char *p, const size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		if (p[i] == '*' || p[i] == '?' || p[i] == '[' || p[i] == '{') {
+			return 0;
+		}
+	}
+	
+	return 1;
+}
+
+/**
+ * Where a store's name index lives, relative to its root. Both start with a dot so that they're
+ * never mistaken for metrics.
+ */
+#define MURMUR_INDEX_FILE ".murmur_index"
+#define MURMUR_INDEX_JOURNAL ".murmur_journal"
+
+/**
+ * How many journal entries are replayed on top of the index before the next store flush
+ * rewrites it.
+ */
+#define MURMUR_INDEX_PENDING_MAX 4096
+
+/**
+ * The start of an index file, followed by node_count nodes, then the labels.
+ */
+struct _murmur_index_header {
+	char magic[8];
+	uint32_t node_count;
+	uint32_t labels_len;
+} __attribute__((packed));
+
+/**
+ * A node in an index file. Each node is one dotted segment of a name, and every node's children
+ * sit next to each other, sorted by label, so that literal segments can be binary searched.
+ * Chains of only children aren't merged into one node: with a segment per level, every segment
+ * of a query is matched against exactly one level of the trie. Everything is little-endian.
+ */
+struct _murmur_index_node {
+	/**
+	 * Where this node's segment lives in the labels.
+	 */
+	uint32_t label;
+	
+	/**
+	 * Where this node's children start, and how many there are.
+	 */
+	uint32_t children;
+	uint32_t child_count;
+	
+	uint16_t label_len;
+	
+	/**
+	 * If the name that ends at this node is a metric.
+	 */
+	uint16_t leaf;
+} __attribute__((packed));
+
+static const char MURMUR_INDEX_MAGIC[8] = "MMRIDX1";
+
+/**
+ * A name created or deleted since the index file was last written.
+ */
+struct _murmur_index_pending {
+	/**
+	 * The metric name, NULL for an empty slot.
+	 */
+	char *name;
+	
+	uint32_t hash;
+	
+	/**
+	 * 1 if the metric was created, 0 if it was deleted.
+	 */
+	int present;
+};
+
+/**
+ * Every metric name in a store. The bulk of it lives in an immutable, mmap'd trie that's
+ * rewritten every so often; everything that happened since is appended to a journal, which
+ * every process using the store replays, so that stores opened by different processes agree.
+ */
+struct _murmur_index {
+	char path[PATH_MAX];
+	char journal_path[PATH_MAX];
+	
+	/**
+	 * The journal is locked shared to append or replay it, and exclusively to rewrite the index
+	 * and truncate it. flock() locks belong to the open file rather than the thread, so it's only
+	 * ever locked while holding the write lock below.
+	 */
+	int journal_fd;
+	off_t journal_off;
+	
+	void *map;
+	size_t map_len;
+	ino_t ino;
+	
+	const struct _murmur_index_node *nodes;
+	uint32_t node_count;
+	const char *labels;
+	uint32_t labels_len;
+	
+	/**
+	 * What the journal says, as a hash table sized to a power of 2.
+	 */
+	struct _murmur_index_pending *pending;
+	uint32_t pending_count;
+	uint32_t pending_mask;
+	
+	/**
+	 * How many of those are deletions, which can leave branches of the trie with nothing in them.
+	 */
+	uint32_t pending_deleted;
+	
+	/**
+	 * Written when replaying the journal, read while searching.
+	 */
+	pthread_rwlock_t lock;
+};
+
+/**
+ * A growable list of names.
+ */
+struct _murmur_names {
+	char **names;
+	uint32_t count;
+	uint32_t alloc;
+	
+	/**
+	 * If the names live in the thread's arena, for lists that only last as long as a query.
+	 */
+	int arena;
+};
+
+static int _murmur_names_add(struct _murmur_names *n, const char *name, const size_t len) {
+	if (n->count == n->alloc) {
+		uint32_t alloc = n->alloc == 0 ? 1024 : n->alloc * 2;
+		char **names;
+		
+		if (n->arena) {
+			names = _murmur_arena_alloc(alloc * sizeof(*names));
+			if (names != NULL && n->count > 0) {
+				memcpy(names, n->names, n->count * sizeof(*names));
+			}
+		} else {
+			names = realloc(n->names, alloc * sizeof(*names));
+		}
+		
+		if (names == NULL) {
+			M_PERROR("Could not grow name list");
+			return -1;
+		}
+		
+		n->names = names;
+		n->alloc = alloc;
+	}
+	
+	char *name_copy = n->arena ? _murmur_arena_alloc(len + 1) : malloc(len + 1);
+	if (name_copy == NULL) {
+		M_PERROR("Could not copy name");
+		return -1;
+	}
+	
+	memcpy(name_copy, name, len);
+	name_copy[len] = '\0';
+	n->names[n->count++] = name_copy;
+	
+	return 0;
+}
+
+static void _murmur_names_free(struct _murmur_names *n) {
+	for (uint32_t i = 0; !n->arena && i < n->count; i++) {
+		free(n->names[i]);
+	}
+	
+	if (!n->arena) {
+		free(n->names);
+	}
+	
+	memset(n, 0, sizeof(*n));
+}
+
+/**
+ * Orders names segment by segment, so that "a.b" comes before "a-c.b": every name sharing a
+ * prefix ends up next to each other, and siblings come out sorted by their label.
+ */
+static int _murmur_names_cmp(const void *a, const void *b) {
+	const unsigned char *x = *(const unsigned char**)a;
+	const unsigned char *y = *(const unsigned char**)b;
+	
+	while (*x != '\0' && *x == *y) {
+		x++;
+		y++;
+	}
+	
+	int cx = *x == '.' ? 1 : *x;
+	int cy = *y == '.' ? 1 : *y;
+	
+	return cx - cy;
+}
+
+/**
+ * Finds every metric under a directory.
+ *
+ * @param path The directory, which is extended in place while searching.
+ * @param path_len Where the directory's path ends.
+ * @param name The directory as a metric prefix, extended in place too.
+ * @param name_len Where the prefix ends.
+ */
+static int _murmur_index_scan(char *path, const size_t path_len, char *name, const size_t name_len, struct _murmur_names *names) {
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		M_PERROR("Could not read %s", path);
+		return -1;
+	}
+	
+	int ret = 0;
+	struct dirent *ent;
+	while (ret == 0 && (ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] == '.') {
+			continue;
+		}
+		
+		size_t len = strlen(ent->d_name);
+		if (path_len + len + 2 >= PATH_MAX || name_len + len + 2 >= PATH_MAX) {
+			continue;
+		}
+		
+		int is_dir = ent->d_type == DT_DIR;
+		if (ent->d_type == DT_UNKNOWN) {
+			struct stat st;
+			is_dir = fstatat(dirfd(dir), ent->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+		}
+		
+		int is_leaf = !is_dir && len > 4 && strcmp(ent->d_name + len - 4, ".mmr") == 0;
+		if (!is_dir && !is_leaf) {
+			continue;
+		}
+		
+		size_t nl = name_len;
+		if (nl > 0) {
+			name[nl++] = '.';
+		}
+		memcpy(name + nl, ent->d_name, len + 1);
+		
+		if (is_leaf) {
+			ret = _murmur_names_add(names, name, nl + len - 4);
+		} else {
+			path[path_len] = '/';
+			memcpy(path + path_len + 1, ent->d_name, len + 1);
+			
+			ret = _murmur_index_scan(path, path_len + 1 + len, name, nl + len, names);
+			
+			path[path_len] = '\0';
+		}
+		
+		name[name_len] = '\0';
+	}
+	
+	closedir(dir);
+	return ret;
+}
+
+/**
+ * A node of a trie that's being built, before it's laid out for writing.
+ */
+struct _murmur_index_build_node {
+	const char *label;
+	uint16_t label_len;
+	uint16_t leaf;
+	
+	uint32_t child_count;
+	uint32_t first_child;
+	uint32_t last_child;
+	uint32_t next_sibling;
+};
+
+/**
+ * Writes a new index file with the given names, which are sorted and deduplicated in place.
+ */
+static int _murmur_index_write(const struct _murmur_index *idx, struct _murmur_names *names) {
+	int ret = -1;
+	int fd = -1;
+	FILE *f = NULL;
+	struct _murmur_index_build_node *nodes = NULL;
+	uint32_t *order = NULL;
+	uint32_t node_count = 1;
+	uint32_t node_alloc = 1024;
+	char tmp[PATH_MAX + 8];
+	
+	snprintf(tmp, sizeof(tmp), "%s.tmp", idx->path);
+	
+	qsort(names->names, names->count, sizeof(*names->names), _murmur_names_cmp);
+	
+	nodes = calloc(node_alloc, sizeof(*nodes));
+	if (nodes == NULL) {
+		M_PERROR("Could not allocate index");
+		goto done;
+	}
+	
+	// Since names are sorted segment by segment, a segment can only ever match its parent's most
+	// recently added child
+	for (uint32_t i = 0; i < names->count; i++) {
+		if (i > 0 && strcmp(names->names[i], names->names[i - 1]) == 0) {
+			continue;
+		}
+		
+		uint32_t curr = 0;
+		const char *seg = names->names[i];
+		
+		while (1) {
+			const char *dot = strchr(seg, '.');
+			size_t len = dot == NULL ? strlen(seg) : (size_t)(dot - seg);
+			
+			struct _murmur_index_build_node *parent = nodes + curr;
+			struct _murmur_index_build_node *last = parent->child_count == 0 ? NULL : nodes + parent->last_child;
+			
+			if (last != NULL && last->label_len == len && memcmp(last->label, seg, len) == 0) {
+				curr = parent->last_child;
+			} else {
+				if (node_count == node_alloc) {
+					node_alloc *= 2;
+					struct _murmur_index_build_node *grown = realloc(nodes, node_alloc * sizeof(*nodes));
+					if (grown == NULL) {
+						M_PERROR("Could not grow index");
+						goto done;
+					}
+					nodes = grown;
+					parent = nodes + curr;
+					last = parent->child_count == 0 ? NULL : nodes + parent->last_child;
+				}
+				
+				struct _murmur_index_build_node *node = nodes + node_count;
+				memset(node, 0, sizeof(*node));
+				node->label = seg;
+				node->label_len = len;
+				
+				if (last == NULL) {
+					parent->first_child = node_count;
+				} else {
+					last->next_sibling = node_count;
+				}
+				
+				parent->last_child = node_count;
+				parent->child_count++;
+				curr = node_count++;
+			}
+			
+			if (dot == NULL) {
+				nodes[curr].leaf = 1;
+				break;
+			}
+			
+			seg = dot + 1;
+		}
+	}
+	
+	// Lay nodes out breadth-first so every node's children are next to each other
+	order = malloc(node_count * sizeof(*order));
+	if (order == NULL) {
+		M_PERROR("Could not allocate index");
+		goto done;
+	}
+	
+	uint32_t queued = 1;
+	order[0] = 0;
+	for (uint32_t i = 0; i < node_count; i++) {
+		for (uint32_t c = nodes[order[i]].first_child, j = 0; j < nodes[order[i]].child_count; c = nodes[c].next_sibling, j++) {
+			order[queued++] = c;
+		}
+	}
+	
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+	if (fd == -1 || (f = fdopen(fd, "w")) == NULL) {
+		M_PERROR("Could not create %s", tmp);
+		goto done;
+	}
+	fd = -1;
+	
+	uint32_t labels_len = 0;
+	for (uint32_t i = 0; i < node_count; i++) {
+		labels_len += nodes[i].label_len;
+	}
+	
+	struct _murmur_index_header header;
+	memcpy(header.magic, MURMUR_INDEX_MAGIC, sizeof(header.magic));
+	header.node_count = htole32(node_count);
+	header.labels_len = htole32(labels_len);
+	fwrite(&header, sizeof(header), 1, f);
+	
+	uint32_t label = 0;
+	uint32_t child = 1;
+	for (uint32_t i = 0; i < node_count; i++) {
+		struct _murmur_index_build_node *n = nodes + order[i];
+		struct _murmur_index_node out = {
+			.label = htole32(label),
+			.children = htole32(child),
+			.child_count = htole32(n->child_count),
+			.label_len = htole16(n->label_len),
+			.leaf = htole16(n->leaf),
+		};
+		
+		fwrite(&out, sizeof(out), 1, f);
+		label += n->label_len;
+		child += n->child_count;
+	}
+	
+	for (uint32_t i = 0; i < node_count; i++) {
+		struct _murmur_index_build_node *n = nodes + order[i];
+		fwrite(n->label, 1, n->label_len, f);
+	}
+	
+	if (fflush(f) != 0 || ferror(f) || fsync(fileno(f)) != 0) {
+		M_PERROR("Could not write %s", tmp);
+		goto done;
+	}
+	
+	if (rename(tmp, idx->path) != 0) {
+		M_PERROR("Could not replace %s", idx->path);
+		goto done;
+	}
+	
+	ret = 0;
+	
+done:
+	if (f != NULL) {
+		fclose(f);
+	}
+	
+	if (fd != -1) {
+		close(fd);
+	}
+	
+	if (ret != 0) {
+		unlink(tmp);
+	}
+	
+	free(order);
+	free(nodes);
+	
+	return ret;
+}
+
+/**
+ * Forgets everything replayed from the journal.
+ */
+static void _murmur_index_pending_clear(struct _murmur_index *idx) {
+	for (uint32_t i = 0; i <= idx->pending_mask; i++) {
+		free(idx->pending[i].name);
+	}
+	
+	memset(idx->pending, 0, (idx->pending_mask + 1) * sizeof(*idx->pending));
+	idx->pending_count = 0;
+	idx->pending_deleted = 0;
+}
+
+static struct _murmur_index_pending* _murmur_index_pending_get(const struct _murmur_index *idx, const char *name, const size_t len) {
+	uint32_t hash = _murmur_hash(name, len);
+	uint32_t slot = hash & idx->pending_mask;
+	
+	while (idx->pending[slot].name != NULL) {
+		struct _murmur_index_pending *p = idx->pending + slot;
+		if (p->hash == hash && strncmp(p->name, name, len) == 0 && p->name[len] == '\0') {
+			return p;
+		}
+		slot = (slot + 1) & idx->pending_mask;
+	}
+	
+	return idx->pending + slot;
+}
+
+static int _murmur_index_pending_set(struct _murmur_index *idx, const char *name, const size_t len, const int present) {
+	struct _murmur_index_pending *p = _murmur_index_pending_get(idx, name, len);
+	if (p->name != NULL) {
+		idx->pending_deleted += p->present - present;
+		p->present = present;
+		return 0;
+	}
+	
+	if ((idx->pending_count + 1) * 2 > idx->pending_mask) {
+		uint32_t mask = (idx->pending_mask + 1) * 2 - 1;
+		struct _murmur_index_pending *pending = calloc(mask + 1, sizeof(*pending));
+		if (pending == NULL) {
+			M_PERROR("Could not grow index journal");
+			return -1;
+		}
+		
+		for (uint32_t i = 0; i <= idx->pending_mask; i++) {
+			if (idx->pending[i].name == NULL) {
+				continue;
+			}
+			
+			uint32_t slot = idx->pending[i].hash & mask;
+			while (pending[slot].name != NULL) {
+				slot = (slot + 1) & mask;
+			}
+			pending[slot] = idx->pending[i];
+		}
+		
+		free(idx->pending);
+		idx->pending = pending;
+		idx->pending_mask = mask;
+		
+		p = _murmur_index_pending_get(idx, name, len);
+	}
+	
+	p->name = strndup(name, len);
+	if (p->name == NULL) {
+		M_PERROR("Could not copy name");
+		return -1;
+	}
+	
+	p->hash = _murmur_hash(name, len);
+	p->present = present;
+	idx->pending_count++;
+	idx->pending_deleted += !present;
+	
+	return 0;
+}
+
+/**
+ * Maps the current index file, dropping whatever was mapped before.
+ */
+static int _murmur_index_map(struct _murmur_index *idx) {
+	if (idx->map != NULL) {
+		munmap(idx->map, idx->map_len);
+	}
+	
+	idx->map = NULL;
+	idx->map_len = 0;
+	idx->nodes = NULL;
+	idx->node_count = 0;
+	idx->labels = NULL;
+	idx->labels_len = 0;
+	idx->ino = 0;
+	
+	int fd = open(idx->path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		M_PERROR("Could not open %s", idx->path);
+		return -1;
+	}
+	
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct _murmur_index_header)) {
+		M_ERROR("Index %s is truncated", idx->path);
+		close(fd);
+		return -1;
+	}
+	
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	
+	if (map == MAP_FAILED) {
+		M_PERROR("Could not map %s", idx->path);
+		return -1;
+	}
+	
+	const struct _murmur_index_header *header = map;
+	uint32_t node_count = le32toh(header->node_count);
+	uint32_t labels_len = le32toh(header->labels_len);
+	
+	if (memcmp(header->magic, MURMUR_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+		node_count == 0 ||
+		sizeof(*header) + ((size_t)node_count * sizeof(struct _murmur_index_node)) + labels_len != (size_t)st.st_size) {
+		M_ERROR("Index %s is corrupt", idx->path);
+		munmap(map, st.st_size);
+		return -1;
+	}
+	
+	idx->map = map;
+	idx->map_len = st.st_size;
+	idx->ino = st.st_ino;
+	idx->nodes = (const struct _murmur_index_node*)(header + 1);
+	idx->node_count = node_count;
+	idx->labels = (const char*)(idx->nodes + node_count);
+	idx->labels_len = labels_len;
+	
+	return 0;
+}
+
+/**
+ * Catches up with whatever other processes have done: maps the index again if it has been
+ * rewritten, then replays the journal. The journal must be locked.
+ */
+static int _murmur_index_refresh(struct _murmur_index *idx) {
+	struct stat st;
+	if (stat(idx->path, &st) == 0 && st.st_ino != idx->ino) {
+		_murmur_index_pending_clear(idx);
+		idx->journal_off = 0;
+		
+		if (_murmur_index_map(idx) != 0) {
+			return -1;
+		}
+	}
+	
+	char buff[16 * 1024];
+	size_t have = 0;
+	
+	while (1) {
+		ssize_t got = pread(idx->journal_fd, buff + have, sizeof(buff) - have, idx->journal_off + have);
+		if (got == -1) {
+			M_PERROR("Could not read %s", idx->journal_path);
+			return -1;
+		}
+		
+		if (got == 0) {
+			break;
+		}
+		
+		have += got;
+		
+		// Only whole lines are taken; a partial one is picked up next time
+		char *line = buff;
+		char *nl;
+		while ((nl = memchr(line, '\n', buff + have - line)) != NULL) {
+			if (nl - line > 1 && (*line == '+' || *line == '-')) {
+				if (_murmur_index_pending_set(idx, line + 1, nl - line - 1, *line == '+') != 0) {
+					return -1;
+				}
+			}
+			
+			line = nl + 1;
+		}
+		
+		size_t used = line - buff;
+		if (used == 0 && have == sizeof(buff)) {
+			M_ERROR("Journal %s has a line that's too long", idx->journal_path);
+			return -1;
+		}
+		
+		memmove(buff, line, have - used);
+		idx->journal_off += used;
+		have -= used;
+	}
+	
+	return 0;
+}
+
+static int _murmur_index_sync(struct _murmur_index *idx) {
+	pthread_rwlock_wrlock(&idx->lock);
+	flock(idx->journal_fd, LOCK_SH);
+	
+	int ret = _murmur_index_refresh(idx);
+	
+	flock(idx->journal_fd, LOCK_UN);
+	pthread_rwlock_unlock(&idx->lock);
+	
+	return ret;
+}
+
+/**
+ * Collects every name in the mapped trie below a node.
+ */
+static int _murmur_index_collect(const struct _murmur_index *idx, const uint32_t node, char *name, const size_t name_len, struct _murmur_names *names) {
+	const struct _murmur_index_node *n = idx->nodes + node;
+	uint32_t start = le32toh(n->children);
+	uint32_t count = le32toh(n->child_count);
+	
+	for (uint32_t i = start; i < start + count && i < idx->node_count; i++) {
+		const struct _murmur_index_node *c = idx->nodes + i;
+		uint16_t len = le16toh(c->label_len);
+		
+		size_t nl = name_len;
+		if (nl > 0) {
+			name[nl++] = '.';
+		}
+		
+		if (nl + len >= PATH_MAX) {
+			continue;
+		}
+		
+		memcpy(name + nl, idx->labels + le32toh(c->label), len);
+		name[nl + len] = '\0';
+		
+		if (le16toh(c->leaf)) {
+			struct _murmur_index_pending *p = _murmur_index_pending_get(idx, name, nl + len);
+			if ((p->name == NULL || p->present) && _murmur_names_add(names, name, nl + len) != 0) {
+				return -1;
+			}
+		}
+		
+		if (_murmur_index_collect(idx, i, name, nl + len, names) != 0) {
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+/**
+ * Folds the journal into a new index file and empties the journal.
+ *
+ * @param names If not NULL, replaces everything that was known with these.
+ */
+static int _murmur_index_rewrite(struct _murmur_index *idx, struct _murmur_names *names) {
+	int ret = -1;
+	struct _murmur_names all = { NULL, 0, 0 };
+	
+	flock(idx->journal_fd, LOCK_EX);
+	
+	if (names == NULL) {
+		if (idx->map != NULL && _murmur_index_refresh(idx) != 0) {
+			goto done;
+		}
+		
+		char name[PATH_MAX];
+		name[0] = '\0';
+		
+		if (idx->map != NULL && _murmur_index_collect(idx, 0, name, 0, &all) != 0) {
+			goto done;
+		}
+		
+		for (uint32_t i = 0; i <= idx->pending_mask; i++) {
+			struct _murmur_index_pending *p = idx->pending + i;
+			if (p->name != NULL && p->present && _murmur_names_add(&all, p->name, strlen(p->name)) != 0) {
+				goto done;
+			}
+		}
+		
+		names = &all;
+	}
+	
+	if (_murmur_index_write(idx, names) != 0) {
+		goto done;
+	}
+	
+	if (ftruncate(idx->journal_fd, 0) != 0) {
+		M_PERROR("Could not truncate %s", idx->journal_path);
+		goto done;
+	}
+	
+	_murmur_index_pending_clear(idx);
+	idx->journal_off = 0;
+	ret = _murmur_index_map(idx);
+	
+done:
+	flock(idx->journal_fd, LOCK_UN);
+	_murmur_names_free(&all);
+	
+	return ret;
+}
+
+/**
+ * Rebuilds the index from whatever is on disk.
+ */
+static int _murmur_index_rebuild(struct _murmur_index *idx, const char *root) {
+	char path[PATH_MAX];
+	char name[PATH_MAX];
+	struct _murmur_names names = { NULL, 0, 0 };
+	
+	snprintf(path, sizeof(path), "%s", root);
+	name[0] = '\0';
+	
+	int ret = _murmur_index_scan(path, strlen(path), name, 0, &names);
+	if (ret == 0) {
+		ret = _murmur_index_rewrite(idx, &names);
+	}
+	
+	_murmur_names_free(&names);
+	
+	return ret;
+}
+
+static void _murmur_index_close(struct _murmur_index *idx) {
+	if (idx == NULL) {
+		return;
+	}
+	
+	if (idx->journal_fd != -1) {
+		if (idx->map != NULL) {
+			_murmur_index_sync(idx);
+			if (idx->pending_count > 0) {
+				_murmur_index_rewrite(idx, NULL);
+			}
+		}
+		
+		close(idx->journal_fd);
+	}
+	
+	if (idx->map != NULL) {
+		munmap(idx->map, idx->map_len);
+	}
+	
+	if (idx->pending != NULL) {
+		_murmur_index_pending_clear(idx);
+	}
+	
+	pthread_rwlock_destroy(&idx->lock);
+	free(idx->pending);
+	free(idx);
+}
+
+/**
+ * Opens a store's index, building it from the files on disk if there isn't one yet.
+ */
+static struct _murmur_index* _murmur_index_open(const char *root) {
+	struct _murmur_index *idx = calloc(1, sizeof(*idx));
+	if (idx == NULL) {
+		M_PERROR("Could not allocate index");
+		return NULL;
+	}
+	
+	idx->journal_fd = -1;
+	idx->pending_mask = 63;
+	idx->pending = calloc(idx->pending_mask + 1, sizeof(*idx->pending));
+	pthread_rwlock_init(&idx->lock, NULL);
+	
+	if (idx->pending == NULL) {
+		M_PERROR("Could not allocate index");
+		goto error;
+	}
+	
+	if ((size_t)snprintf(idx->path, sizeof(idx->path), "%s/" MURMUR_INDEX_FILE, root) >= sizeof(idx->path) ||
+		(size_t)snprintf(idx->journal_path, sizeof(idx->journal_path), "%s/" MURMUR_INDEX_JOURNAL, root) >= sizeof(idx->journal_path)) {
+		M_ERROR("Store path too long: %s", root);
+		goto error;
+	}
+	
+	if (mkdir(root, S_IRWXU|S_IRGRP|S_IXGRP) != 0 && errno != EEXIST) {
+		M_PERROR("Could not create %s", root);
+		goto error;
+	}
+	
+	idx->journal_fd = open(idx->journal_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+	if (idx->journal_fd == -1) {
+		M_PERROR("Could not open %s", idx->journal_path);
+		goto error;
+	}
+	
+	if (access(idx->path, F_OK) != 0) {
+		M_INFO("Building name index for %s", root);
+		if (_murmur_index_rebuild(idx, root) != 0) {
+			goto error;
+		}
+	} else if (_murmur_index_map(idx) != 0 || _murmur_index_sync(idx) != 0) {
+		goto error;
+	}
+	
+	return idx;
+	
+error:
+	_murmur_index_close(idx);
+	return NULL;
+}
+
+/**
+ * Records that a metric was created or deleted.
+ */
+static int _murmur_index_set(struct _murmur_index *idx, const char *name, const int present) {
+	char line[PATH_MAX + 2];
+	int len = snprintf(line, sizeof(line), "%c%s\n", present ? '+' : '-', name);
+	if (len < 0 || (size_t)len >= sizeof(line)) {
+		return -1;
+	}
+	
+	pthread_rwlock_wrlock(&idx->lock);
+	
+	// Appends are atomic with O_APPEND; the lock just keeps them out of a rewrite
+	flock(idx->journal_fd, LOCK_SH);
+	
+	int ret = write(idx->journal_fd, line, len) == len ? 0 : -1;
+	if (ret != 0) {
+		M_PERROR("Could not write to %s", idx->journal_path);
+	} else {
+		ret = _murmur_index_refresh(idx);
+	}
+	
+	flock(idx->journal_fd, LOCK_UN);
+	pthread_rwlock_unlock(&idx->lock);
+	
+	return ret;
+}
+
+/**
+ * Folds the journal into the index once enough of it has piled up. Rewriting the index takes a
+ * while, so it's left to the flush rather than whoever records the name that tips it over.
+ */
+static void _murmur_index_compact(struct _murmur_index *idx) {
+	pthread_rwlock_wrlock(&idx->lock);
+	
+	if (idx->pending_count >= MURMUR_INDEX_PENDING_MAX) {
+		_murmur_index_rewrite(idx, NULL);
+	}
+	
+	pthread_rwlock_unlock(&idx->lock);
+}
+
+/**
+ * Records a file made outside of a store in the journal of the store it's in, if it's in one:
+ * the nearest directory above it with a journal, as long as the path from there could be a
+ * metric name.
+ */
+static void _murmur_index_journal(const char *path) {
+	char full[PATH_MAX];
+	if (realpath(path, full) == NULL) {
+		return;
+	}
+	
+	size_t len = strlen(full);
+	if (len < 4 || strcmp(full + len - 4, ".mmr") != 0) {
+		return;
+	}
+	
+	len -= 4;
+	full[len] = '\0';
+	
+	char *end = full + len;
+	char *slash;
+	while ((slash = memrchr(full, '/', end - full)) != NULL) {
+		// Names are split at dots, so nothing with one in it could have come from a name
+		if (slash + 1 == end || memchr(slash + 1, '.', end - slash - 1) != NULL) {
+			return;
+		}
+		
+		char journal[PATH_MAX + sizeof(MURMUR_INDEX_JOURNAL)];
+		snprintf(journal, sizeof(journal), "%.*s/" MURMUR_INDEX_JOURNAL, (int)(slash - full), full);
+		
+		int fd = open(journal, O_WRONLY | O_APPEND | O_CLOEXEC);
+		if (fd == -1) {
+			end = slash;
+			continue;
+		}
+		
+		char line[PATH_MAX + 2];
+		int line_len = snprintf(line, sizeof(line), "+%s\n", slash + 1);
+		for (char *c = line + 1; c < line + line_len - 1; c++) {
+			if (*c == '/') {
+				*c = '.';
+			}
+		}
+		
+		// Shared, like any store's append, so that it can't land in the middle of a rewrite
+		flock(fd, LOCK_SH);
+		if (write(fd, line, line_len) != line_len) {
+			M_PERROR("Could not add %s to %s", path, journal);
+		}
+		flock(fd, LOCK_UN);
+		
+		close(fd);
+		return;
+	}
+}
+
+/**
+ * Binary searches a node's children for a label.
+ *
+ * @return The child, or -1 if there isn't one.
+ */
+static int64_t _murmur_index_child(const struct _murmur_index *idx, const uint32_t node, const char *label, const size_t len) {
+	const struct _murmur_index_node *n = idx->nodes + node;
+	uint32_t lo = le32toh(n->children);
+	uint32_t hi = lo + le32toh(n->child_count);
+	
+	if (hi > idx->node_count) {
+		return -1;
+	}
+	
+	while (lo < hi) {
+		uint32_t mid = lo + ((hi - lo) / 2);
+		const struct _murmur_index_node *c = idx->nodes + mid;
+		uint16_t label_len = le16toh(c->label_len);
+		
+		int cmp = memcmp(idx->labels + le32toh(c->label), label, label_len < len ? label_len : len);
+		if (cmp == 0) {
+			cmp = (int)label_len - (int)len;
+		}
+		
+		if (cmp == 0) {
+			return mid;
+		} else if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	
+	return -1;
+}
+
+/**
+ * Looks up the trie node for a name.
+ *
+ * @return The node, or -1 if there isn't one.
+ */
+static int64_t _murmur_index_lookup(const struct _murmur_index *idx, const char *name, const size_t len) {
+	int64_t node = 0;
+	const char *seg = name;
+	const char *end = name + len;
+	
+	while (node != -1) {
+		const char *dot = memchr(seg, '.', end - seg);
+		if (dot == NULL) {
+			return _murmur_index_child(idx, node, seg, end - seg);
+		}
+		
+		node = _murmur_index_child(idx, node, seg, dot - seg);
+		seg = dot + 1;
+	}
+	
+	return -1;
+}
+
+/**
+ * Checks if anything below a node of the trie is still there, since deleting every metric
+ * under a branch only takes them out of the journal.
+ *
+ * @param name The node's name, which is extended in place while searching and put back after.
+ */
+static int _murmur_index_live(const struct _murmur_index *idx, const uint32_t node, char *name, const size_t name_len) {
+	if (idx->pending_deleted == 0) {
+		return 1;
+	}
+	
+	const struct _murmur_index_node *n = idx->nodes + node;
+	uint32_t start = le32toh(n->children);
+	uint32_t count = le32toh(n->child_count);
+	int live = 0;
+	
+	for (uint32_t i = start; !live && i < start + count && i < idx->node_count; i++) {
+		const struct _murmur_index_node *c = idx->nodes + i;
+		uint16_t len = le16toh(c->label_len);
+		
+		size_t nl = name_len;
+		if (nl > 0) {
+			name[nl++] = '.';
+		}
+		
+		if (nl + len >= PATH_MAX) {
+			continue;
+		}
+		
+		memcpy(name + nl, idx->labels + le32toh(c->label), len);
+		name[nl + len] = '\0';
+		
+		if (le16toh(c->leaf)) {
+			struct _murmur_index_pending *p = _murmur_index_pending_get(idx, name, nl + len);
+			live = p->name == NULL || p->present;
+		}
+		
+		if (!live) {
+			live = _murmur_index_live(idx, i, name, nl + len);
+		}
+	}
+	
+	name[name_len] = '\0';
+	return live;
+}
+
+/**
+ * The state of a search through the index.
+ */
+struct _murmur_index_find {
+	const struct _murmur_index *idx;
+	
+	/**
+	 * The query, split into its segments.
+	 */
+	const char *segs[PATH_MAX / 2];
+	size_t seg_lens[PATH_MAX / 2];
+	uint32_t seg_count;
+	
+	char name[PATH_MAX];
+	
+	murmur_find_cb cb;
+	void *ctx;
+};
+
+static void _murmur_index_find_node(struct _murmur_index_find *f, const uint32_t node, const uint32_t depth, const size_t name_len) {
+	const struct _murmur_index *idx = f->idx;
+	const struct _murmur_index_node *n = idx->nodes + node;
+	const char *seg = f->segs[depth];
+	size_t seg_len = f->seg_lens[depth];
+	
+	uint32_t start = le32toh(n->children);
+	uint32_t end = start + le32toh(n->child_count);
+	
+	// A plain segment only ever matches one child, so there's no need to look at the rest
+	if (_murmur_glob_is_literal(seg, seg_len)) {
+		int64_t child = _murmur_index_child(idx, node, seg, seg_len);
+		if (child == -1) {
+			return;
+		}
+		
+		start = child;
+		end = child + 1;
+	}
+	
+	for (uint32_t i = start; i < end && i < idx->node_count; i++) {
+		const struct _murmur_index_node *c = idx->nodes + i;
+		const char *label = idx->labels + le32toh(c->label);
+		uint16_t label_len = le16toh(c->label_len);
+		
+		if (!_murmur_glob_match(seg, seg + seg_len, label, label + label_len)) {
+			continue;
+		}
+		
+		size_t nl = name_len;
+		if (nl > 0) {
+			f->name[nl++] = '.';
+		}
+		
+		if (nl + label_len >= PATH_MAX) {
+			continue;
+		}
+		
+		memcpy(f->name + nl, label, label_len);
+		f->name[nl + label_len] = '\0';
+		
+		if (depth + 1 < f->seg_count) {
+			_murmur_index_find_node(f, i, depth + 1, nl + label_len);
+			continue;
+		}
+		
+		if (le16toh(c->leaf)) {
+			struct _murmur_index_pending *p = _murmur_index_pending_get(idx, f->name, nl + label_len);
+			if (p->name == NULL || p->present) {
+				f->cb(f->ctx, f->name, 1);
+			}
+		}
+		
+		if (le32toh(c->child_count) > 0 && _murmur_index_live(idx, i, f->name, nl + label_len)) {
+			f->cb(f->ctx, f->name, 0);
+		}
+	}
+}
+
+/**
+ * Reports the names created since the index was written that match a query, skipping anything
+ * the trie already reported.
+ */
+static int _murmur_index_find_pending(struct _murmur_index_find *f) {
+	const struct _murmur_index *idx = f->idx;
+	struct _murmur_names reported = { NULL, 0, 0 };
+	
+	for (uint32_t i = 0; i <= idx->pending_mask; i++) {
+		const struct _murmur_index_pending *p = idx->pending + i;
+		if (p->name == NULL || !p->present) {
+			continue;
+		}
+		
+		const char *seg = p->name;
+		uint32_t depth = 0;
+		int matched = 1;
+		
+		while (depth < f->seg_count) {
+			const char *dot = strchr(seg, '.');
+			const char *end = dot == NULL ? seg + strlen(seg) : dot;
+			
+			if (!_murmur_glob_match(f->segs[depth], f->segs[depth] + f->seg_lens[depth], seg, end)) {
+				matched = 0;
+				break;
+			}
+			
+			depth++;
+			seg = end;
+			
+			if (dot == NULL) {
+				break;
+			}
+			seg++;
+		}
+		
+		if (!matched || depth < f->seg_count) {
+			continue;
+		}
+		
+		// seg is at the end of the name for a leaf, or just past the dot ending the match for a branch
+		int leaf = *seg == '\0';
+		size_t len = leaf ? (size_t)(seg - p->name) : (size_t)(seg - p->name - 1);
+		
+		memcpy(f->name, p->name, len);
+		f->name[len] = '\0';
+		
+		int64_t node = _murmur_index_lookup(idx, p->name, len);
+		if (node != -1 && (leaf ?
+				le16toh(idx->nodes[node].leaf) :
+				le32toh(idx->nodes[node].child_count) > 0 && _murmur_index_live(idx, node, f->name, len))) {
+			continue;
+		}
+		
+		// A branch may have any number of new children, but should only be reported once
+		int seen = 0;
+		for (uint32_t j = 0; !leaf && j < reported.count; j++) {
+			if (strncmp(reported.names[j], p->name, len) == 0 && reported.names[j][len] == '\0') {
+				seen = 1;
+				break;
+			}
+		}
+		
+		if (seen) {
+			continue;
+		}
+		
+		if (!leaf && _murmur_names_add(&reported, f->name, len) != 0) {
+			_murmur_names_free(&reported);
+			return -1;
+		}
+		
+		f->cb(f->ctx, f->name, leaf);
+	}
+	
+	_murmur_names_free(&reported);
+	
+	return 0;
+}
+
+static int _murmur_index_find(struct _murmur_index *idx, const char *query, murmur_find_cb cb, void *ctx) {
+	if (_murmur_index_sync(idx) != 0) {
+		return -1;
+	}
+	
+	struct _murmur_index_find *f = malloc(sizeof(*f));
+	if (f == NULL) {
+		M_PERROR("Could not allocate find");
+		return -1;
+	}
+	
+	f->idx = idx;
+	f->seg_count = 0;
+	f->cb = cb;
+	f->ctx = ctx;
+	
+	const char *seg = query;
+	while (f->seg_count < sizeof(f->segs) / sizeof(*f->segs)) {
+		const char *dot = strchr(seg, '.');
+		f->segs[f->seg_count] = seg;
+		f->seg_lens[f->seg_count++] = dot == NULL ? strlen(seg) : (size_t)(dot - seg);
+		
+		if (dot == NULL) {
+			break;
+		}
+		seg = dot + 1;
+	}
+	
+	pthread_rwlock_rdlock(&idx->lock);
+	
+	int ret = 0;
+	if (idx->map != NULL) {
+		_murmur_index_find_node(f, 0, 0, 0);
+		ret = _murmur_index_find_pending(f);
+	}
+	
+	pthread_rwlock_unlock(&idx->lock);
+	free(f);
+	
+	return ret;
+}
+
+/**
+ * An open file in a store's handle cache.
+ */
+struct _murmur_store_handle {
+	/**
+	 * The metric name, NULL for an empty slot.
+	 */
+	char *name;
+	
+	uint32_t hash;
+	
+	struct murmur *mmr;
+	
+	/**
+	 * When it was last looked up, by the store's count of lookups.
+	 */
+	uint64_t used;
+};
+
+/**
+ * Someone using handles outside the store's lock. Nothing they've looked up since they started
+ * holding is closed to make room for others.
+ */
+struct _murmur_store_hold {
+	uint64_t since;
+	struct _murmur_store_hold *prev;
+	struct _murmur_store_hold *next;
+};
+
+/**
+ * The fewest files a store keeps open, however low the process's limit is.
+ */
+#define MURMUR_STORE_MIN_HANDLES 64
+
+struct murmur_store {
+	/**
+	 * The directory all metrics live under.
+	 */
+	char *root;
+	
+	/**
+	 * How to create metrics that don't exist yet. NULL to never create.
+	 */
+	const struct murmur_schemas *schemas;
+	
+	/**
+	 * Set when files are only read: they're opened without being repaired or written.
+	 */
+	int readonly;
+	
+	/**
+	 * What to drop or rename before writing. NULL to write everything as-is.
+	 */
+	const struct murmur_rules *rules;
+	
+	/**
+	 * Where writes wait for the next flush.
+	 */
+	struct murmur_sched *sched;
+	
+	/**
+	 * Every file that has been opened, as a hash table sized to a power of 2.
+	 */
+	struct _murmur_store_handle *handles;
+	uint32_t handles_count;
+	uint32_t handles_mask;
+	
+	/**
+	 * How many files may stay open, and how many lookups there have been, so that those that
+	 * went unused longest are closed first when there are too many.
+	 */
+	uint32_t handles_max;
+	uint64_t handles_tick;
+	
+	/**
+	 * Everyone using handles right now, so that theirs stay open.
+	 */
+	struct _murmur_store_hold *holds;
+	
+	/**
+	 * Held for the files that queued points are waiting to be written to, from the first point
+	 * queued until a flush leaves nothing waiting.
+	 */
+	struct _murmur_store_hold queued;
+	int queued_held;
+	
+	/**
+	 * Guards the handle cache, so that files can be looked up from many threads.
+	 */
+	pthread_mutex_t handles_lock;
+	
+	/**
+	 * Every metric in the store, for finding them without walking the directories.
+	 */
+	struct _murmur_index *index;
+	
+	/**
+	 * Where recent points wait to be rolled up, when partitioning is on. NULL when it's off.
+	 */
+	struct _murmur_parts *parts;
+	
+	/**
+	 * Where recent points are kept until they're written in bulk, when memtables are on. NULL
+	 * when they're off.
+	 */
+	struct _murmur_mem *mem;
+	
+	/**
+	 * Everyone who wants to be told about points as they're written.
+	 */
+	struct _murmur_subs *subs;
+};
+
+static void _murmur_parts_free(struct _murmur_parts *parts);
+static void _murmur_mem_free(struct _murmur_mem *mem);
+static struct _murmur_subs* _murmur_subs_new();
+static void _murmur_subs_notify(struct _murmur_subs *subs, const char *name, const int64_t timestamp, const double value);
+static void _murmur_subs_send(struct _murmur_subs *subs);
+static void _murmur_subs_free(struct _murmur_subs *subs);
+
+/**
+ * Figures out where a metric lives on disk: "a.b.c" lives at "root/a/b/c.mmr".
+ *
+ * @return 0 on success, -1 if the name can't be stored.
+ */
+static int _murmur_store_path(const struct murmur_store *store, const char *name, char *path, const size_t len) {
+	size_t name_len = strlen(name);
+	if (name_len == 0 || *name == '.' || name[name_len - 1] == '.' ||
+		strstr(name, "..") != NULL || strchr(name, '/') != NULL) {
+		M_ERROR("Invalid metric name: %s", name);
+		return -1;
+	}
+	
+	int written = snprintf(path, len, "%s/%s.mmr", store->root, name);
+	if (written < 0 || (size_t)written >= len) {
+		M_ERROR("Metric name too long: %s", name);
+		return -1;
+	}
+	
+	for (char *c = path + strlen(store->root) + 1; *c != '\0'; c++) {
+		if (*c == '.' && c < path + written - 4) {
+			*c = '/';
+		}
+	}
+	
+	return 0;
+}
+
+/**
+ * Makes sure every directory above a path exists.
+ */
+static int _murmur_mkdirs(char *path) {
+	for (char *c = path + 1; *c != '\0'; c++) {
+		if (*c != '/') {
+			continue;
+		}
+		
+		*c = '\0';
+		int err = mkdir(path, S_IRWXU|S_IRGRP|S_IXGRP) != 0 && errno != EEXIST;
+		*c = '/';
+		
+		if (err) {
+			M_PERROR("Could not create directory for %s", path);
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+/**
+ * Removes every directory above a path, up to a root, that has nothing left in it.
+ */
+static void _murmur_rmdirs(char *path, const size_t root_len) {
+	char *end = path + strlen(path);
+	char *slash;
+	
+	while ((slash = memrchr(path, '/', end - path)) != NULL && (size_t)(slash - path) > root_len) {
+		*slash = '\0';
+		int err = rmdir(path);
+		*slash = '/';
+		
+		if (err != 0) {
+			break;
+		}
+		
+		end = slash;
+	}
+}
+
+static int _murmur_store_handles_grow(struct murmur_store *store) {
+	uint32_t mask = (store->handles_mask + 1) * 2 - 1;
+	struct _murmur_store_handle *handles = calloc(mask + 1, sizeof(*handles));
+	if (handles == NULL) {
+		M_PERROR("Could not grow handle cache");
+		return -1;
+	}
+	
+	for (uint32_t i = 0; i <= store->handles_mask; i++) {
+		struct _murmur_store_handle *h = store->handles + i;
+		if (h->name == NULL) {
+			continue;
+		}
+		
+		uint32_t slot = h->hash & mask;
+		while (handles[slot].name != NULL) {
+			slot = (slot + 1) & mask;
+		}
+		handles[slot] = *h;
+	}
+	
+	free(store->handles);
+	store->handles = handles;
+	store->handles_mask = mask;
+	
+	return 0;
+}
+
+struct murmur_store* murmur_store_open(const char *root, const struct murmur_schemas *schemas) {
+	struct murmur_store *store = malloc(sizeof(*store));
+	memset(store, 0, sizeof(*store));
+	
+	store->root = strdup(root);
+	store->schemas = schemas;
+	store->sched = murmur_sched_new();
+	store->subs = _murmur_subs_new();
+	store->handles_mask = 63;
+	store->handles = calloc(store->handles_mask + 1, sizeof(*store->handles));
+	pthread_mutex_init(&store->handles_lock, NULL);
+	
+	// Half of what the process may have open leaves room for everything else
+	struct rlimit lim;
+	store->handles_max = UINT32_MAX;
+	if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur != RLIM_INFINITY && lim.rlim_cur / 2 < UINT32_MAX) {
+		store->handles_max = lim.rlim_cur / 2;
+	}
+	if (store->handles_max < MURMUR_STORE_MIN_HANDLES) {
+		store->handles_max = MURMUR_STORE_MIN_HANDLES;
+	}
+	
+	if (store->root == NULL || store->sched == NULL || store->subs == NULL || store->handles == NULL) {
+		M_PERROR("Could not allocate store");
+		murmur_store_close(store);
+		return NULL;
+	}
+	
+	// Trailing slashes would make paths look like "root//a/b.mmr"
+	size_t len = strlen(store->root);
+	while (len > 1 && store->root[len - 1] == '/') {
+		store->root[--len] = '\0';
+	}
+	
+	store->index = _murmur_index_open(store->root);
+	if (store->index == NULL) {
+		murmur_store_close(store);
+		return NULL;
+	}
+	
+	return store;
+}
+
+struct murmur_store* murmur_store_open_readonly(const char *root) {
+	struct murmur_store *store = murmur_store_open(root, NULL);
+	if (store != NULL) {
+		store->readonly = 1;
+	}
+	
+	return store;
+}
+
+void murmur_store_close(struct murmur_store *store) {
+	if (store == NULL) {
+		return;
+	}
+	
+	if (store->sched != NULL) {
+		murmur_store_flush(store);
+		murmur_sched_free(store->sched);
+	}
+	
+	for (uint32_t i = 0; store->handles != NULL && i <= store->handles_mask; i++) {
+		struct _murmur_store_handle *h = store->handles + i;
+		if (h->name != NULL) {
+			free(h->name);
+			murmur_close(h->mmr);
+		}
+	}
+	
+	_murmur_parts_free(store->parts);
+	_murmur_mem_free(store->mem);
+	_murmur_subs_free(store->subs);
+	_murmur_index_close(store->index);
+	pthread_mutex_destroy(&store->handles_lock);
+	free(store->handles);
+	free(store->root);
+	free(store);
+}
+
+/**
+ * Finds or opens the file for a metric with the handle lock held.
+ *
+ * @param[out] created Set if the file had to be created, so that it can be indexed once the
+ *     lock is released
+ */
+static struct murmur* _murmur_store_handle_locked(struct murmur_store *store, const char *name, const int create, int *created) {
+	uint32_t hash = _murmur_hash(name, strlen(name));
+	uint32_t slot = hash & store->handles_mask;
+	
+	while (store->handles[slot].name != NULL) {
+		struct _murmur_store_handle *h = store->handles + slot;
+		if (h->hash == hash && strcmp(h->name, name) == 0) {
+			h->used = ++store->handles_tick;
+			return h->mmr;
+		}
+		slot = (slot + 1) & store->handles_mask;
+	}
+	
+	char path[PATH_MAX];
+	if (_murmur_store_path(store, name, path, sizeof(path)) != 0) {
+		return NULL;
+	}
+	
+	if (access(path, F_OK) != 0) {
+		if (errno != ENOENT || !create) {
+			return NULL;
+		}
+		
+		const struct murmur_schema *schema = store->schemas == NULL ? NULL : murmur_schemas_match(store->schemas, name);
+		if (schema == NULL) {
+			M_WARN("No schema matches %s, not creating it", name);
+			return NULL;
+		}
+		
+		M_DEBUG("Creating %s with schema [%s]", path, schema->name);
+		
+		if (_murmur_mkdirs(path) != 0 ||
+			_murmur_create(path, schema->specc, schema->specv, schema->aggregation, schema->x_files_factor) != 0) {
+			return NULL;
+		}
+		
+		*created = 1;
+	}
+	
+	struct murmur *mmr = store->readonly ? murmur_open_readonly(path) : murmur_open(path);
+	if (mmr == NULL) {
+		return NULL;
+	}
+	
+	struct _murmur_store_handle *h = store->handles + slot;
+	h->name = strdup(name);
+	h->hash = hash;
+	h->mmr = mmr;
+	h->used = ++store->handles_tick;
+	
+	if (++store->handles_count * 2 > store->handles_mask) {
+		_murmur_store_handles_grow(store);
+	}
+	
+	return mmr;
+}
+
+/**
+ * Takes an entry out of the handle cache, moving back any entries that probed past it so that
+ * lookups still find them.
+ */
+static void _murmur_store_handles_remove(struct murmur_store *store, uint32_t slot) {
+	store->handles[slot].name = NULL;
+	store->handles_count--;
+	
+	uint32_t next = (slot + 1) & store->handles_mask;
+	while (store->handles[next].name != NULL) {
+		uint32_t home = store->handles[next].hash & store->handles_mask;
+		
+		// Only move entries whose home isn't cyclically within (slot, next]
+		if (((next - home) & store->handles_mask) >= ((next - slot) & store->handles_mask)) {
+			store->handles[slot] = store->handles[next];
+			store->handles[next].name = NULL;
+			slot = next;
+		}
+		
+		next = (next + 1) & store->handles_mask;
+	}
+}
+
+/**
+ * Starts holding: every handle looked up from now on stays open until the hold is released.
+ */
+static void _murmur_store_hold(struct murmur_store *store, struct _murmur_store_hold *hold) {
+	pthread_mutex_lock(&store->handles_lock);
+	
+	hold->since = store->handles_tick + 1;
+	hold->prev = NULL;
+	hold->next = store->holds;
+	if (store->holds != NULL) {
+		store->holds->prev = hold;
+	}
+	store->holds = hold;
+	
+	pthread_mutex_unlock(&store->handles_lock);
+}
+
+static void _murmur_store_release(struct murmur_store *store, struct _murmur_store_hold *hold) {
+	pthread_mutex_lock(&store->handles_lock);
+	
+	if (hold->prev != NULL) {
+		hold->prev->next = hold->next;
+	} else {
+		store->holds = hold->next;
+	}
+	
+	if (hold->next != NULL) {
+		hold->next->prev = hold->prev;
+	}
+	
+	pthread_mutex_unlock(&store->handles_lock);
+}
+
+/**
+ * Holds the files that points are about to be queued for, until a flush writes them all.
+ */
+static void _murmur_store_hold_queued(struct murmur_store *store) {
+	if (!store->queued_held) {
+		_murmur_store_hold(store, &store->queued);
+		store->queued_held = 1;
+	}
+}
+
+static int _murmur_store_used_sort(const void *a, const void *b) {
+	uint64_t ua = *(const uint64_t*)a;
+	uint64_t ub = *(const uint64_t*)b;
+	return ua < ub ? -1 : (ua > ub ? 1 : 0);
+}
+
+/**
+ * Closes the files that went unused longest when there are more open than the store allows.
+ * An eighth more than needed are closed, so that this doesn't happen on every new file.
+ */
+static void _murmur_store_evict(struct murmur_store *store) {
+	pthread_mutex_lock(&store->handles_lock);
+	
+	if (store->handles_count <= store->handles_max) {
+		pthread_mutex_unlock(&store->handles_lock);
+		return;
+	}
+	
+	uint64_t held = UINT64_MAX;
+	for (struct _murmur_store_hold *hold = store->holds; hold != NULL; hold = hold->next) {
+		if (hold->since < held) {
+			held = hold->since;
+		}
+	}
+	
+	uint64_t *used = malloc(store->handles_count * sizeof(*used));
+	if (used == NULL) {
+		M_PERROR("Could not allocate room to close files");
+		pthread_mutex_unlock(&store->handles_lock);
+		return;
+	}
+	
+	uint32_t count = 0;
+	for (uint32_t i = 0; i <= store->handles_mask; i++) {
+		struct _murmur_store_handle *h = store->handles + i;
+		if (h->name != NULL && h->used < held) {
+			used[count++] = h->used;
+		}
+	}
+	
+	uint32_t want = store->handles_count - (store->handles_max - (store->handles_max / 8));
+	if (want > count) {
+		want = count;
+	}
+	
+	if (want > 0) {
+		qsort(used, count, sizeof(*used), _murmur_store_used_sort);
+		uint64_t oldest = used[want - 1];
+		
+		// Removing an entry can move another into its slot, so the slot is looked at again
+		for (uint32_t i = 0; i <= store->handles_mask;) {
+			struct _murmur_store_handle *h = store->handles + i;
+			if (h->name == NULL || h->used > oldest) {
+				i++;
+				continue;
+			}
+			
+			free(h->name);
+			murmur_close(h->mmr);
+			_murmur_store_handles_remove(store, i);
+		}
+	}
+	
+	M_DEBUG("Closed %u of %u open files", want, store->handles_count + want);
+	
+	free(used);
+	pthread_mutex_unlock(&store->handles_lock);
+}
+
+/**
+ * Takes a metric out of a store, either deleting its file or moving it to the same place
+ * under another directory.
+ *
+ * @param archive Where to move the file, NULL to delete it.
+ */
+static int _murmur_store_drop(struct murmur_store *store, const char *name, const char *archive) {
+	char path[PATH_MAX];
+	char dest[PATH_MAX];
+	
+	if (_murmur_store_path(store, name, path, sizeof(path)) != 0) {
+		return -1;
+	}
+	
+	if (archive != NULL) {
+		int written = snprintf(dest, sizeof(dest), "%s%s", archive, path + strlen(store->root));
+		if (written < 0 || (size_t)written >= sizeof(dest)) {
+			M_ERROR("Archive path too long for %s", name);
+			return -1;
+		}
+		
+		if (_murmur_mkdirs(dest) != 0) {
+			return -1;
+		}
+	}
+	
+	pthread_mutex_lock(&store->handles_lock);
+	
+	uint32_t hash = _murmur_hash(name, strlen(name));
+	uint32_t slot = hash & store->handles_mask;
+	
+	while (store->handles[slot].name != NULL) {
+		struct _murmur_store_handle *h = store->handles + slot;
+		if (h->hash == hash && strcmp(h->name, name) == 0) {
+			free(h->name);
+			murmur_close(h->mmr);
+			_murmur_store_handles_remove(store, slot);
+			break;
+		}
+		slot = (slot + 1) & store->handles_mask;
+	}
+	
+	int ret = archive == NULL ? unlink(path) : rename(path, dest);
+	if (ret != 0) {
+		M_PERROR("Could not %s %s", archive == NULL ? "delete" : "archive", path);
+	} else {
+		// Branches left with nothing in them go too, so the directories match what find reports
+		_murmur_rmdirs(path, strlen(store->root));
+	}
+	
+	pthread_mutex_unlock(&store->handles_lock);
+	
+	return ret == 0 ? _murmur_index_set(store->index, name, 0) : -1;
+}
+
+int murmur_store_delete(struct murmur_store *store, const char *name) {
+	// Queued points would otherwise be written to a closed file
+	if (murmur_store_flush(store) != 0) {
+		return -1;
+	}
+	
+	return _murmur_store_drop(store, name, NULL);
+}
+
+int murmur_store_reindex(struct murmur_store *store) {
+	pthread_rwlock_wrlock(&store->index->lock);
+	int ret = _murmur_index_rebuild(store->index, store->root);
+	pthread_rwlock_unlock(&store->index->lock);
+	
+	return ret;
+}
+
+int murmur_store_find(struct murmur_store *store, const char *query, murmur_find_cb cb, void *ctx) {
+	return _murmur_index_find(store->index, query, cb, ctx);
+}
+
+/**
+ * A directory waiting to be read by a scan worker.
+ */
+struct _murmur_scan_dir {
+	struct _murmur_scan_dir *next;
+	
+	/**
+	 * Relative to the root, "" for the root itself.
+	 */
+	char path[];
+};
+
+/**
+ * Shared between the workers of a scan.
+ */
+struct _murmur_scan {
+	/**
+	 * Directories are opened relative to this, so that only directories being read hold a
+	 * descriptor, no matter how wide the tree is.
+	 */
+	int root_fd;
+	
+	/**
+	 * Guards everything below.
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	
+	/**
+	 * Directories waiting to be read. Taken newest-first, so that the scan goes deep before
+	 * it goes wide and the list stays short.
+	 */
+	struct _murmur_scan_dir *dirs;
+	
+	/**
+	 * How many workers are reading a directory, and so might find more.
+	 */
+	uint32_t busy;
+	
+	int failed;
+	
+	/**
+	 * Set once the callback asks to stop, read by workers without the lock.
+	 */
+	volatile int stopped;
+	
+	/**
+	 * Callbacks are made one at a time.
+	 */
+	pthread_mutex_t cb_lock;
+	murmur_scan_cb cb;
+	void *ctx;
+};
+
+static int _murmur_scan_push(struct _murmur_scan *scan, const char *path, const size_t len) {
+	struct _murmur_scan_dir *dir = malloc(sizeof(*dir) + len + 1);
+	if (dir == NULL) {
+		M_PERROR("Could not queue %s", path);
+		return -1;
+	}
+	
+	memcpy(dir->path, path, len);
+	dir->path[len] = '\0';
+	
+	pthread_mutex_lock(&scan->lock);
+	dir->next = scan->dirs;
+	scan->dirs = dir;
+	pthread_cond_signal(&scan->cond);
+	pthread_mutex_unlock(&scan->lock);
+	
+	return 0;
+}
+
+/**
+ * Reads the headers of a metric file and hands it to the callback.
+ */
+static int _murmur_scan_file(struct _murmur_scan *scan, DIR *dir, const char *file, const char *path, const size_t path_len) {
+	char name[PATH_MAX];
+	size_t name_len = path_len - 4;
+	
+	memcpy(name, path, name_len);
+	name[name_len] = '\0';
+	for (char *c = name; *c != '\0'; c++) {
+		if (*c == '/') {
+			*c = '.';
+		}
+	}
+	
+	int fd = openat(dirfd(dir), file, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		M_PERROR("Could not open %s", path);
+		return -1;
+	}
+	
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		M_PERROR("Could not stat %s", path);
+		close(fd);
+		return -1;
+	}
+	
+	struct murmur_scan_entry entry = {
+		.name = name,
+		.path = path,
+		.mtime = st.st_mtime,
+		.size = st.st_size,
+		.disk_usage = (uint64_t)st.st_blocks * 512,
+		.mmr = _murmur_open_fd(fd),
+	};
+	
+	pthread_mutex_lock(&scan->cb_lock);
+	int stop = scan->cb(scan->ctx, &entry);
+	pthread_mutex_unlock(&scan->cb_lock);
+	
+	murmur_close((struct murmur*)entry.mmr);
+	
+	if (stop) {
+		pthread_mutex_lock(&scan->lock);
+		scan->stopped = 1;
+		pthread_cond_broadcast(&scan->cond);
+		pthread_mutex_unlock(&scan->lock);
+	}
+	
+	return entry.mmr == NULL ? -1 : 0;
+}
+
+/**
+ * Reads a directory, queueing its subdirectories and reporting its metrics.
+ */
+static int _murmur_scan_dir(struct _murmur_scan *scan, const char *path) {
+	int fd = openat(scan->root_fd, *path == '\0' ? "." : path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+	if (dir == NULL) {
+		M_PERROR("Could not read directory %s", path);
+		if (fd != -1) {
+			close(fd);
+		}
+		return -1;
+	}
+	
+	int ret = 0;
+	size_t path_len = strlen(path);
+	char child[PATH_MAX];
+	struct dirent *ent;
+	
+	while (!scan->stopped && (ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] == '.') {
+			continue;
+		}
+		
+		size_t len = strlen(ent->d_name);
+		if (path_len + len + 2 >= sizeof(child)) {
+			continue;
+		}
+		
+		int is_dir = ent->d_type == DT_DIR;
+		if (ent->d_type == DT_UNKNOWN) {
+			struct stat st;
+			is_dir = fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+		}
+		
+		int is_leaf = !is_dir && len > 4 && strcmp(ent->d_name + len - 4, ".mmr") == 0;
+		if (!is_dir && !is_leaf) {
+			continue;
+		}
+		
+		size_t child_len = 0;
+		if (path_len > 0) {
+			memcpy(child, path, path_len);
+			child[path_len] = '/';
+			child_len = path_len + 1;
+		}
+		memcpy(child + child_len, ent->d_name, len + 1);
+		child_len += len;
+		
+		if (is_dir) {
+			ret |= _murmur_scan_push(scan, child, child_len);
+		} else {
+			ret |= _murmur_scan_file(scan, dir, ent->d_name, child, child_len);
+		}
+	}
+	
+	closedir(dir);
+	
+	return ret;
+}
+
+static void* _murmur_scan_worker(void *arg) {
+	struct _murmur_scan *scan = arg;
+	
+	// Whatever the callbacks read or write is housekeeping
+	murmur_io_set_class(io_maintenance);
+	
+	pthread_mutex_lock(&scan->lock);
+	
+	while (1) {
+		while (scan->dirs == NULL && scan->busy > 0 && !scan->stopped) {
+			pthread_cond_wait(&scan->cond, &scan->lock);
+		}
+		
+		// With nothing queued and nobody left to queue more, the scan is done
+		if (scan->dirs == NULL || scan->stopped) {
+			pthread_cond_broadcast(&scan->cond);
+			break;
+		}
+		
+		struct _murmur_scan_dir *dir = scan->dirs;
+		scan->dirs = dir->next;
+		scan->busy++;
+		pthread_mutex_unlock(&scan->lock);
+		
+		int err = _murmur_scan_dir(scan, dir->path);
+		free(dir);
+		
+		pthread_mutex_lock(&scan->lock);
+		scan->failed |= err;
+		scan->busy--;
+		
+		if (scan->busy == 0 && scan->dirs == NULL) {
+			pthread_cond_broadcast(&scan->cond);
+		}
+	}
+	
+	pthread_mutex_unlock(&scan->lock);
+	
+	return NULL;
+}
+
+int murmur_scan(const char *root, const uint32_t threads, murmur_scan_cb cb, void *ctx) {
+	struct _murmur_scan scan;
+	memset(&scan, 0, sizeof(scan));
+	scan.cb = cb;
+	scan.ctx = ctx;
+	
+	scan.root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (scan.root_fd == -1) {
+		M_PERROR("Could not open %s", root);
+		return -1;
+	}
+	
+	pthread_mutex_init(&scan.lock, NULL);
+	pthread_cond_init(&scan.cond, NULL);
+	pthread_mutex_init(&scan.cb_lock, NULL);
+	
+	uint32_t thread_count = threads == 0 ? 1 : threads;
+	pthread_t workers[thread_count];
+	uint32_t started = 0;
+	
+	if (_murmur_scan_push(&scan, "", 0) != 0) {
+		scan.failed = 1;
+	}
+	
+	for (; !scan.failed && started < thread_count; started++) {
+		if (pthread_create(workers + started, NULL, _murmur_scan_worker, &scan) != 0) {
+			M_PERROR("Could not start scan worker");
+			break;
+		}
+	}
+	
+	// Without any workers, nothing happens
+	if (started == 0) {
+		scan.failed = 1;
+	}
+	
+	for (uint32_t i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	
+	while (scan.dirs != NULL) {
+		struct _murmur_scan_dir *next = scan.dirs->next;
+		free(scan.dirs);
+		scan.dirs = next;
+	}
+	
+	close(scan.root_fd);
+	pthread_mutex_destroy(&scan.cb_lock);
+	pthread_cond_destroy(&scan.cond);
+	pthread_mutex_destroy(&scan.lock);
+	
+	return scan.failed ? -1 : 0;
+}
+
+/**
+ * The metrics a clean found to be stale.
+ */
+struct _murmur_clean {
+	int64_t older_than;
+	struct _murmur_names stale;
+	int failed;
+	
+	murmur_scan_cb cb;
+	void *ctx;
+};
+
+static int _murmur_clean_on_scan(void *ctx, const struct murmur_scan_entry *entry) {
+	struct _murmur_clean *clean = ctx;
+	
+	if (entry->mtime >= clean->older_than) {
+		return 0;
+	}
+	
+	if (_murmur_names_add(&clean->stale, entry->name, strlen(entry->name)) != 0) {
+		clean->failed = 1;
+		return 1;
+	}
+	
+	return clean->cb == NULL ? 0 : clean->cb(clean->ctx, entry);
+}
+
+int murmur_store_clean(struct murmur_store *store, const int64_t older_than, const char *archive, const uint32_t threads, murmur_scan_cb cb, void *ctx) {
+	struct _murmur_clean clean = {
+		.older_than = older_than,
+		.stale = { NULL, 0, 0 },
+		.failed = 0,
+		.cb = cb,
+		.ctx = ctx,
+	};
+	
+	// Anything queued is about to make its file fresh again
+	if (murmur_store_flush(store) != 0) {
+		return -1;
+	}
+	
+	int ret = 0;
+	if (murmur_scan(store->root, threads, _murmur_clean_on_scan, &clean) != 0 || clean.failed) {
+		ret = -1;
+	}
+	
+	for (uint32_t i = 0; ret == 0 && i < clean.stale.count; i++) {
+		ret = _murmur_store_drop(store, clean.stale.names[i], archive);
+	}
+	
+	int removed = clean.stale.count;
+	_murmur_names_free(&clean.stale);
+	
+	return ret == 0 ? removed : -1;
+}
+
+void murmur_store_set_rules(struct murmur_store *store, const struct murmur_rules *rules) {
+	store->rules = rules;
+}
+
+struct murmur* murmur_store_handle(struct murmur_store *store, const char *name, const int create) {
+	int created = 0;
+	
+	pthread_mutex_lock(&store->handles_lock);
+	struct murmur *mmr = _murmur_store_handle_locked(store, name, create, &created);
+	pthread_mutex_unlock(&store->handles_lock);
+	
+	// The file is there either way, and a rebuild would find it
+	if (created && _murmur_index_set(store->index, name, 1) != 0) {
+		M_WARN("Could not add %s to the index", name);
+	}
+	
+	return mmr;
+}
+
+/**
+ * Where a store keeps its partitions, under its root. Metric names can't start with a dot, so
+ * this never clashes with one.
+ */
+#define MURMUR_PARTS_DIR ".murmur_parts"
+
+/**
+ * Identifies a partition file.
+ */
+#define MURMUR_PARTS_MAGIC "MMRPART1"
+
+/**
+ * The fewest metrics a partition has room for.
+ */
+#define MURMUR_PARTS_MIN_WIDTH 64
+
+/**
+ * The start of a partition file. Its values follow, one row of `width` doubles for each slot.
+ * They're in the host's byte order: a partition is only ever read back by the machine that
+ * wrote it, to roll it up.
+ */
+struct _murmur_part_header {
+	char magic[8];
+	int64_t start;
+	uint32_t step;
+	uint32_t slots;
+	uint32_t width;
+	uint32_t reserved;
+};
+
+/**
+ * Every metric's points for one span of time, as a matrix of slot by metric id.
+ */
+struct _murmur_part {
+	/**
+	 * The timestamp of the first slot.
+	 */
+	int64_t start;
+	
+	/**
+	 * slots * width values, NAN where nothing has been written. A slot's values are all
+	 * together, so that a flush only writes the run of slots that changed since the last one.
+	 */
+	double *values;
+	uint32_t width;
+	
+	/**
+	 * The slots written since the last flush, from > until when there are none.
+	 */
+	uint32_t dirty_from;
+	uint32_t dirty_until;
+	
+	/**
+	 * If the whole file has to be written, because it's new or has been widened.
+	 */
+	int rewrite;
+	
+	/**
+	 * If every value is in the files, and the partition only has to be taken off the list.
+	 */
+	int rolled;
+	
+	int fd;
+	
+	/**
+	 * The next older partition.
+	 */
+	struct _murmur_part *next;
+};
+
+struct _murmur_parts {
+	/**
+	 * The directory the partitions and ids live in.
+	 */
+	char *dir;
+	
+	uint32_t step;
+	uint32_t slots;
+	
+	/**
+	 * How many seconds past a partition's end it still takes late points, before it's rolled up.
+	 */
+	uint32_t grace;
+	
+	/**
+	 * Every metric that has been given an id, by id.
+	 */
+	char **names;
+	uint32_t count;
+	uint32_t alloc;
+	
+	/**
+	 * A hash table over the names, sized to a power of 2, holding id + 1 (0 for an empty slot).
+	 */
+	uint32_t *table;
+	uint32_t table_mask;
+	
+	/**
+	 * Where new ids are saved: the file has one name per line, and a name's id is its line.
+	 */
+	int ids_fd;
+	
+	/**
+	 * Every partition that hasn't been rolled up, newest first.
+	 */
+	struct _murmur_part *parts;
+	
+	pthread_mutex_t lock;
+};
+
+static int _murmur_parts_table_grow(struct _murmur_parts *parts) {
+	uint32_t mask = parts->table_mask == 0 ? 63 : (parts->table_mask + 1) * 2 - 1;
+	uint32_t *table = calloc(mask + 1, sizeof(*table));
+	if (table == NULL) {
+		M_PERROR("Could not grow partition ids");
+		return -1;
+	}
+	
+	for (uint32_t id = 0; id < parts->count; id++) {
+		uint32_t slot = _murmur_hash(parts->names[id], strlen(parts->names[id])) & mask;
+		while (table[slot] != 0) {
+			slot = (slot + 1) & mask;
+		}
+		table[slot] = id + 1;
+	}
+	
+	free(parts->table);
+	parts->table = table;
+	parts->table_mask = mask;
+	
+	return 0;
+}
+
+/**
+ * Finds a metric's id, giving it one if it doesn't have one yet and add is set.
+ *
+ * @return The id, -1 if it has none or one couldn't be given.
+ */
+static int64_t _murmur_parts_id(struct _murmur_parts *parts, const char *name, const int add) {
+	size_t len = strlen(name);
+	uint32_t slot = _murmur_hash(name, len) & parts->table_mask;
+	
+	while (parts->table[slot] != 0) {
+		uint32_t id = parts->table[slot] - 1;
+		if (strcmp(parts->names[id], name) == 0) {
+			return id;
+		}
+		slot = (slot + 1) & parts->table_mask;
+	}
+	
+	if (!add) {
+		return -1;
+	}
+	
+	if (parts->count == parts->alloc) {
+		uint32_t alloc = parts->alloc == 0 ? 64 : parts->alloc * 2;
+		char **names = realloc(parts->names, alloc * sizeof(*names));
+		if (names == NULL) {
+			M_PERROR("Could not add %s to the partitions", name);
+			return -1;
+		}
+		parts->names = names;
+		parts->alloc = alloc;
+	}
+	
+	char *copy = strdup(name);
+	if (copy == NULL) {
+		M_PERROR("Could not add %s to the partitions", name);
+		return -1;
+	}
+	
+	// Saved before it's used, so that no partition on disk holds an id that isn't
+	if (parts->ids_fd != -1) {
+		struct iovec iov[2] = {
+			{ .iov_base = copy, .iov_len = len },
+			{ .iov_base = "\n", .iov_len = 1 },
+		};
+		
+		if (writev(parts->ids_fd, iov, 2) != (ssize_t)len + 1) {
+			M_PERROR("Could not save the partition id for %s", name);
+			free(copy);
+			return -1;
+		}
+	}
+	
+	parts->names[parts->count] = copy;
+	parts->table[slot] = parts->count + 1;
+	parts->count++;
+	
+	if (parts->count * 2 > parts->table_mask) {
+		_murmur_parts_table_grow(parts);
+	}
+	
+	return parts->count - 1;
+}
+
+/**
+ * Gives a partition room for at least `need` metrics. Growing it moves every slot's values,
+ * so the whole file is written on the next flush.
+ */
+static int _murmur_part_widen(const struct _murmur_parts *parts, struct _murmur_part *part, const uint32_t need) {
+	uint32_t width = part->width == 0 ? MURMUR_PARTS_MIN_WIDTH : part->width;
+	while (width < need) {
+		width *= 2;
+	}
+	
+	if (width == part->width) {
+		return 0;
+	}
+	
+	uint64_t count = (uint64_t)parts->slots * width;
+	double *values = malloc(count * sizeof(*values));
+	if (values == NULL) {
+		M_PERROR("Could not widen partition %ld", part->start);
+		return -1;
+	}
+	
+	for (uint64_t i = 0; i < count; i++) {
+		values[i] = NAN;
+	}
+	
+	for (uint32_t s = 0; part->values != NULL && s < parts->slots; s++) {
+		memcpy(values + ((uint64_t)s * width), part->values + ((uint64_t)s * part->width), part->width * sizeof(*values));
+	}
+	
+	free(part->values);
+	part->values = values;
+	part->width = width;
+	part->rewrite = 1;
+	
+	return 0;
+}
+
+static void _murmur_part_free(struct _murmur_part *part) {
+	if (part->fd != -1) {
+		close(part->fd);
+	}
+	
+	free(part->values);
+	free(part);
+}
+
+static int _murmur_part_path(const struct _murmur_parts *parts, const int64_t start, char *path, const size_t len) {
+	int written = snprintf(path, len, "%s/%ld.part", parts->dir, start);
+	if (written < 0 || (size_t)written >= len) {
+		M_ERROR("Partition path too long in %s", parts->dir);
+		return -1;
+	}
+	
+	return 0;
+}
+
+/**
+ * Finds the partition that starts at a time, making it if there isn't one and create is set.
+ *
+ * @return The partition, NULL if there isn't one or it couldn't be made.
+ */
+static struct _murmur_part* _murmur_parts_get(struct _murmur_parts *parts, const int64_t start, const int create) {
+	struct _murmur_part **prev = &parts->parts;
+	while (*prev != NULL && (*prev)->start > start) {
+		prev = &(*prev)->next;
+	}
+	
+	if (*prev != NULL && (*prev)->start == start) {
+		return *prev;
+	}
+	
+	if (!create) {
+		return NULL;
+	}
+	
+	struct _murmur_part *part = calloc(1, sizeof(*part));
+	if (part == NULL) {
+		M_PERROR("Could not allocate partition");
+		return NULL;
+	}
+	
+	part->start = start;
+	part->fd = -1;
+	part->rewrite = 1;
+	part->dirty_from = parts->slots;
+	
+	if (_murmur_part_widen(parts, part, parts->count) != 0) {
+		free(part);
+		return NULL;
+	}
+	
+	part->next = *prev;
+	*prev = part;
+	
+	return part;
+}
+
+/**
+ * Writes what changed in a partition since the last flush: the run of slots that were written
+ * to, or the whole file when it's new or has been widened. Either way, it's a single write.
+ */
+static int _murmur_part_write(const struct _murmur_parts *parts, struct _murmur_part *part) {
+	if (!part->rewrite && part->dirty_from > part->dirty_until) {
+		return 0;
+	}
+	
+	if (part->fd == -1) {
+		char path[PATH_MAX];
+		if (_murmur_part_path(parts, part->start, path, sizeof(path)) != 0) {
+			return -1;
+		}
+		
+		part->fd = open(path, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP);
+		if (part->fd == -1) {
+			M_PERROR("Could not open %s", path);
+			return -1;
+		}
+	}
+	
+	size_t row = part->width * sizeof(*part->values);
+	ssize_t want;
+	ssize_t wrote;
+	
+	if (part->rewrite) {
+		struct _murmur_part_header header = {
+			.start = part->start,
+			.step = parts->step,
+			.slots = parts->slots,
+			.width = part->width,
+		};
+		memcpy(header.magic, MURMUR_PARTS_MAGIC, sizeof(header.magic));
+		
+		struct iovec iov[2] = {
+			{ .iov_base = &header, .iov_len = sizeof(header) },
+			{ .iov_base = part->values, .iov_len = parts->slots * row },
+		};
+		
+		want = sizeof(header) + (parts->slots * row);
+		wrote = _murmur_io_pwritev(io_ingest, part->fd, iov, 2, 0);
+	} else {
+		want = (part->dirty_until - part->dirty_from + 1) * row;
+		wrote = _murmur_io_pwrite(io_ingest, part->fd, (char*)part->values + (part->dirty_from * row), want,
+			sizeof(struct _murmur_part_header) + (part->dirty_from * row));
+	}
+	
+	if (wrote != want) {
+		M_PERROR("Could not write partition %ld", part->start);
+		return -1;
+	}
+	
+	part->rewrite = 0;
+	part->dirty_from = parts->slots;
+	part->dirty_until = 0;
+	
+	return 0;
+}
+
+/**
+ * Moves every value in a partition into its metric's file, through the store's scheduler so
+ * that each file is written in order and each lower archive is aggregated once, then deletes
+ * the partition's file. If any value can't be written, the file is kept for the next try.
+ */
+static int _murmur_part_rollup(struct murmur_store *store, struct _murmur_part *part) {
+	struct _murmur_parts *parts = store->parts;
+	
+	// Written first, so that if the rollup doesn't finish, the next open has all of it to redo
+	if (_murmur_part_write(parts, part) != 0) {
+		return -1;
+	}
+	
+	int ret = 0;
+	uint64_t expired = 0;
+	
+	for (uint32_t id = 0; ret == 0 && id < parts->count && id < part->width; id++) {
+		struct murmur *mmr = NULL;
+		
+		for (uint32_t s = 0; s < parts->slots; s++) {
+			double value = part->values[((uint64_t)s * part->width) + id];
+			if (isnan(value)) {
+				continue;
+			}
+			
+			if (mmr == NULL && (mmr = murmur_store_handle(store, parts->names[id], 1)) == NULL) {
+				M_ERROR("Could not open %s to roll up partition %ld", parts->names[id], part->start);
+				ret = -1;
+				break;
+			}
+			
+			// Points that have aged out of their file while they waited can never be written
+			int64_t timestamp = part->start + ((int64_t)s * parts->step);
+			struct murmur_archive *arch;
+			if (_murmur_get_archive(mmr, timestamp, &arch) != 0) {
+				expired++;
+				continue;
+			}
+			
+			if (murmur_sched_set(store->sched, mmr, timestamp, value) != 0) {
+				ret = -1;
+				break;
+			}
+		}
+	}
+	
+	if (expired > 0) {
+		M_WARN("Dropping %lu points from partition %ld that are too old for their files", expired, part->start);
+	}
+	
+	if (murmur_sched_flush(store->sched) != 0) {
+		ret = -1;
+	}
+	
+	if (ret != 0) {
+		return -1;
+	}
+	
+	char path[PATH_MAX];
+	if (_murmur_part_path(parts, part->start, path, sizeof(path)) == 0 && unlink(path) != 0) {
+		M_PERROR("Could not remove %s", path);
+	}
+	
+	return 0;
+}
+
+/**
+ * Writes every partition that's still taking points, and rolls up every one that isn't.
+ *
+ * Only the thread writing to the store changes the partitions, and that's this one, so the
+ * writes and rollups don't need the lock: readers keep seeing a partition until it's all in
+ * the files, and the lock is only taken to take it off the list.
+ */
+static int _murmur_parts_flush(struct murmur_store *store) {
+	struct _murmur_parts *parts = store->parts;
+	int64_t span = (int64_t)parts->step * parts->slots;
+	int64_t now = time(NULL);
+	int ret = 0;
+	
+	for (struct _murmur_part *part = parts->parts; part != NULL; part = part->next) {
+		if (part->start + span + parts->grace > now) {
+			ret |= _murmur_part_write(parts, part);
+			continue;
+		}
+		
+		// Kept to try again on the next flush
+		if (_murmur_part_rollup(store, part) != 0) {
+			ret = -1;
+			continue;
+		}
+		
+		part->rolled = 1;
+	}
+	
+	pthread_mutex_lock(&parts->lock);
+	
+	struct _murmur_part **prev = &parts->parts;
+	while (*prev != NULL) {
+		struct _murmur_part *part = *prev;
+		if (!part->rolled) {
+			prev = &part->next;
+			continue;
+		}
+		
+		*prev = part->next;
+		_murmur_part_free(part);
+	}
+	
+	pthread_mutex_unlock(&parts->lock);
+	
+	return ret == 0 ? 0 : -1;
+}
+
+/**
+ * Writes a point into its partition.
+ *
+ * @return 0 on success, 1 if the point is too old or too new for a partition and belongs in
+ * its file, -1 on failure.
+ */
+static int _murmur_parts_set(struct _murmur_parts *parts, const char *name, const int64_t timestamp, const double value) {
+	int64_t span = (int64_t)parts->step * parts->slots;
+	int64_t start = timestamp - (timestamp % span);
+	int64_t now = time(NULL);
+	int ret = -1;
+	
+	if (timestamp > now) {
+		return 1;
+	}
+	
+	pthread_mutex_lock(&parts->lock);
+	
+	// A partition that's past its grace but not yet rolled up still takes points, or they'd
+	// be overwritten by the rollup
+	struct _murmur_part *part = _murmur_parts_get(parts, start, start + span + parts->grace > now);
+	if (part == NULL) {
+		ret = start + span + parts->grace > now ? -1 : 1;
+		goto done;
+	}
+	
+	int64_t id = _murmur_parts_id(parts, name, 1);
+	if (id == -1 || _murmur_part_widen(parts, part, id + 1) != 0) {
+		goto done;
+	}
+	
+	uint32_t slot = (timestamp - start) / parts->step;
+	part->values[((uint64_t)slot * part->width) + id] = value;
+	
+	if (slot < part->dirty_from) {
+		part->dirty_from = slot;
+	}
+	
+	if (slot > part->dirty_until) {
+		part->dirty_until = slot;
+	}
+	
+	ret = 0;
+	
+done:
+	pthread_mutex_unlock(&parts->lock);
+	return ret;
+}
+
+/**
+ * Fills in a series, over what was read from its metric's file, with whatever its metric has
+ * in partitions. Only series at the partitions' step can be filled in.
+ */
+static void _murmur_parts_overlay(struct _murmur_parts *parts, const char *name, struct murmur_series *series) {
+	if (parts == NULL || series->step != parts->step || series->count == 0) {
+		return;
+	}
+	
+	pthread_mutex_lock(&parts->lock);
+	
+	int64_t id = _murmur_parts_id(parts, name, 0);
+	
+	for (struct _murmur_part *part = parts->parts; id != -1 && part != NULL; part = part->next) {
+		if (id >= part->width) {
+			continue;
+		}
+		
+		for (uint32_t s = 0; s < parts->slots; s++) {
+			int64_t t = part->start + ((int64_t)s * parts->step);
+			if (t < series->from) {
+				continue;
+			}
+			
+			uint64_t i = (t - series->from) / series->step;
+			if (i >= series->count) {
+				break;
+			}
+			
+			double value = part->values[((uint64_t)s * part->width) + id];
+			if (!isnan(value)) {
+				series->values[i] = value;
+			}
+		}
+	}
+	
+	pthread_mutex_unlock(&parts->lock);
+}
+
+/**
+ * Reads a partition file back in, so that it can keep taking points or be rolled up.
+ */
+static int _murmur_part_load(struct _murmur_parts *parts, const char *path) {
+	int fd = open(path, O_RDWR);
+	if (fd == -1) {
+		M_PERROR("Could not open %s", path);
+		return -1;
+	}
+	
+	struct _murmur_part_header header;
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+		memcmp(header.magic, MURMUR_PARTS_MAGIC, sizeof(header.magic)) != 0) {
+		M_WARN("%s is not a partition, ignoring it", path);
+		close(fd);
+		return 0;
+	}
+	
+	if (header.step != parts->step || header.slots != parts->slots) {
+		M_WARN("%s was written with a different partition spec, ignoring it", path);
+		close(fd);
+		return 0;
+	}
+	
+	struct _murmur_part *part = _murmur_parts_get(parts, header.start, 1);
+	if (part == NULL || _murmur_part_widen(parts, part, header.width) != 0) {
+		close(fd);
+		return -1;
+	}
+	
+	// Anything the file is missing, from a flush that didn't finish, is left empty
+	uint64_t count = (uint64_t)parts->slots * header.width;
+	double *values = malloc(count * sizeof(*values));
+	if (values == NULL) {
+		M_PERROR("Could not read %s", path);
+		close(fd);
+		return -1;
+	}
+	
+	for (uint64_t i = 0; i < count; i++) {
+		values[i] = NAN;
+	}
+	
+	if (pread(fd, values, count * sizeof(*values), sizeof(header)) == -1) {
+		M_PERROR("Could not read %s", path);
+		free(values);
+		close(fd);
+		return -1;
+	}
+	
+	for (uint32_t s = 0; s < parts->slots; s++) {
+		memcpy(part->values + ((uint64_t)s * part->width), values + ((uint64_t)s * header.width), header.width * sizeof(*values));
+	}
+	
+	free(values);
+	part->fd = fd;
+	
+	// Made wider than the file, for the ids given since it was written
+	part->rewrite = part->width != header.width;
+	
+	return 0;
+}
+
+/**
+ * Reads the ids and every partition in the partitions' directory.
+ */
+static int _murmur_parts_load(struct _murmur_parts *parts) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/ids", parts->dir);
+	
+	if (access(path, F_OK) == 0) {
+		char *ids = _murmur_read_file(path);
+		if (ids == NULL) {
+			return -1;
+		}
+		
+		char *save = NULL;
+		for (char *name = strtok_r(ids, "\n", &save); name != NULL; name = strtok_r(NULL, "\n", &save)) {
+			if (_murmur_parts_id(parts, name, 1) == -1) {
+				free(ids);
+				return -1;
+			}
+		}
+		
+		free(ids);
+	}
+	
+	parts->ids_fd = open(path, O_WRONLY|O_CREAT|O_APPEND, S_IRUSR|S_IWUSR|S_IRGRP);
+	if (parts->ids_fd == -1) {
+		M_PERROR("Could not open %s", path);
+		return -1;
+	}
+	
+	DIR *dir = opendir(parts->dir);
+	if (dir == NULL) {
+		M_PERROR("Could not open %s", parts->dir);
+		return -1;
+	}
+	
+	int ret = 0;
+	struct dirent *ent;
+	while (ret == 0 && (ent = readdir(dir)) != NULL) {
+		size_t len = strlen(ent->d_name);
+		if (len <= 5 || strcmp(ent->d_name + len - 5, ".part") != 0) {
+			continue;
+		}
+		
+		snprintf(path, sizeof(path), "%s/%s", parts->dir, ent->d_name);
+		ret = _murmur_part_load(parts, path);
+	}
+	
+	closedir(dir);
+	return ret;
+}
+
+static void _murmur_parts_free(struct _murmur_parts *parts) {
+	if (parts == NULL) {
+		return;
+	}
+	
+	while (parts->parts != NULL) {
+		struct _murmur_part *part = parts->parts;
+		parts->parts = part->next;
+		_murmur_part_free(part);
+	}
+	
+	for (uint32_t i = 0; i < parts->count; i++) {
+		free(parts->names[i]);
+	}
+	
+	if (parts->ids_fd != -1) {
+		close(parts->ids_fd);
+	}
+	
+	pthread_mutex_destroy(&parts->lock);
+	free(parts->names);
+	free(parts->table);
+	free(parts->dir);
+	free(parts);
+}
+
+int murmur_store_partition(struct murmur_store *store, const char *spec, const uint32_t grace) {
+	if (store->parts != NULL || store->mem != NULL) {
+		M_ERROR("%s already has a write layout", store->root);
+		return -1;
+	}
+	
+	struct archive_header *ah;
+	if (_murmur_parse_archive_spec(1, (char**)&spec, &ah, NULL) == 0) {
+		return -1;
+	}
+	
+	uint32_t step = ah->seconds_per_point;
+	uint32_t slots = ah->points;
+	free(ah);
+	
+	if (step == 0 || slots == 0) {
+		M_ERROR("Invalid partition spec: %s", spec);
+		return -1;
+	}
+	
+	struct _murmur_parts *parts = calloc(1, sizeof(*parts));
+	if (parts == NULL) {
+		M_PERROR("Could not allocate partitions");
+		return -1;
+	}
+	
+	parts->step = step;
+	parts->slots = slots;
+	parts->grace = grace;
+	parts->ids_fd = -1;
+	pthread_mutex_init(&parts->lock, NULL);
+	
+	size_t len = strlen(store->root) + sizeof(MURMUR_PARTS_DIR) + 1;
+	parts->dir = malloc(len);
+	if (parts->dir == NULL || _murmur_parts_table_grow(parts) != 0) {
+		M_PERROR("Could not allocate partitions");
+		goto error;
+	}
+	snprintf(parts->dir, len, "%s/%s", store->root, MURMUR_PARTS_DIR);
+	
+	if (mkdir(parts->dir, S_IRWXU|S_IRGRP|S_IXGRP) != 0 && errno != EEXIST) {
+		M_PERROR("Could not create %s", parts->dir);
+		goto error;
+	}
+	
+	if (_murmur_parts_load(parts) != 0) {
+		goto error;
+	}
+	
+	store->parts = parts;
+	return 0;
+
+error:
+	_murmur_parts_free(parts);
+	return -1;
+}
+
+/**
+ * Where a store with memtables logs its writes, under its root.
+ */
+#define MURMUR_MEM_LOG ".murmur_log"
+
+/**
+ * How many bytes of log records are collected before they're written.
+ */
+#define MURMUR_MEM_LOG_BYTES 65536
+
+/**
+ * A write, as it's logged. The name follows, without a NUL.
+ */
+struct _murmur_mem_record {
+	int64_t timestamp;
+	double value;
+	uint32_t name_len;
+	uint32_t reserved;
+};
+
+struct _murmur_mem_point {
+	int64_t timestamp;
+	double value;
+};
+
+/**
+ * Every point a metric has in a memtable, sorted by timestamp, with one for each timestamp.
+ */
+struct _murmur_mem_series {
+	/**
+	 * The metric name, NULL for an empty slot.
+	 */
+	char *name;
+	
+	uint32_t hash;
+	
+	/**
+	 * The metric's file, owned by the store's handle cache.
+	 */
+	struct murmur *mmr;
+	
+	struct _murmur_mem_point *points;
+	uint32_t count;
+	uint32_t alloc;
+};
+
+/**
+ * A hash table of series, sized to a power of 2.
+ */
+struct _murmur_memtable {
+	struct _murmur_mem_series *series;
+	uint32_t count;
+	uint32_t mask;
+};
+
+struct _murmur_mem_shard {
+	/**
+	 * Takes new writes.
+	 */
+	struct _murmur_memtable active;
+	
+	/**
+	 * What a flush is writing to the files, still read from until it's done. Has no slots
+	 * otherwise.
+	 */
+	struct _murmur_memtable frozen;
+	
+	pthread_mutex_t lock;
+};
+
+struct _murmur_mem {
+	/**
+	 * How many points, or seconds, the memtables take before they're flushed to the files.
+	 */
+	uint64_t max_points;
+	uint32_t max_age;
+	
+	/**
+	 * How many points the memtables hold, and when they were last flushed.
+	 */
+	uint64_t points;
+	int64_t flushed;
+	
+	/**
+	 * Every write since the last flush, so that the memtables can be rebuilt after a crash.
+	 * Records collect in the buffer and are appended together.
+	 */
+	int log_fd;
+	size_t log_len;
+	char log[MURMUR_MEM_LOG_BYTES];
+	
+	uint32_t shard_count;
+	struct _murmur_mem_shard shards[];
+};
+
+static int _murmur_memtable_init(struct _murmur_memtable *table) {
+	table->count = 0;
+	table->mask = 63;
+	table->series = calloc(table->mask + 1, sizeof(*table->series));
+	if (table->series == NULL) {
+		M_PERROR("Could not allocate memtable");
+		return -1;
+	}
+	
+	return 0;
+}
+
+static void _murmur_memtable_free(struct _murmur_memtable *table) {
+	for (uint32_t i = 0; table->series != NULL && i <= table->mask; i++) {
+		free(table->series[i].name);
+		free(table->series[i].points);
+	}
+	
+	free(table->series);
+	memset(table, 0, sizeof(*table));
+}
+
+static int _murmur_memtable_grow(struct _murmur_memtable *table) {
+	uint32_t mask = (table->mask + 1) * 2 - 1;
+	struct _murmur_mem_series *series = calloc(mask + 1, sizeof(*series));
+	if (series == NULL) {
+		M_PERROR("Could not grow memtable");
+		return -1;
+	}
+	
+	for (uint32_t i = 0; i <= table->mask; i++) {
+		struct _murmur_mem_series *s = table->series + i;
+		if (s->name == NULL) {
+			continue;
+		}
+		
+		uint32_t slot = s->hash & mask;
+		while (series[slot].name != NULL) {
+			slot = (slot + 1) & mask;
+		}
+		series[slot] = *s;
+	}
+	
+	free(table->series);
+	table->series = series;
+	table->mask = mask;
+	
+	return 0;
+}
+
+/**
+ * Finds the slot for a metric: either where it is, or the empty slot where it would go.
+ */
+static struct _murmur_mem_series* _murmur_memtable_slot(const struct _murmur_memtable *table, const char *name, const uint32_t hash) {
+	uint32_t slot = hash & table->mask;
+	
+	while (table->series[slot].name != NULL) {
+		struct _murmur_mem_series *s = table->series + slot;
+		if (s->hash == hash && strcmp(s->name, name) == 0) {
+			break;
+		}
+		slot = (slot + 1) & table->mask;
+	}
+	
+	return table->series + slot;
+}
+
+/**
+ * Puts a point in a memtable, in order, replacing any point already there for its timestamp.
+ *
+ * @return 1 if the point is new, 0 if it replaced one, -1 on failure.
+ */
+static int _murmur_memtable_set(struct _murmur_memtable *table, struct murmur *mmr, const char *name, const uint32_t hash, const int64_t timestamp, const double value) {
+	struct _murmur_mem_series *s = _murmur_memtable_slot(table, name, hash);
+	
+	if (s->name == NULL) {
+		s->name = strdup(name);
+		if (s->name == NULL) {
+			M_PERROR("Could not add %s to the memtable", name);
+			return -1;
+		}
+		
+		s->hash = hash;
+		s->mmr = mmr;
+		
+		if (++table->count * 2 > table->mask) {
+			if (_murmur_memtable_grow(table) != 0) {
+				return -1;
+			}
+			s = _murmur_memtable_slot(table, name, hash);
+		}
+	}
+	
+	// Points almost always arrive in order, so look from the end
+	uint32_t at = s->count;
+	while (at > 0 && s->points[at - 1].timestamp > timestamp) {
+		at--;
+	}
+	
+	if (at > 0 && s->points[at - 1].timestamp == timestamp) {
+		s->points[at - 1].value = value;
+		return 0;
+	}
+	
+	if (s->count == s->alloc) {
+		uint32_t alloc = s->alloc == 0 ? 8 : s->alloc * 2;
+		struct _murmur_mem_point *points = realloc(s->points, alloc * sizeof(*points));
+		if (points == NULL) {
+			M_PERROR("Could not add to the memtable for %s", name);
+			return -1;
+		}
+		s->points = points;
+		s->alloc = alloc;
+	}
+	
+	memmove(s->points + at + 1, s->points + at, (s->count - at) * sizeof(*s->points));
+	s->points[at].timestamp = timestamp;
+	s->points[at].value = value;
+	s->count++;
+	
+	return 1;
+}
+
+/**
+ * Puts every point from one memtable into another, except where the other already has a point
+ * for the same timestamp, which is newer.
+ *
+ * @return The number of points added, or -1 on failure.
+ */
+static int64_t _murmur_memtable_merge(struct _murmur_memtable *into, const struct _murmur_memtable *from) {
+	int64_t added = 0;
+	
+	for (uint32_t i = 0; from->series != NULL && i <= from->mask; i++) {
+		const struct _murmur_mem_series *s = from->series + i;
+		if (s->name == NULL) {
+			continue;
+		}
+		
+		const struct _murmur_mem_series *newer = _murmur_memtable_slot(into, s->name, s->hash);
+		uint32_t at = 0;
+		
+		for (uint32_t j = 0; j < s->count; j++) {
+			// Both are sorted, so walk them together
+			while (newer->name != NULL && at < newer->count && newer->points[at].timestamp < s->points[j].timestamp) {
+				at++;
+			}
+			
+			if (newer->name != NULL && at < newer->count && newer->points[at].timestamp == s->points[j].timestamp) {
+				continue;
+			}
+			
+			int ret = _murmur_memtable_set(into, s->mmr, s->name, s->hash, s->points[j].timestamp, s->points[j].value);
+			if (ret == -1) {
+				M_WARN("Could not keep every unwritten point in the memtable; they're still in the log");
+				return -1;
+			}
+			added += ret;
+			
+			// Setting may have grown the table, or moved the points along
+			newer = _murmur_memtable_slot(into, s->name, s->hash);
+			at++;
+		}
+	}
+	
+	return added;
+}
+
+/**
+ * Appends every collected log record to the log.
+ */
+static int _murmur_mem_log_write(struct _murmur_mem *mem) {
+	if (mem->log_len == 0) {
+		return 0;
+	}
+	
+	ssize_t wrote = write(mem->log_fd, mem->log, mem->log_len);
+	if (wrote != (ssize_t)mem->log_len) {
+		M_PERROR("Could not write to the memtable log");
+		return -1;
+	}
+	
+	mem->log_len = 0;
+	return 0;
+}
+
+/**
+ * Appends every collected log record to the log, and waits for them to reach the disk.
+ */
+static int _murmur_mem_log_sync(struct _murmur_mem *mem) {
+	if (mem->log_len == 0) {
+		return 0;
+	}
+	
+	if (_murmur_mem_log_write(mem) != 0) {
+		return -1;
+	}
+	
+	if (fdatasync(mem->log_fd) != 0) {
+		M_PERROR("Could not sync the memtable log");
+		return -1;
+	}
+	
+	return 0;
+}
+
+static int _murmur_mem_insert(struct _murmur_mem *mem, struct murmur *mmr, const char *name, const int64_t timestamp, const double value) {
+	uint32_t hash = _murmur_hash(name, strlen(name));
+	struct _murmur_mem_shard *shard = mem->shards + (hash % mem->shard_count);
+	
+	pthread_mutex_lock(&shard->lock);
+	int added = _murmur_memtable_set(&shard->active, mmr, name, hash, timestamp, value);
+	pthread_mutex_unlock(&shard->lock);
+	
+	if (added == -1) {
+		return -1;
+	}
+	
+	mem->points += added;
+	return 0;
+}
+
+/**
+ * Logs a point, then puts it in its shard's memtable.
+ */
+static int _murmur_mem_set(struct _murmur_mem *mem, struct murmur *mmr, const char *name, const int64_t timestamp, const double value) {
+	struct murmur_archive *arch;
+	if (_murmur_get_archive(mmr, timestamp, &arch) != 0) {
+		M_ERROR("Could not locate suitable archive for item at timestamp: %ld", timestamp);
+		return -1;
+	}
+	
+	struct _murmur_mem_record rec = {
+		.timestamp = timestamp,
+		.value = value,
+		.name_len = strlen(name),
+	};
+	
+	if (mem->log_len + sizeof(rec) + rec.name_len > sizeof(mem->log) && _murmur_mem_log_write(mem) != 0) {
+		return -1;
+	}
+	
+	memcpy(mem->log + mem->log_len, &rec, sizeof(rec));
+	memcpy(mem->log + mem->log_len + sizeof(rec), name, rec.name_len);
+	mem->log_len += sizeof(rec) + rec.name_len;
+	
+	return _murmur_mem_insert(mem, mmr, name, timestamp, value);
+}
+
+/**
+ * If the memtables have taken enough points, or held them long enough, to be flushed.
+ */
+static int _murmur_mem_due(const struct _murmur_mem *mem) {
+	return mem->points >= mem->max_points || time(NULL) - mem->flushed >= mem->max_age;
+}
+
+/**
+ * Writes every memtable to the files, in bulk, through the store's scheduler. Each memtable is
+ * frozen while it's written, so that reads still see it and writes go to a new one, and the log
+ * is emptied once it's all on disk.
+ */
+static int _murmur_mem_flush(struct murmur_store *store) {
+	struct _murmur_mem *mem = store->mem;
+	
+	// If the files can't be written, a restart can still get everything back
+	if (_murmur_mem_log_write(mem) != 0) {
+		return -1;
+	}
+	
+	for (uint32_t i = 0; i < mem->shard_count; i++) {
+		struct _murmur_mem_shard *shard = mem->shards + i;
+		struct _murmur_memtable active;
+		
+		if (_murmur_memtable_init(&active) != 0) {
+			return -1;
+		}
+		
+		pthread_mutex_lock(&shard->lock);
+		shard->frozen = shard->active;
+		shard->active = active;
+		pthread_mutex_unlock(&shard->lock);
+	}
+	
+	mem->points = 0;
+	mem->flushed = time(NULL);
+	
+	int ret = 0;
+	uint64_t expired = 0;
+	
+	for (uint32_t i = 0; ret == 0 && i < mem->shard_count; i++) {
+		struct _murmur_memtable *frozen = &mem->shards[i].frozen;
+		
+		for (uint32_t j = 0; ret == 0 && j <= frozen->mask; j++) {
+			struct _murmur_mem_series *s = frozen->series + j;
+			for (uint32_t k = 0; s->name != NULL && k < s->count; k++) {
+				// Points that have aged out of their file while they waited can never be written
+				struct murmur_archive *arch;
+				if (_murmur_get_archive(s->mmr, s->points[k].timestamp, &arch) != 0) {
+					expired++;
+					continue;
+				}
+				
+				if (murmur_sched_set(store->sched, s->mmr, s->points[k].timestamp, s->points[k].value) != 0) {
+					ret = -1;
+					break;
+				}
+			}
+		}
+	}
+	
+	if (expired > 0) {
+		M_WARN("Dropping %lu memtable points that are too old for their files", expired);
+	}
+	
+	if (murmur_sched_flush(store->sched) != 0) {
+		ret = -1;
+	}
+	
+	// Whatever wasn't written goes back in the memtables for the next flush, under anything
+	// that's been written since
+	for (uint32_t i = 0; i < mem->shard_count; i++) {
+		struct _murmur_mem_shard *shard = mem->shards + i;
+		
+		pthread_mutex_lock(&shard->lock);
+		if (ret != 0) {
+			int64_t merged = _murmur_memtable_merge(&shard->active, &shard->frozen);
+			if (merged >= 0) {
+				mem->points += merged;
+			}
+		}
+		_murmur_memtable_free(&shard->frozen);
+		pthread_mutex_unlock(&shard->lock);
+	}
+	
+	// The log still has every point since the last flush that wrote them all
+	if (ret != 0) {
+		M_WARN("Keeping the memtable log, since not everything was written");
+		return -1;
+	}
+	
+	if (ftruncate(mem->log_fd, 0) != 0) {
+		M_PERROR("Could not empty the memtable log");
+		return -1;
+	}
+	
+	return 0;
+}
+
+/**
+ * Fills in a series, over what was read from its metric's file, with whatever its metric has
+ * in the memtables. Only series from the most precise archive can be filled in.
+ */
+static void _murmur_mem_overlay(struct _murmur_mem *mem, const struct murmur *mmr, const char *name, struct murmur_series *series) {
+	if (mem == NULL || series->count == 0 || series->step != mmr->archives->seconds_per_point) {
+		return;
+	}
+	
+	uint32_t hash = _murmur_hash(name, strlen(name));
+	struct _murmur_mem_shard *shard = mem->shards + (hash % mem->shard_count);
+	
+	pthread_mutex_lock(&shard->lock);
+	
+	// Frozen first, since anything in the active memtable is newer
+	struct _murmur_memtable *tables[] = { &shard->frozen, &shard->active };
+	for (uint32_t i = 0; i < 2; i++) {
+		if (tables[i]->series == NULL) {
+			continue;
+		}
+		
+		struct _murmur_mem_series *s = _murmur_memtable_slot(tables[i], name, hash);
+		for (uint32_t j = 0; s->name != NULL && j < s->count; j++) {
+			int64_t interval = s->points[j].timestamp - (s->points[j].timestamp % series->step);
+			if (interval < series->from) {
+				continue;
+			}
+			
+			uint64_t at = (interval - series->from) / series->step;
+			if (at >= series->count) {
+				break;
+			}
+			
+			series->values[at] = s->points[j].value;
+		}
+	}
+	
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Puts everything in the log back into the memtables. A record cut short by a crash ends it.
+ */
+static int _murmur_mem_replay(struct murmur_store *store, const int fd) {
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		M_PERROR("Could not read the memtable log");
+		return -1;
+	}
+	
+	if (st.st_size == 0) {
+		return 0;
+	}
+	
+	char *log = malloc(st.st_size);
+	if (log == NULL || pread(fd, log, st.st_size, 0) != st.st_size) {
+		M_PERROR("Could not read the memtable log");
+		free(log);
+		return -1;
+	}
+	
+	char name[PATH_MAX];
+	uint64_t replayed = 0;
+	off_t at = 0;
+	
+	_murmur_store_hold_queued(store);
+	
+	while (at + (off_t)sizeof(struct _murmur_mem_record) <= st.st_size) {
+		struct _murmur_mem_record rec;
+		memcpy(&rec, log + at, sizeof(rec));
+		
+		if (rec.name_len >= sizeof(name) || at + (off_t)sizeof(rec) + rec.name_len > st.st_size) {
+			break;
+		}
+		
+		memcpy(name, log + at + sizeof(rec), rec.name_len);
+		name[rec.name_len] = '\0';
+		at += sizeof(rec) + rec.name_len;
+		
+		struct murmur *mmr = murmur_store_handle(store, name, 1);
+		if (mmr != NULL && _murmur_mem_insert(store->mem, mmr, name, rec.timestamp, rec.value) == 0) {
+			replayed++;
+		}
+	}
+	
+	// Drop whatever was cut short, so that new records aren't appended after it
+	if (at != st.st_size && ftruncate(fd, at) != 0) {
+		M_PERROR("Could not trim the memtable log");
+		free(log);
+		return -1;
+	}
+	
+	M_INFO("Replayed %lu points from the memtable log", replayed);
+	
+	free(log);
+	return 0;
+}
+
+static void _murmur_mem_free(struct _murmur_mem *mem) {
+	if (mem == NULL) {
+		return;
+	}
+	
+	for (uint32_t i = 0; i < mem->shard_count; i++) {
+		_murmur_memtable_free(&mem->shards[i].active);
+		_murmur_memtable_free(&mem->shards[i].frozen);
+		pthread_mutex_destroy(&mem->shards[i].lock);
+	}
+	
+	if (mem->log_fd != -1) {
+		close(mem->log_fd);
+	}
+	
+	free(mem);
+}
+
+int murmur_store_memtable(struct murmur_store *store, const uint32_t shards, const uint64_t max_points, const uint32_t max_age) {
+	if (store->mem != NULL || store->parts != NULL) {
+		M_ERROR("%s already has a write layout", store->root);
+		return -1;
+	}
+	
+	if (shards == 0) {
+		M_ERROR("Memtables need at least one shard");
+		return -1;
+	}
+	
+	struct _murmur_mem *mem = calloc(1, sizeof(*mem) + (shards * sizeof(*mem->shards)));
+	if (mem == NULL) {
+		M_PERROR("Could not allocate memtables");
+		return -1;
+	}
+	
+	mem->max_points = max_points;
+	mem->max_age = max_age;
+	mem->flushed = time(NULL);
+	mem->log_fd = -1;
+	
+	for (uint32_t i = 0; i < shards; i++) {
+		pthread_mutex_init(&mem->shards[i].lock, NULL);
+		mem->shard_count++;
+		
+		if (_murmur_memtable_init(&mem->shards[i].active) != 0) {
+			goto error;
+		}
+	}
+	
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", store->root, MURMUR_MEM_LOG);
+	
+	mem->log_fd = open(path, O_RDWR|O_CREAT|O_APPEND, S_IRUSR|S_IWUSR|S_IRGRP);
+	if (mem->log_fd == -1) {
+		M_PERROR("Could not open %s", path);
+		goto error;
+	}
+	
+	store->mem = mem;
+	
+	if (_murmur_mem_replay(store, mem->log_fd) != 0) {
+		store->mem = NULL;
+		goto error;
+	}
+	
+	return 0;
+
+error:
+	_murmur_mem_free(mem);
+	return -1;
+}
+
+int murmur_store_set(struct murmur_store *store, const char *name, const int64_t timestamp, const double value) {
+	char rewritten[PATH_MAX];
+	if (store->rules != NULL) {
+		int keep = murmur_rules_apply(store->rules, name, rewritten, sizeof(rewritten));
+		if (keep <= 0) {
+			return keep;
+		}
+		
+		name = rewritten;
+	}
+	
+	_murmur_store_hold_queued(store);
+	
+	struct murmur *mmr = murmur_store_handle(store, name, 1);
+	if (mmr == NULL) {
+		return -1;
+	}
+	
+	int ret = 1;
+	
+	if (store->mem != NULL) {
+		ret = _murmur_mem_set(store->mem, mmr, name, timestamp, value);
+	} else if (store->parts != NULL) {
+		ret = _murmur_parts_set(store->parts, name, timestamp, value);
+	}
+	
+	if (ret == 1) {
+		ret = murmur_sched_set(store->sched, mmr, timestamp, value);
+	}
+	
+	if (ret == 0) {
+		_murmur_subs_notify(store->subs, name, timestamp, value);
+	}
+	
+	return ret;
+}
+
+int murmur_store_flush(struct murmur_store *store) {
+	int ret = murmur_sched_flush(store->sched);
+	
+	if (store->subs != NULL) {
+		_murmur_subs_send(store->subs);
+	}
+	
+	if (store->mem != NULL && _murmur_mem_flush(store) != 0) {
+		ret = -1;
+	}
+	
+	if (store->parts != NULL && _murmur_parts_flush(store) != 0) {
+		ret = -1;
+	}
+	
+	// With nothing waiting on any file, those that went unused longest can be closed
+	if (store->queued_held && store->sched->count == 0 && (store->mem == NULL || store->mem->points == 0)) {
+		_murmur_store_release(store, &store->queued);
+		store->queued_held = 0;
+	}
+	
+	_murmur_store_evict(store);
+	
+	if (store->index != NULL) {
+		_murmur_index_compact(store->index);
+	}
+	
+	return ret;
+}
+
+/**
+ * How many bytes of the input each import thread parses per round. This bounds the memory an
+ * import holds, since every parsed point waits for its round's writes.
+ */
+#define MURMUR_IMPORT_CHUNK (8 * 1024 * 1024)
+
+/**
+ * How many points an import thread queues before writing them.
+ */
+#define MURMUR_IMPORT_FLUSH_POINTS 65536
+
+/**
+ * The longest field that's parsed as a number.
+ */
+#define MURMUR_IMPORT_NUMBER_MAX 64
+
+/**
+ * A point parsed from an import, waiting to be written by the thread that owns its metric.
+ */
+struct _murmur_import_point {
+	/**
+	 * The name, in the input, or NULL if a rule rewrote it.
+	 */
+	const char *name;
+	
+	/**
+	 * Where the rewritten name is in the parsing thread's pool, if it was.
+	 */
+	size_t pool;
+	
+	uint32_t name_len;
+	int64_t timestamp;
+	double value;
+};
+
+/**
+ * The points one thread parsed for another to write.
+ */
+struct _murmur_import_bucket {
+	struct _murmur_import_point *points;
+	size_t count;
+	size_t alloc;
+};
+
+struct _murmur_import;
+
+/**
+ * A thread of an import, which both parses part of the input and writes a share of the metrics.
+ */
+struct _murmur_import_worker {
+	struct _murmur_import *imp;
+	uint32_t id;
+	
+	/**
+	 * The lines to parse this round.
+	 */
+	const char *start;
+	const char *end;
+	
+	/**
+	 * What was parsed, by the thread that will write it.
+	 */
+	struct _murmur_import_bucket *buckets;
+	
+	/**
+	 * Names rewritten by the rules this round, each followed by a NUL.
+	 */
+	char *pool;
+	size_t pool_len;
+	size_t pool_alloc;
+	
+	struct murmur_sched *sched;
+	
+	uint64_t lines;
+	uint64_t points;
+	uint64_t skipped;
+	int failed;
+};
+
+struct _murmur_import {
+	struct murmur_store *store;
+	uint32_t thread_count;
+	struct _murmur_import_worker *workers;
+};
+
+static const double _murmur_import_pow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+};
+
+/**
+ * Parses a timestamp, dropping anything after the decimal point.
+ *
+ * @return 0 on success, -1 if the field isn't a number.
+ */
+static int _murmur_import_timestamp(const char *s, const char *end, int64_t *timestamp) {
+	int neg = 0;
+	if (s < end && (*s == '-' || *s == '+')) {
+		neg = *s == '-';
+		s++;
+	}
+	
+	const char *digits = s;
+	uint64_t ts = 0;
+	for (; s < end && *s >= '0' && *s <= '9'; s++) {
+		ts = (ts * 10) + (*s - '0');
+	}
+	
+	if (s == digits || s - digits > 18) {
+		return -1;
+	}
+	
+	// Some exports use fractional timestamps
+	if (s < end && *s == '.') {
+		for (s++; s < end && *s >= '0' && *s <= '9'; s++);
+	}
+	
+	if (s != end) {
+		return -1;
+	}
+	
+	*timestamp = neg ? -(int64_t)ts : (int64_t)ts;
+	return 0;
+}
+
+/**
+ * Parses a value. Plain decimals with up to 15 digits are exact as an integer, so dividing by a
+ * power of ten rounds the same way strtod() would; anything else goes to strtod().
+ *
+ * @return 0 on success, -1 if the field isn't a number.
+ */
+static int _murmur_import_value(const char *s, const char *end, double *value) {
+	const char *p = s;
+	int neg = 0;
+	if (p < end && (*p == '-' || *p == '+')) {
+		neg = *p == '-';
+		p++;
+	}
+	
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int frac = -1;
+	for (; p < end; p++) {
+		if (*p >= '0' && *p <= '9') {
+			mantissa = (mantissa * 10) + (*p - '0');
+			digits++;
+			frac += frac >= 0;
+		} else if (*p == '.' && frac < 0) {
+			frac = 0;
+		} else {
+			break;
+		}
+	}
+	
+	if (p == end && digits > 0 && digits <= 15) {
+		double v = (double)mantissa;
+		if (frac > 0) {
+			v /= _murmur_import_pow10[frac];
+		}
+		
+		*value = neg ? -v : v;
+		return 0;
+	}
+	
+	char buf[MURMUR_IMPORT_NUMBER_MAX];
+	size_t len = end - s;
+	if (len == 0 || len >= sizeof(buf)) {
+		return -1;
+	}
+	
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+	
+	char *parsed;
+	*value = strtod(buf, &parsed);
+	
+	return *parsed == '\0' ? 0 : -1;
+}
+
+static int _murmur_import_push(struct _murmur_import_bucket *b, const struct _murmur_import_point *pt) {
+	if (b->count == b->alloc) {
+		size_t alloc = b->alloc == 0 ? 1024 : b->alloc * 2;
+		struct _murmur_import_point *points = realloc(b->points, alloc * sizeof(*points));
+		if (points == NULL) {
+			M_PERROR("Could not allocate import points");
+			return -1;
+		}
+		
+		b->points = points;
+		b->alloc = alloc;
+	}
+	
+	b->points[b->count++] = *pt;
+	return 0;
+}
+
+/**
+ * Keeps a rewritten name for the writes of this round.
+ *
+ * @return Where the name is in the pool, or -1 on failure.
+ */
+static ssize_t _murmur_import_pool(struct _murmur_import_worker *w, const char *name, const size_t len) {
+	if (w->pool_len + len + 1 > w->pool_alloc) {
+		size_t alloc = w->pool_alloc == 0 ? 4096 : w->pool_alloc;
+		while (alloc < w->pool_len + len + 1) {
+			alloc *= 2;
+		}
+		
+		char *pool = realloc(w->pool, alloc);
+		if (pool == NULL) {
+			M_PERROR("Could not allocate import names");
+			return -1;
+		}
+		
+		w->pool = pool;
+		w->pool_alloc = alloc;
+	}
+	
+	size_t at = w->pool_len;
+	memcpy(w->pool + at, name, len);
+	w->pool[at + len] = '\0';
+	w->pool_len += len + 1;
+	
+	return at;
+}
+
+/**
+ * Splits a line into name, timestamp and value.
+ *
+ * @return 0 on success, -1 if the line is malformed.
+ */
+static int _murmur_import_line(const char *line, const char *end, const char **name, uint32_t *name_len, int64_t *timestamp, double *value) {
+	const char *fields[3];
+	const char *ends[3];
+	const char *p = line;
+	
+	for (int i = 0; i < 3; i++) {
+		fields[i] = p;
+		while (p < end && *p != ',' && *p != '\t') {
+			p++;
+		}
+		ends[i] = p;
+		
+		// Exactly three fields
+		if ((i < 2) != (p < end)) {
+			return -1;
+		}
+		p++;
+	}
+	
+	if (ends[0] == fields[0] || ends[0] - fields[0] >= PATH_MAX) {
+		return -1;
+	}
+	
+	if (_murmur_import_timestamp(fields[1], ends[1], timestamp) != 0 || _murmur_import_value(fields[2], ends[2], value) != 0) {
+		return -1;
+	}
+	
+	*name = fields[0];
+	*name_len = ends[0] - fields[0];
+	return 0;
+}
+
+/**
+ * Parses a worker's lines, handing each point to the thread that owns its metric. Lines with the
+ * same name as the one before skip the rules and the hashing, since exports usually keep a
+ * metric's points together.
+ */
+static void* _murmur_import_parse(void *arg) {
+	struct _murmur_import_worker *w = arg;
+	struct _murmur_import *imp = w->imp;
+	const struct murmur_rules *rules = imp->store->rules;
+	
+	const char *last = NULL;
+	uint32_t last_len = 0;
+	int last_keep = 1;
+	struct _murmur_import_point tmpl = { NULL, 0, 0, 0, 0 };
+	uint32_t owner = 0;
+	
+	char raw[PATH_MAX];
+	char rewritten[PATH_MAX];
+	
+	for (const char *line = w->start; line < w->end;) {
+		const char *nl = memchr(line, '\n', w->end - line);
+		const char *eol = nl == NULL ? w->end : nl;
+		const char *next = nl == NULL ? w->end : nl + 1;
+		
+		if (eol > line && eol[-1] == '\r') {
+			eol--;
+		}
+		
+		if (eol == line) {
+			line = next;
+			continue;
+		}
+		
+		w->lines++;
+		
+		const char *name;
+		uint32_t name_len;
+		struct _murmur_import_point pt;
+		if (_murmur_import_line(line, eol, &name, &name_len, &pt.timestamp, &pt.value) != 0) {
+			w->skipped++;
+			line = next;
+			continue;
+		}
+		
+		if (last == NULL || name_len != last_len || memcmp(name, last, name_len) != 0) {
+			last = name;
+			last_len = name_len;
+			last_keep = 1;
+			tmpl.name = name;
+			tmpl.name_len = name_len;
+			
+			if (rules != NULL) {
+				memcpy(raw, name, name_len);
+				raw[name_len] = '\0';
+				
+				last_keep = murmur_rules_apply(rules, raw, rewritten, sizeof(rewritten));
+				if (last_keep > 0 && strcmp(raw, rewritten) != 0) {
+					size_t len = strlen(rewritten);
+					ssize_t at = _murmur_import_pool(w, rewritten, len);
+					if (at < 0) {
+						w->failed = 1;
+						return NULL;
+					}
+					
+					tmpl.name = NULL;
+					tmpl.pool = at;
+					tmpl.name_len = len;
+				}
+			}
+			
+			const char *hashed = tmpl.name == NULL ? w->pool + tmpl.pool : tmpl.name;
+			owner = _murmur_hash(hashed, tmpl.name_len) % imp->thread_count;
+		}
+		
+		line = next;
+		
+		if (last_keep <= 0) {
+			w->skipped++;
+			continue;
+		}
+		
+		pt.name = tmpl.name;
+		pt.pool = tmpl.pool;
+		pt.name_len = tmpl.name_len;
+		
+		if (_murmur_import_push(w->buckets + owner, &pt) != 0) {
+			w->failed = 1;
+			return NULL;
+		}
+	}
+	
+	return NULL;
+}
+
+/**
+ * Writes every point parsed this round for the metrics a worker owns. No other thread writes
+ * those metrics, so each worker can flush its own scheduler without any locking.
+ */
+static void* _murmur_import_write(void *arg) {
+	struct _murmur_import_worker *w = arg;
+	struct _murmur_import *imp = w->imp;
+	
+	const char *last = NULL;
+	uint32_t last_len = 0;
+	struct murmur *mmr = NULL;
+	char name[PATH_MAX];
+	
+	// Every file with points queued stays open until they're written
+	struct _murmur_store_hold hold;
+	_murmur_store_hold(imp->store, &hold);
+	
+	for (uint32_t i = 0; i < imp->thread_count; i++) {
+		struct _murmur_import_worker *parser = imp->workers + i;
+		struct _murmur_import_bucket *b = parser->buckets + w->id;
+		
+		for (size_t j = 0; j < b->count; j++) {
+			struct _murmur_import_point *pt = b->points + j;
+			const char *n = pt->name == NULL ? parser->pool + pt->pool : pt->name;
+			
+			if (last == NULL || pt->name_len != last_len || memcmp(n, last, last_len) != 0) {
+				last = n;
+				last_len = pt->name_len;
+				
+				memcpy(name, n, last_len);
+				name[last_len] = '\0';
+				mmr = murmur_store_handle(imp->store, name, 1);
+			}
+			
+			// Checked here, since the scheduler complains about every point it can't place
+			struct murmur_archive *arch;
+			if (mmr == NULL || _murmur_get_archive(mmr, pt->timestamp, &arch) != 0) {
+				w->skipped++;
+				continue;
+			}
+			
+			if (murmur_sched_set(w->sched, mmr, pt->timestamp, pt->value) != 0) {
+				w->failed = 1;
+				_murmur_store_release(imp->store, &hold);
+				return NULL;
+			}
+			
+			w->points++;
+			
+			if (w->sched->count >= MURMUR_IMPORT_FLUSH_POINTS) {
+				if (murmur_sched_flush(w->sched) != 0) {
+					w->failed = 1;
+				}
+				
+				// Nothing is queued now, so files can be closed to make room, and the next point
+				// looks its file up again in case it was one of them
+				_murmur_store_release(imp->store, &hold);
+				_murmur_store_hold(imp->store, &hold);
+				_murmur_store_evict(imp->store);
+				last = NULL;
+			}
+		}
+	}
+	
+	if (murmur_sched_flush(w->sched) != 0) {
+		w->failed = 1;
+	}
+	
+	_murmur_store_release(imp->store, &hold);
+	_murmur_store_evict(imp->store);
+	
+	return NULL;
+}
+
+/**
+ * Runs one phase of a round on every worker, and waits for them all.
+ *
+ * @return 0 on success, -1 if a thread couldn't be started.
+ */
+static int _murmur_import_run(struct _murmur_import *imp, void* (*fn)(void*)) {
+	pthread_t threads[imp->thread_count];
+	uint32_t started = 0;
+	
+	// The first worker runs on the calling thread
+	for (uint32_t i = 1; i < imp->thread_count; i++, started++) {
+		if (pthread_create(threads + started, NULL, fn, imp->workers + i) != 0) {
+			M_PERROR("Could not start import worker");
+			break;
+		}
+	}
+	
+	int ret = started + 1 == imp->thread_count ? 0 : -1;
+	
+	// Workers that weren't started still have to run, or their share would be lost
+	for (uint32_t i = started + 1; i < imp->thread_count; i++) {
+		fn(imp->workers + i);
+	}
+	
+	fn(imp->workers);
+	
+	for (uint32_t i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	
+	return ret;
+}
+
+int murmur_store_import(struct murmur_store *store, const char *path, const uint32_t threads, struct murmur_import_stats *stats) {
+	memset(stats, 0, sizeof(*stats));
+	
+	// Anything queued could otherwise be written over what's imported
+	if (murmur_store_flush(store) != 0) {
+		return -1;
+	}
+	
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		M_PERROR("Could not open %s", path);
+		return -1;
+	}
+	
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		M_PERROR("Could not stat %s", path);
+		close(fd);
+		return -1;
+	}
+	
+	if (st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	
+	const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	
+	if (map == MAP_FAILED) {
+		M_PERROR("Could not map %s", path);
+		return -1;
+	}
+	
+	madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+	
+	struct _murmur_import imp;
+	imp.store = store;
+	imp.thread_count = threads == 0 ? 1 : threads;
+	imp.workers = calloc(imp.thread_count, sizeof(*imp.workers));
+	
+	int ret = 0;
+	
+	if (imp.workers == NULL) {
+		M_PERROR("Could not allocate import workers");
+		ret = -1;
+		goto done;
+	}
+	
+	for (uint32_t i = 0; i < imp.thread_count; i++) {
+		struct _murmur_import_worker *w = imp.workers + i;
+		w->imp = &imp;
+		w->id = i;
+		w->buckets = calloc(imp.thread_count, sizeof(*w->buckets));
+		w->sched = murmur_sched_new();
+		
+		if (w->buckets == NULL || w->sched == NULL) {
+			M_PERROR("Could not allocate import worker");
+			ret = -1;
+			goto done;
+		}
+	}
+	
+	const char *pos = map;
+	const char *end = map + st.st_size;
+	
+	while (ret == 0 && pos < end) {
+		// Each worker's lines run from where the last one's stopped to the end of the line that
+		// crosses its chunk
+		for (uint32_t i = 0; i < imp.thread_count; i++) {
+			struct _murmur_import_worker *w = imp.workers + i;
+			w->start = pos;
+			
+			if ((size_t)(end - pos) > MURMUR_IMPORT_CHUNK) {
+				const char *nl = memchr(pos + MURMUR_IMPORT_CHUNK, '\n', end - pos - MURMUR_IMPORT_CHUNK);
+				pos = nl == NULL ? end : nl + 1;
+			} else {
+				pos = end;
+			}
+			
+			w->end = pos;
+			w->pool_len = 0;
+			
+			for (uint32_t j = 0; j < imp.thread_count; j++) {
+				w->buckets[j].count = 0;
+			}
+		}
+		
+		if (_murmur_import_run(&imp, _murmur_import_parse) != 0) {
+			ret = -1;
+		}
+		
+		for (uint32_t i = 0; i < imp.thread_count; i++) {
+			if (imp.workers[i].failed) {
+				ret = -1;
+			}
+		}
+		
+		if (ret == 0 && _murmur_import_run(&imp, _murmur_import_write) != 0) {
+			ret = -1;
+		}
+		
+		// What's been read is already parsed and written
+		madvise((void*)map, pos - map, MADV_DONTNEED);
+	}
+	
+	stats->bytes = st.st_size;
+	
+done:
+	if (imp.workers != NULL) {
+		for (uint32_t i = 0; i < imp.thread_count; i++) {
+			struct _murmur_import_worker *w = imp.workers + i;
+			stats->lines += w->lines;
+			stats->points += w->points;
+			stats->skipped += w->skipped;
+			
+			if (w->failed) {
+				ret = -1;
+			}
+			
+			if (w->buckets != NULL) {
+				for (uint32_t j = 0; j < imp.thread_count; j++) {
+					free(w->buckets[j].points);
+				}
+			}
+			
+			free(w->buckets);
+			free(w->pool);
+			murmur_sched_free(w->sched);
+		}
+		
+		free(imp.workers);
+	}
+	
+	munmap((void*)map, st.st_size);
+	
+	return ret;
+}
+
+/**
+ * The longest line accepted over the plaintext protocol.
+ */
+#define MURMUR_LINE_MAX 4096
+
+/**
+ * How many points a store that's receiving over the network queues before flushing early.
+ */
+#define MURMUR_STORE_FLUSH_POINTS 65536
+
+/**
+ * How many points are placed on the ring for each unit of a node's weight.
+ */
+#define MURMUR_RING_VNODES 128
+
+/**
+ * How many bytes the relay collects for a node before sending them.
+ */
+#define MURMUR_RELAY_BATCH (64 * 1024)
+
+/**
+ * How often the relay sends whatever it has collected, even if it's less than a batch.
+ */
+#define MURMUR_RELAY_FLUSH_MS 100
+
+/**
+ * How long the relay waits for a node to accept a connection.
+ */
+#define MURMUR_RELAY_CONNECT_MS 1000
+
+/**
+ * The longest the relay waits between attempts to reconnect to a node.
+ */
+#define MURMUR_RELAY_BACKOFF_MAX_MS 30000
+
+/**
+ * How many bytes of requests a query server connection may have buffered before it's cut off.
+ */
+#define MURMUR_HTTP_REQUEST_MAX (64 * 1024)
+
+/**
+ * The most targets a single render request may ask for.
+ */
+#define MURMUR_HTTP_TARGETS_MAX 256
+
+/**
+ * The widest a render may ask for its series to be downsampled to. Wider asks get this.
+ */
+#define MURMUR_HTTP_MAX_POINTS 65536
+
+/**
+ * A monotonic clock, in milliseconds.
+ */
+static int64_t _murmur_now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+int murmur_unix_listen(const char *path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		M_ERROR("Socket path too long: %s", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		M_PERROR("Could not create socket");
+		return -1;
+	}
+	
+	// Left behind by a listener that didn't exit cleanly
+	if (unlink(path) != 0 && errno != ENOENT) {
+		M_PERROR("Could not remove %s", path);
+		close(fd);
+		return -1;
+	}
+	
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+		M_PERROR("Could not listen on %s", path);
+		close(fd);
+		return -1;
+	}
+	
+	return fd;
+}
+
+int murmur_tcp_listen(const char *host, const uint16_t port) {
+	char service[8];
+	snprintf(service, sizeof(service), "%u", port);
+	
+	struct addrinfo *res = NULL;
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	};
+	
+	int err = getaddrinfo(host, service, &hints, &res);
+	if (err != 0) {
+		M_ERROR("Could not resolve %s:%u: %s", host == NULL ? "*" : host, port, gai_strerror(err));
+		return -1;
+	}
+	
+	int fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+	if (fd == -1) {
+		M_PERROR("Could not create socket");
+		goto error;
+	}
+	
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	
+	if (bind(fd, res->ai_addr, res->ai_addrlen) != 0 || listen(fd, 128) != 0) {
+		M_PERROR("Could not listen on port %u", port);
+		goto error;
+	}
+	
+	freeaddrinfo(res);
+	return fd;
+
+error:
+	if (fd != -1) {
+		close(fd);
+	}
+	freeaddrinfo(res);
+	return -1;
+}
+
+/**
+ * Starts connecting to a node without waiting for the connection to finish.
+ */
+static int _murmur_tcp_connect_start(const char *host, const uint16_t port) {
+	char service[8];
+	snprintf(service, sizeof(service), "%u", port);
+	
+	struct addrinfo *res = NULL;
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	
+	int err = getaddrinfo(host, service, &hints, &res);
+	if (err != 0) {
+		M_ERROR("Could not resolve %s:%u: %s", host, port, gai_strerror(err));
+		return -1;
+	}
+	
+	int fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, res->ai_protocol);
+	if (fd != -1 && connect(fd, res->ai_addr, res->ai_addrlen) != 0 && errno != EINPROGRESS) {
+		close(fd);
+		fd = -1;
+	}
+	
+	freeaddrinfo(res);
+	return fd;
+}
+
+/**
+ * Checks on a connection started by _murmur_tcp_connect_start(), waiting up to timeout_ms.
+ *
+ * @return 1 once connected, 0 if still connecting, -1 if the connection failed.
+ */
+static int _murmur_tcp_connect_finish(const int fd, const int timeout_ms) {
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	int ready = poll(&pfd, 1, timeout_ms);
+	if (ready == 0 || (ready == -1 && errno == EINTR)) {
+		return 0;
+	}
+	
+	int err = 0;
+	socklen_t len = sizeof(err);
+	if (ready == -1 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) {
+		return -1;
+	}
+	
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	
+	return 1;
+}
+
+int murmur_tcp_connect(const char *host, const uint16_t port, const int timeout_ms) {
+	int fd = _murmur_tcp_connect_start(host, port);
+	if (fd == -1) {
+		M_DEBUG("Could not connect to %s:%u: %s", host, port, strerror(errno));
+		return -1;
+	}
+	
+	int connected = _murmur_tcp_connect_finish(fd, timeout_ms);
+	if (connected != 1) {
+		if (connected == 0) {
+			errno = ETIMEDOUT;
+		}
+		
+		M_DEBUG("Could not connect to %s:%u: %s", host, port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	
+	// Callers get a blocking socket, with sends bounded by the same timeout
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	
+	struct timeval tv = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_usec = (timeout_ms % 1000) * 1000,
+	};
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	
+	return fd;
+}
+
+/**
+ * A growable buffer for building up output.
+ */
+struct _murmur_buff {
+	char *data;
+	size_t len;
+	size_t alloc;
+};
+
+static int _murmur_buff_reserve(struct _murmur_buff *b, const size_t len) {
+	if (b->len + len <= b->alloc) {
+		return 0;
+	}
+	
+	size_t alloc = b->alloc == 0 ? 4096 : b->alloc;
+	while (alloc < b->len + len) {
+		alloc *= 2;
+	}
+	
+	char *data = realloc(b->data, alloc);
+	if (data == NULL) {
+		M_PERROR("Could not grow buffer");
+		return -1;
+	}
+	
+	b->data = data;
+	b->alloc = alloc;
+	
+	return 0;
+}
+
+static int _murmur_buff_append(struct _murmur_buff *b, const char *data, const size_t len) {
+	if (_murmur_buff_reserve(b, len) != 0) {
+		return -1;
+	}
+	
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	
+	return 0;
+}
+
+static int _murmur_buff_printf(struct _murmur_buff *b, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+static int _murmur_buff_printf(struct _murmur_buff *b, const char *format, ...) {
+	va_list args;
+	
+	va_start(args, format);
+	int len = vsnprintf(b->data + b->len, b->alloc - b->len, format, args);
+	va_end(args);
+	
+	if (len < 0) {
+		return -1;
+	}
+	
+	if (b->len + len >= b->alloc) {
+		if (_murmur_buff_reserve(b, len + 1) != 0) {
+			return -1;
+		}
+		
+		va_start(args, format);
+		vsnprintf(b->data + b->len, b->alloc - b->len, format, args);
+		va_end(args);
+	}
+	
+	b->len += len;
+	return 0;
+}
+
+/**
+ * How many bytes of replies a line server holds for a client before it stops reading from it.
+ */
+#define MURMUR_LINE_MAX_PENDING (16 * 1024 * 1024)
+
+/**
+ * A connection sending lines to a line server.
+ */
+struct _murmur_line_client {
+	int fd;
+	size_t len;
+	char buff[MURMUR_LINE_MAX];
+	
+	/**
+	 * Replies waiting for the socket to take them, sent from the server's loop as it becomes
+	 * writable so that a slow reader only holds up itself.
+	 */
+	struct _murmur_buff out;
+	size_t out_sent;
+};
+
+/**
+ * Called with each line a line server receives, without its newline.
+ *
+ * @return 0 to keep going, -1 to close the connection.
+ */
+typedef int (*_murmur_line_fn)(void *ctx, struct _murmur_line_client *c, char *line);
+
+/**
+ * Sends as much of a client's replies as its socket takes without waiting.
+ *
+ * @return 0 if the client is still good, -1 if it should be closed.
+ */
+static int _murmur_line_write(struct _murmur_line_client *c) {
+	while (c->out_sent < c->out.len) {
+		ssize_t s = send(c->fd, c->out.data + c->out_sent, c->out.len - c->out_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (s == -1) {
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+		}
+		
+		c->out_sent += s;
+	}
+	
+	c->out.len = 0;
+	c->out_sent = 0;
+	
+	return 0;
+}
+
+/**
+ * Queues a reply to a client, and sends what it can of it now.
+ *
+ * @return 0 if the client is still good, -1 if it should be closed.
+ */
+static int _murmur_line_reply(struct _murmur_line_client *c, const char *data, const size_t len) {
+	if (_murmur_buff_append(&c->out, data, len) != 0) {
+		return -1;
+	}
+	
+	return _murmur_line_write(c);
+}
+
+static void _murmur_line_client_free(struct _murmur_line_client *c) {
+	close(c->fd);
+	free(c->out.data);
+	free(c);
+}
+
+/**
+ * Called periodically from a line server's loop.
+ */
+typedef void (*_murmur_tick_fn)(void *ctx);
+
+/**
+ * Reads what's waiting on a client, handing every full line to the callback.
+ *
+ * @return 0 if the client is still good, -1 if it should be closed.
+ */
+static int _murmur_line_read(struct _murmur_line_client *c, _murmur_line_fn on_line, void *ctx) {
+	while (1) {
+		ssize_t got = recv(c->fd, c->buff + c->len, sizeof(c->buff) - c->len, MSG_DONTWAIT);
+		if (got == 0) {
+			return -1;
+		}
+		
+		if (got == -1) {
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+		}
+		
+		c->len += got;
+		
+		char *start = c->buff;
+		char *end = c->buff + c->len;
+		char *nl;
+		while ((nl = memchr(start, '\n', end - start)) != NULL) {
+			*nl = '\0';
+			if (nl > start && *(nl - 1) == '\r') {
+				*(nl - 1) = '\0';
+			}
+			
+			if (on_line(ctx, c, start) != 0) {
+				return -1;
+			}
+			
+			start = nl + 1;
+		}
+		
+		c->len = end - start;
+		memmove(c->buff, start, c->len);
+		
+		if (c->len == sizeof(c->buff)) {
+			M_WARN("Dropping line longer than %d bytes", MURMUR_LINE_MAX);
+			c->len = 0;
+		}
+	}
+}
+
+/**
+ * Accepts connections and hands every line received to a callback until told to stop.
+ * Once stopped, whatever clients already sent is still read before returning.
+ *
+ * @param fd The listening socket.
+ * @param stop Set to non-zero (from a signal handler, for example) to stop.
+ * @param tick_ms How often to call on_tick.
+ * @param on_line Called for each line.
+ * @param on_tick Called every tick_ms, and once more before returning.
+ * @param ctx Passed to the callbacks.
+ */
+static int _murmur_serve_lines(const int fd, volatile int *stop, const int tick_ms, _murmur_line_fn on_line, _murmur_tick_fn on_tick, void *ctx) {
+	struct _murmur_line_client **clients = NULL;
+	struct pollfd *pfds = NULL;
+	uint32_t clientc = 0;
+	uint32_t alloc = 0;
+	int ret = 0;
+	
+	int64_t next_tick = _murmur_now_ms() + tick_ms;
+	
+	while (1) {
+		int stopping = *stop;
+		
+		if (clientc + 1 > alloc) {
+			alloc = alloc == 0 ? 16 : alloc * 2;
+			clients = realloc(clients, alloc * sizeof(*clients));
+			pfds = realloc(pfds, (alloc + 1) * sizeof(*pfds));
+			if (clients == NULL || pfds == NULL) {
+				M_PERROR("Could not grow client list");
+				ret = -1;
+				break;
+			}
+		}
+		
+		pfds[0].fd = stopping ? -1 : fd;
+		pfds[0].events = POLLIN;
+		for (uint32_t i = 0; i < clientc; i++) {
+			struct _murmur_line_client *c = clients[i];
+			pfds[i + 1].fd = c->fd;
+			pfds[i + 1].events = 0;
+			
+			// A client that isn't reading its replies isn't heard until it catches up
+			if (c->out.len - c->out_sent < MURMUR_LINE_MAX_PENDING) {
+				pfds[i + 1].events |= POLLIN;
+			}
+			
+			if (c->out_sent < c->out.len) {
+				pfds[i + 1].events |= POLLOUT;
+			}
+		}
+		
+		int64_t wait = next_tick - _murmur_now_ms();
+		int ready = poll(pfds, clientc + 1, stopping ? 0 : (wait < 0 ? 0 : wait));
+		if (ready == -1 && errno != EINTR) {
+			M_PERROR("Could not poll for clients");
+			ret = -1;
+			break;
+		}
+		
+		for (uint32_t i = clientc; ready > 0 && i > 0; i--) {
+			struct _murmur_line_client *c = clients[i - 1];
+			if (pfds[i].revents == 0) {
+				continue;
+			}
+			
+			int err = 0;
+			if (pfds[i].revents & POLLOUT) {
+				err = _murmur_line_write(c);
+			}
+			
+			if (err == 0 && (pfds[i].revents & ~POLLOUT)) {
+				err = _murmur_line_read(c, on_line, ctx);
+			}
+			
+			if (err != 0) {
+				_murmur_line_client_free(c);
+				clients[i - 1] = clients[--clientc];
+			}
+		}
+		
+		if (ready > 0 && (pfds[0].revents & POLLIN)) {
+			int cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+			if (cfd == -1) {
+				M_PERROR("Could not accept client");
+			} else {
+				struct _murmur_line_client *c = calloc(1, sizeof(*c));
+				if (c == NULL) {
+					M_PERROR("Could not allocate client");
+					close(cfd);
+				} else {
+					c->fd = cfd;
+					clients[clientc++] = c;
+				}
+			}
+		}
+		
+		if (stopping) {
+			break;
+		}
+		
+		if (_murmur_now_ms() >= next_tick) {
+			on_tick(ctx);
+			next_tick = _murmur_now_ms() + tick_ms;
+		}
+	}
+	
+	for (uint32_t i = 0; i < clientc; i++) {
+		_murmur_line_client_free(clients[i]);
+	}
+	
+	free(clients);
+	free(pfds);
+	
+	on_tick(ctx);
+	
+	return ret;
+}
+
+/**
+ * Splits a plaintext protocol line ("name value timestamp") into its parts, in place.
+ *
+ * @return 0 on success, -1 if the line is malformed.
+ */
+static int _murmur_parse_plaintext(char *line, char **name, double *value, int64_t *timestamp) {
+	char *save = NULL;
+	char *n = strtok_r(line, " \t", &save);
+	char *v = strtok_r(NULL, " \t", &save);
+	char *t = strtok_r(NULL, " \t", &save);
+	
+	if (n == NULL || v == NULL || t == NULL || strtok_r(NULL, " \t", &save) != NULL) {
+		return -1;
+	}
+	
+	char *end;
+	*value = strtod(v, &end);
+	if (*end != '\0') {
+		return -1;
+	}
+	
+	*timestamp = strtoll(t, &end, 10);
+	if (*end != '\0') {
+		// Some senders use fractional timestamps
+		*timestamp = (int64_t)strtod(t, &end);
+		if (*end != '\0') {
+			return -1;
+		}
+	}
+	
+	*name = n;
+	return 0;
+}
+
+static int _murmur_store_on_fetch(struct murmur_store *store, struct _murmur_line_client *c, char *line);
+
+static int _murmur_store_on_line(void *ctx, struct _murmur_line_client *c, char *line) {
+	struct murmur_store *store = ctx;
+	
+	if (strncmp(line, "fetch ", 6) == 0) {
+		return _murmur_store_on_fetch(store, c, line);
+	}
+	
+	// The subscription gets its own copy of the connection, so that it outlives the client
+	// being closed here, and finds out it's gone on its next send
+	if (strncmp(line, "subscribe ", 10) == 0) {
+		int sfd = fcntl(c->fd, F_DUPFD_CLOEXEC, 0);
+		if (sfd == -1) {
+			M_PERROR("Could not subscribe to %s", line + 10);
+			return -1;
+		}
+		
+		return murmur_store_subscribe_fd(store, line + 10, sfd) == -1 ? -1 : 0;
+	}
+	
+	char *name;
+	double value;
+	int64_t timestamp;
+	
+	if (_murmur_parse_plaintext(line, &name, &value, &timestamp) != 0) {
+		M_WARN("Ignoring malformed line starting with: %s", line);
+		return 0;
+	}
+	
+	murmur_store_set(store, name, timestamp, value);
+	
+	if (store->sched->count >= MURMUR_STORE_FLUSH_POINTS || (store->mem != NULL && store->mem->points >= store->mem->max_points)) {
+		murmur_store_flush(store);
+	}
+	
+	return 0;
+}
+
+static void _murmur_store_on_tick(void *ctx) {
+	struct murmur_store *store = ctx;
+	
+	// Between flushes, only the log has to reach the disk
+	if (store->mem != NULL && !_murmur_mem_due(store->mem)) {
+		_murmur_mem_log_sync(store->mem);
+		_murmur_subs_send(store->subs);
+		return;
+	}
+	
+	murmur_store_flush(store);
+}
+
+int murmur_store_listen(struct murmur_store *store, const int fd, volatile int *stop) {
+	return _murmur_serve_lines(fd, stop, 1000, _murmur_store_on_line, _murmur_store_on_tick, store);
+}
+
+/**
+ * A node's position on the ring.
+ */
+struct _murmur_ring_point {
+	uint64_t hash;
+	uint32_t node;
+};
+
+struct murmur_ring {
+	/**
+	 * Every node, in the order added.
+	 */
+	struct murmur_ring_node *nodes;
+	uint32_t node_count;
+	
+	/**
+	 * Every node's positions on the ring, sorted by hash.
+	 */
+	struct _murmur_ring_point *points;
+	uint32_t point_count;
+	
+	/**
+	 * How many nodes each metric is sent to.
+	 */
+	uint32_t replicas;
+};
+
+/**
+ * A 64-bit hash for placing things on the ring: FNV-1a, finished with murmur3's mixer so
+ * that similar names spread out.
+ */
+static inline uint64_t _murmur_hash64(const char *str, const size_t len) {
+	uint64_t h = 14695981039346656037ull;
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)str[i]) * 1099511628211ull;
+	}
+	
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	
+	return h;
+}
+
+static int _murmur_ring_sort(const void *a, const void *b) {
+	const struct _murmur_ring_point *pa = a;
+	const struct _murmur_ring_point *pb = b;
+	
+	if (pa->hash != pb->hash) {
+		return pa->hash < pb->hash ? -1 : 1;
+	}
+	
+	return pa->node < pb->node ? -1 : (pa->node > pb->node);
+}
+
+struct murmur_ring* murmur_ring_new(const uint32_t replicas) {
+	struct murmur_ring *ring = malloc(sizeof(*ring));
+	memset(ring, 0, sizeof(*ring));
+	ring->replicas = replicas == 0 ? 1 : replicas;
+	
+	return ring;
+}
+
+void murmur_ring_free(struct murmur_ring *ring) {
+	if (ring != NULL) {
+		for (uint32_t i = 0; i < ring->node_count; i++) {
+			free(ring->nodes[i].host);
+		}
+		
+		free(ring->nodes);
+		free(ring->points);
+		free(ring);
+	}
+}
+
+int murmur_ring_add(struct murmur_ring *ring, const char *host, const uint16_t port, const uint32_t weight) {
+	if (weight == 0) {
+		M_ERROR("Ring nodes need a weight of at least 1");
+		return -1;
+	}
+	
+	for (uint32_t i = 0; i < ring->node_count; i++) {
+		if (ring->nodes[i].port == port && strcmp(ring->nodes[i].host, host) == 0) {
+			M_ERROR("%s:%u is already in the ring", host, port);
+			return -1;
+		}
+	}
+	
+	struct murmur_ring_node *nodes = realloc(ring->nodes, (ring->node_count + 1) * sizeof(*nodes));
+	struct _murmur_ring_point *points = realloc(ring->points, (ring->point_count + (weight * MURMUR_RING_VNODES)) * sizeof(*points));
+	if (nodes != NULL) {
+		ring->nodes = nodes;
+	}
+	if (points != NULL) {
+		ring->points = points;
+	}
+	if (nodes == NULL || points == NULL) {
+		M_PERROR("Could not grow ring");
+		return -1;
+	}
+	
+	uint32_t node = ring->node_count++;
+	ring->nodes[node].host = strdup(host);
+	ring->nodes[node].port = port;
+	ring->nodes[node].weight = weight;
+	
+	for (uint32_t i = 0; i < weight * MURMUR_RING_VNODES; i++) {
+		char key[300];
+		int len = snprintf(key, sizeof(key), "%s:%u#%u", host, port, i);
+		
+		struct _murmur_ring_point *p = ring->points + ring->point_count++;
+		p->hash = _murmur_hash64(key, len);
+		p->node = node;
+	}
+	
+	qsort(ring->points, ring->point_count, sizeof(*ring->points), _murmur_ring_sort);
+	
+	return 0;
+}
+
+uint32_t murmur_ring_lookup(const struct murmur_ring *ring, const char *name, uint32_t *nodes) {
+	if (ring->point_count == 0) {
+		return 0;
+	}
+	
+	uint64_t hash = _murmur_hash64(name, strlen(name));
+	
+	// First point at or past the name's hash
+	uint32_t lo = 0;
+	uint32_t hi = ring->point_count;
+	while (lo < hi) {
+		uint32_t mid = lo + ((hi - lo) / 2);
+		if (ring->points[mid].hash < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	
+	uint32_t want = ring->replicas < ring->node_count ? ring->replicas : ring->node_count;
+	uint32_t found = 0;
+	
+	for (uint32_t i = 0; i < ring->point_count && found < want; i++) {
+		uint32_t node = ring->points[(lo + i) % ring->point_count].node;
+		
+		int dup = 0;
+		for (uint32_t j = 0; j < found; j++) {
+			dup |= nodes[j] == node;
+		}
+		
+		if (!dup) {
+			nodes[found++] = node;
+		}
+	}
+	
+	return found;
+}
+
+const struct murmur_ring_node* murmur_ring_node(const struct murmur_ring *ring, const uint32_t node) {
+	return node < ring->node_count ? ring->nodes + node : NULL;
+}
+
+uint32_t murmur_ring_replicas(const struct murmur_ring *ring) {
+	return ring->replicas;
+}
+
+/**
+ * A node the relay sends to, along with everything waiting to go to it.
+ */
+struct _murmur_relay_dest {
+	/**
+	 * The connection to the node, -1 when disconnected.
+	 */
+	int fd;
+	
+	/**
+	 * If the connection is still being made, and when to give up on it.
+	 */
+	int connecting;
+	int64_t connect_by;
+	
+	/**
+	 * Lines waiting to be sent.
+	 */
+	char *buff;
+	size_t len;
+	size_t alloc;
+	
+	/**
+	 * How much of the first line has gone out on this connection. The whole line stays in the
+	 * buffer until it's all sent, so that a new connection can send it again from its start.
+	 */
+	size_t sent;
+	
+	/**
+	 * When to next try connecting, and how long to wait after that if it fails.
+	 */
+	int64_t retry_at;
+	int64_t backoff;
+	
+	/**
+	 * How many bytes were thrown away because the node was unreachable for too long.
+	 */
+	uint64_t dropped;
+};
+
+struct murmur_relay {
+	/**
+	 * Where metrics go.
+	 */
+	const struct murmur_ring *ring;
+	
+	/**
+	 * One destination for each node in the ring.
+	 */
+	struct _murmur_relay_dest *dests;
+	
+	/**
+	 * How much to buffer for a node before sending it.
+	 */
+	size_t batch;
+	
+	/**
+	 * How much to buffer for a node that can't be reached before dropping the oldest lines.
+	 */
+	size_t max_buffer;
+};
+
+struct murmur_relay* murmur_relay_new(const struct murmur_ring *ring, const size_t max_buffer) {
+	struct murmur_relay *relay = malloc(sizeof(*relay));
+	memset(relay, 0, sizeof(*relay));
+	
+	relay->ring = ring;
+	relay->batch = MURMUR_RELAY_BATCH;
+	relay->max_buffer = max_buffer < MURMUR_LINE_MAX ? MURMUR_LINE_MAX : max_buffer;
+	relay->dests = calloc(ring->node_count, sizeof(*relay->dests));
+	
+	for (uint32_t i = 0; i < ring->node_count; i++) {
+		relay->dests[i].fd = -1;
+	}
+	
+	return relay;
+}
+
+void murmur_relay_free(struct murmur_relay *relay) {
+	if (relay != NULL) {
+		for (uint32_t i = 0; i < relay->ring->node_count; i++) {
+			struct _murmur_relay_dest *d = relay->dests + i;
+			if (d->fd != -1) {
+				close(d->fd);
+			}
+			
+			if (d->len > 0) {
+				M_WARN("Relay closing with %zu bytes undelivered to %s:%u", d->len, relay->ring->nodes[i].host, relay->ring->nodes[i].port);
+			}
+			
+			free(d->buff);
+		}
+		
+		free(relay->dests);
+		free(relay);
+	}
+}
+
+/**
+ * Closes the connection to a node, and waits a while before trying again, longer each time.
+ */
+static void _murmur_relay_dest_retry(struct _murmur_relay_dest *d, const int64_t now) {
+	if (d->fd != -1) {
+		close(d->fd);
+		d->fd = -1;
+	}
+	
+	d->connecting = 0;
+	d->sent = 0;
+	
+	d->backoff = d->backoff == 0 ? MURMUR_RELAY_CONNECT_MS / 10 : d->backoff * 2;
+	if (d->backoff > MURMUR_RELAY_BACKOFF_MAX_MS) {
+		d->backoff = MURMUR_RELAY_BACKOFF_MAX_MS;
+	}
+	d->retry_at = now + d->backoff;
+}
+
+/**
+ * Sends as much as possible of what's buffered for a node, connecting if needed. Connections
+ * are made without waiting: each call checks whether it's done, so a node that's down never
+ * holds up the others.
+ *
+ * @return 0 if everything was sent, -1 if anything is still waiting.
+ */
+static int _murmur_relay_dest_flush(struct murmur_relay *relay, const uint32_t node) {
+	struct _murmur_relay_dest *d = relay->dests + node;
+	const struct murmur_ring_node *n = relay->ring->nodes + node;
+	
+	if (d->len == 0) {
+		return 0;
+	}
+	
+	int64_t now = _murmur_now_ms();
+	
+	if (d->fd == -1) {
+		if (now < d->retry_at) {
+			return -1;
+		}
+		
+		d->fd = _murmur_tcp_connect_start(n->host, n->port);
+		if (d->fd == -1) {
+			_murmur_relay_dest_retry(d, now);
+			return -1;
+		}
+		
+		d->connecting = 1;
+		d->connect_by = now + MURMUR_RELAY_CONNECT_MS;
+	}
+	
+	if (d->connecting) {
+		int connected = _murmur_tcp_connect_finish(d->fd, 0);
+		if (connected == 0 && now < d->connect_by) {
+			return -1;
+		}
+		
+		if (connected != 1) {
+			M_DEBUG("Could not connect to %s:%u", n->host, n->port);
+			_murmur_relay_dest_retry(d, now);
+			return -1;
+		}
+		
+		int on = 1;
+		setsockopt(d->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		
+		d->connecting = 0;
+		d->backoff = 0;
+		M_DEBUG("Relay connected to %s:%u", n->host, n->port);
+	}
+	
+	size_t sent = d->sent;
+	while (sent < d->len) {
+		ssize_t s = send(d->fd, d->buff + sent, d->len - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (s > 0) {
+			sent += s;
+			continue;
+		}
+		
+		if (s == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			break;
+		}
+		
+		M_WARN("Lost connection to %s:%u, buffering", n->host, n->port);
+		close(d->fd);
+		d->fd = -1;
+		break;
+	}
+	
+	// Only whole lines leave the buffer. If the connection went, the line it was cut off in
+	// goes again from its start on the next one, rather than the receiver getting half of it.
+	char *nl = sent == 0 ? NULL : memrchr(d->buff, '\n', sent);
+	size_t done = nl == NULL ? 0 : (size_t)(nl - d->buff) + 1;
+	
+	d->len -= done;
+	memmove(d->buff, d->buff + done, d->len);
+	d->sent = d->fd == -1 ? 0 : sent - done;
+	
+	return d->len == 0 ? 0 : -1;
+}
+
+/**
+ * Buffers a line for a node, dropping the oldest lines if there's too much waiting.
+ */
+static int _murmur_relay_dest_append(struct murmur_relay *relay, struct _murmur_relay_dest *d, const char *line, const size_t len) {
+	if (d->len + len > relay->max_buffer) {
+		size_t need = d->len + len - relay->max_buffer;
+		char *nl = need > d->len ? NULL : memchr(d->buff + need - 1, '\n', d->len - need + 1);
+		size_t drop = nl == NULL ? d->len : (size_t)(nl - d->buff) + 1;
+		
+		// A line partly sent on the current connection has to go out whole, so start over on a
+		// fresh one
+		if (d->fd != -1 && d->sent > 0) {
+			close(d->fd);
+			d->fd = -1;
+			d->sent = 0;
+		}
+		
+		d->dropped += drop;
+		d->len -= drop;
+		memmove(d->buff, d->buff + drop, d->len);
+	}
+	
+	if (d->len + len > d->alloc) {
+		size_t alloc = d->alloc == 0 ? relay->batch * 2 : d->alloc;
+		while (alloc < d->len + len) {
+			alloc *= 2;
+		}
+		
+		char *b = realloc(d->buff, alloc);
+		if (b == NULL) {
+			M_PERROR("Could not grow relay buffer");
+			return -1;
+		}
+		
+		d->buff = b;
+		d->alloc = alloc;
+	}
+	
+	memcpy(d->buff + d->len, line, len);
+	d->len += len;
+	
+	return 0;
+}
+
+int murmur_relay_send(struct murmur_relay *relay, const char *name, const double value, const int64_t timestamp) {
+	char line[MURMUR_LINE_MAX];
+	int len = snprintf(line, sizeof(line), "%s %.17g %ld\n", name, value, timestamp);
+	if (len < 0 || (size_t)len >= sizeof(line)) {
+		M_ERROR("Metric name too long: %s", name);
+		return -1;
+	}
+	
+	uint32_t nodes[relay->ring->replicas];
+	uint32_t nodec = murmur_ring_lookup(relay->ring, name, nodes);
+	if (nodec == 0) {
+		M_ERROR("No nodes to relay %s to", name);
+		return -1;
+	}
+	
+	int ret = 0;
+	for (uint32_t i = 0; i < nodec; i++) {
+		struct _murmur_relay_dest *d = relay->dests + nodes[i];
+		
+		if (_murmur_relay_dest_append(relay, d, line, len) != 0) {
+			ret = -1;
+		} else if (d->len >= relay->batch) {
+			_murmur_relay_dest_flush(relay, nodes[i]);
+		}
+	}
+	
+	return ret;
+}
+
+int murmur_relay_flush(struct murmur_relay *relay) {
+	int ret = 0;
+	for (uint32_t i = 0; i < relay->ring->node_count; i++) {
+		if (_murmur_relay_dest_flush(relay, i) != 0) {
+			ret = -1;
+		}
+	}
+	
+	return ret;
+}
+
+uint64_t murmur_relay_dropped(const struct murmur_relay *relay) {
+	uint64_t dropped = 0;
+	for (uint32_t i = 0; i < relay->ring->node_count; i++) {
+		dropped += relay->dests[i].dropped;
+	}
+	
+	return dropped;
+}
+
+static int _murmur_relay_on_line(void *ctx, struct _murmur_line_client *c, char *line) {
+	char *name;
+	double value;
+	int64_t timestamp;
+	
+	if (_murmur_parse_plaintext(line, &name, &value, &timestamp) != 0) {
+		M_WARN("Ignoring malformed line starting with: %s", line);
+		return 0;
+	}
+	
+	murmur_relay_send(ctx, name, value, timestamp);
+	return 0;
+}
+
+static void _murmur_relay_on_tick(void *ctx) {
+	murmur_relay_flush(ctx);
+}
+
+int murmur_relay_run(struct murmur_relay *relay, const int fd, volatile int *stop) {
+	return _murmur_serve_lines(fd, stop, MURMUR_RELAY_FLUSH_MS, _murmur_relay_on_line, _murmur_relay_on_tick, relay);
+}
+
+/**
+ * Formats a series in graphite's raw format: "name,from,until,step|v1,v2,None,...". A
+ * missing series is sent with no points: "name,0,0,0|".
+ */
+static int _murmur_format_raw(struct _murmur_buff *b, const char *name, const struct murmur_series *series) {
+	if (series == NULL || series->count == 0) {
+		return _murmur_buff_printf(b, "%s,0,0,0|\n", name);
+	}
+	
+	int64_t until = series->from + ((int64_t)series->count * series->step);
+	if (_murmur_buff_printf(b, "%s,%ld,%ld,%u|", name, series->from, until, series->step) != 0) {
+		return -1;
+	}
+	
+	for (uint32_t i = 0; i < series->count; i++) {
+		double v = series->values[i];
+		int err = isnan(v) ?
+			_murmur_buff_append(b, "None", 4) :
+			_murmur_buff_printf(b, "%.17g", v);
+		
+		if (err != 0 || _murmur_buff_append(b, i + 1 == series->count ? "\n" : ",", 1) != 0) {
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+/**
+ * Parses a line in graphite's raw format, in place.
+ *
+ * @param[out] series The points, which must be free'd. Empty if the line had none.
+ *
+ * @return 0 on success, -1 if the line is malformed.
+ */
+static int _murmur_parse_raw(char *line, char **name, struct murmur_series *series) {
+	memset(series, 0, sizeof(*series));
+	
+	char *bar = strchr(line, '|');
+	if (bar == NULL) {
+		return -1;
+	}
+	*bar = '\0';
+	
+	// Walk the header backwards: names can't contain commas, but this keeps that from mattering
+	char *fields[3];
+	for (int i = 2; i >= 0; i--) {
+		char *comma = strrchr(line, ',');
+		if (comma == NULL) {
+			return -1;
+		}
+		*comma = '\0';
+		fields[i] = comma + 1;
+	}
+	
+	*name = line;
+	int64_t from = strtoll(fields[0], NULL, 10);
+	int64_t until = strtoll(fields[1], NULL, 10);
+	long step = strtol(fields[2], NULL, 10);
+	
+	if (step <= 0 || until <= from) {
+		return 0;
+	}
+	
+	series->from = from;
+	series->step = step;
+	series->count = (until - from) / step;
+	if (_murmur_series_alloc(series, series->count) != 0) {
+		return -1;
+	}
+	
+	char *curr = bar + 1;
+	for (uint32_t i = 0; i < series->count; i++) {
+		char *end = curr;
+		series->values[i] = NAN;
+		
+		if (*curr != '\0' && strncmp(curr, "None", 4) != 0) {
+			series->values[i] = strtod(curr, &end);
+		}
+		
+		curr = strchr(end, ',');
+		if (curr == NULL) {
+			// Short lines are missing their trailing points
+			for (uint32_t j = i + 1; j < series->count; j++) {
+				series->values[j] = NAN;
+			}
+			break;
+		}
+		curr++;
+	}
+	
+	return 0;
+}
+
+int murmur_store_fetch(struct murmur_store *store, const char *name, const int64_t from, const int64_t until, struct murmur_series *series) {
+	memset(series, 0, sizeof(*series));
+	
+	struct _murmur_store_hold hold;
+	_murmur_store_hold(store, &hold);
+	
+	int ret = -1;
+	struct murmur *mmr = murmur_store_handle(store, name, 0);
+	if (mmr != NULL && murmur_fetch(mmr, from, until, series) == 0) {
+		_murmur_parts_overlay(store->parts, name, series);
+		_murmur_mem_overlay(store->mem, mmr, name, series);
+		ret = 0;
+	}
+	
+	_murmur_store_release(store, &hold);
+	return ret;
+}
+
+/**
+ * How many bytes of points a socket subscription collects before sending them early.
+ */
+#define MURMUR_SUB_BATCH 65536
+
+/**
+ * How many bytes a socket subscription may have waiting for a slow consumer before newer points
+ * are dropped.
+ */
+#define MURMUR_SUB_MAX_BUFFER (1 << 20)
+
+struct _murmur_sub {
+	int id;
+	char *pattern;
+	
+	/**
+	 * Called with each point, for a callback subscription.
+	 */
+	murmur_sub_cb cb;
+	void *ctx;
+	
+	/**
+	 * Where points are sent, as plaintext lines, for a socket subscription. -1 otherwise.
+	 */
+	int fd;
+	
+	/**
+	 * Lines waiting to be sent.
+	 */
+	struct _murmur_buff b;
+};
+
+struct _murmur_subs {
+	/**
+	 * Every subscription, in the order made.
+	 */
+	struct _murmur_sub *subs;
+	uint32_t count;
+	uint32_t alloc;
+	
+	/**
+	 * Every subscription's pattern, compiled in the same order. NULL when there are none.
+	 */
+	struct _murmur_dfa *dfa;
+	
+	int next_id;
+	
+	/**
+	 * How many points have been dropped for consumers that couldn't keep up.
+	 */
+	uint64_t dropped;
+	
+	pthread_mutex_t lock;
+};
+
+static struct _murmur_subs* _murmur_subs_new() {
+	struct _murmur_subs *subs = calloc(1, sizeof(*subs));
+	if (subs == NULL) {
+		M_PERROR("Could not allocate subscriptions");
+		return NULL;
+	}
+	
+	subs->next_id = 1;
+	pthread_mutex_init(&subs->lock, NULL);
+	
+	return subs;
+}
+
+/**
+ * Compiles every subscription's pattern again, after one has been added or removed.
+ */
+static int _murmur_subs_compile(struct _murmur_subs *subs) {
+	struct _murmur_dfa *dfa = NULL;
+	
+	if (subs->count > 0) {
+		const char **patv = malloc(subs->count * sizeof(*patv));
+		if (patv == NULL) {
+			M_PERROR("Could not compile subscriptions");
+			return -1;
+		}
+		
+		for (uint32_t i = 0; i < subs->count; i++) {
+			patv[i] = subs->subs[i].pattern;
+		}
+		
+		dfa = _murmur_dfa_compile(subs->count, patv);
+		free(patv);
+		
+		if (dfa == NULL) {
+			return -1;
+		}
+	}
+	
+	_murmur_dfa_free(subs->dfa);
+	subs->dfa = dfa;
+	
+	return 0;
+}
+
+static void _murmur_sub_close(struct _murmur_sub *sub) {
+	if (sub->fd != -1) {
+		close(sub->fd);
+	}
+	
+	free(sub->pattern);
+	free(sub->b.data);
+}
+
+/**
+ * Removes a subscription, with the lock held.
+ */
+static void _murmur_subs_remove(struct _murmur_subs *subs, const uint32_t i) {
+	_murmur_sub_close(subs->subs + i);
+	memmove(subs->subs + i, subs->subs + i + 1, (subs->count - i - 1) * sizeof(*subs->subs));
+	subs->count--;
+	
+	if (_murmur_subs_compile(subs) != 0) {
+		M_ERROR("Could not recompile subscriptions, dropping all of them");
+		
+		for (uint32_t j = 0; j < subs->count; j++) {
+			_murmur_sub_close(subs->subs + j);
+		}
+		subs->count = 0;
+		
+		_murmur_dfa_free(subs->dfa);
+		subs->dfa = NULL;
+	}
+}
+
+static int _murmur_subs_add(struct murmur_store *store, const char *pattern, murmur_sub_cb cb, void *ctx, const int fd) {
+	struct _murmur_subs *subs = store->subs;
+	int id = -1;
+	
+	pthread_mutex_lock(&subs->lock);
+	
+	if (subs->count == subs->alloc) {
+		uint32_t alloc = subs->alloc == 0 ? 8 : subs->alloc * 2;
+		struct _murmur_sub *s = realloc(subs->subs, alloc * sizeof(*s));
+		if (s == NULL) {
+			M_PERROR("Could not add subscription");
+			goto done;
+		}
+		subs->subs = s;
+		subs->alloc = alloc;
+	}
+	
+	struct _murmur_sub *sub = subs->subs + subs->count;
+	memset(sub, 0, sizeof(*sub));
+	sub->pattern = strdup(pattern);
+	sub->cb = cb;
+	sub->ctx = ctx;
+	sub->fd = fd;
+	
+	if (sub->pattern == NULL) {
+		M_PERROR("Could not add subscription");
+		goto done;
+	}
+	
+	subs->count++;
+	
+	if (_murmur_subs_compile(subs) != 0) {
+		M_ERROR("Invalid subscription pattern: %s", pattern);
+		subs->count--;
+		free(sub->pattern);
+		goto done;
+	}
+	
+	sub->id = id = subs->next_id++;
+	
+done:
+	pthread_mutex_unlock(&subs->lock);
+	return id;
+}
+
+int murmur_store_subscribe(struct murmur_store *store, const char *pattern, murmur_sub_cb cb, void *ctx) {
+	return _murmur_subs_add(store, pattern, cb, ctx, -1);
+}
+
+int murmur_store_subscribe_fd(struct murmur_store *store, const char *pattern, const int fd) {
+	int id = _murmur_subs_add(store, pattern, NULL, NULL, fd);
+	if (id == -1) {
+		close(fd);
+	}
+	
+	return id;
+}
+
+int murmur_store_unsubscribe(struct murmur_store *store, const int id) {
+	struct _murmur_subs *subs = store->subs;
+	int ret = -1;
+	
+	pthread_mutex_lock(&subs->lock);
+	
+	for (uint32_t i = 0; i < subs->count; i++) {
+		if (subs->subs[i].id == id) {
+			_murmur_subs_remove(subs, i);
+			ret = 0;
+			break;
+		}
+	}
+	
+	pthread_mutex_unlock(&subs->lock);
+	return ret;
+}
+
+/**
+ * Sends as much of what a socket subscription has waiting as its consumer will take, without
+ * waiting on it.
+ *
+ * @return 0 if the consumer is still there, -1 if it's gone.
+ */
+static int _murmur_sub_send(struct _murmur_sub *sub) {
+	size_t sent = 0;
+	
+	while (sent < sub->b.len) {
+		ssize_t s = send(sub->fd, sub->b.data + sent, sub->b.len - sent, MSG_DONTWAIT|MSG_NOSIGNAL);
+		if (s == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			
+			M_DEBUG("Subscriber for %s went away: %s", sub->pattern, strerror(errno));
+			return -1;
+		}
+		
+		sent += s;
+	}
+	
+	sub->b.len -= sent;
+	memmove(sub->b.data, sub->b.data + sent, sub->b.len);
+	
+	return 0;
+}
+
+/**
+ * Sends what every socket subscription has collected, dropping those whose consumer is gone.
+ */
+static void _murmur_subs_send(struct _murmur_subs *subs) {
+	if (__atomic_load_n(&subs->count, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+	
+	pthread_mutex_lock(&subs->lock);
+	
+	for (uint32_t i = subs->count; i > 0; i--) {
+		struct _murmur_sub *sub = subs->subs + i - 1;
+		if (sub->fd != -1 && _murmur_sub_send(sub) != 0) {
+			_murmur_subs_remove(subs, i - 1);
+		}
+	}
+	
+	pthread_mutex_unlock(&subs->lock);
+}
+
+/**
+ * Hands a point that was just written to every subscription whose pattern matches its name.
+ * Finding them costs one run of the automaton, however many subscriptions there are.
+ */
+static void _murmur_subs_notify(struct _murmur_subs *subs, const char *name, const int64_t timestamp, const double value) {
+	if (__atomic_load_n(&subs->count, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+	
+	pthread_mutex_lock(&subs->lock);
+	
+	const uint32_t *accepts;
+	uint32_t matched = subs->dfa == NULL ? 0 : _murmur_dfa_match_all(subs->dfa, name, strlen(name), &accepts);
+	
+	for (uint32_t i = 0; i < matched; i++) {
+		struct _murmur_sub *sub = subs->subs + accepts[i];
+		
+		if (sub->cb != NULL) {
+			sub->cb(sub->ctx, name, timestamp, value);
+			continue;
+		}
+		
+		if (sub->b.len >= MURMUR_SUB_MAX_BUFFER) {
+			subs->dropped++;
+			continue;
+		}
+		
+		_murmur_buff_printf(&sub->b, "%s %.17g %ld\n", name, value, timestamp);
+		
+		// Sent early, without waiting on the consumer
+		if (sub->b.len >= MURMUR_SUB_BATCH) {
+			_murmur_sub_send(sub);
+		}
+	}
+	
+	pthread_mutex_unlock(&subs->lock);
+}
+
+static void _murmur_subs_free(struct _murmur_subs *subs) {
+	if (subs == NULL) {
+		return;
+	}
+	
+	for (uint32_t i = 0; i < subs->count; i++) {
+		_murmur_sub_close(subs->subs + i);
+	}
+	
+	_murmur_dfa_free(subs->dfa);
+	pthread_mutex_destroy(&subs->lock);
+	free(subs->subs);
+	free(subs);
+}
+
+/**
+ * Answers a "fetch NAME FROM UNTIL" line with the series in raw format. The reply is queued on
+ * the client, so a client that's slow to read it doesn't hold up the other connections.
+ */
+static int _murmur_store_on_fetch(struct murmur_store *store, struct _murmur_line_client *c, char *line) {
+	char *save = NULL;
+	strtok_r(line, " \t", &save);
+	char *name = strtok_r(NULL, " \t", &save);
+	char *from = strtok_r(NULL, " \t", &save);
+	char *until = strtok_r(NULL, " \t", &save);
+	
+	if (name == NULL || from == NULL || until == NULL) {
+		M_WARN("Ignoring malformed fetch");
+		return -1;
+	}
+	
+	struct murmur_series series;
+	struct _murmur_buff b = { NULL, 0, 0 };
+	
+	int found = murmur_store_fetch(store, name, strtoll(from, NULL, 10), strtoll(until, NULL, 10), &series) == 0;
+	
+	int ret = _murmur_format_raw(&b, name, found ? &series : NULL);
+	if (ret == 0) {
+		ret = _murmur_line_reply(c, b.data, b.len);
+	}
+	
+	murmur_series_free(&series);
+	free(b.data);
+	
+	return ret;
+}
+
+/**
+ * A piece of a response waiting to be sent.
+ */
+struct _murmur_http_chunk {
+	struct _murmur_http_chunk *next;
+	size_t len;
+	size_t sent;
+	char data[];
+};
+
+/**
+ * A client connection to the query server.
+ */
+struct _murmur_http_conn {
+	int fd;
+	
+	/**
+	 * Requests received but not yet handled. Only touched by the event loop.
+	 */
+	struct _murmur_buff in;
+	
+	/**
+	 * If a worker currently owns a request on this connection. Only touched by the event loop.
+	 */
+	int responding;
+	
+	/**
+	 * If the connection should be closed after the current response.
+	 */
+	int close_after;
+	
+	/**
+	 * If the client went away while a worker was responding.
+	 */
+	int dead;
+	
+	/**
+	 * Guards out and done, which workers fill in.
+	 */
+	pthread_mutex_t lock;
+	struct _murmur_http_chunk *out_head;
+	struct _murmur_http_chunk *out_tail;
+	int done;
+	
+	/**
+	 * Linked list of connections with something new to send, guarded by the server's lock.
+	 */
+	int dirty;
+	struct _murmur_http_conn *dirty_next;
+	
+	/**
+	 * If the connection is done with and should be freed once the current events are handled.
+	 */
+	int closed;
+	
+	/**
+	 * Every open connection, so they can be cleaned up when the server stops.
+	 */
+	struct _murmur_http_conn *prev;
+	struct _murmur_http_conn *next;
+};
+
+/**
+ * A request waiting for a worker.
+ */
+struct _murmur_http_job {
+	struct _murmur_http_job *next;
+	struct _murmur_http_conn *conn;
+	
+	/**
+	 * The request's method and target, like "GET" and "/render?target=a.b".
+	 */
+	char *method;
+	char *target;
+};
+
+/**
+ * The query server.
+ */
+struct _murmur_server {
+	struct murmur_store *store;
+	struct murmur_serve_opts opts;
+	
+	int epfd;
+	int evfd;
+	
+	/**
+	 * Guards everything below.
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	
+	struct _murmur_http_job *jobs_head;
+	struct _murmur_http_job *jobs_tail;
+	
+	struct _murmur_http_conn *dirty;
+	
+	int stopping;
+	
+	/**
+	 * The total cost of renders being read right now, and where renders wait for it to drop.
+	 */
+	uint64_t inflight_bytes;
+	pthread_cond_t budget;
+	
+	/**
+	 * Every connection, only touched by the event loop.
+	 */
+	struct _murmur_http_conn *conns;
+};
+
+/**
+ * What a response is being built for.
+ */
+struct _murmur_http_response {
+	struct _murmur_server *server;
+	struct _murmur_http_conn *conn;
+	
+	/**
+	 * Output collected until it's big enough to send as a chunk.
+	 */
+	struct _murmur_buff b;
+};
+
+/**
+ * Tells the event loop a connection has something to send. Once a response is marked done, the
+ * event loop may free the connection at any time, so it's marked under the server's lock, and
+ * the connection isn't touched again.
+ */
+static void _murmur_http_wake(struct _murmur_server *server, struct _murmur_http_conn *conn, const int done) {
+	pthread_mutex_lock(&server->lock);
+	
+	if (done) {
+		pthread_mutex_lock(&conn->lock);
+		conn->done = 1;
+		pthread_mutex_unlock(&conn->lock);
+	}
+	
+	if (!conn->dirty) {
+		conn->dirty = 1;
+		conn->dirty_next = server->dirty;
+		server->dirty = conn;
+	}
+	pthread_mutex_unlock(&server->lock);
+	
+	uint64_t one = 1;
+	if (write(server->evfd, &one, sizeof(one)) != sizeof(one)) {
+		M_PERROR("Could not wake query server");
+	}
+}
+
+/**
+ * Queues bytes on a connection, exactly as given.
+ */
+static void _murmur_http_send_raw(struct _murmur_http_response *r, const char *data, const size_t len, const int done) {
+	struct _murmur_http_chunk *chunk = NULL;
+	
+	if (len > 0) {
+		chunk = malloc(sizeof(*chunk) + len);
+		if (chunk == NULL) {
+			M_PERROR("Could not allocate response");
+			return;
+		}
+		
+		chunk->next = NULL;
+		chunk->len = len;
+		chunk->sent = 0;
+		memcpy(chunk->data, data, len);
+	}
+	
+	struct _murmur_http_conn *conn = r->conn;
+	pthread_mutex_lock(&conn->lock);
+	
+	if (chunk != NULL) {
+		if (conn->out_tail == NULL) {
+			conn->out_head = chunk;
+		} else {
+			conn->out_tail->next = chunk;
+		}
+		conn->out_tail = chunk;
+	}
+	
+	pthread_mutex_unlock(&conn->lock);
+	
+	_murmur_http_wake(r->server, conn, done);
+}
+
+/**
+ * Sends whatever has been built up as a single chunk of a chunked response.
+ */
+static void _murmur_http_flush(struct _murmur_http_response *r) {
+	if (r->b.len == 0) {
+		return;
+	}
+	
+	char head[32];
+	int head_len = snprintf(head, sizeof(head), "%zx\r\n", r->b.len);
+	
+	struct _murmur_buff chunk = { NULL, 0, 0 };
+	if (_murmur_buff_append(&chunk, head, head_len) == 0 &&
+		_murmur_buff_append(&chunk, r->b.data, r->b.len) == 0 &&
+		_murmur_buff_append(&chunk, "\r\n", 2) == 0) {
+		_murmur_http_send_raw(r, chunk.data, chunk.len, 0);
+	}
+	
+	free(chunk.data);
+	r->b.len = 0;
+}
+
+/**
+ * Sends whatever has been built up once it's big enough to be worth it.
+ */
+static void _murmur_http_maybe_flush(struct _murmur_http_response *r) {
+	if (r->b.len >= 16 * 1024) {
+		_murmur_http_flush(r);
+	}
+}
+
+/**
+ * Starts a streamed (chunked) response.
+ *
+ * @param headers Any extra headers, each ending in "\r\n".
+ */
+static void _murmur_http_begin(struct _murmur_http_response *r, const char *content_type, const char *headers) {
+	char head[512];
+	int len = snprintf(head, sizeof(head),
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: %s\r\n"
+		"Transfer-Encoding: chunked\r\n"
+		"%s"
+		"%s"
+		"\r\n",
+		content_type,
+		headers,
+		r->conn->close_after ? "Connection: close\r\n" : "");
+	
+	_murmur_http_send_raw(r, head, len, 0);
+}
+
+/**
+ * Finishes a streamed response.
+ */
+static void _murmur_http_end(struct _murmur_http_response *r) {
+	_murmur_http_flush(r);
+	_murmur_http_send_raw(r, "0\r\n\r\n", 5, 1);
+}
+
+/**
+ * Sends a complete, non-streamed error response.
+ */
+static void _murmur_http_error(struct _murmur_http_response *r, const int status, const char *reason) {
+	char resp[512];
+	int len = snprintf(resp, sizeof(resp),
+		"HTTP/1.1 %d %s\r\n"
+		"Content-Type: text/plain\r\n"
+		"Content-Length: %zu\r\n"
+		"%s"
+		"\r\n"
+		"%s\n",
+		status, reason,
+		strlen(reason) + 1,
+		r->conn->close_after ? "Connection: close\r\n" : "",
+		reason);
+	
+	_murmur_http_send_raw(r, resp, len, 1);
+}
+
+/**
+ * Decodes a URL-encoded string in place.
+ */
+static void _murmur_url_decode(char *str) {
+	char *out = str;
+	for (char *c = str; *c != '\0'; c++) {
+		if (*c == '+') {
+			*out++ = ' ';
+		} else if (*c == '%' && isxdigit((unsigned char)c[1]) && isxdigit((unsigned char)c[2])) {
+			char hex[3] = { c[1], c[2], '\0' };
+			*out++ = strtol(hex, NULL, 16);
+			c += 2;
+		} else {
+			*out++ = *c;
+		}
+	}
+	
+	*out = '\0';
+}
+
+/**
+ * Parses a time the way graphite does: "now", a unix timestamp, or relative to now, like "-1h"
+ * or "-30min".
+ *
+ * @return 0 on success, -1 if it's not understood.
+ */
+static int _murmur_parse_time(const char *str, const int64_t now, int64_t *out) {
+	if (strcmp(str, "now") == 0) {
+		*out = now;
+		return 0;
+	}
+	
+	char *end;
+	long val = strtol(str, &end, 10);
+	if (end == str) {
+		return -1;
+	}
+	
+	if (*end == '\0') {
+		*out = val;
+		return 0;
+	}
+	
+	if (*str != '-' && *str != '+') {
+		return -1;
+	}
+	
+	if (_murmur_spec_to_seconds(&val, end, 0) != 0) {
+		return -1;
+	}
+	
+	*out = now + val;
+	return 0;
+}
+
+/**
+ * The parameters of a query.
+ */
+struct _murmur_http_query {
+	const char *targets[MURMUR_HTTP_TARGETS_MAX];
+	uint32_t target_count;
+	
+	const char *from;
+	const char *until;
+	const char *format;
+	const char *query;
+	const char *max_points;
+	const char *downsample;
+};
+
+/**
+ * Splits a query string into its parameters, decoding them in place.
+ */
+static int _murmur_http_parse_query(char *qs, struct _murmur_http_query *q) {
+	memset(q, 0, sizeof(*q));
+	
+	char *save = NULL;
+	for (char *param = strtok_r(qs, "&", &save); param != NULL; param = strtok_r(NULL, "&", &save)) {
+		char *eq = strchr(param, '=');
+		if (eq == NULL) {
+			continue;
+		}
+		
+		*eq = '\0';
+		char *value = eq + 1;
+		_murmur_url_decode(param);
+		_murmur_url_decode(value);
+		
+		if (strcmp(param, "target") == 0) {
+			if (q->target_count == MURMUR_HTTP_TARGETS_MAX) {
+				return -1;
+			}
+			q->targets[q->target_count++] = value;
+		} else if (strcmp(param, "from") == 0) {
+			q->from = value;
+		} else if (strcmp(param, "until") == 0) {
+			q->until = value;
+		} else if (strcmp(param, "format") == 0) {
+			q->format = value;
+		} else if (strcmp(param, "query") == 0) {
+			q->query = value;
+		} else if (strcmp(param, "maxDataPoints") == 0) {
+			q->max_points = value;
+		} else if (strcmp(param, "downsample") == 0) {
+			q->downsample = value;
+		}
+	}
+	
+	return 0;
+}
+
+/**
+ * Writes a string as a JSON string literal.
+ */
+static int _murmur_json_string(struct _murmur_buff *b, const char *str) {
+	if (_murmur_buff_append(b, "\"", 1) != 0) {
+		return -1;
+	}
+	
+	for (const char *c = str; *c != '\0'; c++) {
+		int err;
+		if (*c == '"' || *c == '\\') {
+			char esc[2] = { '\\', *c };
+			err = _murmur_buff_append(b, esc, 2);
+		} else if ((unsigned char)*c < 0x20) {
+			err = _murmur_buff_printf(b, "\\u%04x", *c);
+		} else {
+			err = _murmur_buff_append(b, c, 1);
+		}
+		
+		if (err != 0) {
+			return -1;
+		}
+	}
+	
+	return _murmur_buff_append(b, "\"", 1);
+}
+
+/**
+ * Formats a series for the binary format: the name's length (uint16) and the name, followed
+ * by the first timestamp (int64), step (uint32), count (uint32) and every value as a double.
+ * Everything is little-endian, and missing points are NaN.
+ */
+static int _murmur_format_binary(struct _murmur_buff *b, const char *name, const struct murmur_series *series) {
+	uint16_t name_len = htole16(strlen(name));
+	int64_t from = htole64(series->from);
+	uint32_t step = htole32(series->step);
+	uint32_t count = htole32(series->count);
+	
+	if (_murmur_buff_reserve(b, 2 + strlen(name) + 16 + (series->count * sizeof(double))) != 0) {
+		return -1;
+	}
+	
+	_murmur_buff_append(b, (char*)&name_len, sizeof(name_len));
+	_murmur_buff_append(b, name, strlen(name));
+	_murmur_buff_append(b, (char*)&from, sizeof(from));
+	_murmur_buff_append(b, (char*)&step, sizeof(step));
+	_murmur_buff_append(b, (char*)&count, sizeof(count));
+	
+	for (uint32_t i = 0; i < series->count; i++) {
+		union {
+			double d;
+			uint64_t u;
+		} v = { .d = series->values[i] };
+		
+		v.u = htole64(v.u);
+		_murmur_buff_append(b, (char*)&v.u, sizeof(v.u));
+	}
+	
+	return 0;
+}
+
+/**
+ * Formats a series as a render API JSON object: {"target": ..., "datapoints": [[v, ts], ...]}.
+ */
+static int _murmur_format_json(struct _murmur_buff *b, const char *name, const struct murmur_series *series) {
+	if (_murmur_buff_append(b, "{\"target\":", 10) != 0 ||
+		_murmur_json_string(b, name) != 0 ||
+		_murmur_buff_append(b, ",\"datapoints\":[", 15) != 0) {
+		return -1;
+	}
+	
+	for (uint32_t i = 0; i < series->count; i++) {
+		int64_t at = series->from + ((int64_t)i * series->step);
+		double v = series->values[i];
+		
+		// JSON has no infinities, so they're as good as missing
+		int err = !isfinite(v) ?
+			_murmur_buff_printf(b, "%s[null,%ld]", i == 0 ? "" : ",", at) :
+			_murmur_buff_printf(b, "%s[%.17g,%ld]", i == 0 ? "" : ",", v, at);
+		
+		if (err != 0) {
+			return -1;
+		}
+	}
+	
+	return _murmur_buff_append(b, "]}", 2);
+}
+
+/**
+ * Formats downsampled points like _murmur_format_json(), each at its own time.
+ */
+static int _murmur_format_json_points(struct _murmur_buff *b, const char *name, const struct murmur_points *points) {
+	if (_murmur_buff_append(b, "{\"target\":", 10) != 0 ||
+		_murmur_json_string(b, name) != 0 ||
+		_murmur_buff_append(b, ",\"datapoints\":[", 15) != 0) {
+		return -1;
+	}
+	
+	for (uint32_t i = 0; i < points->count; i++) {
+		double v = points->values[i];
+		
+		int err = !isfinite(v) ?
+			_murmur_buff_printf(b, "%s[null,%ld]", i == 0 ? "" : ",", points->timestamps[i]) :
+			_murmur_buff_printf(b, "%s[%.17g,%ld]", i == 0 ? "" : ",", v, points->timestamps[i]);
+		
+		if (err != 0) {
+			return -1;
+		}
+	}
+	
+	return _murmur_buff_append(b, "]}", 2);
+}
+
+/**
+ * Collects the metrics a render target expands to.
+ */
+static void _murmur_http_on_expand(void *ctx, const char *name, const int leaf) {
+	struct _murmur_names *names = ctx;
+	
+	if (leaf) {
+		_murmur_names_add(names, name, strlen(name));
+	}
+}
+
+/**
+ * Waits until there's room in the server's budget for a render to read.
+ *
+ * @return 0 once there's room, -1 if the wait timed out or the server is stopping.
+ */
+static int _murmur_http_admit(struct _murmur_server *server, const uint64_t cost) {
+	const struct murmur_serve_opts *opts = &server->opts;
+	if (opts->max_inflight_bytes == 0) {
+		return 0;
+	}
+	
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += opts->queue_timeout_ms / 1000;
+	deadline.tv_nsec += (opts->queue_timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	
+	int ret = 0;
+	pthread_mutex_lock(&server->lock);
+	
+	// Something bigger than the whole budget still gets to run, just alone
+	while (ret == 0 && server->inflight_bytes > 0 && server->inflight_bytes + cost > opts->max_inflight_bytes) {
+		if (server->stopping) {
+			ret = -1;
+		} else if (opts->queue_timeout_ms == 0) {
+			pthread_cond_wait(&server->budget, &server->lock);
+		} else if (pthread_cond_timedwait(&server->budget, &server->lock, &deadline) == ETIMEDOUT) {
+			ret = -1;
+		}
+	}
+	
+	if (ret == 0) {
+		server->inflight_bytes += cost;
+	}
+	
+	pthread_mutex_unlock(&server->lock);
+	
+	return ret;
+}
+
+static void _murmur_http_release(struct _murmur_server *server, const uint64_t cost) {
+	if (server->opts.max_inflight_bytes == 0) {
+		return;
+	}
+	
+	pthread_mutex_lock(&server->lock);
+	server->inflight_bytes -= cost;
+	pthread_cond_broadcast(&server->budget);
+	pthread_mutex_unlock(&server->lock);
+}
+
+/**
+ * Finds the most precise step a render can read at while staying within a budget. Only the
+ * steps archives actually have are tried.
+ *
+ * @param[out] cost What reading at the chosen step costs.
+ *
+ * @return The step, 0 if the most precise archives already fit.
+ */
+static uint32_t _murmur_http_downsample(struct murmur **mmrs, const uint32_t count, const int64_t from, const int64_t until, const uint64_t budget, uint64_t *cost) {
+	uint32_t steps[64];
+	uint32_t step_count = 0;
+	
+	for (uint32_t i = 0; i < count; i++) {
+		for (uint32_t a = 0; mmrs[i] != NULL && a < mmrs[i]->archive_count; a++) {
+			uint32_t step = mmrs[i]->archives[a].seconds_per_point;
+			
+			uint32_t j = 0;
+			while (j < step_count && steps[j] < step) {
+				j++;
+			}
+			
+			if ((j < step_count && steps[j] == step) || step_count == sizeof(steps) / sizeof(*steps)) {
+				continue;
+			}
+			
+			memmove(steps + j + 1, steps + j, (step_count - j) * sizeof(*steps));
+			steps[j] = step;
+			step_count++;
+		}
+	}
+	
+	uint32_t step = 0;
+	for (uint32_t s = 0; s < step_count; s++) {
+		step = steps[s];
+		
+		*cost = 0;
+		for (uint32_t i = 0; i < count; i++) {
+			if (mmrs[i] != NULL) {
+				*cost += murmur_fetch_cost(mmrs[i], from, until, step);
+			}
+		}
+		
+		if (*cost <= budget) {
+			break;
+		}
+	}
+	
+	return step;
+}
+
+/**
+ * Handles /render: expands every target, decides whether the whole thing can be afforded, then
+ * fetches each metric and streams it as soon as it's read.
+ */
+static void _murmur_http_render(struct _murmur_http_response *r, struct _murmur_http_query *q) {
+	struct _murmur_server *server = r->server;
+	const struct murmur_serve_opts *opts = &server->opts;
+	
+	// Everything here only lasts as long as the request
+	struct _murmur_arena_mark mark = _murmur_arena_mark();
+	struct _murmur_names names = { NULL, 0, 0, 1 };
+	struct murmur **mmrs = NULL;
+	struct _murmur_store_hold hold;
+	
+	int64_t now = time(NULL);
+	int64_t from = now - (24 * 60 * 60);
+	int64_t until = now;
+	
+	if ((q->from != NULL && _murmur_parse_time(q->from, now, &from) != 0) ||
+		(q->until != NULL && _murmur_parse_time(q->until, now, &until) != 0) ||
+		from > until) {
+		_murmur_http_error(r, 400, "Bad Request");
+		return;
+	}
+	
+	enum { fmt_json, fmt_raw, fmt_binary } fmt = fmt_json;
+	if (q->format == NULL || strcmp(q->format, "json") == 0) {
+		fmt = fmt_json;
+	} else if (strcmp(q->format, "raw") == 0) {
+		fmt = fmt_raw;
+	} else if (strcmp(q->format, "binary") == 0) {
+		fmt = fmt_binary;
+	} else {
+		_murmur_http_error(r, 400, "Bad Request");
+		return;
+	}
+	
+	enum murmur_downsample ds = 0;
+	uint32_t width = 0;
+	if (q->downsample != NULL) {
+		if (strcmp(q->downsample, "m4") == 0) {
+			ds = ds_m4;
+		} else if (strcmp(q->downsample, "lttb") == 0) {
+			ds = ds_lttb;
+		}
+		
+		char *end = NULL;
+		long w = q->max_points == NULL ? 0 : strtol(q->max_points, &end, 10);
+		
+		// Only JSON has room for points at their own times
+		if (ds == 0 || fmt != fmt_json || w <= 0 || w > UINT32_MAX || *end != '\0') {
+			_murmur_http_error(r, 400, "Bad Request");
+			return;
+		}
+		
+		width = w < MURMUR_HTTP_MAX_POINTS ? w : MURMUR_HTTP_MAX_POINTS;
+	}
+	
+	for (uint32_t i = 0; i < q->target_count; i++) {
+		const char *target = q->targets[i];
+		
+		if (_murmur_glob_is_literal(target, strlen(target))) {
+			_murmur_names_add(&names, target, strlen(target));
+		} else {
+			murmur_store_find(server->store, target, _murmur_http_on_expand, &names);
+		}
+		
+		if (opts->max_series > 0 && names.count > opts->max_series) {
+			_murmur_http_error(r, 413, "Too Many Series");
+			goto done;
+		}
+	}
+	
+	mmrs = _murmur_arena_alloc((names.count + 1) * sizeof(*mmrs));
+	if (mmrs == NULL) {
+		_murmur_http_error(r, 500, "Internal Server Error");
+		goto done;
+	}
+	
+	_murmur_store_hold(server->store, &hold);
+	
+	uint64_t cost = 0;
+	for (uint32_t i = 0; i < names.count; i++) {
+		mmrs[i] = murmur_store_handle(server->store, names.names[i], 0);
+		if (mmrs[i] != NULL) {
+			cost += murmur_fetch_cost(mmrs[i], from, until, 0);
+		}
+	}
+	
+	uint32_t step = 0;
+	if (opts->downsample_bytes > 0 && cost > opts->downsample_bytes) {
+		step = _murmur_http_downsample(mmrs, names.count, from, until, opts->downsample_bytes, &cost);
+	}
+	
+	if (opts->max_query_bytes > 0 && cost > opts->max_query_bytes) {
+		_murmur_http_error(r, 413, "Query Too Expensive");
+		goto done;
+	}
+	
+	if (_murmur_http_admit(server, cost) != 0) {
+		_murmur_http_error(r, 503, "Service Unavailable");
+		goto done;
+	}
+	
+	static const char * const CONTENT_TYPES[] = {
+		"application/json",
+		"text/plain",
+		"application/octet-stream",
+	};
+	
+	char headers[128];
+	snprintf(headers, sizeof(headers), "X-Murmur-Cost: %lu\r\nX-Murmur-Step: %u\r\n", cost, step);
+	
+	_murmur_http_begin(r, CONTENT_TYPES[fmt], headers);
+	
+	if (fmt == fmt_json) {
+		_murmur_buff_append(&r->b, "[", 1);
+	}
+	
+	uint32_t written = 0;
+	for (uint32_t i = 0; i < names.count; i++) {
+		struct murmur_series series;
+		if (mmrs[i] == NULL || murmur_fetch_step(mmrs[i], from, until, step, &series) != 0) {
+			continue;
+		}
+		_murmur_parts_overlay(server->store->parts, names.names[i], &series);
+		_murmur_mem_overlay(server->store->mem, mmrs[i], names.names[i], &series);
+		
+		switch (fmt) {
+			case fmt_json:
+				if (written > 0) {
+					_murmur_buff_append(&r->b, ",", 1);
+				}
+				if (ds == 0) {
+					_murmur_format_json(&r->b, names.names[i], &series);
+				} else {
+					struct murmur_points points;
+					if (_murmur_downsample(&series, ds, width, &points) == 0) {
+						_murmur_format_json_points(&r->b, names.names[i], &points);
+					} else {
+						_murmur_format_json(&r->b, names.names[i], &series);
+					}
+					murmur_points_free(&points);
+				}
+				break;
+			
+			case fmt_raw:
+				_murmur_format_raw(&r->b, names.names[i], &series);
+				break;
+			
+			case fmt_binary:
+				_murmur_format_binary(&r->b, names.names[i], &series);
+				break;
+		}
+		
+		written++;
+		murmur_series_free(&series);
+		_murmur_http_maybe_flush(r);
+	}
+	
+	if (fmt == fmt_json) {
+		_murmur_buff_append(&r->b, "]", 1);
+	}
+	
+	_murmur_http_end(r);
+	_murmur_http_release(server, cost);
+	
+done:
+	if (mmrs != NULL) {
+		_murmur_store_release(server->store, &hold);
+	}
+	
+	_murmur_names_free(&names);
+	_murmur_arena_release(mark);
+}
+
+/**
+ * Collects the results of a find into a response.
+ */
+struct _murmur_http_find {
+	struct _murmur_http_response *r;
+	uint32_t found;
+};
+
+static void _murmur_http_on_find(void *ctx, const char *name, const int leaf) {
+	struct _murmur_http_find *f = ctx;
+	struct _murmur_buff *b = &f->r->b;
+	const char *text = strrchr(name, '.');
+	
+	if (f->found++ > 0) {
+		_murmur_buff_append(b, ",", 1);
+	}
+	
+	_murmur_buff_append(b, "{\"text\":", 8);
+	_murmur_json_string(b, text == NULL ? name : text + 1);
+	_murmur_buff_append(b, ",\"id\":", 6);
+	_murmur_json_string(b, name);
+	_murmur_buff_printf(b, ",\"leaf\":%d,\"expandable\":%d}", leaf, !leaf);
+	
+	_murmur_http_maybe_flush(f->r);
+}
+
+/**
+ * Handles /metrics/find: lists every metric and directory matching a query.
+ */
+static void _murmur_http_find(struct _murmur_http_response *r, struct _murmur_http_query *q) {
+	if (q->query == NULL || *q->query == '\0') {
+		_murmur_http_error(r, 400, "Bad Request");
+		return;
+	}
+	
+	struct _murmur_http_find f = { r, 0 };
+	
+	_murmur_http_begin(r, "application/json", "");
+	_murmur_buff_append(&r->b, "[", 1);
+	murmur_store_find(r->server->store, q->query, _murmur_http_on_find, &f);
+	_murmur_buff_append(&r->b, "]", 1);
+	_murmur_http_end(r);
+}
+
+/**
+ * Runs a request on a worker.
+ */
+static void _murmur_http_handle(struct _murmur_server *server, struct _murmur_http_job *job) {
+	struct _murmur_http_response r = {
+		.server = server,
+		.conn = job->conn,
+		.b = { NULL, 0, 0 },
+	};
+	
+	if (strcmp(job->method, "GET") != 0) {
+		_murmur_http_error(&r, 405, "Method Not Allowed");
+		return;
+	}
+	
+	char *qs = strchr(job->target, '?');
+	if (qs != NULL) {
+		*qs++ = '\0';
+	}
+	
+	struct _murmur_http_query q;
+	if (_murmur_http_parse_query(qs == NULL ? "" : qs, &q) != 0) {
+		_murmur_http_error(&r, 400, "Bad Request");
+	} else if (strcmp(job->target, "/render") == 0) {
+		_murmur_http_render(&r, &q);
+	} else if (strcmp(job->target, "/metrics/find") == 0) {
+		_murmur_http_find(&r, &q);
+	} else {
+		_murmur_http_error(&r, 404, "Not Found");
+	}
+	
+	free(r.b.data);
+}
+
+static void* _murmur_http_worker(void *arg) {
+	struct _murmur_server *server = arg;
+	
+	murmur_io_set_class(io_query);
+	
+	while (1) {
+		pthread_mutex_lock(&server->lock);
+		while (server->jobs_head == NULL && !server->stopping) {
+			pthread_cond_wait(&server->cond, &server->lock);
+		}
+		
+		struct _murmur_http_job *job = server->jobs_head;
+		if (job == NULL) {
+			pthread_mutex_unlock(&server->lock);
+			break;
+		}
+		
+		server->jobs_head = job->next;
+		if (server->jobs_head == NULL) {
+			server->jobs_tail = NULL;
+		}
+		pthread_mutex_unlock(&server->lock);
+		
+		_murmur_http_handle(server, job);
+		
+		free(job->method);
+		free(job->target);
+		free(job);
+	}
+	
+	return NULL;
+}
+
+static void _murmur_http_conn_free(struct _murmur_server *server, struct _murmur_http_conn *conn) {
+	if (conn->fd != -1) {
+		epoll_ctl(server->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+		close(conn->fd);
+	}
+	
+	pthread_mutex_lock(&server->lock);
+	for (struct _murmur_http_conn **c = &server->dirty; *c != NULL; c = &(*c)->dirty_next) {
+		if (*c == conn) {
+			*c = conn->dirty_next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&server->lock);
+	
+	if (conn->prev == NULL) {
+		server->conns = conn->next;
+	} else {
+		conn->prev->next = conn->next;
+	}
+	
+	if (conn->next != NULL) {
+		conn->next->prev = conn->prev;
+	}
+	
+	struct _murmur_http_chunk *chunk = conn->out_head;
+	while (chunk != NULL) {
+		struct _murmur_http_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	
+	pthread_mutex_destroy(&conn->lock);
+	free(conn->in.data);
+	free(conn);
+}
+
+/**
+ * Hands the next full request on a connection to the workers, if there is one.
+ *
+ * @return 0 on success, -1 if the connection should be closed.
+ */
+static int _murmur_http_dispatch(struct _murmur_server *server, struct _murmur_http_conn *conn) {
+	if (conn->responding || conn->in.len == 0) {
+		return 0;
+	}
+	
+	char *end = memmem(conn->in.data, conn->in.len, "\r\n\r\n", 4);
+	if (end == NULL) {
+		return conn->in.len > MURMUR_HTTP_REQUEST_MAX ? -1 : 0;
+	}
+	
+	*end = '\0';
+	size_t request_len = (end - conn->in.data) + 4;
+	
+	char method[16];
+	char target[MURMUR_LINE_MAX];
+	char version[16];
+	if (sscanf(conn->in.data, "%15s %4095s %15s", method, target, version) != 3) {
+		return -1;
+	}
+	
+	// HTTP/1.1 keeps connections open unless asked not to; 1.0 is the other way around
+	conn->close_after = strcmp(version, "HTTP/1.1") != 0;
+	
+	char *save = NULL;
+	strtok_r(conn->in.data, "\r\n", &save);
+	for (char *h = strtok_r(NULL, "\r\n", &save); h != NULL; h = strtok_r(NULL, "\r\n", &save)) {
+		if (strncasecmp(h, "connection:", 11) != 0) {
+			continue;
+		}
+		
+		if (strcasestr(h + 11, "close") != NULL) {
+			conn->close_after = 1;
+		} else if (strcasestr(h + 11, "keep-alive") != NULL) {
+			conn->close_after = 0;
+		}
+	}
+	
+	conn->in.len -= request_len;
+	memmove(conn->in.data, conn->in.data + request_len, conn->in.len);
+	
+	struct _murmur_http_job *job = malloc(sizeof(*job));
+	if (job == NULL) {
+		return -1;
+	}
+	
+	job->next = NULL;
+	job->conn = conn;
+	job->method = strdup(method);
+	job->target = strdup(target);
+	
+	if (job->method == NULL || job->target == NULL) {
+		free(job->method);
+		free(job->target);
+		free(job);
+		return -1;
+	}
+	
+	conn->responding = 1;
+	
+	pthread_mutex_lock(&server->lock);
+	if (server->jobs_tail == NULL) {
+		server->jobs_head = job;
+	} else {
+		server->jobs_tail->next = job;
+	}
+	server->jobs_tail = job;
+	pthread_cond_signal(&server->cond);
+	pthread_mutex_unlock(&server->lock);
+	
+	return 0;
+}
+
+/**
+ * Sends as much of a connection's response as the socket will take.
+ *
+ * @return 0 on success, -1 if the connection should be closed.
+ */
+static int _murmur_http_conn_write(struct _murmur_server *server, struct _murmur_http_conn *conn) {
+	int blocked = 0;
+	
+	pthread_mutex_lock(&conn->lock);
+	
+	while (conn->out_head != NULL) {
+		struct _murmur_http_chunk *chunk = conn->out_head;
+		
+		if (!conn->dead) {
+			ssize_t s = send(conn->fd, chunk->data + chunk->sent, chunk->len - chunk->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (s == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				blocked = 1;
+				break;
+			}
+			
+			if (s == -1) {
+				conn->dead = 1;
+			} else {
+				chunk->sent += s;
+				if (chunk->sent < chunk->len) {
+					continue;
+				}
+			}
+		}
+		
+		conn->out_head = chunk->next;
+		if (conn->out_head == NULL) {
+			conn->out_tail = NULL;
+		}
+		free(chunk);
+	}
+	
+	int finished = conn->done && conn->out_head == NULL;
+	if (finished) {
+		conn->done = 0;
+	}
+	
+	pthread_mutex_unlock(&conn->lock);
+	
+	if (finished) {
+		conn->responding = 0;
+	}
+	
+	if (conn->dead) {
+		return finished ? -1 : 0;
+	}
+	
+	struct epoll_event ev = {
+		.events = EPOLLIN | (blocked ? EPOLLOUT : 0),
+		.data.ptr = conn,
+	};
+	epoll_ctl(server->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+	
+	if (finished) {
+		if (conn->close_after) {
+			return -1;
+		}
+		
+		return _murmur_http_dispatch(server, conn);
+	}
+	
+	return 0;
+}
+
+/**
+ * Reads everything waiting on a connection.
+ *
+ * @return 0 on success, -1 if the connection should be closed.
+ */
+static int _murmur_http_conn_read(struct _murmur_server *server, struct _murmur_http_conn *conn) {
+	while (1) {
+		if (_murmur_buff_reserve(&conn->in, 4096) != 0) {
+			return -1;
+		}
+		
+		ssize_t got = recv(conn->fd, conn->in.data + conn->in.len, conn->in.alloc - conn->in.len, MSG_DONTWAIT);
+		if (got == 0) {
+			return -1;
+		}
+		
+		if (got == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				break;
+			}
+			return -1;
+		}
+		
+		conn->in.len += got;
+		
+		if (conn->in.len > MURMUR_HTTP_REQUEST_MAX) {
+			return -1;
+		}
+	}
+	
+	return _murmur_http_dispatch(server, conn);
+}
+
+/**
+ * Closes a connection. It's freed after the current batch of events, unless a worker is still
+ * responding on it, in which case it's freed once the worker is done.
+ */
+static void _murmur_http_conn_close(struct _murmur_server *server, struct _murmur_http_conn *conn) {
+	if (conn->fd != -1) {
+		epoll_ctl(server->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+		close(conn->fd);
+		conn->fd = -1;
+	}
+	
+	conn->dead = 1;
+	conn->closed = !conn->responding;
+}
+
+int murmur_serve(struct murmur_store *store, const int fd, const struct murmur_serve_opts *opts, volatile int *stop) {
+	int ret = 0;
+	uint32_t started = 0;
+	uint32_t worker_count = opts == NULL || opts->workers == 0 ? 1 : opts->workers;
+	pthread_t threads[worker_count];
+	
+	struct _murmur_server server;
+	memset(&server, 0, sizeof(server));
+	server.store = store;
+	if (opts != NULL) {
+		server.opts = *opts;
+	}
+	server.epfd = epoll_create1(EPOLL_CLOEXEC);
+	server.evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	pthread_mutex_init(&server.lock, NULL);
+	pthread_cond_init(&server.cond, NULL);
+	pthread_cond_init(&server.budget, NULL);
+	
+	if (server.epfd == -1 || server.evfd == -1) {
+		M_PERROR("Could not set up query server");
+		ret = -1;
+		goto done;
+	}
+	
+	// The listening socket and eventfd are told apart from connections by their data
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	struct epoll_event evev = { .events = EPOLLIN, .data.ptr = &server };
+	if (epoll_ctl(server.epfd, EPOLL_CTL_ADD, fd, &ev) != 0 ||
+		epoll_ctl(server.epfd, EPOLL_CTL_ADD, server.evfd, &evev) != 0) {
+		M_PERROR("Could not set up query server");
+		ret = -1;
+		goto done;
+	}
+	
+	for (; started < worker_count; started++) {
+		if (pthread_create(threads + started, NULL, _murmur_http_worker, &server) != 0) {
+			M_PERROR("Could not start query worker");
+			ret = -1;
+			goto done;
+		}
+	}
+	
+	struct epoll_event events[64];
+	while (!*stop) {
+		int ready = epoll_wait(server.epfd, events, 64, 1000);
+		if (ready == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			M_PERROR("Could not wait for queries");
+			ret = -1;
+			break;
+		}
+		
+		for (int i = 0; i < ready; i++) {
+			void *ptr = events[i].data.ptr;
+			
+			if (ptr == NULL) {
+				int cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+				if (cfd == -1) {
+					continue;
+				}
+				
+				struct _murmur_http_conn *conn = calloc(1, sizeof(*conn));
+				if (conn == NULL) {
+					close(cfd);
+					continue;
+				}
+				
+				conn->fd = cfd;
+				pthread_mutex_init(&conn->lock, NULL);
+				
+				conn->next = server.conns;
+				if (conn->next != NULL) {
+					conn->next->prev = conn;
+				}
+				server.conns = conn;
+				
+				struct epoll_event cev = { .events = EPOLLIN, .data.ptr = conn };
+				epoll_ctl(server.epfd, EPOLL_CTL_ADD, cfd, &cev);
+				
+				continue;
+			}
+			
+			if (ptr == &server) {
+				uint64_t count;
+				if (read(server.evfd, &count, sizeof(count)) != sizeof(count)) {
+					continue;
+				}
+				
+				while (1) {
+					pthread_mutex_lock(&server.lock);
+					struct _murmur_http_conn *dirty = server.dirty;
+					if (dirty != NULL) {
+						server.dirty = dirty->dirty_next;
+						dirty->dirty = 0;
+					}
+					pthread_mutex_unlock(&server.lock);
+					
+					if (dirty == NULL) {
+						break;
+					}
+					
+					if (!dirty->closed && _murmur_http_conn_write(&server, dirty) != 0) {
+						_murmur_http_conn_close(&server, dirty);
+					}
+				}
+				
+				continue;
+			}
+			
+			struct _murmur_http_conn *conn = ptr;
+			int failed = 0;
+			
+			if (conn->closed) {
+				continue;
+			}
+			
+			if (events[i].events & EPOLLOUT) {
+				failed = _murmur_http_conn_write(&server, conn) != 0;
+			}
+			
+			if (!failed && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+				failed = _murmur_http_conn_read(&server, conn) != 0;
+			}
+			
+			if (failed) {
+				_murmur_http_conn_close(&server, conn);
+			}
+		}
+		
+		struct _murmur_http_conn *conn = server.conns;
+		while (conn != NULL) {
+			struct _murmur_http_conn *next = conn->next;
+			if (conn->closed) {
+				_murmur_http_conn_free(&server, conn);
+			}
+			conn = next;
+		}
+	}
+	
+done:
+	pthread_mutex_lock(&server.lock);
+	server.stopping = 1;
+	pthread_cond_broadcast(&server.cond);
+	pthread_cond_broadcast(&server.budget);
+	pthread_mutex_unlock(&server.lock);
+	
+	for (uint32_t i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	
+	// Whatever was queued has been answered, though maybe not sent: clients see a cut-off response
+	while (server.conns != NULL) {
+		_murmur_http_conn_free(&server, server.conns);
+	}
+	
+	if (server.epfd != -1) {
+		close(server.epfd);
+	}
+	
+	if (server.evfd != -1) {
+		close(server.evfd);
+	}
+	
+	pthread_cond_destroy(&server.budget);
+	pthread_cond_destroy(&server.cond);
+	pthread_mutex_destroy(&server.lock);
+	
+	return ret;
+}
+
+/**
+ * Fills the gaps in one series with the points from another, for the same metric from a
+ * different node. The second series is consumed.
+ */
+static void _murmur_series_merge(struct murmur_series *dst, struct murmur_series *src) {
+	if (src->count == 0) {
+		murmur_series_free(src);
+		return;
+	}
+	
+	if (dst->count == 0) {
+		murmur_series_free(dst);
+		*dst = *src;
+		memset(src, 0, sizeof(*src));
+		return;
+	}
+	
+	if (dst->step != src->step) {
+		// Different precisions can't be lined up point by point: keep whichever knows more
+		uint32_t dst_known = 0;
+		uint32_t src_known = 0;
+		for (uint32_t i = 0; i < dst->count; i++) {
+			dst_known += !isnan(dst->values[i]);
+		}
+		for (uint32_t i = 0; i < src->count; i++) {
+			src_known += !isnan(src->values[i]);
+		}
+		
+		if (src_known > dst_known) {
+			struct murmur_series tmp = *dst;
+			*dst = *src;
+			*src = tmp;
+		}
+		
+		murmur_series_free(src);
+		return;
+	}
+	
+	for (uint32_t i = 0; i < dst->count; i++) {
+		if (!isnan(dst->values[i])) {
+			continue;
+		}
+		
+		int64_t at = dst->from + ((int64_t)i * dst->step) - src->from;
+		if (at >= 0 && at % src->step == 0 && at / src->step < src->count) {
+			dst->values[i] = src->values[at / src->step];
+		}
+	}
+	
+	murmur_series_free(src);
+}
+
+/**
+ * A metric being fetched from the cluster.
+ */
+struct _murmur_cluster_metric {
+	/**
+	 * How many nodes have yet to answer for the metric.
+	 */
+	uint32_t pending;
+	
+	/**
+	 * Everything the nodes that have answered know about the metric.
+	 */
+	struct murmur_series series;
+};
+
+/**
+ * A connection to a node that's being asked for metrics.
+ */
+struct _murmur_cluster_conn {
+	/**
+	 * The connection, -1 when finished.
+	 */
+	int fd;
+	int connected;
+	
+	/**
+	 * Every request for the node, and how much has been sent.
+	 */
+	struct _murmur_buff out;
+	size_t sent;
+	
+	/**
+	 * The metrics requested, in the order they were requested (and will be answered).
+	 */
+	uint32_t *metrics;
+	uint32_t metric_count;
+	uint32_t answered;
+	
+	/**
+	 * Answers that haven't been fully received.
+	 */
+	struct _murmur_buff in;
+};
+
+/**
+ * Everything needed while fetching from a cluster.
+ */
+struct _murmur_cluster_fetch {
+	const struct murmur_ring *ring;
+	const char * const *names;
+	struct _murmur_cluster_metric *metrics;
+	struct _murmur_cluster_conn *conns;
+	murmur_fetch_cb cb;
+	void *ctx;
+};
+
+/**
+ * Hands a metric to the caller once every node has answered for it.
+ */
+static void _murmur_cluster_answered(struct _murmur_cluster_fetch *f, const uint32_t metric) {
+	struct _murmur_cluster_metric *m = f->metrics + metric;
+	if (--m->pending > 0) {
+		return;
+	}
+	
+	f->cb(f->ctx, f->names[metric], m->series.count == 0 ? NULL : &m->series);
+	murmur_series_free(&m->series);
+}
+
+static void _murmur_cluster_conn_close(struct _murmur_cluster_fetch *f, struct _murmur_cluster_conn *c, const int failed) {
+	if (failed) {
+		const struct murmur_ring_node *n = f->ring->nodes + (c - f->conns);
+		M_WARN("Fetch from %s:%u failed, %u metrics unanswered", n->host, n->port, c->metric_count - c->answered);
+		
+		for (uint32_t i = c->answered; i < c->metric_count; i++) {
+			_murmur_cluster_answered(f, c->metrics[i]);
+		}
+		c->answered = c->metric_count;
+	}
+	
+	if (c->fd != -1) {
+		close(c->fd);
+		c->fd = -1;
+	}
+}
+
+/**
+ * Reads answers from a node, merging each into its metric.
+ *
+ * @return 0 if the connection is still good, -1 if it failed.
+ */
+static int _murmur_cluster_conn_read(struct _murmur_cluster_fetch *f, struct _murmur_cluster_conn *c) {
+	while (1) {
+		if (_murmur_buff_reserve(&c->in, 64 * 1024) != 0) {
+			return -1;
+		}
+		
+		ssize_t got = recv(c->fd, c->in.data + c->in.len, c->in.alloc - c->in.len, 0);
+		if (got == 0) {
+			return c->answered == c->metric_count ? 0 : -1;
+		}
+		
+		if (got == -1) {
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+		}
+		
+		c->in.len += got;
+		
+		char *start = c->in.data;
+		char *end = c->in.data + c->in.len;
+		char *nl;
+		while ((nl = memchr(start, '\n', end - start)) != NULL && c->answered < c->metric_count) {
+			*nl = '\0';
+			
+			char *name;
+			struct murmur_series series;
+			uint32_t metric = c->metrics[c->answered++];
+			
+			if (_murmur_parse_raw(start, &name, &series) != 0 || strcmp(name, f->names[metric]) != 0) {
+				M_WARN("Node sent a malformed answer for %s", f->names[metric]);
+				murmur_series_free(&series);
+				c->answered--;
+				return -1;
+			}
+			
+			_murmur_series_merge(&f->metrics[metric].series, &series);
+			_murmur_cluster_answered(f, metric);
+			
+			start = nl + 1;
+		}
+		
+		c->in.len = end - start;
+		memmove(c->in.data, start, c->in.len);
+		
+		if (c->answered == c->metric_count) {
+			return 0;
+		}
+	}
+}
+
+int murmur_cluster_fetch(const struct murmur_ring *ring, const char * const *names, const uint32_t count, const int64_t from, const int64_t until, const int timeout_ms, murmur_fetch_cb cb, void *ctx) {
+	int ret = 0;
+	uint32_t nodes[ring->replicas];
+	struct pollfd pfds[ring->node_count + 1];
+	uint32_t pconns[ring->node_count + 1];
+	
+	struct _murmur_cluster_fetch f = {
+		.ring = ring,
+		.names = names,
+		.metrics = calloc(count + 1, sizeof(*f.metrics)),
+		.conns = calloc(ring->node_count + 1, sizeof(*f.conns)),
+		.cb = cb,
+		.ctx = ctx,
+	};
+	
+	if (f.metrics == NULL || f.conns == NULL) {
+		M_PERROR("Could not allocate cluster fetch");
+		free(f.metrics);
+		free(f.conns);
+		return -1;
+	}
+	
+	for (uint32_t i = 0; i < ring->node_count; i++) {
+		f.conns[i].fd = -1;
+	}
+	
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t nodec = murmur_ring_lookup(ring, names[i], nodes);
+		f.metrics[i].pending = nodec + 1;
+		
+		for (uint32_t j = 0; j < nodec; j++) {
+			struct _murmur_cluster_conn *c = f.conns + nodes[j];
+			
+			if ((c->metric_count & (c->metric_count - 1)) == 0) {
+				c->metrics = realloc(c->metrics, (c->metric_count == 0 ? 1 : c->metric_count * 2) * sizeof(*c->metrics));
+			}
+			
+			c->metrics[c->metric_count++] = i;
+			
+			if (_murmur_buff_printf(&c->out, "fetch %s %ld %ld\n", names[i], from, until) != 0) {
+				ret = -1;
+			}
+		}
+	}
+	
+	// Every node is asked at once
+	for (uint32_t i = 0; i < ring->node_count; i++) {
+		struct _murmur_cluster_conn *c = f.conns + i;
+		if (c->metric_count == 0) {
+			continue;
+		}
+		
+		c->fd = _murmur_tcp_connect_start(ring->nodes[i].host, ring->nodes[i].port);
+		if (c->fd == -1) {
+			_murmur_cluster_conn_close(&f, c, 1);
+			ret = -1;
+		}
+	}
+	
+	// Metrics that no node could be asked about are done already
+	for (uint32_t i = 0; i < count; i++) {
+		_murmur_cluster_answered(&f, i);
+	}
+	
+	int64_t deadline = _murmur_now_ms() + timeout_ms;
+	
+	while (1) {
+		uint32_t pfdc = 0;
+		for (uint32_t i = 0; i < ring->node_count; i++) {
+			struct _murmur_cluster_conn *c = f.conns + i;
+			if (c->fd == -1) {
+				continue;
+			}
+			
+			pfds[pfdc].fd = c->fd;
+			pfds[pfdc].events = POLLIN | (c->sent < c->out.len ? POLLOUT : 0);
+			pconns[pfdc] = i;
+			pfdc++;
+		}
+		
+		if (pfdc == 0) {
+			break;
+		}
+		
+		int64_t wait = deadline - _murmur_now_ms();
+		if (wait <= 0) {
+			M_WARN("Cluster fetch timed out");
+			for (uint32_t i = 0; i < pfdc; i++) {
+				_murmur_cluster_conn_close(&f, f.conns + pconns[i], 1);
+			}
+			ret = -1;
+			break;
+		}
+		
+		if (poll(pfds, pfdc, wait) == -1 && errno != EINTR) {
+			M_PERROR("Could not poll nodes");
+		}
+		
+		for (uint32_t i = 0; i < pfdc; i++) {
+			struct _murmur_cluster_conn *c = f.conns + pconns[i];
+			short revents = pfds[i].revents;
+			int failed = 0;
+			
+			if (revents == 0) {
+				continue;
+			}
+			
+			if (!c->connected && (revents & (POLLOUT | POLLERR | POLLHUP))) {
+				int err = 0;
+				socklen_t len = sizeof(err);
+				getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+				
+				failed = err != 0;
+				c->connected = !failed;
+			}
+			
+			if (!failed && c->connected && (revents & POLLOUT) && c->sent < c->out.len) {
+				ssize_t s = send(c->fd, c->out.data + c->sent, c->out.len - c->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+				if (s > 0) {
+					c->sent += s;
+				} else if (s == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+					failed = 1;
+				}
+			}
+			
+			if (!failed && c->connected && (revents & (POLLIN | POLLHUP | POLLERR))) {
+				failed = _murmur_cluster_conn_read(&f, c) != 0;
+			}
+			
+			if (failed) {
+				ret = -1;
+			}
+			
+			if (failed || c->answered == c->metric_count) {
+				_murmur_cluster_conn_close(&f, c, failed);
+			}
+		}
+	}
+	
+	for (uint32_t i = 0; i < ring->node_count; i++) {
+		free(f.conns[i].metrics);
+		free(f.conns[i].out.data);
+		free(f.conns[i].in.data);
+	}
+	
+	free(f.conns);
+	free(f.metrics);
+	
+	return ret;
+}
\ No newline at end of file
@@ -11,6 +11,10 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #if defined(COMPILE_DEBUG)
 	#define M_DEBUG(format, ...) fprintf(stderr, "DEBUG : %s:%-4d : " format "\n", __FILE__, __LINE__, ##__VA_ARGS__)
 	#define M_INFO(format, ...) fprintf(stderr, "INFO : %s:%-4d : " format "\n", __FILE__, __LINE__, ##__VA_ARGS__)
@@ -60,6 +64,13 @@ enum aggregation_method {
 	agg_min = 5,
 };
 
+struct point;
+
+/**
+ * Aggregates points read from disk into a single value.
+ */
+typedef double (*murmur_aggregate_fn)(const struct point *pointsv, const uint64_t pointsc);
+
 /**
  * Information about the archive in the murmur file.
  */
@@ -93,10 +104,69 @@ struct murmur_archive {
 	 * The lower precision archive, below this one. NULL if this is the least-precise.
 	 */
 	struct murmur_archive *lower;
+	
+	/**
+	 * How many points of this archive make up one point of the lower archive. 0 if there is no lower.
+	 */
+	uint32_t ratio;
+	
+	/**
+	 * Aggregates ratio points of this archive into a point of the lower one, chosen when the
+	 * file is opened for its aggregation method and ratio. NULL if there is no lower.
+	 */
+	murmur_aggregate_fn aggregate;
+	
+	/**
+	 * How this archive's points are aggregated from the archive above it.
+	 */
+	enum aggregation_method aggregation;
+	
+	/**
+	 * The next archive at the same precision, fed from the same archive above but aggregated
+	 * differently. NULL if there is none.
+	 *
+	 * Only the first archive at each precision feeds the ones below it and is read by default:
+	 * the rest are only read when their aggregation is asked for, with
+	 * murmur_fetch_aggregation().
+	 */
+	struct murmur_archive *sibling;
+	
+	/**
+	 * Aggregates points of the archive above into a point of this one, like that archive's
+	 * aggregate does for the first archive at this precision. NULL for the most precise archive.
+	 */
+	murmur_aggregate_fn gather;
 };
 
 /**
- * Represents an entire murmur file.
+ * The file has an extension block, so it can record writes whose propagation is in flight and
+ * repair them when it's next opened.
+ */
+#define MURMUR_FLAG_EXT 0x1
+
+/**
+ * The file keeps running prefix sums for each archive, so that range sums don't have to read
+ * every point.
+ */
+#define MURMUR_FLAG_PREFIX 0x2
+
+/**
+ * The file records an aggregation method for each archive, rather than only the one in its
+ * header.
+ */
+#define MURMUR_FLAG_AGGREGATION 0x4
+
+/**
+ * murmur_set() records each write in the extension block before making it, so that a crash
+ * part-way through its propagation is repaired on the next open. Turned on with
+ * murmur_protect(); write schedulers always record their batches.
+ */
+#define MURMUR_FLAG_PROTECT 0x8
+
+/**
+ * Represents an entire murmur file. A process may have a great many of these open, so its
+ * archives are shared with every other open file of the same kind, and each handle only holds
+ * what's particular to its own file.
  */
 struct murmur {
 	/**
@@ -109,11 +179,26 @@ struct murmur {
 	 */
 	enum aggregation_method aggregation;
 	
+	/**
+	 * The device the file lives on, so that writes can be ordered on disk.
+	 */
+	uint64_t dev;
+	
+	/**
+	 * The inode of the file, so that writes can be ordered on disk.
+	 */
+	uint64_t ino;
+	
 	/**
 	 * The amount of time that can be stored in this file.
 	 */
 	uint64_t max_retention;
 	
+	/**
+	 * The number of archives in the file.
+	 */
+	uint32_t archive_count;
+	
 	/**
 	 * Specifies the fraction of data points in a propagation interval
 	 * that must have known values for a propagation to occur.
@@ -121,12 +206,21 @@ struct murmur {
 	char x_files_factor;
 	
 	/**
-	 * The number of archives in the file.
+	 * What the file supports beyond the original format: some of MURMUR_FLAG_*.
 	 */
-	uint32_t archive_count;
+	char flags;
+	
+	/**
+	 * Which archives have a write intent recorded through this handle and not yet cleared,
+	 * allocated with the first. While any do, the handle holds a shared flock() on the file,
+	 * which tells anyone opening it that the writes are still in flight.
+	 */
+	char *intents;
+	uint32_t intent_count;
 	
 	/**
-	 * An array of archives.
+	 * An array of archives. Every file with the same archives and aggregation shares a single
+	 * copy of them, which lives until the process exits: they must never be changed or free'd.
 	 */
 	struct murmur_archive *archives;
 };
@@ -138,18 +232,26 @@ struct murmur {
  *
  * @param path The path where the archive should be created
  * @param specc The number of items in the spec vector.
- * @param specv The specs for the individual archives.
- * @param aggregation How stats should be aggregated together.
+ * @param specv The specs for the individual archives, as PRECISION:RETENTION, such as
+ * "1m:30d". A third part, such as "1h:1y:max", gives the archive its own aggregation method.
+ * Archives may share a precision as long as each has a different method: one write then feeds
+ * them all.
+ * @param aggregation How stats should be aggregated together, for archives that don't give
+ * their own method.
  * @param x_files_factor The fraction of data points (0-100) in a propagation
  * interval that must have known values for a propagation to occur.
  *
+ * If the path is under a store's root, the store's name index is told about it (see
+ * murmur_store_find()).
+ *
  * @return 0 on success
  * @return -1 on failure
  */
 int murmur_create(const char *path, const uint32_t specc, char **specv, const enum aggregation_method aggregation, const char x_files_factor);
 
 /**
- * Opens a murmur file and prepares it for manipulation.
+ * Opens a murmur file and prepares it for manipulation. Propagation that a crashed writer left
+ * unfinished is finished here, unless another handle is still writing to the file.
  *
  * @param path Path to the murmur file to open.
  *
@@ -157,6 +259,16 @@ int murmur_create(const char *path, const uint32_t specc, char **specv, const en
  */
 struct murmur* murmur_open(const char *path);
 
+/**
+ * Opens a murmur file only to read it. Nothing is written to the file, not even repairs, and
+ * any write through the handle fails.
+ *
+ * @param path Path to the murmur file to open.
+ *
+ * @return The murmur file, NULL on failure.
+ */
+struct murmur* murmur_open_readonly(const char *path);
+
 /**
  * Closes a murmur file and frees all information.
  *
@@ -186,17 +298,1344 @@ int murmur_get(struct murmur *mmr, const int64_t timestamp, double * const value
 int murmur_set(struct murmur *mmr, const int64_t timestamp, const double value);
 
 /**
- * Dumps basic information about the murmur file, such as its headers, aggregation, etc.
+ * Makes murmur_set() protect each write against a crash before it has propagated, at the cost
+ * of two more small writes per point. Off by default: write schedulers record a whole batch
+ * at once, and are the better way to write many points safely.
+ *
+ * Files created before extension blocks can't be protected, and this does nothing for them.
+ *
+ * @param mmr The murmur file.
+ * @param protect Non-zero to protect writes, 0 not to.
+ */
+void murmur_protect(struct murmur *mmr, const int protect);
+
+/**
+ * A run of evenly-spaced points read out of a murmur file.
+ */
+struct murmur_series {
+	/**
+	 * The timestamp of the first point.
+	 */
+	int64_t from;
+	
+	/**
+	 * The number of seconds between points.
+	 */
+	uint32_t step;
+	
+	/**
+	 * The number of points.
+	 */
+	uint32_t count;
+	
+	/**
+	 * The points' values, NAN where there is no data.
+	 */
+	double *values;
+};
+
+/**
+ * Reads every point in a time range from the most precise archive that covers all of it.
+ * The range is trimmed to what the file can hold.
+ *
+ * @param mmr The mumur database.
+ * @param from The start of the range, exclusive.
+ * @param until The end of the range, inclusive.
+ * @param[out] series The points. This MUST ALWAYS be free'd with murmur_series_free().
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int murmur_fetch(struct murmur *mmr, int64_t from, int64_t until, struct murmur_series *series);
+
+/**
+ * Like murmur_fetch(), but only reads from archives with at least min_step seconds per point,
+ * falling back to the coarsest archive if none are coarse enough. Coarser archives hold fewer
+ * points for the same range, so this is a way to read less.
  *
  * @param mmr The mumur database.
+ * @param from The start of the range, exclusive.
+ * @param until The end of the range, inclusive.
+ * @param min_step The fewest seconds per point to read, 0 for the most precise archive.
+ * @param[out] series The points. This MUST ALWAYS be free'd with murmur_series_free().
+ *
+ * @return 0 on success, -1 on failure.
  */
-int murmur_dump_info(struct murmur *mmr);
+int murmur_fetch_step(struct murmur *mmr, const int64_t from, const int64_t until, const uint32_t min_step, struct murmur_series *series);
 
 /**
- * Dumps the entire contents of the murmur file.
+ * Like murmur_fetch_step(), but reads from the archive at that precision with the given
+ * aggregation method, for files with more than one archive at a precision. The most precise
+ * archive holds the points as written, so it counts as every method.
  *
  * @param mmr The mumur database.
+ * @param from The start of the range, exclusive.
+ * @param until The end of the range, inclusive.
+ * @param min_step The fewest seconds per point to read, 0 for the most precise archive.
+ * @param aggregation The method the archive read must have been aggregated with.
+ * @param[out] series The points. This MUST ALWAYS be free'd with murmur_series_free().
+ *
+ * @return 0 on success, -1 on failure or if no archive at that precision has the method.
  */
-int murmur_dump(struct murmur *mmr);
+int murmur_fetch_aggregation(struct murmur *mmr, const int64_t from, const int64_t until, const uint32_t min_step, const enum aggregation_method aggregation, struct murmur_series *series);
+
+/**
+ * Like murmur_fetch_step(), but writes the values into the caller's buffer instead of
+ * allocating one. Nothing is allocated, so the series does not need to be free'd.
+ *
+ * @param mmr The mumur database.
+ * @param from The start of the range, exclusive.
+ * @param until The end of the range, inclusive.
+ * @param min_step The fewest seconds per point to read, 0 for the most precise archive.
+ * @param values Where to write the values.
+ * @param capacity How many values fit in the buffer.
+ * @param[out] series The series, with values pointing into the buffer. If the buffer is too
+ *     small, this still gives the count that would have been needed.
+ *
+ * @return 0 on success, -1 on failure or if the buffer is too small.
+ */
+int murmur_fetch_into(struct murmur *mmr, const int64_t from, const int64_t until, const uint32_t min_step, double *values, const uint32_t capacity, struct murmur_series *series);
+
+/**
+ * Receives each pass of a progressive fetch.
+ *
+ * @param ctx What was given to murmur_fetch_progressive().
+ * @param series The points read by this pass. Only valid during the call.
+ * @param final Non-zero if this is the last pass, at the precision murmur_fetch_step() would give.
+ *
+ * @return 0 to carry on with the next pass, anything else to stop.
+ */
+typedef int (*murmur_progress_cb)(void *ctx, const struct murmur_series *series, const int final);
+
+/**
+ * Reads a time range coarsest first: the least precise archive is read and handed over right
+ * away, then each finer archive in turn, down to the one murmur_fetch_step() would read. Coarse
+ * archives hold few points, so the first answer comes back about as quickly as the smallest
+ * archive can be read, and the rest arrive as refinements.
+ *
+ * @param mmr The murmur database.
+ * @param from The start of the range, exclusive.
+ * @param until The end of the range, inclusive.
+ * @param min_step The fewest seconds per point to refine to, 0 for the most precise archive.
+ * @param cb Called once per archive read, coarsest first.
+ * @param ctx Passed to the callback.
+ *
+ * @return 0 on success (including when the callback stopped it), -1 on failure.
+ */
+int murmur_fetch_progressive(struct murmur *mmr, const int64_t from, const int64_t until, const uint32_t min_step, murmur_progress_cb cb, void *ctx);
+
+/**
+ * Estimates how many bytes murmur_fetch_step() would read from disk, from the headers alone.
+ *
+ * @return The number of bytes, 0 if the range is outside of what the file holds or invalid.
+ */
+uint64_t murmur_fetch_cost(const struct murmur *mmr, const int64_t from, const int64_t until, const uint32_t min_step);
+
+/**
+ * Adds prefix sums to an existing file: for every slot of every archive, the sum and count of
+ * all the points up to it, built from what's in the file now and kept up to date on every write
+ * from then on. murmur_range_sum() then reads two of them, rather than every point in the range.
+ *
+ * This takes about 2.7 times the space of the archives, and a write to anything but the newest
+ * point has to update the sums of every point after it. Files created before extension blocks
+ * can't have them.
+ *
+ * @warning Nothing else may have the file open while this runs, or their writes won't be added
+ * to the sums.
+ *
+ * @param path The file.
+ *
+ * @return 0 on success (including if the file already has them), -1 on failure.
+ */
+int murmur_prefix_enable(const char *path);
+
+/**
+ * Sums the points in a time range, from the same archive murmur_fetch() would read. With prefix
+ * sums this costs the same however long the range is; without them, every point is read.
+ *
+ * @param mmr The murmur database.
+ * @param from The start of the range, exclusive.
+ * @param until The end of the range, inclusive.
+ * @param[out] sum The sum of the points.
+ * @param[out] count How many points there are, so that sum / count is their average.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int murmur_range_sum(struct murmur *mmr, const int64_t from, const int64_t until, double *sum, uint64_t *count);
+
+/**
+ * Statistics over the points in a time range.
+ */
+struct murmur_stats {
+	/**
+	 * How many points there are. Everything else is NAN when this is 0.
+	 */
+	uint64_t count;
+	
+	double min;
+	double max;
+	double sum;
+	double mean;
+	
+	/**
+	 * The population standard deviation.
+	 */
+	double stddev;
+};
+
+/**
+ * Works out statistics over a time range, from the same archive murmur_fetch() would read, in a
+ * single pass that reads a few points at a time: nothing the size of the range is allocated.
+ *
+ * Quantiles come from a fixed-size sketch that keeps each one within 1% of the true value,
+ * however many points there are, as long as the points span less than 17 orders of magnitude
+ * (the smallest are lumped together beyond that). Values within 1e-9 of zero count as zero.
+ *
+ * @param mmr The murmur database.
+ * @param from The start of the range, exclusive.
+ * @param until The end of the range, inclusive.
+ * @param quantiles Which quantiles to find, each from 0 to 1. May be NULL if count is 0.
+ * @param quantile_count How many quantiles there are.
+ * @param[out] stats The statistics.
+ * @param[out] quantile_values The value at each quantile, NAN if there are no points.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int murmur_range_stats(struct murmur *mmr, const int64_t from, const int64_t until, const double *quantiles, const uint32_t quantile_count, struct murmur_stats *stats, double *quantile_values);
+
+/**
+ * How murmur_fetch_downsample() picks the points to keep.
+ */
+enum murmur_downsample {
+	/**
+	 * For every pixel: its first, smallest, largest and last points. A line drawn through them
+	 * looks exactly like one drawn through everything, so this is lossless for line charts, at up
+	 * to 4 points per pixel.
+	 */
+	ds_m4 = 1,
+	
+	/**
+	 * Largest-Triangle-Three-Buckets: one point per pixel, the one that keeps the most of the
+	 * line's shape. Smaller than M4, but only close to what was there.
+	 */
+	ds_lttb = 2,
+};
+
+/**
+ * Points at irregular times, such as what's left after downsampling.
+ */
+struct murmur_points {
+	/**
+	 * The number of points.
+	 */
+	uint32_t count;
+	
+	/**
+	 * The points' timestamps, in order.
+	 */
+	int64_t *timestamps;
+	
+	/**
+	 * The points' values. These are never NAN: missing points are left out.
+	 */
+	double *values;
+};
+
+/**
+ * Reads a time range like murmur_fetch_step(), then shrinks it to what's needed to draw it
+ * width pixels wide, in a single pass over the points.
+ *
+ * @param mmr The murmur database.
+ * @param from The start of the range, exclusive.
+ * @param until The end of the range, inclusive.
+ * @param min_step The fewest seconds per point to read, 0 for the most precise archive.
+ * @param mode How to pick the points.
+ * @param width How many pixels wide the chart is. Ranges with fewer points are kept whole.
+ * @param[out] points The points. This MUST ALWAYS be free'd with murmur_points_free().
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int murmur_fetch_downsample(struct murmur *mmr, const int64_t from, const int64_t until, const uint32_t min_step, const enum murmur_downsample mode, const uint32_t width, struct murmur_points *points);
+
+/**
+ * Frees downsampled points.
+ *
+ * @param points The points.
+ */
+void murmur_points_free(struct murmur_points *points);
+
+/**
+ * Frees the points in a series. Their buffer goes back to a pool, for the next fetch of about
+ * the same size.
+ *
+ * @param series The series.
+ */
+void murmur_series_free(struct murmur_series *series);
+
+/**
+ * Counters for the memory used by fetches and queries.
+ */
+struct murmur_mem_stats {
+	/**
+	 * The most scratch memory any thread has had handed out at once.
+	 */
+	uint64_t arena_high_water;
+	
+	/**
+	 * How much scratch memory all threads are holding on to, in use or not.
+	 */
+	uint64_t arena_reserved;
+	
+	/**
+	 * How many times a thread has had to allocate more scratch memory.
+	 */
+	uint64_t arena_chunks;
+	
+	/**
+	 * How many series were given a reused buffer, and how many needed a new one.
+	 */
+	uint64_t pool_hits;
+	uint64_t pool_misses;
+	
+	/**
+	 * How much memory is sitting in the pool, waiting to be reused.
+	 */
+	uint64_t pool_free_bytes;
+};
+
+/**
+ * Gets the memory counters. Once every thread has seen its busiest query, arena_chunks and
+ * pool_misses stop going up: queries then allocate nothing.
+ *
+ * @param[out] stats The counters.
+ */
+void murmur_mem_stats(struct murmur_mem_stats *stats);
+
+/**
+ * Collects point writes (and the propagations they cause) across many murmur files
+ * and issues them sorted by their location on disk.
+ */
+struct murmur_sched;
+
+/**
+ * Creates a new, empty write scheduler.
+ *
+ * @return The scheduler, NULL on failure.
+ */
+struct murmur_sched* murmur_sched_new();
+
+/**
+ * Frees a scheduler. Any writes that have not been flushed are discarded.
+ *
+ * @param sched The scheduler to free.
+ */
+void murmur_sched_free(struct murmur_sched *sched);
+
+/**
+ * Queues a point to be written on the next flush. If the same point is queued more than once,
+ * the last value queued wins.
+ *
+ * @param sched The scheduler.
+ * @param mmr The murmur file the point belongs to. It must stay open until the next flush.
+ * @param timestamp The timestamp for the value
+ * @param value The value to write
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int murmur_sched_set(struct murmur_sched *sched, struct murmur *mmr, const int64_t timestamp, const double value);
+
+/**
+ * Writes all queued points, ordered by (device, inode, offset) with adjacent points merged
+ * into single writes, then does the same for each level of propagation. Every lower-precision
+ * point is only aggregated once per flush, no matter how many of its source points changed.
+ *
+ * @param sched The scheduler.
+ *
+ * @return 0 on success, -1 if any write failed.
+ */
+int murmur_sched_flush(struct murmur_sched *sched);
+
+/**
+ * The kinds of I/O that compete for the disk.
+ */
+enum murmur_io_class {
+	io_ingest = 0,
+	io_propagation,
+	io_query,
+	io_maintenance,
+};
+
+#define MURMUR_IO_CLASSES 4
+
+/**
+ * How much of the disk a class of I/O is given.
+ */
+struct murmur_io_class_opts {
+	/**
+	 * The class's share of bytes relative to the other classes that want the disk. 0 is
+	 * treated as 1.
+	 */
+	uint32_t weight;
+	
+	/**
+	 * The most operations of this class that may be in flight at once, 0 for no limit other
+	 * than the overall depth.
+	 */
+	uint32_t depth;
+};
+
+/**
+ * Counters for one class of I/O.
+ */
+struct murmur_io_stats {
+	uint64_t ops;
+	uint64_t bytes;
+	
+	/**
+	 * Total time operations spent waiting for their turn.
+	 */
+	uint64_t wait_ns;
+	
+	uint32_t inflight;
+	uint32_t waiting;
+};
+
+/**
+ * Turns on scheduling of point reads and writes between classes of I/O, for every murmur file
+ * in the process. Once more than `depth` operations are in flight, the next to go is from
+ * whichever waiting class has been given the fewest bytes for its weight, so a burst of
+ * expensive queries can't starve ingest (or the other way around).
+ *
+ * @param depth The most operations to have in flight at once, 0 to turn scheduling off.
+ * @param classes MURMUR_IO_CLASSES entries, indexed by enum murmur_io_class.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int murmur_io_configure(const uint32_t depth, const struct murmur_io_class_opts *classes);
+
+/**
+ * Marks all I/O done by the calling thread as belonging to a class, no matter what it is.
+ * Query and scan workers mark themselves; everything else is classed by what it's doing.
+ *
+ * @param cls The class, or -1 to go back to classing each operation.
+ *
+ * @return The class the thread had before.
+ */
+int murmur_io_set_class(const int cls);
 
-#endif
\ No newline at end of file
+/**
+ * Gets the counters for each class of I/O. They are kept even when scheduling is off.
+ *
+ * @param[out] stats MURMUR_IO_CLASSES entries, indexed by enum murmur_io_class.
+ */
+void murmur_io_stats(struct murmur_io_stats *stats);
+
+/**
+ * A pool of threads that runs blocking calls (opens, fetches, flushes) for callers that
+ * can't block, like event loops and coroutines.
+ */
+struct murmur_engine;
+
+/**
+ * A call to run on an engine. The caller owns the job, and it must stay put until done is
+ * called: engines don't allocate anything per job, so they can be embedded in whatever is
+ * waiting on them.
+ */
+struct murmur_job {
+	/**
+	 * Does the work, on one of the engine's threads.
+	 *
+	 * @return Whatever should be in ret.
+	 */
+	int (*run)(struct murmur_job *job);
+	
+	/**
+	 * Called on the same thread, right after run. The engine doesn't touch the job after
+	 * this, so it may be free'd or reused here.
+	 */
+	void (*done)(struct murmur_job *job);
+	
+	/**
+	 * What run returned.
+	 */
+	int ret;
+	
+	/**
+	 * Used by the engine while the job is queued.
+	 */
+	struct murmur_job *next;
+};
+
+/**
+ * Starts an engine.
+ *
+ * @param threads How many jobs can be run at once, at least 1.
+ *
+ * @return The engine, NULL on failure.
+ */
+struct murmur_engine* murmur_engine_new(const uint32_t threads);
+
+/**
+ * Runs every job already submitted, then stops the engine's threads and frees it. This may not
+ * be called from one of the engine's own jobs.
+ *
+ * @param engine The engine.
+ */
+void murmur_engine_free(struct murmur_engine *engine);
+
+/**
+ * Queues a job to be run. Jobs start in the order they were submitted.
+ *
+ * @param engine The engine.
+ * @param job The job, with run and done set.
+ *
+ * @return 0 on success, -1 if the engine is stopping.
+ */
+int murmur_engine_submit(struct murmur_engine *engine, struct murmur_job *job);
+
+/**
+ * A rule describing how to create new metrics whose names match a pattern.
+ */
+struct murmur_schema {
+	/**
+	 * The name of the rule, from its [section] in the configuration.
+	 */
+	char *name;
+	
+	/**
+	 * Which metrics the rule applies to, as dot-separated segments. A segment may be
+	 * `*` to match any single segment, and the last may be `**` to match one or more.
+	 */
+	char *pattern;
+	
+	/**
+	 * The archive specs, as given in the configuration. specv points into this.
+	 */
+	char *retentions;
+	
+	/**
+	 * The number of archive specs.
+	 */
+	uint32_t specc;
+	
+	/**
+	 * The archive specs, in the format murmur_create() takes.
+	 */
+	char **specv;
+	
+	/**
+	 * How stats should be aggregated together.
+	 */
+	enum aggregation_method aggregation;
+	
+	/**
+	 * The fraction of data points (0-100) in a propagation interval that must have
+	 * known values for a propagation to occur.
+	 */
+	char x_files_factor;
+};
+
+/**
+ * A list of schemas, compiled so that finding the schema for a name takes time proportional
+ * to the length of the name, no matter how many schemas there are.
+ */
+struct murmur_schemas;
+
+/**
+ * Parses a schema configuration. The format is a list of sections, checked in order, with
+ * the first matching pattern winning:
+ *
+ *     [carbon]
+ *     pattern = carbon.**
+ *     retentions = 1m:90d
+ *
+ *     [default]
+ *     pattern = **
+ *     retentions = 10s:1d,1m:30d
+ *     aggregation = average
+ *     x_files_factor = 50
+ *
+ * aggregation defaults to average, and x_files_factor to 50.
+ *
+ * @param conf The configuration.
+ *
+ * @return The compiled schemas, NULL on failure.
+ */
+struct murmur_schemas* murmur_schemas_parse(const char *conf);
+
+/**
+ * Reads and parses a schema configuration from a file.
+ *
+ * @see murmur_schemas_parse
+ *
+ * @param path The path of the configuration.
+ *
+ * @return The compiled schemas, NULL on failure.
+ */
+struct murmur_schemas* murmur_schemas_load(const char *path);
+
+/**
+ * Frees compiled schemas.
+ *
+ * @param schemas The schemas to free.
+ */
+void murmur_schemas_free(struct murmur_schemas *schemas);
+
+/**
+ * Finds the schema to use for a metric.
+ *
+ * @param schemas The compiled schemas.
+ * @param name The dot-separated metric name.
+ *
+ * @return The first schema that matches, NULL if none do.
+ */
+const struct murmur_schema* murmur_schemas_match(const struct murmur_schemas *schemas, const char *name);
+
+/**
+ * Creates a new murmur archive from a schema.
+ *
+ * @warning This function is destructive: if the given path exists, it will be overwritten.
+ *
+ * @param path The path where the archive should be created
+ * @param schema The schema to create the archive with
+ *
+ * @return 0 on success
+ * @return -1 on failure
+ */
+int murmur_create_schema(const char *path, const struct murmur_schema *schema);
+
+/**
+ * A list of ingest rules that drop or rename metrics, compiled so that running a name through
+ * every rule is a single pass over the name, no matter how many rules there are.
+ */
+struct murmur_rules;
+
+/**
+ * Parses ingest rules. Each line is one of the following, using the same patterns as
+ * schemas, and the first rule whose pattern matches a name decides what happens to it:
+ *
+ *     deny    PATTERN
+ *     allow   PATTERN
+ *     rewrite PATTERN REPLACEMENT
+ *
+ * In a replacement, $1 through $9 are replaced with what each wildcard in the pattern
+ * matched (for `**`, every remaining segment). Names that match no rule are allowed.
+ *
+ *     deny    *.tmp.**
+ *     rewrite servers.*.cpu.** hosts.$1.cpu.$2
+ *
+ * @param conf The rules.
+ *
+ * @return The compiled rules, NULL on failure.
+ */
+struct murmur_rules* murmur_rules_parse(const char *conf);
+
+/**
+ * Reads and parses ingest rules from a file.
+ *
+ * @see murmur_rules_parse
+ *
+ * @param path The path of the rules.
+ *
+ * @return The compiled rules, NULL on failure.
+ */
+struct murmur_rules* murmur_rules_load(const char *path);
+
+/**
+ * Frees compiled rules.
+ *
+ * @param rules The rules to free.
+ */
+void murmur_rules_free(struct murmur_rules *rules);
+
+/**
+ * Runs a name through the rules.
+ *
+ * @param rules The compiled rules.
+ * @param name The metric name.
+ * @param[out] out Where the name to write to is put, if the name is kept.
+ * @param len The size of out.
+ *
+ * @return 1 if the name should be written (as out), 0 if it should be dropped, -1 on failure.
+ */
+int murmur_rules_apply(const struct murmur_rules *rules, const char *name, char *out, const size_t len);
+
+/**
+ * A directory of murmur files, addressed by dotted metric name ("a.b.c" lives at
+ * "root/a/b/c.mmr"), with a cache of open files and a write scheduler.
+ */
+struct murmur_store;
+
+/**
+ * Opens a store.
+ *
+ * @param root The directory the store lives in.
+ * @param schemas How to create metrics that don't exist yet; NULL to never create. These
+ * must outlive the store.
+ *
+ * @return The store, NULL on failure.
+ */
+struct murmur_store* murmur_store_open(const char *root, const struct murmur_schemas *schemas);
+
+/**
+ * Opens a store only to read from it: its files are opened with murmur_open_readonly(), so
+ * nothing is created, repaired or written.
+ *
+ * @param root The directory the store lives in.
+ *
+ * @return The store, NULL on failure.
+ */
+struct murmur_store* murmur_store_open_readonly(const char *root);
+
+/**
+ * Flushes any pending writes and closes a store, along with every file it has open.
+ *
+ * @param store The store to close.
+ */
+void murmur_store_close(struct murmur_store *store);
+
+/**
+ * Gets the open file for a metric, opening it if necessary.
+ *
+ * @param store The store.
+ * @param name The metric name.
+ * @param create If the metric should be created from the store's schemas when it doesn't exist.
+ *
+ * @return The file, owned by the store. NULL if it doesn't exist or couldn't be opened. A store
+ *     only keeps so many files open, half as many as the process may have, so the next
+ *     murmur_store_flush() may close one that hasn't been used in a while.
+ */
+struct murmur* murmur_store_handle(struct murmur_store *store, const char *name, const int create);
+
+/**
+ * Sets the ingest rules that every name goes through before being written.
+ *
+ * @param store The store.
+ * @param rules The compiled rules, which must outlive the store. NULL to remove them.
+ */
+void murmur_store_set_rules(struct murmur_store *store, const struct murmur_rules *rules);
+
+/**
+ * Queues a point for a metric, creating the metric if needed. The point is written on the
+ * next flush. If the store's rules drop the name, nothing is queued and this succeeds.
+ *
+ * @param store The store.
+ * @param name The metric name.
+ * @param timestamp The timestamp for the value
+ * @param value The value to write
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int murmur_store_set(struct murmur_store *store, const char *name, const int64_t timestamp, const double value);
+
+/**
+ * Writes every queued point.
+ *
+ * @see murmur_sched_flush
+ *
+ * @param store The store.
+ *
+ * @return 0 on success, -1 if any write failed.
+ */
+int murmur_store_flush(struct murmur_store *store);
+
+/**
+ * Turns on time partitioning for a store. Rather than queueing each point for its metric's
+ * file, recent points are kept in partitions: one file for each span of time, holding every
+ * metric's points for that span as a matrix of slot by metric, so that a flush is one
+ * sequential write per partition however many metrics were written. Once a partition's span
+ * (and grace) has passed, the next flush rolls it up into each metric's file.
+ *
+ * Metrics are still created from the store's schemas when they're first written, and points
+ * too old for a partition still go straight to their file. Fetches see points in partitions
+ * as soon as they're set, when the archive read has the partitions' precision.
+ *
+ * Partitions left by a store that didn't close are picked up again.
+ *
+ * @param store The store.
+ * @param spec The partitions' precision and span, like "10s:1h", which should match the most
+ * precise archive of the store's schemas.
+ * @param grace How many seconds after a partition's span ends it keeps taking late points.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int murmur_store_partition(struct murmur_store *store, const char *spec, const uint32_t grace);
+
+/**
+ * Turns on memtables for a store. Points are appended to a log and kept in memory, sorted, in
+ * one of a number of shards by metric; every so often they're all written to their files in
+ * bulk, and the log is emptied. Fetches see points in memtables as soon as they're set, when
+ * the archive read is a file's most precise one.
+ *
+ * The log is written when enough points have been collected and when a listening store ticks,
+ * so a crash loses at most a second of points. Anything in the log when this is called (from a
+ * store that didn't close) is put back in the memtables.
+ *
+ * A store can't have both memtables and partitions.
+ *
+ * @param store The store.
+ * @param shards How many memtables to spread metrics across, so that reads of some metrics
+ * don't wait on writes to others.
+ * @param max_points How many points the memtables take before they're written to the files.
+ * @param max_age How many seconds the memtables take points for before they're written to the
+ * files.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int murmur_store_memtable(struct murmur_store *store, const uint32_t shards, const uint64_t max_points, const uint32_t max_age);
+
+/**
+ * Called with every point written to a store whose name matches a subscription.
+ *
+ * @param ctx What was given to murmur_store_subscribe().
+ * @param name The metric name, after the store's rules.
+ * @param timestamp The point's timestamp.
+ * @param value The point's value.
+ */
+typedef void (*murmur_sub_cb)(void *ctx, const char *name, const int64_t timestamp, const double value);
+
+/**
+ * Subscribes to every point written to a store for the metrics matching a pattern. Points are
+ * handed over as soon as they're accepted by murmur_store_set(), before they're flushed, so
+ * consumers can be pushed recent points rather than polling for them.
+ *
+ * Patterns are made of dotted segments, each a literal or `*` (any one segment), and the last
+ * may be `**` (one or more segments). However many subscriptions there are, a point only has to
+ * be matched once.
+ *
+ * The callback is called from whichever thread writes the point, while the store's
+ * subscriptions are locked: it must be quick, and must not subscribe or unsubscribe.
+ *
+ * @param store The store.
+ * @param pattern Which metrics to subscribe to, like "servers.*.cpu".
+ * @param cb Called with each point.
+ * @param ctx Passed to the callback.
+ *
+ * @return The subscription's id, for murmur_store_unsubscribe(). -1 on failure.
+ */
+int murmur_store_subscribe(struct murmur_store *store, const char *pattern, murmur_sub_cb cb, void *ctx);
+
+/**
+ * Subscribes a socket to every point written to a store for the metrics matching a pattern.
+ * Points are sent as plaintext protocol lines ("name value timestamp"), in batches: whenever the
+ * store flushes (every second, for a listening store), or sooner when enough have collected.
+ *
+ * The consumer is never waited on: if it falls far enough behind, newer points are dropped
+ * until it catches up. Once it goes away, the subscription is removed.
+ *
+ * A listening store's clients can subscribe by sending "subscribe PATTERN".
+ *
+ * @see murmur_store_subscribe
+ *
+ * @param store The store.
+ * @param pattern Which metrics to subscribe to.
+ * @param fd A connected socket, which is owned by the subscription from here on, even on failure.
+ *
+ * @return The subscription's id, for murmur_store_unsubscribe(). -1 on failure.
+ */
+int murmur_store_subscribe_fd(struct murmur_store *store, const char *pattern, const int fd);
+
+/**
+ * Removes a subscription, closing its socket if it has one. Points that were waiting to be sent
+ * to it are dropped.
+ *
+ * @param store The store.
+ * @param id The subscription's id.
+ *
+ * @return 0 on success, -1 if there's no such subscription.
+ */
+int murmur_store_unsubscribe(struct murmur_store *store, const int id);
+
+/**
+ * Listens for connections on a unix socket, replacing anything already at the path.
+ *
+ * @param path Where the socket lives.
+ *
+ * @return The listening socket, -1 on failure.
+ */
+int murmur_unix_listen(const char *path);
+
+/**
+ * Listens for TCP connections.
+ *
+ * @param host The address to listen on, NULL for every address.
+ * @param port The port to listen on.
+ *
+ * @return The listening socket, -1 on failure.
+ */
+int murmur_tcp_listen(const char *host, const uint16_t port);
+
+/**
+ * Connects to a TCP server.
+ *
+ * @param host The server's address.
+ * @param port The server's port.
+ * @param timeout_ms How long to wait for the connection to be accepted.
+ *
+ * @return The connected socket, -1 on failure.
+ */
+int murmur_tcp_connect(const char *host, const uint16_t port, const int timeout_ms);
+
+/**
+ * Reads every point in a time range for a metric in a store. Points that are queued but
+ * haven't been flushed aren't seen, except for those in partitions or memtables.
+ *
+ * @see murmur_fetch
+ *
+ * @param store The store.
+ * @param name The metric name.
+ * @param from The start of the range, exclusive.
+ * @param until The end of the range, inclusive.
+ * @param[out] series The points. This MUST ALWAYS be free'd with murmur_series_free().
+ *
+ * @return 0 on success, -1 on failure or if the metric doesn't exist.
+ */
+int murmur_store_fetch(struct murmur_store *store, const char *name, const int64_t from, const int64_t until, struct murmur_series *series);
+
+/**
+ * Receives metrics over the plaintext protocol ("name value timestamp" lines) and writes
+ * them to a store, flushing every second. Runs until stop is set.
+ *
+ * A line of "fetch NAME FROM UNTIL" is answered with the series in graphite's raw format
+ * ("name,from,until,step|v1,v2,None,..."), or "name,0,0,0|" if the metric doesn't exist.
+ *
+ * @param store The store to write to.
+ * @param fd A listening socket, from murmur_tcp_listen().
+ * @param stop Set to non-zero (from a signal handler, for example) to return.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int murmur_store_listen(struct murmur_store *store, const int fd, volatile int *stop);
+
+/**
+ * Called for everything a find matches.
+ *
+ * @param ctx The context given with the find.
+ * @param name The full, dotted name.
+ * @param leaf 1 if it's a metric, 0 if it's a branch with more beneath it.
+ */
+typedef void (*murmur_find_cb)(void *ctx, const char *name, const int leaf);
+
+/**
+ * Finds every metric and branch in a store that matches a query, like "servers.*.cpu" or
+ * "servers.web{1,2}.load.[0-9]". Each dotted segment is matched against one level of the store
+ * with `*`, `?`, `[...]` and `{a,b}`.
+ *
+ * This searches the store's name index rather than its directories: a trie of every name, kept
+ * in ".murmur_index" under the root, plus a journal of what has been created or deleted since,
+ * in ".murmur_journal". The index is built on first open, and metrics created and deleted through
+ * any store on the same root, in any process, are seen, as are files made under the root with
+ * murmur_create() (and so `murmur create`). Files put there some other way, such as by copying,
+ * need murmur_store_reindex().
+ *
+ * @param store The store.
+ * @param query What to look for.
+ * @param cb Called for every match.
+ * @param ctx Passed to the callback.
+ *
+ * @return 0 on success, -1 if part of the store couldn't be read.
+ */
+int murmur_store_find(struct murmur_store *store, const char *query, murmur_find_cb cb, void *ctx);
+
+/**
+ * Deletes a metric from a store, flushing anything that's queued first. This must not run while
+ * other threads are reading the same metric.
+ *
+ * @param store The store.
+ * @param name The metric name.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int murmur_store_delete(struct murmur_store *store, const char *name);
+
+/**
+ * Rebuilds a store's name index from the files on disk.
+ *
+ * @param store The store.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int murmur_store_reindex(struct murmur_store *store);
+
+/**
+ * A metric file found by murmur_scan().
+ */
+struct murmur_scan_entry {
+	/**
+	 * The metric name, like "a.b.c".
+	 */
+	const char *name;
+	
+	/**
+	 * Where the file lives, relative to the root, like "a/b/c.mmr".
+	 */
+	const char *path;
+	
+	/**
+	 * When the file was last written to.
+	 */
+	int64_t mtime;
+	
+	/**
+	 * The size of the file, and how much disk it actually takes up.
+	 */
+	uint64_t size;
+	uint64_t disk_usage;
+	
+	/**
+	 * The file's headers, NULL if it couldn't be read. This is only open for reading, and only
+	 * for the duration of the callback.
+	 */
+	const struct murmur *mmr;
+};
+
+/**
+ * Called for every file a scan finds. Calls are never made concurrently.
+ *
+ * @param ctx The context given with the scan.
+ * @param entry The file.
+ *
+ * @return 0 to continue, anything else to stop the scan.
+ */
+typedef int (*murmur_scan_cb)(void *ctx, const struct murmur_scan_entry *entry);
+
+/**
+ * Reads the headers of every metric under a directory, with many threads reading directories
+ * and files at once.
+ *
+ * @param root The directory.
+ * @param threads How many threads to read with.
+ * @param cb Called for every metric.
+ * @param ctx Passed to the callback.
+ *
+ * @return 0 on success, -1 if anything couldn't be read (everything else is still reported).
+ */
+int murmur_scan(const char *root, const uint32_t threads, murmur_scan_cb cb, void *ctx);
+
+/**
+ * Removes every metric in a store that hasn't been written to since a given time, either deleting
+ * it or moving it under another directory.
+ *
+ * @param store The store.
+ * @param older_than Metrics last written before this are removed.
+ * @param archive Where to move metrics, keeping their paths relative to the store's root. NULL to
+ * delete them. This must be on the same filesystem as the store.
+ * @param threads How many threads to scan with.
+ * @param cb If not NULL, called for every metric before it's removed. Returning non-zero stops
+ * the scan, but anything found so far is still removed.
+ * @param ctx Passed to the callback.
+ *
+ * @return The number of metrics removed, or -1 on failure.
+ */
+int murmur_store_clean(struct murmur_store *store, const int64_t older_than, const char *archive, const uint32_t threads, murmur_scan_cb cb, void *ctx);
+
+/**
+ * What an import read and wrote.
+ */
+struct murmur_import_stats {
+	/**
+	 * The number of lines that weren't empty.
+	 */
+	uint64_t lines;
+	
+	/**
+	 * The number of points written.
+	 */
+	uint64_t points;
+	
+	/**
+	 * The number of lines that were malformed, dropped by the rules, or outside of what their
+	 * metric holds. A header line is counted here.
+	 */
+	uint64_t skipped;
+	
+	/**
+	 * The size of the input.
+	 */
+	uint64_t bytes;
+};
+
+/**
+ * Writes the points from a CSV or TSV file into a store. Each line is "name,timestamp,value",
+ * separated by commas or tabs, and metrics are created and renamed just like with
+ * murmur_store_set(). The file is mapped and split between the threads at line boundaries, and
+ * every metric is written by one thread only, through its own write scheduler.
+ *
+ * This is for backfilling: points go straight to the files, skipping any memtable, partitions
+ * and subscriptions. Nothing else may write to the store while it runs.
+ *
+ * @param store The store.
+ * @param path The file to import.
+ * @param threads How many threads to parse and write with.
+ * @param stats Set to what was imported, even on failure.
+ *
+ * @return 0 on success, -1 if the file couldn't be read or anything couldn't be written.
+ */
+int murmur_store_import(struct murmur_store *store, const char *path, const uint32_t threads, struct murmur_import_stats *stats);
+
+/**
+ * How murmur_serve() runs. Any limit left at 0 isn't enforced.
+ */
+struct murmur_serve_opts {
+	/**
+	 * How many worker threads to run. Defaults to 1.
+	 */
+	uint32_t workers;
+	
+	/**
+	 * The most metrics a render's targets may expand to. Anything more is rejected before
+	 * any file is opened.
+	 */
+	uint32_t max_series;
+	
+	/**
+	 * Renders that would read more than this many bytes are read from coarser archives
+	 * instead, picking the most precise that fits.
+	 */
+	uint64_t downsample_bytes;
+	
+	/**
+	 * Renders that would still read more than this many bytes, even after downsampling,
+	 * are rejected.
+	 */
+	uint64_t max_query_bytes;
+	
+	/**
+	 * How many bytes every render being read at once may add up to. Renders beyond that
+	 * wait their turn, up to queue_timeout_ms, before being turned away. A render that's
+	 * bigger than this on its own runs once nothing else is.
+	 */
+	uint64_t max_inflight_bytes;
+	uint32_t queue_timeout_ms;
+};
+
+/**
+ * Answers HTTP queries against a store until stop is set. The event loop only moves bytes; the
+ * requests themselves are run by a pool of worker threads that stream their responses back as
+ * each target is read, so slow requests don't hold up others. Connections are kept alive and
+ * requests may be pipelined.
+ *
+ * Supported are:
+ *  - /render?target=NAME&target=...&from=...&until=...&format=json|raw|binary
+ *    Targets may be patterns, as with murmur_store_find(), and expand to every metric matching.
+ *    Times are unix timestamps, "now", or relative, like "-1h". From defaults to a day ago.
+ *    The binary format is, for each target: the name's length (uint16) and name, the first
+ *    timestamp (int64), step (uint32), count (uint32) and every value as a double, NaN for
+ *    missing points, all little-endian.
+ *    With &maxDataPoints=WIDTH&downsample=m4|lttb, each JSON series is shrunk to what's needed
+ *    to draw it WIDTH pixels wide (see murmur_fetch_downsample()), its points at their own times.
+ *    WIDTH is capped at 65536.
+ *    Renders that expand to too many metrics, or would read too much, are answered with 413;
+ *    those that waited too long for their turn with 503.
+ *  - /metrics/find?query=PATTERN
+ *    Answered with [{"text": ..., "id": ..., "leaf": 0|1, "expandable": 0|1}, ...].
+ *
+ * Every render is costed before anything is read, from the archive headers of every metric it
+ * touches (see murmur_fetch_cost()), and the limits in the options decide what happens to it.
+ * The cost is reported in an X-Murmur-Cost header, and the step read at in X-Murmur-Step.
+ *
+ * @param store The store to read from. Writes to it may happen at the same time, from
+ * murmur_store_listen() on another thread, for example.
+ * @param fd A listening socket, from murmur_tcp_listen().
+ * @param opts How to run the server, NULL for the defaults.
+ * @param stop Set to non-zero (from a signal handler, for example) to return.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int murmur_serve(struct murmur_store *store, const int fd, const struct murmur_serve_opts *opts, volatile int *stop);
+
+/**
+ * A node in a consistent hash ring.
+ */
+struct murmur_ring_node {
+	/**
+	 * Where the node listens.
+	 */
+	char *host;
+	uint16_t port;
+	
+	/**
+	 * The node's share of metrics, relative to other nodes.
+	 */
+	uint32_t weight;
+};
+
+/**
+ * A consistent hash ring that decides which nodes each metric lives on. Adding or removing
+ * a node only moves the metrics that node gains or loses.
+ */
+struct murmur_ring;
+
+/**
+ * Creates an empty ring.
+ *
+ * @param replicas How many nodes each metric lives on.
+ *
+ * @return The ring, NULL on failure.
+ */
+struct murmur_ring* murmur_ring_new(const uint32_t replicas);
+
+/**
+ * Frees a ring.
+ *
+ * @param ring The ring to free.
+ */
+void murmur_ring_free(struct murmur_ring *ring);
+
+/**
+ * Adds a node to the ring.
+ *
+ * @param ring The ring.
+ * @param host Where the node listens.
+ * @param port Where the node listens.
+ * @param weight The node's share of metrics, relative to the other nodes.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int murmur_ring_add(struct murmur_ring *ring, const char *host, const uint16_t port, const uint32_t weight);
+
+/**
+ * Finds the nodes a metric lives on.
+ *
+ * @param ring The ring.
+ * @param name The metric name.
+ * @param[out] nodes Where the nodes' indexes are put, primary first. This must have room
+ * for as many replicas as the ring has.
+ *
+ * @return The number of nodes found: the ring's replicas, unless there aren't enough nodes.
+ */
+uint32_t murmur_ring_lookup(const struct murmur_ring *ring, const char *name, uint32_t *nodes);
+
+/**
+ * Gets a node in the ring.
+ *
+ * @param ring The ring.
+ * @param node The node's index.
+ *
+ * @return The node, NULL if there is no such node.
+ */
+const struct murmur_ring_node* murmur_ring_node(const struct murmur_ring *ring, const uint32_t node);
+
+/**
+ * Gets how many nodes each metric lives on.
+ *
+ * @param ring The ring.
+ */
+uint32_t murmur_ring_replicas(const struct murmur_ring *ring);
+
+/**
+ * Routes metrics to the nodes that own them over the plaintext protocol, batching what is
+ * sent to each node and buffering for nodes that can't be reached.
+ */
+struct murmur_relay;
+
+/**
+ * Creates a relay.
+ *
+ * @param ring Where to send metrics. It must outlive the relay, and may not have nodes
+ * added to it while the relay exists.
+ * @param max_buffer How many bytes to keep for each node that can't be reached before
+ * dropping the oldest.
+ *
+ * @return The relay, NULL on failure.
+ */
+struct murmur_relay* murmur_relay_new(const struct murmur_ring *ring, const size_t max_buffer);
+
+/**
+ * Frees a relay. Anything not yet sent is lost.
+ *
+ * @param relay The relay to free.
+ */
+void murmur_relay_free(struct murmur_relay *relay);
+
+/**
+ * Queues a point for every node that owns the metric, sending to any node that has a full batch.
+ *
+ * @param relay The relay.
+ * @param name The metric name.
+ * @param value The value
+ * @param timestamp The timestamp for the value
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int murmur_relay_send(struct murmur_relay *relay, const char *name, const double value, const int64_t timestamp);
+
+/**
+ * Sends everything queued to every node that can be reached.
+ *
+ * @param relay The relay.
+ *
+ * @return 0 if everything was sent, -1 if anything is still waiting.
+ */
+int murmur_relay_flush(struct murmur_relay *relay);
+
+/**
+ * Gets how many bytes were dropped because nodes couldn't be reached.
+ *
+ * @param relay The relay.
+ */
+uint64_t murmur_relay_dropped(const struct murmur_relay *relay);
+
+/**
+ * Receives metrics over the plaintext protocol and relays them. Runs until stop is set.
+ *
+ * @param relay The relay.
+ * @param fd A listening socket, from murmur_tcp_listen().
+ * @param stop Set to non-zero (from a signal handler, for example) to return.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int murmur_relay_run(struct murmur_relay *relay, const int fd, volatile int *stop);
+
+/**
+ * Called with each metric's points as soon as they're known.
+ *
+ * @param ctx The context given with the fetch.
+ * @param name The metric name.
+ * @param series The points, NULL if no node has the metric. Only valid during the call.
+ */
+typedef void (*murmur_fetch_cb)(void *ctx, const char *name, const struct murmur_series *series);
+
+/**
+ * Fetches many metrics from the nodes that own them, asking every node at once. When a metric
+ * lives on more than one node, gaps in one node's points are filled with another's. Each metric
+ * is handed to the callback as soon as all of its nodes have answered.
+ *
+ * @param ring Where metrics live. Every node must be running murmur_store_listen().
+ * @param names The metrics to fetch.
+ * @param count The number of metrics.
+ * @param from The start of the range, exclusive.
+ * @param until The end of the range, inclusive.
+ * @param timeout_ms How long to wait for nodes to answer.
+ * @param cb Called once for every metric, even those that couldn't be fetched.
+ * @param ctx Passed to the callback.
+ *
+ * @return 0 if every node answered, -1 if any failed (whatever they knew is still given).
+ */
+int murmur_cluster_fetch(const struct murmur_ring *ring, const char * const *names, const uint32_t count, const int64_t from, const int64_t until, const int timeout_ms, murmur_fetch_cb cb, void *ctx);
+
+/**
+ * Dumps basic information about the murmur file, such as its headers, aggregation, etc.
+ *
+ * @param mmr The mumur database.
+ */
+int murmur_dump_info(struct murmur *mmr);
+
+/**
+ * Dumps the entire contents of the murmur file.
+ *
+ * @param mmr The mumur database.
+ */
+int murmur_dump(struct murmur *mmr);
+
+/**
+ * Gets the name of an aggregation method, as used in schemas.
+ *
+ * @return The name, or "unknown" if it isn't a valid method.
+ */
+const char* murmur_aggregation_name(const enum aggregation_method aggregation);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
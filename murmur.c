@@ -1,11 +1,15 @@
 #include <errno.h>
+#include <math.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "libmurmur.h"
 
-static int _create(const char *path, const int specc, char **specv) {
+static int _create(const char *path, const int argc, char **argv) {
 	struct stat buf;
 	if (stat(path, &buf) == -1) {
 		if (errno != ENOENT) {
@@ -13,11 +17,50 @@ static int _create(const char *path, const int specc, char **specv) {
 			return 1;
 		}
 		
-		if (murmur_create(path, specc, specv, agg_average, 50) != 0) {
+		// Options come after the path: argv[0] is the path, so getopt starts past it
+		int opt;
+		const char *schemas_path = NULL;
+		while ((opt = getopt(argc, argv, "s:")) != -1) {
+			switch (opt) {
+				case 's':
+					schemas_path = optarg;
+					break;
+				
+				default:
+					return 1;
+			}
+		}
+		
+		if (schemas_path == NULL) {
+			if (murmur_create(path, argc - optind, argv + optind, agg_average, 50) != 0) {
+				return 1;
+			}
+			
+			return 0;
+		}
+		
+		if (argc - optind != 1) {
+			M_ERROR("With -s, give the name of the metric to pick a schema for.");
 			return 1;
 		}
 		
-		return 0;
+		struct murmur_schemas *schemas = murmur_schemas_load(schemas_path);
+		if (schemas == NULL) {
+			return 1;
+		}
+		
+		int ret = 0;
+		const char *name = argv[optind];
+		const struct murmur_schema *schema = murmur_schemas_match(schemas, name);
+		if (schema == NULL) {
+			M_ERROR("No schema matches %s", name);
+			ret = 1;
+		} else if (murmur_create_schema(path, schema) != 0) {
+			ret = 1;
+		}
+		
+		murmur_schemas_free(schemas);
+		return ret;
 	}
 	
 	M_ERROR("That path already exists!");
@@ -25,7 +68,7 @@ static int _create(const char *path, const int specc, char **specv) {
 }
 
 static int _dump(char *path) {
-	struct murmur *mmr = murmur_open(path);
+	struct murmur *mmr = murmur_open_readonly(path);
 	if (mmr == NULL) {
 		return 1;
 	}
@@ -40,7 +83,7 @@ static int _dump(char *path) {
 }
 
 static int _info(char *path) {
-	struct murmur *mmr = murmur_open(path);
+	struct murmur *mmr = murmur_open_readonly(path);
 	if (mmr == NULL) {
 		return 1;
 	}
@@ -54,20 +97,621 @@ static int _info(char *path) {
 	return 0;
 }
 
+static int _prefix(char *path) {
+	return murmur_prefix_enable(path) != 0;
+}
+
+/**
+ * Set when a daemon command should shut down.
+ */
+static volatile int _stop = 0;
+
+static void _on_signal(int sig) {
+	_stop = 1;
+}
+
+static void _handle_signals() {
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = _on_signal;
+	
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+}
+
+/**
+ * Parses a list of HOST:PORT[:WEIGHT] destinations into a ring.
+ */
+static int _ring_add_all(struct murmur_ring *ring, const int destc, char **destv) {
+	for (int i = 0; i < destc; i++) {
+		char host[256];
+		unsigned int port = 0;
+		unsigned int weight = 1;
+		
+		if (sscanf(destv[i], "%255[^:]:%u:%u", host, &port, &weight) < 2 || port > 65535) {
+			M_ERROR("Invalid destination: %s", destv[i]);
+			return -1;
+		}
+		
+		if (murmur_ring_add(ring, host, port, weight) != 0) {
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+static int _listen(const char *root, const int argc, char **argv) {
+	int opt;
+	long port = 2003;
+	const char *schemas_path = NULL;
+	const char *rules_path = NULL;
+	const char *partition = NULL;
+	long grace = 60;
+	long memtable = 0;
+	const char *unix_path = NULL;
+	
+	while ((opt = getopt(argc, argv, "p:s:r:P:g:m:U:")) != -1) {
+		switch (opt) {
+			case 'p':
+				port = strtol(optarg, NULL, 10);
+				break;
+			
+			case 's':
+				schemas_path = optarg;
+				break;
+			
+			case 'r':
+				rules_path = optarg;
+				break;
+			
+			case 'P':
+				partition = optarg;
+				break;
+			
+			case 'g':
+				grace = strtol(optarg, NULL, 10);
+				break;
+			
+			case 'm':
+				memtable = strtol(optarg, NULL, 10);
+				break;
+			
+			case 'U':
+				unix_path = optarg;
+				break;
+			
+			default:
+				return 1;
+		}
+	}
+	
+	int ret = 1;
+	int fd = -1;
+	struct murmur_schemas *schemas = NULL;
+	struct murmur_rules *rules = NULL;
+	struct murmur_store *store = NULL;
+	
+	if (schemas_path != NULL && (schemas = murmur_schemas_load(schemas_path)) == NULL) {
+		goto done;
+	}
+	
+	if (rules_path != NULL && (rules = murmur_rules_load(rules_path)) == NULL) {
+		goto done;
+	}
+	
+	store = murmur_store_open(root, schemas);
+	if (store == NULL) {
+		goto done;
+	}
+	murmur_store_set_rules(store, rules);
+	
+	if (partition != NULL && murmur_store_partition(store, partition, grace) != 0) {
+		goto done;
+	}
+	
+	if (memtable > 0 && murmur_store_memtable(store, 16, memtable, 60) != 0) {
+		goto done;
+	}
+	
+	fd = unix_path != NULL ? murmur_unix_listen(unix_path) : murmur_tcp_listen(NULL, port);
+	if (fd == -1) {
+		goto done;
+	}
+	
+	_handle_signals();
+	
+	if (unix_path != NULL) {
+		M_INFO("Storing metrics in %s, listening on %s", root, unix_path);
+	} else {
+		M_INFO("Storing metrics in %s, listening on port %ld", root, port);
+	}
+	
+	ret = murmur_store_listen(store, fd, &_stop) != 0;
+	
+done:
+	if (fd != -1) {
+		close(fd);
+	}
+	murmur_store_close(store);
+	murmur_rules_free(rules);
+	murmur_schemas_free(schemas);
+	
+	return ret;
+}
+
+static int _relay(const char *port, const int argc, char **argv) {
+	int opt;
+	long replicas = 1;
+	long max_buffer = 64 * 1024 * 1024;
+	
+	while ((opt = getopt(argc, argv, "n:b:")) != -1) {
+		switch (opt) {
+			case 'n':
+				replicas = strtol(optarg, NULL, 10);
+				break;
+			
+			case 'b':
+				max_buffer = strtol(optarg, NULL, 10);
+				break;
+			
+			default:
+				return 1;
+		}
+	}
+	
+	if (optind == argc) {
+		M_ERROR("The relay needs at least one destination (HOST:PORT[:WEIGHT]).");
+		return 1;
+	}
+	
+	int ret = 1;
+	int fd = -1;
+	struct murmur_relay *relay = NULL;
+	struct murmur_ring *ring = murmur_ring_new(replicas);
+	
+	if (_ring_add_all(ring, argc - optind, argv + optind) != 0) {
+		goto done;
+	}
+	
+	relay = murmur_relay_new(ring, max_buffer);
+	fd = murmur_tcp_listen(NULL, strtol(port, NULL, 10));
+	if (relay == NULL || fd == -1) {
+		goto done;
+	}
+	
+	_handle_signals();
+	M_INFO("Relaying from port %s to %d destinations", port, argc - optind);
+	
+	ret = murmur_relay_run(relay, fd, &_stop) != 0;
+	murmur_relay_flush(relay);
+	
+done:
+	if (fd != -1) {
+		close(fd);
+	}
+	murmur_relay_free(relay);
+	murmur_ring_free(ring);
+	
+	return ret;
+}
+
+static void _print_raw(void *ctx, const char *name, const struct murmur_series *series) {
+	if (series == NULL) {
+		printf("%s,0,0,0|\n", name);
+		return;
+	}
+	
+	printf("%s,%ld,%ld,%u|", name, series->from, series->from + ((int64_t)series->count * series->step), series->step);
+	for (uint32_t i = 0; i < series->count; i++) {
+		if (isnan(series->values[i])) {
+			printf("None");
+		} else {
+			printf("%.17g", series->values[i]);
+		}
+		
+		printf(i + 1 == series->count ? "\n" : ",");
+	}
+	
+	fflush(stdout);
+}
+
+static int _query(char *nodes, const int argc, char **argv) {
+	int opt;
+	long replicas = 1;
+	long timeout = 10000;
+	int64_t until = time(NULL);
+	int64_t from = until - (24 * 60 * 60);
+	
+	while ((opt = getopt(argc, argv, "n:f:u:t:")) != -1) {
+		switch (opt) {
+			case 'n':
+				replicas = strtol(optarg, NULL, 10);
+				break;
+			
+			case 'f':
+				from = strtoll(optarg, NULL, 10);
+				break;
+			
+			case 'u':
+				until = strtoll(optarg, NULL, 10);
+				break;
+			
+			case 't':
+				timeout = strtol(optarg, NULL, 10);
+				break;
+			
+			default:
+				return 1;
+		}
+	}
+	
+	int destc = 0;
+	char *destv[256];
+	char *save = NULL;
+	for (char *d = strtok_r(nodes, ",", &save); d != NULL && destc < 256; d = strtok_r(NULL, ",", &save)) {
+		destv[destc++] = d;
+	}
+	
+	struct murmur_ring *ring = murmur_ring_new(replicas);
+	if (_ring_add_all(ring, destc, destv) != 0) {
+		murmur_ring_free(ring);
+		return 1;
+	}
+	
+	int ret = murmur_cluster_fetch(ring, (const char * const *)(argv + optind), argc - optind, from, until, timeout, _print_raw, NULL) != 0;
+	
+	murmur_ring_free(ring);
+	return ret;
+}
+
+static int _serve(const char *root, const int argc, char **argv) {
+	int opt;
+	long port = 8080;
+	long workers = 4;
+	struct murmur_serve_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	
+	while ((opt = getopt(argc, argv, "p:w:s:d:c:i:t:")) != -1) {
+		switch (opt) {
+			case 'p':
+				port = strtol(optarg, NULL, 10);
+				break;
+			
+			case 'w':
+				workers = strtol(optarg, NULL, 10);
+				break;
+			
+			case 's':
+				opts.max_series = strtoul(optarg, NULL, 10);
+				break;
+			
+			case 'd':
+				opts.downsample_bytes = strtoull(optarg, NULL, 10) * 1024 * 1024;
+				break;
+			
+			case 'c':
+				opts.max_query_bytes = strtoull(optarg, NULL, 10) * 1024 * 1024;
+				break;
+			
+			case 'i':
+				opts.max_inflight_bytes = strtoull(optarg, NULL, 10) * 1024 * 1024;
+				break;
+			
+			case 't':
+				opts.queue_timeout_ms = strtoul(optarg, NULL, 10);
+				break;
+			
+			default:
+				return 1;
+		}
+	}
+	
+	if (workers < 1) {
+		M_ERROR("Need at least one worker");
+		return 1;
+	}
+	opts.workers = workers;
+	
+	struct murmur_store *store = murmur_store_open_readonly(root);
+	if (store == NULL) {
+		return 1;
+	}
+	
+	int fd = murmur_tcp_listen(NULL, port);
+	if (fd == -1) {
+		murmur_store_close(store);
+		return 1;
+	}
+	
+	_handle_signals();
+	M_INFO("Serving metrics from %s on port %ld with %ld workers", root, port, workers);
+	
+	int ret = murmur_serve(store, fd, &opts, &_stop) != 0;
+	
+	close(fd);
+	murmur_store_close(store);
+	
+	return ret;
+}
+
+static int _reindex(const char *root) {
+	struct murmur_store *store = murmur_store_open(root, NULL);
+	if (store == NULL) {
+		return 1;
+	}
+	
+	int ret = murmur_store_reindex(store) != 0;
+	
+	murmur_store_close(store);
+	return ret;
+}
+
+/**
+ * Totals for a scan.
+ */
+struct scan_totals {
+	uint64_t files;
+	uint64_t unreadable;
+	uint64_t size;
+	uint64_t disk_usage;
+	int64_t now;
+	int quiet;
+};
+
+static int _print_scan(void *ctx, const struct murmur_scan_entry *entry) {
+	struct scan_totals *totals = ctx;
+	
+	totals->files++;
+	totals->size += entry->size;
+	totals->disk_usage += entry->disk_usage;
+	
+	if (entry->mmr == NULL) {
+		totals->unreadable++;
+		printf("%s\tunreadable\n", entry->name);
+		return 0;
+	}
+	
+	if (totals->quiet) {
+		return 0;
+	}
+	
+	char retentions[256];
+	size_t len = 0;
+	retentions[0] = '\0';
+	for (uint32_t i = 0; i < entry->mmr->archive_count && len < sizeof(retentions); i++) {
+		struct murmur_archive *arch = entry->mmr->archives + i;
+		len += snprintf(retentions + len, sizeof(retentions) - len, "%s%us:%u",
+			i == 0 ? "" : ",",
+			arch->seconds_per_point,
+			arch->points);
+	}
+	
+	printf("%s\t%s\t%s\t%d\t%ld\t%.1fd\t%lu\t%lu\n",
+		entry->name,
+		retentions,
+		murmur_aggregation_name(entry->mmr->aggregation),
+		entry->mmr->x_files_factor,
+		entry->mtime,
+		(totals->now - entry->mtime) / 86400.0,
+		entry->size,
+		entry->disk_usage);
+	
+	return 0;
+}
+
+static int _scan(const char *root, const int argc, char **argv) {
+	int opt;
+	long threads = 8;
+	struct scan_totals totals;
+	memset(&totals, 0, sizeof(totals));
+	
+	while ((opt = getopt(argc, argv, "t:q")) != -1) {
+		switch (opt) {
+			case 't':
+				threads = strtol(optarg, NULL, 10);
+				break;
+			
+			case 'q':
+				totals.quiet = 1;
+				break;
+			
+			default:
+				return 1;
+		}
+	}
+	
+	totals.now = time(NULL);
+	
+	if (!totals.quiet) {
+		printf("# name\tretentions\taggregation\txff\tlast_update\tage\tsize\tdisk_usage\n");
+	}
+	
+	int ret = murmur_scan(root, threads < 1 ? 1 : threads, _print_scan, &totals) != 0;
+	
+	M_INFO("%lu metrics (%lu unreadable), %lu bytes, %lu bytes on disk",
+		totals.files,
+		totals.unreadable,
+		totals.size,
+		totals.disk_usage);
+	
+	return ret;
+}
+
+static int _print_stale(void *ctx, const struct murmur_scan_entry *entry) {
+	const int64_t *older_than = ctx;
+	
+	if (entry->mtime < *older_than) {
+		printf("%s\n", entry->name);
+	}
+	
+	return 0;
+}
+
+static int _print_clean(void *ctx, const struct murmur_scan_entry *entry) {
+	printf("%s\n", entry->name);
+	return 0;
+}
+
+static int _clean(const char *root, const int argc, char **argv) {
+	int opt;
+	long threads = 8;
+	long days = -1;
+	int dry_run = 0;
+	const char *archive = NULL;
+	
+	while ((opt = getopt(argc, argv, "d:a:nt:")) != -1) {
+		switch (opt) {
+			case 'd':
+				days = strtol(optarg, NULL, 10);
+				break;
+			
+			case 'a':
+				archive = optarg;
+				break;
+			
+			case 'n':
+				dry_run = 1;
+				break;
+			
+			case 't':
+				threads = strtol(optarg, NULL, 10);
+				break;
+			
+			default:
+				return 1;
+		}
+	}
+	
+	if (days < 0) {
+		M_ERROR("You must say how many days old a metric must be, with -d");
+		return 1;
+	}
+	
+	int64_t older_than = time(NULL) - (days * 86400);
+	
+	if (dry_run) {
+		return murmur_scan(root, threads < 1 ? 1 : threads, _print_stale, &older_than) != 0;
+	}
+	
+	struct murmur_store *store = murmur_store_open(root, NULL);
+	if (store == NULL) {
+		return 1;
+	}
+	
+	int removed = murmur_store_clean(store, older_than, archive, threads < 1 ? 1 : threads, _print_clean, NULL);
+	murmur_store_close(store);
+	
+	if (removed >= 0) {
+		M_INFO("%s %d metrics", archive == NULL ? "Deleted" : "Archived", removed);
+	}
+	
+	return removed < 0;
+}
+
+static int _import(const char *root, const int argc, char **argv) {
+	int opt;
+	long threads = 8;
+	const char *schemas_path = NULL;
+	const char *rules_path = NULL;
+	
+	while ((opt = getopt(argc, argv, "s:r:t:")) != -1) {
+		switch (opt) {
+			case 's':
+				schemas_path = optarg;
+				break;
+			
+			case 'r':
+				rules_path = optarg;
+				break;
+			
+			case 't':
+				threads = strtol(optarg, NULL, 10);
+				break;
+			
+			default:
+				return 1;
+		}
+	}
+	
+	if (argc - optind != 1) {
+		M_ERROR("You must give exactly one file to import");
+		return 1;
+	}
+	
+	int ret = 1;
+	struct murmur_schemas *schemas = NULL;
+	struct murmur_rules *rules = NULL;
+	struct murmur_store *store = NULL;
+	struct murmur_import_stats stats;
+	
+	if (schemas_path != NULL && (schemas = murmur_schemas_load(schemas_path)) == NULL) {
+		goto done;
+	}
+	
+	if (rules_path != NULL && (rules = murmur_rules_load(rules_path)) == NULL) {
+		goto done;
+	}
+	
+	store = murmur_store_open(root, schemas);
+	if (store == NULL) {
+		goto done;
+	}
+	murmur_store_set_rules(store, rules);
+	
+	ret = murmur_store_import(store, argv[optind], threads < 1 ? 1 : threads, &stats) != 0;
+	
+	M_INFO("%lu lines, %lu points written, %lu skipped, %lu bytes",
+		stats.lines,
+		stats.points,
+		stats.skipped,
+		stats.bytes);
+
+done:
+	murmur_store_close(store);
+	murmur_rules_free(rules);
+	murmur_schemas_free(schemas);
+	
+	return ret;
+}
+
 static void _show_usage() {
 	fprintf(stderr, 
 		"Usage: murmur COMMAND ...\n"
 		"\n"
 		"Commands:\n"
 		"  create   creates a new murmur database\n"
+		"             murmur create PATH SPEC...\n"
+		"                 where SPEC is PRECISION:RETENTION[:METHOD], such as 1m:30d or 1h:1y:max\n"
+		"             murmur create PATH -s SCHEMAS METRIC\n"
 		"  dump     dumps the contents of a database\n"
 		"  info     dumps information about a database\n"
+		"  prefix   adds prefix sums to a database, for constant-time range sums\n"
+		"  listen   receives metrics over the plaintext protocol into a directory\n"
+		"             murmur listen DIR [-p PORT] [-s SCHEMAS] [-r RULES] [-P PARTITION_SPEC [-g GRACE]]\n"
+		"                 [-m MEMTABLE_POINTS] [-U UNIX_SOCKET]\n"
+		"  relay    routes metrics to other murmur instances by consistent hashing\n"
+		"             murmur relay PORT [-n REPLICAS] [-b MAX_BUFFER] HOST:PORT[:WEIGHT]...\n"
+		"  query    fetches metrics from every instance that owns them, printing raw series\n"
+		"             murmur query HOST:PORT[:WEIGHT],... [-n REPLICAS] [-f FROM] [-u UNTIL] [-t TIMEOUT_MS] METRIC...\n"
+		"  serve    answers graphite-style HTTP queries (/render, /metrics/find) from a directory\n"
+		"             murmur serve DIR [-p PORT] [-w WORKERS] [-s MAX_SERIES] [-d DOWNSAMPLE_MB]\n"
+		"                 [-c MAX_QUERY_MB] [-i MAX_INFLIGHT_MB] [-t QUEUE_TIMEOUT_MS]\n"
+		"  reindex  rebuilds a directory's name index from the files in it\n"
+		"             murmur reindex DIR\n"
+		"  scan     reads the headers of every database in a directory, in parallel\n"
+		"             murmur scan DIR [-t THREADS] [-q]\n"
+		"  clean    deletes (or moves elsewhere) every metric in a directory not written to in DAYS days\n"
+		"             murmur clean DIR -d DAYS [-a ARCHIVE_DIR] [-n] [-t THREADS]\n"
+		"  import   writes the points in a CSV or TSV file (name,timestamp,value) into a directory\n"
+		"             murmur import DIR [-s SCHEMAS] [-r RULES] [-t THREADS] FILE\n"
+		"  bench    repeatedly opens and writes to a database\n"
 	);
 }
 
-static int benchmark() {
+static int _bench(const char *path) {
 	for (int i = 0; i < 100000; i++) {
-		struct murmur *mmr = murmur_open("murmur_test.mmr");
+		struct murmur *mmr = murmur_open(path);
 		if (mmr == NULL) {
 			return 1;
 		}
@@ -98,14 +742,32 @@ int main(int argc, char **argv) {
 	char *command = *(argv + 1);
 	char *path = *(argv + 2);
 	
-	return benchmark();
-	
 	if (strcmp("create", command) == 0) {
-		return _create(path, argc-3, argv+3);
+		return _create(path, argc-2, argv+2);
 	} else if (strcmp("dump", command) == 0) {
 		return _dump(path);
 	} else if (strcmp("info", command) == 0) {
 		return _info(path);
+	} else if (strcmp("prefix", command) == 0) {
+		return _prefix(path);
+	} else if (strcmp("listen", command) == 0) {
+		return _listen(path, argc-2, argv+2);
+	} else if (strcmp("relay", command) == 0) {
+		return _relay(path, argc-2, argv+2);
+	} else if (strcmp("query", command) == 0) {
+		return _query(path, argc-2, argv+2);
+	} else if (strcmp("serve", command) == 0) {
+		return _serve(path, argc-2, argv+2);
+	} else if (strcmp("reindex", command) == 0) {
+		return _reindex(path);
+	} else if (strcmp("scan", command) == 0) {
+		return _scan(path, argc-2, argv+2);
+	} else if (strcmp("clean", command) == 0) {
+		return _clean(path, argc-2, argv+2);
+	} else if (strcmp("import", command) == 0) {
+		return _import(path, argc-2, argv+2);
+	} else if (strcmp("bench", command) == 0) {
+		return _bench(path);
 	}
 	
 	_show_usage();
@@ -0,0 +1,365 @@
+/**
+ * Murmur: a header-only C++ interface to libmurmur.
+ * @file murmur.hpp
+ *
+ * Needs C++20 (for std::span). Nothing here allocates per call: fetches go into the caller's
+ * buffers, and batched writes reuse a queue that lives as long as the handle.
+ */
+
+#ifndef LIBMURMUR_HPP
+#define LIBMURMUR_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <span>
+#include <utility>
+
+#include "libmurmur.h"
+
+namespace libmurmur {
+
+/**
+ * Why a call failed. The details have already been logged by libmurmur.
+ */
+enum class Error {
+	/**
+	 * The file couldn't be opened, read or written.
+	 */
+	io = 1,
+	
+	/**
+	 * The timestamp is outside of what the file holds.
+	 */
+	out_of_range,
+	
+	/**
+	 * The buffer given to a fetch can't hold all of the points.
+	 */
+	buffer_too_small,
+	
+	/**
+	 * The handle doesn't own a file (it was moved from).
+	 */
+	closed,
+};
+
+/**
+ * Wraps an error so that a Result can be built from it, like std::unexpected.
+ */
+struct Unexpected {
+	Error error;
+};
+
+/**
+ * Either a value or the reason there isn't one. This is a small stand-in for std::expected,
+ * which isn't in C++20, and works the same way for the parts it has.
+ */
+template <typename T>
+class Result {
+public:
+	using value_type = T;
+	
+	Result(const T &value) : ok_(true), value_(value) {}
+	Result(T &&value) : ok_(true), value_(std::move(value)) {}
+	Result(Unexpected e) : ok_(false), error_(e.error) {}
+	
+	Result(Result &&other) : ok_(other.ok_) {
+		if (ok_) {
+			new (&value_) T(std::move(other.value_));
+		} else {
+			error_ = other.error_;
+		}
+	}
+	
+	Result(const Result &other) : ok_(other.ok_) {
+		if (ok_) {
+			new (&value_) T(other.value_);
+		} else {
+			error_ = other.error_;
+		}
+	}
+	
+	Result& operator=(Result other) {
+		this->~Result();
+		new (this) Result(std::move(other));
+		return *this;
+	}
+	
+	~Result() {
+		if (ok_) {
+			value_.~T();
+		}
+	}
+	
+	bool has_value() const { return ok_; }
+	explicit operator bool() const { return ok_; }
+	
+	T& value() & { return value_; }
+	const T& value() const & { return value_; }
+	T&& value() && { return std::move(value_); }
+	
+	T& operator*() & { return value_; }
+	const T& operator*() const & { return value_; }
+	T&& operator*() && { return std::move(value_); }
+	
+	T* operator->() { return &value_; }
+	const T* operator->() const { return &value_; }
+	
+	Error error() const { return error_; }
+
+private:
+	bool ok_;
+	
+	union {
+		T value_;
+		Error error_;
+	};
+};
+
+template <>
+class Result<void> {
+public:
+	using value_type = void;
+	
+	Result() : ok_(true), error_() {}
+	Result(Unexpected e) : ok_(false), error_(e.error) {}
+	
+	bool has_value() const { return ok_; }
+	explicit operator bool() const { return ok_; }
+	
+	Error error() const { return error_; }
+
+private:
+	bool ok_;
+	Error error_;
+};
+
+/**
+ * A single value to write.
+ */
+struct Point {
+	int64_t timestamp;
+	double value;
+};
+
+/**
+ * A run of evenly-spaced values, read into the caller's buffer.
+ */
+struct Series {
+	/**
+	 * The timestamp of the first value.
+	 */
+	int64_t from;
+	
+	/**
+	 * The number of seconds between values.
+	 */
+	uint32_t step;
+	
+	/**
+	 * The values, NAN where there is no data: the front of the buffer given to the fetch.
+	 */
+	std::span<double> values;
+};
+
+/**
+ * An open murmur file. This owns the file, closing it when it goes away, and can be moved but
+ * not copied.
+ */
+class Murmur {
+public:
+	/**
+	 * Creates a new murmur file. See murmur_create().
+	 */
+	static Result<void> create(const char *path, std::span<const char * const> specs, const enum aggregation_method aggregation, const char x_files_factor = 0) {
+		if (murmur_create(path, specs.size(), const_cast<char**>(specs.data()), aggregation, x_files_factor) != 0) {
+			return Unexpected{Error::io};
+		}
+		
+		return {};
+	}
+	
+	/**
+	 * Opens an existing murmur file.
+	 */
+	static Result<Murmur> open(const char *path) {
+		struct murmur *mmr = murmur_open(path);
+		if (mmr == nullptr) {
+			return Unexpected{Error::io};
+		}
+		
+		return Murmur(mmr);
+	}
+	
+	/**
+	 * Takes ownership of an already-open file.
+	 */
+	explicit Murmur(struct murmur *mmr) : mmr_(mmr), sched_(nullptr) {}
+	
+	Murmur(Murmur &&other) noexcept :
+		mmr_(std::exchange(other.mmr_, nullptr)),
+		sched_(std::exchange(other.sched_, nullptr)) {}
+	
+	Murmur& operator=(Murmur &&other) noexcept {
+		if (this != &other) {
+			close();
+			mmr_ = std::exchange(other.mmr_, nullptr);
+			sched_ = std::exchange(other.sched_, nullptr);
+		}
+		
+		return *this;
+	}
+	
+	Murmur(const Murmur&) = delete;
+	Murmur& operator=(const Murmur&) = delete;
+	
+	~Murmur() {
+		close();
+	}
+	
+	/**
+	 * Closes the file early. The handle can't be used after this.
+	 */
+	void close() {
+		murmur_sched_free(sched_);
+		sched_ = nullptr;
+		
+		if (mmr_ != nullptr) {
+			murmur_close(mmr_);
+			mmr_ = nullptr;
+		}
+	}
+	
+	/**
+	 * The underlying file, for anything not wrapped here. It stays owned by the handle.
+	 */
+	struct murmur* native() const { return mmr_; }
+	
+	explicit operator bool() const { return mmr_ != nullptr; }
+	
+	/**
+	 * Writes a single value. See murmur_set().
+	 */
+	Result<void> set(const int64_t timestamp, const double value) {
+		if (mmr_ == nullptr) {
+			return Unexpected{Error::closed};
+		}
+		
+		if (murmur_set(mmr_, timestamp, value) != 0) {
+			return Unexpected{Error::io};
+		}
+		
+		return {};
+	}
+	
+	/**
+	 * Reads a single value. See murmur_get().
+	 */
+	Result<double> get(const int64_t timestamp) {
+		if (mmr_ == nullptr) {
+			return Unexpected{Error::closed};
+		}
+		
+		double value;
+		if (murmur_get(mmr_, timestamp, &value) != 0) {
+			return Unexpected{Error::io};
+		}
+		
+		return value;
+	}
+	
+	/**
+	 * Writes many values at once, through a write scheduler: they go to disk in order, with
+	 * adjacent points merged and each lower-precision point aggregated only once. See
+	 * murmur_sched_flush().
+	 *
+	 * Every point that can be written is, even if some can't.
+	 */
+	Result<void> set_many(std::span<const Point> points) {
+		if (mmr_ == nullptr) {
+			return Unexpected{Error::closed};
+		}
+		
+		if (sched_ == nullptr) {
+			sched_ = murmur_sched_new();
+			if (sched_ == nullptr) {
+				return Unexpected{Error::io};
+			}
+		}
+		
+		bool out_of_range = false;
+		for (const Point &pt : points) {
+			out_of_range |= murmur_sched_set(sched_, mmr_, pt.timestamp, pt.value) != 0;
+		}
+		
+		if (murmur_sched_flush(sched_) != 0) {
+			return Unexpected{Error::io};
+		}
+		
+		if (out_of_range) {
+			return Unexpected{Error::out_of_range};
+		}
+		
+		return {};
+	}
+	
+	/**
+	 * How many values fetch() would give for a range, from the headers alone.
+	 */
+	Result<size_t> fetch_size(const int64_t from, const int64_t until, const uint32_t min_step = 0) {
+		if (mmr_ == nullptr) {
+			return Unexpected{Error::closed};
+		}
+		
+		struct murmur_series series;
+		if (murmur_fetch_into(mmr_, from, until, min_step, nullptr, 0, &series) != 0 && series.count == 0) {
+			return Unexpected{Error::io};
+		}
+		
+		return static_cast<size_t>(series.count);
+	}
+	
+	/**
+	 * Reads a time range into a buffer. See murmur_fetch_into().
+	 *
+	 * @param min_step The fewest seconds per point to read, 0 for the most precise archive.
+	 *
+	 * @return The series, whose values are the front of the buffer.
+	 */
+	Result<Series> fetch(const int64_t from, const int64_t until, std::span<double> out, const uint32_t min_step = 0) {
+		if (mmr_ == nullptr) {
+			return Unexpected{Error::closed};
+		}
+		
+		// A series never has more values than fit in a uint32_t, so a bigger buffer's tail is
+		// just never used
+		const uint32_t capacity = out.size() < UINT32_MAX ? static_cast<uint32_t>(out.size()) : UINT32_MAX;
+		
+		struct murmur_series series;
+		if (murmur_fetch_into(mmr_, from, until, min_step, out.data(), capacity, &series) != 0) {
+			return Unexpected{series.count > out.size() ? Error::buffer_too_small : Error::io};
+		}
+		
+		return Series{series.from, series.step, out.first(series.count)};
+	}
+	
+	/**
+	 * How many bytes a fetch would read from disk. See murmur_fetch_cost().
+	 */
+	uint64_t fetch_cost(const int64_t from, const int64_t until, const uint32_t min_step = 0) const {
+		return mmr_ == nullptr ? 0 : murmur_fetch_cost(mmr_, from, until, min_step);
+	}
+
+private:
+	struct murmur *mmr_;
+	
+	/**
+	 * Reused by set_many(), so that its queue only grows once.
+	 */
+	struct murmur_sched *sched_;
+};
+
+}
+
+#endif
@@ -0,0 +1,174 @@
+/**
+ * Murmur: awaitable versions of the blocking calls in murmur.hpp, for C++20 coroutines.
+ * @file murmur_async.hpp
+ *
+ * Every co_await hands its call to a murmur_engine, and the coroutine is suspended (holding no
+ * thread) until one of the engine's threads has run it. The coroutine then carries on on that
+ * thread: keep the work between awaits short, or hop back to your own executor.
+ */
+
+#ifndef LIBMURMUR_ASYNC_HPP
+#define LIBMURMUR_ASYNC_HPP
+
+#include <coroutine>
+#include <optional>
+#include <utility>
+
+#include "murmur.hpp"
+
+namespace libmurmur {
+
+/**
+ * Runs a call on an engine when awaited. The job lives inside the awaiter, which lives in the
+ * coroutine's frame, so nothing is allocated per call.
+ *
+ * @tparam T What the call gives, as Result<T>.
+ * @tparam F The call: anything invocable with no arguments that gives Result<T>.
+ */
+template <typename T, typename F>
+class Async {
+public:
+	Async(struct murmur_engine *engine, F fn) : engine_(engine), fn_(std::move(fn)) {}
+	
+	Async(const Async&) = delete;
+	Async& operator=(const Async&) = delete;
+	
+	bool await_ready() const noexcept {
+		return false;
+	}
+	
+	bool await_suspend(std::coroutine_handle<> handle) {
+		handle_ = handle;
+		job_.self = this;
+		job_.job.run = run;
+		job_.job.done = done;
+		
+		// The engine is going away: there's nothing to wait for
+		if (engine_ == nullptr || murmur_engine_submit(engine_, &job_.job) != 0) {
+			result_.emplace(Unexpected{Error::closed});
+			return false;
+		}
+		
+		return true;
+	}
+	
+	Result<T> await_resume() {
+		return std::move(*result_);
+	}
+
+private:
+	/**
+	 * The C job, with a way back to the awaiter.
+	 */
+	struct Job {
+		struct murmur_job job;
+		Async *self;
+	};
+	
+	static int run(struct murmur_job *job) {
+		Async *self = reinterpret_cast<Job*>(job)->self;
+		self->result_.emplace(self->fn_());
+		return 0;
+	}
+	
+	static void done(struct murmur_job *job) {
+		reinterpret_cast<Job*>(job)->self->handle_.resume();
+	}
+	
+	struct murmur_engine *engine_;
+	F fn_;
+	Job job_ {};
+	std::coroutine_handle<> handle_;
+	std::optional<Result<T>> result_;
+};
+
+/**
+ * Owns a murmur_engine and gives awaitable versions of Murmur's calls. A handle may only have
+ * one call in flight at a time, just like when it's used from a single thread; different
+ * handles can all be used at once.
+ */
+class Engine {
+public:
+	/**
+	 * Starts an engine. See murmur_engine_new().
+	 */
+	explicit Engine(const uint32_t threads) : engine_(murmur_engine_new(threads)) {}
+	
+	Engine(Engine &&other) noexcept : engine_(std::exchange(other.engine_, nullptr)) {}
+	
+	Engine& operator=(Engine &&other) noexcept {
+		if (this != &other) {
+			murmur_engine_free(engine_);
+			engine_ = std::exchange(other.engine_, nullptr);
+		}
+		
+		return *this;
+	}
+	
+	Engine(const Engine&) = delete;
+	Engine& operator=(const Engine&) = delete;
+	
+	/**
+	 * Waits for everything already awaited to finish. See murmur_engine_free().
+	 */
+	~Engine() {
+		murmur_engine_free(engine_);
+	}
+	
+	struct murmur_engine* native() const { return engine_; }
+	
+	explicit operator bool() const { return engine_ != nullptr; }
+	
+	/**
+	 * Runs any blocking call on the engine.
+	 *
+	 * @param fn Gives a Result<T>.
+	 */
+	template <typename F>
+	auto run(F fn) {
+		using T = typename decltype(fn())::value_type;
+		return Async<T, F>(engine_, std::move(fn));
+	}
+	
+	/**
+	 * Opens a file. See Murmur::open().
+	 */
+	auto open(const char *path) {
+		return run([path]() { return Murmur::open(path); });
+	}
+	
+	/**
+	 * Reads a time range into a buffer. See Murmur::fetch().
+	 */
+	auto fetch(Murmur &mmr, const int64_t from, const int64_t until, std::span<double> out, const uint32_t min_step = 0) {
+		return run([&mmr, from, until, out, min_step]() { return mmr.fetch(from, until, out, min_step); });
+	}
+	
+	/**
+	 * Writes many values, and propogates them. See Murmur::set_many().
+	 */
+	auto set_many(Murmur &mmr, std::span<const Point> points) {
+		return run([&mmr, points]() { return mmr.set_many(points); });
+	}
+	
+	/**
+	 * Writes everything queued in a scheduler, and propogates it to the lower archives. See
+	 * murmur_sched_flush().
+	 */
+	auto flush(struct murmur_sched *sched) {
+		return run([sched]() -> Result<void> {
+			if (murmur_sched_flush(sched) != 0) {
+				return Unexpected{Error::io};
+			}
+			
+			return {};
+		});
+	}
+
+private:
+	struct murmur_engine *engine_;
+};
+
+}
+
+#endif
@@ -3,7 +3,12 @@
  */
 #include "libmurmur.c"
 
+#include <signal.h>
+#include <sys/wait.h>
+
 #define PATH "murmur_test.mmr"
+#define PATH2 "murmur_test2.mmr"
+#define STORE "murmur_test_store"
 
 /**
  * A test assertion
@@ -158,6 +163,2189 @@ static int test_full() {
 	return 0;
 }
 
+static int test_sched() {
+	char *spec[] = {
+		"10s:1m",
+		"1m:5m",
+	};
+	TEST(murmur_create(PATH, NUM_ELEMS(spec), spec, agg_average, 0) == 0);
+	TEST(murmur_create(PATH2, NUM_ELEMS(spec), spec, agg_sum, 0) == 0);
+	
+	struct murmur *a = murmur_open(PATH);
+	struct murmur *b = murmur_open(PATH2);
+	TEST(a != NULL && b != NULL);
+	
+	struct murmur_sched *sched = murmur_sched_new();
+	TEST(sched != NULL);
+	
+	mmr_test_time = (a->archives->retention * 5) - 10;
+	
+	// Queue in reverse, interleaved between files, so nothing is in disk order
+	time_t at = mmr_test_time;
+	for (int i = 0; i < 6; i++) {
+		TEST(murmur_sched_set(sched, a, at, 100 * (i + 1)) == 0);
+		TEST(murmur_sched_set(sched, b, at, i + 1) == 0);
+		at -= 10;
+	}
+	
+	// The last write to a point wins
+	TEST(murmur_sched_set(sched, b, mmr_test_time, 7) == 0);
+	
+	TEST(murmur_sched_flush(sched) == 0);
+	
+	double val;
+	at = mmr_test_time;
+	for (int i = 0; i < 6; i++) {
+		TEST(murmur_get(a, at, &val) == 0);
+		TEST(val == 100 * (i + 1));
+		at -= 10;
+	}
+	
+	TEST(murmur_get(b, mmr_test_time, &val) == 0);
+	TEST(val == 7);
+	
+	TEST(_murmur_arch_get(a, a->archives + 1, mmr_test_time, &val) == 0);
+	TEST(val == (((double)100+200+300+400+500+600)/6));
+	
+	TEST(_murmur_arch_get(b, b->archives + 1, mmr_test_time, &val) == 0);
+	TEST(val == 7+2+3+4+5+6);
+	
+	// Nothing left to write
+	TEST(murmur_sched_flush(sched) == 0);
+	
+	murmur_sched_free(sched);
+	murmur_close(a);
+	murmur_close(b);
+	
+	return 0;
+}
+
+static int test_schemas() {
+	const char *conf =
+		"# Checked in order\n"
+		"[carbon]\n"
+		"pattern = carbon.**\n"
+		"retentions = 1m:90d\n"
+		"\n"
+		"[cpu]\n"
+		"pattern = servers.*.cpu\n"
+		"retentions = 10s:1m, 1m:5m\n"
+		"aggregation = max\n"
+		"x_files_factor = 10\n"
+		"\n"
+		"[web01]\n"
+		"pattern = servers.web01.*\n"
+		"retentions = 10s:1m\n"
+		"\n"
+		"[default]\n"
+		"pattern = **\n"
+		"retentions = 1m:1d\n";
+	
+	struct murmur_schemas *schemas = murmur_schemas_parse(conf);
+	TEST(schemas != NULL);
+	
+	const struct murmur_schema *schema = murmur_schemas_match(schemas, "carbon.agents.a.cpu");
+	TEST(schema != NULL && strcmp(schema->name, "carbon") == 0);
+	
+	schema = murmur_schemas_match(schemas, "carbon");
+	TEST(schema != NULL && strcmp(schema->name, "default") == 0);
+	
+	// Both cpu and web01 match: the first one listed wins
+	schema = murmur_schemas_match(schemas, "servers.web01.cpu");
+	TEST(schema != NULL && strcmp(schema->name, "cpu") == 0);
+	TEST(schema->aggregation == agg_max);
+	TEST(schema->x_files_factor == 10);
+	TEST(schema->specc == 2);
+	TEST(strcmp(schema->specv[1], "1m:5m") == 0);
+	
+	schema = murmur_schemas_match(schemas, "servers.web01.memory");
+	TEST(schema != NULL && strcmp(schema->name, "web01") == 0);
+	TEST(schema->aggregation == agg_average);
+	TEST(schema->x_files_factor == 50);
+	
+	schema = murmur_schemas_match(schemas, "servers.web02.memory");
+	TEST(schema != NULL && strcmp(schema->name, "default") == 0);
+	
+	murmur_schemas_free(schemas);
+	
+	TEST(murmur_schemas_parse("[a]\npattern = a.**.b\nretentions = 1m:1d\n") == NULL);
+	TEST(murmur_schemas_parse("[a]\npattern = a\n") == NULL);
+	TEST(murmur_schemas_parse("[a]\npattern = a\nretentions = 1m:1d\naggregation = median\n") == NULL);
+	
+	// Lots of rules shouldn't change which one is found
+	char big[64 * 1024] = "";
+	for (int i = 0; i < 500; i++) {
+		char rule[128];
+		snprintf(rule, sizeof(rule), "[r%d]\npattern = app%d.*.requests\nretentions = 1m:1d\n", i, i);
+		strcat(big, rule);
+	}
+	
+	schemas = murmur_schemas_parse(big);
+	TEST(schemas != NULL);
+	
+	schema = murmur_schemas_match(schemas, "app321.host.requests");
+	TEST(schema != NULL && strcmp(schema->name, "r321") == 0);
+	TEST(murmur_schemas_match(schemas, "app321.host.errors") == NULL);
+	TEST(murmur_schemas_match(schemas, "app500.host.requests") == NULL);
+	
+	murmur_schemas_free(schemas);
+	
+	return 0;
+}
+
+static int test_store_create() {
+	TEST(system("rm -rf " STORE) == 0);
+	
+	struct murmur_schemas *schemas = murmur_schemas_parse(
+		"[cpu]\n"
+		"pattern = servers.*.cpu\n"
+		"retentions = 10s:1m,1m:5m\n"
+		"aggregation = sum\n");
+	TEST(schemas != NULL);
+	
+	struct murmur_store *store = murmur_store_open(STORE "/", schemas);
+	TEST(store != NULL);
+	
+	mmr_test_time = 1000;
+	
+	TEST(murmur_store_set(store, "servers.web01.cpu", mmr_test_time, 10) == 0);
+	TEST(murmur_store_set(store, "servers.web01.cpu", mmr_test_time - 10, 20) == 0);
+	
+	// No schema, no metric
+	TEST(murmur_store_set(store, "servers.web01.memory", mmr_test_time, 10) == -1);
+	TEST(murmur_store_set(store, "servers..cpu", mmr_test_time, 10) == -1);
+	
+	TEST(murmur_store_flush(store) == 0);
+	murmur_store_close(store);
+	
+	struct murmur *mmr = murmur_open(STORE "/servers/web01/cpu.mmr");
+	TEST(mmr != NULL);
+	TEST(mmr->aggregation == agg_sum);
+	TEST(mmr->archive_count == 2);
+	
+	double val;
+	TEST(murmur_get(mmr, mmr_test_time, &val) == 0);
+	TEST(val == 10);
+	TEST(_murmur_arch_get(mmr, mmr->archives + 1, mmr_test_time, &val) == 0);
+	TEST(val == 30);
+	
+	murmur_close(mmr);
+	
+	// Only so many files stay open, and those in use aren't closed under anyone
+	store = murmur_store_open(STORE, schemas);
+	TEST(store != NULL);
+	TEST(store->handles_max >= MURMUR_STORE_MIN_HANDLES);
+	store->handles_max = 4;
+	
+	char name[64];
+	for (uint32_t i = 0; i < 100; i++) {
+		snprintf(name, sizeof(name), "servers.h%u.cpu", i);
+		TEST(murmur_store_set(store, name, mmr_test_time, i) == 0);
+	}
+	TEST(store->handles_count == 100);
+	TEST(murmur_store_flush(store) == 0);
+	TEST(store->handles_count <= 4);
+	
+	struct _murmur_store_hold hold;
+	_murmur_store_hold(store, &hold);
+	for (uint32_t i = 0; i < 10; i++) {
+		snprintf(name, sizeof(name), "servers.h%u.cpu", i);
+		TEST(murmur_store_handle(store, name, 0) != NULL);
+	}
+	_murmur_store_evict(store);
+	TEST(store->handles_count >= 10);
+	
+	_murmur_store_release(store, &hold);
+	_murmur_store_evict(store);
+	TEST(store->handles_count <= 4);
+	
+	struct murmur_series series;
+	TEST(murmur_store_fetch(store, "servers.h42.cpu", mmr_test_time - 10, mmr_test_time, &series) == 0);
+	TEST(series.count == 1 && series.values[0] == 42);
+	murmur_series_free(&series);
+	
+	murmur_store_close(store);
+	murmur_schemas_free(schemas);
+	
+	return 0;
+}
+
+static int test_rules() {
+	struct murmur_rules *rules = murmur_rules_parse(
+		"# First match wins\n"
+		"deny    *.tmp.**\n"
+		"rewrite servers.*.cpu.** hosts.$1.cpu.$2\n"
+		"allow   servers.**\n"
+		"allow   hosts.**\n"
+		"deny    **\n");
+	TEST(rules != NULL);
+	
+	char out[256];
+	TEST(murmur_rules_apply(rules, "web01.tmp.cpu", out, sizeof(out)) == 0);
+	TEST(murmur_rules_apply(rules, "servers.tmp.cpu.user", out, sizeof(out)) == 0);
+	
+	TEST(murmur_rules_apply(rules, "servers.web01.cpu.user.total", out, sizeof(out)) == 1);
+	TEST(strcmp(out, "hosts.web01.cpu.user.total") == 0);
+	
+	TEST(murmur_rules_apply(rules, "servers.web01.memory", out, sizeof(out)) == 1);
+	TEST(strcmp(out, "servers.web01.memory") == 0);
+	
+	TEST(murmur_rules_apply(rules, "apps.api.requests", out, sizeof(out)) == 0);
+	
+	// The rewritten name doesn't fit
+	TEST(murmur_rules_apply(rules, "servers.web01.cpu.user", out, 8) == -1);
+	
+	murmur_rules_free(rules);
+	
+	TEST(murmur_rules_parse("rewrite a.* b.$2\n") == NULL);
+	TEST(murmur_rules_parse("drop a.*\n") == NULL);
+	TEST(murmur_rules_parse("allow a b\n") == NULL);
+	
+	// With no rules, everything passes through
+	rules = murmur_rules_parse("");
+	TEST(rules != NULL);
+	TEST(murmur_rules_apply(rules, "a.b.c", out, sizeof(out)) == 1);
+	TEST(strcmp(out, "a.b.c") == 0);
+	murmur_rules_free(rules);
+	
+	// Through a store
+	TEST(system("rm -rf " STORE) == 0);
+	
+	struct murmur_schemas *schemas = murmur_schemas_parse("[all]\npattern = **\nretentions = 10s:1m\n");
+	rules = murmur_rules_parse("deny noisy.**\nrewrite old.* new.$1\n");
+	TEST(schemas != NULL && rules != NULL);
+	
+	struct murmur_store *store = murmur_store_open(STORE, schemas);
+	TEST(store != NULL);
+	murmur_store_set_rules(store, rules);
+	
+	mmr_test_time = 1000;
+	TEST(murmur_store_set(store, "noisy.metric", mmr_test_time, 1) == 0);
+	TEST(murmur_store_set(store, "old.metric", mmr_test_time, 2) == 0);
+	murmur_store_close(store);
+	
+	TEST(access(STORE "/noisy/metric.mmr", F_OK) != 0);
+	TEST(access(STORE "/old/metric.mmr", F_OK) != 0);
+	
+	struct murmur *mmr = murmur_open(STORE "/new/metric.mmr");
+	TEST(mmr != NULL);
+	
+	double val;
+	TEST(murmur_get(mmr, mmr_test_time, &val) == 0);
+	TEST(val == 2);
+	
+	murmur_close(mmr);
+	murmur_rules_free(rules);
+	murmur_schemas_free(schemas);
+	
+	return 0;
+}
+
+static int test_ring() {
+	struct murmur_ring *ring = murmur_ring_new(2);
+	TEST(ring != NULL);
+	
+	uint32_t nodes[2];
+	TEST(murmur_ring_lookup(ring, "a.b.c", nodes) == 0);
+	
+	TEST(murmur_ring_add(ring, "127.0.0.1", 2003, 1) == 0);
+	TEST(murmur_ring_add(ring, "127.0.0.1", 2004, 1) == 0);
+	TEST(murmur_ring_add(ring, "127.0.0.1", 2005, 2) == 0);
+	TEST(murmur_ring_add(ring, "127.0.0.1", 2005, 2) == -1);
+	TEST(murmur_ring_add(ring, "127.0.0.1", 2006, 0) == -1);
+	
+	uint32_t counts[4] = { 0 };
+	uint32_t primaries[10000];
+	for (uint32_t i = 0; i < NUM_ELEMS(primaries); i++) {
+		char name[64];
+		snprintf(name, sizeof(name), "servers.host%u.cpu", i);
+		
+		TEST(murmur_ring_lookup(ring, name, nodes) == 2);
+		TEST(nodes[0] != nodes[1]);
+		
+		primaries[i] = nodes[0];
+		counts[nodes[0]]++;
+	}
+	
+	// Weighted 1:1:2, give or take
+	TEST(counts[0] > 1800 && counts[0] < 3200);
+	TEST(counts[1] > 1800 && counts[1] < 3200);
+	TEST(counts[2] > 4000 && counts[2] < 6000);
+	
+	// A new node should only take its share, without shuffling the rest around
+	TEST(murmur_ring_add(ring, "127.0.0.1", 2006, 1) == 0);
+	
+	uint32_t moved = 0;
+	for (uint32_t i = 0; i < NUM_ELEMS(primaries); i++) {
+		char name[64];
+		snprintf(name, sizeof(name), "servers.host%u.cpu", i);
+		
+		TEST(murmur_ring_lookup(ring, name, nodes) == 2);
+		if (nodes[0] != primaries[i]) {
+			TEST(nodes[0] == 3);
+			moved++;
+		}
+	}
+	
+	TEST(moved > 1200 && moved < 2800);
+	
+	murmur_ring_free(ring);
+	
+	return 0;
+}
+
+/**
+ * Runs a store listening on the given socket in a child process, as a stand-in for a node.
+ */
+static volatile int node_stop = 0;
+
+static void node_on_signal(int sig) {
+	node_stop = 1;
+}
+
+static pid_t node_start(const char *root, const int fd) {
+	pid_t pid = fork();
+	if (pid != 0) {
+		close(fd);
+		return pid;
+	}
+	
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = node_on_signal;
+	sigaction(SIGTERM, &sa, NULL);
+	
+	struct murmur_schemas *schemas = murmur_schemas_parse("[all]\npattern = **\nretentions = 10s:1m\n");
+	struct murmur_store *store = murmur_store_open(root, schemas);
+	
+	int ret = murmur_store_listen(store, fd, &node_stop);
+	
+	murmur_store_close(store);
+	murmur_schemas_free(schemas);
+	_exit(ret);
+}
+
+static int node_stop_all(pid_t *pids, const int count) {
+	for (int i = 0; i < count; i++) {
+		int status;
+		kill(pids[i], SIGTERM);
+		if (waitpid(pids[i], &status, 0) != pids[i] || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+static int test_relay() {
+	TEST(system("rm -rf " STORE " && mkdir -p " STORE "/0 " STORE "/1") == 0);
+	
+	uint16_t base = 20000 + ((getpid() % 4000) * 4);
+	
+	struct murmur_ring *ring = murmur_ring_new(1);
+	TEST(murmur_ring_add(ring, "127.0.0.1", base, 1) == 0);
+	TEST(murmur_ring_add(ring, "127.0.0.1", base + 1, 1) == 0);
+	
+	struct murmur_relay *relay = murmur_relay_new(ring, 1024 * 1024);
+	TEST(relay != NULL);
+	
+	// Only the first node is up to begin with
+	pid_t pids[2];
+	int fd = murmur_tcp_listen("127.0.0.1", base);
+	TEST(fd != -1);
+	pids[0] = node_start(STORE "/0", fd);
+	
+	mmr_test_time = 1000;
+	
+	char name[64];
+	for (int i = 0; i < 100; i++) {
+		snprintf(name, sizeof(name), "relay.metric%d", i);
+		TEST(murmur_relay_send(relay, name, i, mmr_test_time) == 0);
+	}
+	
+	// The second node's points wait for it
+	TEST(murmur_relay_flush(relay) == -1);
+	
+	fd = murmur_tcp_listen("127.0.0.1", base + 1);
+	TEST(fd != -1);
+	pids[1] = node_start(STORE "/1", fd);
+	
+	int flushed = -1;
+	for (int i = 0; i < 100 && flushed != 0; i++) {
+		flushed = murmur_relay_flush(relay);
+		usleep(50 * 1000);
+	}
+	TEST(flushed == 0);
+	TEST(murmur_relay_dropped(relay) == 0);
+	
+	murmur_relay_free(relay);
+	TEST(node_stop_all(pids, 2) == 0);
+	
+	// Every metric should be on the node the ring picked, and only there
+	for (int i = 0; i < 100; i++) {
+		uint32_t node;
+		snprintf(name, sizeof(name), "relay.metric%d", i);
+		TEST(murmur_ring_lookup(ring, name, &node) == 1);
+		
+		char path[128];
+		snprintf(path, sizeof(path), STORE "/%u/relay/metric%d.mmr", node, i);
+		
+		struct murmur *mmr = murmur_open(path);
+		TEST(mmr != NULL);
+		
+		double val;
+		TEST(murmur_get(mmr, mmr_test_time, &val) == 0);
+		TEST(val == i);
+		murmur_close(mmr);
+		
+		snprintf(path, sizeof(path), STORE "/%u/relay/metric%d.mmr", !node, i);
+		TEST(access(path, F_OK) != 0);
+	}
+	
+	murmur_ring_free(ring);
+	
+	return 0;
+}
+
+/**
+ * What a cluster fetch found for a metric.
+ */
+struct fetched {
+	int calls;
+	int found;
+	double at_990;
+	double at_1000;
+};
+
+static void on_fetched(void *ctx, const char *name, const struct murmur_series *series) {
+	struct fetched *f = ctx;
+	if (strcmp(name, "cluster.b") == 0) {
+		f++;
+	} else if (strcmp(name, "cluster.missing") == 0) {
+		f += 2;
+	}
+	
+	f->calls++;
+	f->found = series != NULL;
+	f->at_990 = f->at_1000 = NAN;
+	
+	for (uint32_t i = 0; series != NULL && i < series->count; i++) {
+		int64_t at = series->from + (i * series->step);
+		if (at == 990) {
+			f->at_990 = series->values[i];
+		} else if (at == 1000) {
+			f->at_1000 = series->values[i];
+		}
+	}
+}
+
+static int test_cluster_fetch() {
+	TEST(system("rm -rf " STORE " && mkdir -p " STORE "/0 " STORE "/1") == 0);
+	
+	mmr_test_time = 1000;
+	
+	// Each node only got some of the points
+	struct murmur_schemas *schemas = murmur_schemas_parse("[all]\npattern = **\nretentions = 10s:1m\n");
+	struct murmur_store *store = murmur_store_open(STORE "/0", schemas);
+	TEST(murmur_store_set(store, "cluster.a", 1000, 1) == 0);
+	murmur_store_close(store);
+	
+	store = murmur_store_open(STORE "/1", schemas);
+	TEST(murmur_store_set(store, "cluster.a", 990, 2) == 0);
+	TEST(murmur_store_set(store, "cluster.b", 1000, 3) == 0);
+	murmur_store_close(store);
+	murmur_schemas_free(schemas);
+	
+	uint16_t base = 20000 + ((getpid() % 4000) * 4) + 2;
+	
+	struct murmur_ring *ring = murmur_ring_new(2);
+	TEST(murmur_ring_add(ring, "127.0.0.1", base, 1) == 0);
+	TEST(murmur_ring_add(ring, "127.0.0.1", base + 1, 1) == 0);
+	
+	pid_t pids[2];
+	int fd = murmur_tcp_listen("127.0.0.1", base);
+	TEST(fd != -1);
+	pids[0] = node_start(STORE "/0", fd);
+	
+	fd = murmur_tcp_listen("127.0.0.1", base + 1);
+	TEST(fd != -1);
+	pids[1] = node_start(STORE "/1", fd);
+	
+	const char *names[] = {
+		"cluster.a",
+		"cluster.b",
+		"cluster.missing",
+	};
+	
+	struct fetched fetched[3];
+	memset(fetched, 0, sizeof(fetched));
+	
+	TEST(murmur_cluster_fetch(ring, names, NUM_ELEMS(names), 900, 1000, 5000, on_fetched, fetched) == 0);
+	
+	TEST(fetched[0].calls == 1 && fetched[0].found);
+	TEST(fetched[0].at_1000 == 1);
+	TEST(fetched[0].at_990 == 2);
+	
+	TEST(fetched[1].calls == 1 && fetched[1].found);
+	TEST(fetched[1].at_1000 == 3);
+	TEST(isnan(fetched[1].at_990));
+	
+	TEST(fetched[2].calls == 1 && !fetched[2].found);
+	
+	// A client that never reads its replies doesn't hold up anyone else
+	int stalled = socket(AF_INET, SOCK_STREAM, 0);
+	int small = 4096;
+	TEST(setsockopt(stalled, SOL_SOCKET, SO_RCVBUF, &small, sizeof(small)) == 0);
+	
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(base),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	TEST(connect(stalled, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+	
+	char fetches[32 * 1024];
+	size_t fetches_len = 0;
+	while (fetches_len + 32 < sizeof(fetches)) {
+		fetches_len += snprintf(fetches + fetches_len, sizeof(fetches) - fetches_len, "fetch cluster.a 900 1000\n");
+	}
+	
+	// Far more replies than the sockets can buffer, all still read by the node
+	size_t sent = 0;
+	size_t want = fetches_len * 96;
+	while (sent < want) {
+		struct pollfd pfd = { .fd = stalled, .events = POLLOUT };
+		if (poll(&pfd, 1, 2000) != 1) {
+			break;
+		}
+		
+		size_t at = sent % fetches_len;
+		ssize_t s = send(stalled, fetches + at, fetches_len - at, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (s > 0) {
+			sent += s;
+		}
+	}
+	TEST(sent == want);
+	
+	memset(fetched, 0, sizeof(fetched));
+	TEST(murmur_cluster_fetch(ring, names, NUM_ELEMS(names), 900, 1000, 5000, on_fetched, fetched) == 0);
+	TEST(fetched[0].calls == 1 && fetched[0].at_1000 == 1);
+	close(stalled);
+	
+	TEST(node_stop_all(pids + 1, 1) == 0);
+	
+	// With a node down, whatever the rest know still comes back
+	memset(fetched, 0, sizeof(fetched));
+	TEST(murmur_cluster_fetch(ring, names, NUM_ELEMS(names), 900, 1000, 5000, on_fetched, fetched) == -1);
+	
+	TEST(fetched[0].calls == 1 && fetched[0].found);
+	TEST(fetched[0].at_1000 == 1);
+	TEST(isnan(fetched[0].at_990));
+	
+	TEST(fetched[1].calls == 1 && !fetched[1].found);
+	TEST(fetched[2].calls == 1 && !fetched[2].found);
+	
+	TEST(node_stop_all(pids, 1) == 0);
+	murmur_ring_free(ring);
+	
+	return 0;
+}
+
+/**
+ * Counts what a find turned up.
+ */
+struct found {
+	uint32_t count;
+	uint32_t leaves;
+	char names[256];
+};
+
+static void on_found(void *ctx, const char *name, const int leaf) {
+	struct found *f = ctx;
+	
+	f->count++;
+	f->leaves += leaf;
+	strncat(f->names, name, sizeof(f->names) - strlen(f->names) - 1);
+}
+
+static volatile int serve_stop = 0;
+
+static void serve_on_signal(int sig) {
+	serve_stop = 1;
+}
+
+/**
+ * Runs a query server for the test store in a child process.
+ */
+static pid_t serve_start(const int fd, const struct murmur_serve_opts *opts) {
+	pid_t pid = fork();
+	if (pid != 0) {
+		close(fd);
+		return pid;
+	}
+	
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = serve_on_signal;
+	sigaction(SIGTERM, &sa, NULL);
+	
+	struct murmur_store *store = murmur_store_open(STORE, NULL);
+	int ret = murmur_serve(store, fd, opts, &serve_stop);
+	murmur_store_close(store);
+	_exit(ret);
+}
+
+/**
+ * Sends requests to a query server and reads everything until it hangs up.
+ *
+ * @return The responses, which must be free'd.
+ */
+static char* serve_request(const uint16_t port, const char *requests) {
+	int fd = murmur_tcp_connect("127.0.0.1", port, 5000);
+	if (fd == -1 || send(fd, requests, strlen(requests), MSG_NOSIGNAL) != (ssize_t)strlen(requests)) {
+		return NULL;
+	}
+	
+	struct _murmur_buff b = { NULL, 0, 0 };
+	while (_murmur_buff_reserve(&b, 4096) == 0) {
+		ssize_t got = recv(fd, b.data + b.len, b.alloc - b.len - 1, 0);
+		if (got <= 0) {
+			break;
+		}
+		b.len += got;
+	}
+	
+	b.data[b.len] = '\0';
+	close(fd);
+	
+	return b.data;
+}
+
+static int test_serve() {
+	TEST(system("rm -rf " STORE " && mkdir -p " STORE) == 0);
+	
+	mmr_test_time = 1000;
+	
+	struct murmur_schemas *schemas = murmur_schemas_parse("[all]\npattern = **\nretentions = 10s:1m\n");
+	struct murmur_store *store = murmur_store_open(STORE, schemas);
+	TEST(murmur_store_set(store, "web.a.cpu", 990, 2) == 0);
+	TEST(murmur_store_set(store, "web.a.cpu", 1000, 1) == 0);
+	TEST(murmur_store_set(store, "web.b.cpu", 1000, 3) == 0);
+	TEST(murmur_store_set(store, "db.a.cpu", 1000, 4) == 0);
+	TEST(murmur_store_flush(store) == 0);
+	
+	struct found found;
+	memset(&found, 0, sizeof(found));
+	TEST(murmur_store_find(store, "web.*.cpu", on_found, &found) == 0);
+	TEST(found.count == 2 && found.leaves == 2);
+	TEST(found.names[0] == 'w');
+	
+	memset(&found, 0, sizeof(found));
+	TEST(murmur_store_find(store, "*.[ab]", on_found, &found) == 0);
+	TEST(found.count == 3 && found.leaves == 0);
+	
+	memset(&found, 0, sizeof(found));
+	TEST(murmur_store_find(store, "web.?.cpu.more", on_found, &found) == 0);
+	TEST(found.count == 0);
+	
+	murmur_store_close(store);
+	murmur_schemas_free(schemas);
+	
+	uint16_t port = 20000 + ((getpid() % 4000) * 4);
+	int fd = murmur_tcp_listen("127.0.0.1", port);
+	TEST(fd != -1);
+	
+	pid_t pid = serve_start(fd, NULL);
+	
+	// Everything is pipelined on one connection, and the last asks for it to be closed
+	const char *requests =
+		"GET /render?target=web.a.cpu&target=missing&from=-30s&until=now HTTP/1.1\r\n\r\n"
+		"GET /metrics/find?query=%7Bweb%2Cdb%7D.* HTTP/1.1\r\nHost: localhost\r\n\r\n"
+		"GET /nothing HTTP/1.1\r\n\r\n"
+		"GET /render?target=web.b.cpu&from=970&until=1000&format=raw HTTP/1.1\r\nConnection: close\r\n\r\n";
+	
+	char *resp = serve_request(port, requests);
+	
+	int status;
+	kill(pid, SIGTERM);
+	TEST(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	TEST(resp != NULL);
+	
+	char *json = strstr(resp, "[{\"target\":\"web.a.cpu\",\"datapoints\":[[null,980],[2,990],[1,1000]]}]");
+	char *find_web = strstr(resp, "{\"text\":\"a\",\"id\":\"web.a\",\"leaf\":0,\"expandable\":1}");
+	char *find_db = strstr(resp, "\"id\":\"db.a\"");
+	char *not_found = strstr(resp, "HTTP/1.1 404 Not Found");
+	char *raw = strstr(resp, "web.b.cpu,980,1010,10|None,None,3");
+	
+	// Responses must come back in the order they were asked for
+	TEST(json != NULL);
+	TEST(find_web != NULL && find_web > json);
+	TEST(find_db != NULL && find_db > json);
+	TEST(not_found != NULL && not_found > find_web && not_found > find_db);
+	TEST(raw != NULL && raw > not_found);
+	TEST(strstr(resp, "missing") == NULL);
+	
+	free(resp);
+	
+	return 0;
+}
+
+static int test_admission() {
+	TEST(system("rm -rf " STORE " && mkdir -p " STORE) == 0);
+	
+	mmr_test_time = 1000;
+	
+	struct murmur_schemas *schemas = murmur_schemas_parse("[all]\npattern = **\nretentions = 10s:1m,1m:10m\n");
+	struct murmur_store *store = murmur_store_open(STORE, schemas);
+	TEST(murmur_store_set(store, "adm.a", 1000, 1) == 0);
+	TEST(murmur_store_set(store, "adm.b", 1000, 2) == 0);
+	TEST(murmur_store_set(store, "other.x", 1000, 3) == 0);
+	TEST(murmur_store_flush(store) == 0);
+	
+	// Costs come straight from the archive that would be read
+	struct murmur *mmr = murmur_store_handle(store, "adm.a", 0);
+	TEST(murmur_fetch_cost(mmr, 940, 1000, 0) == 6 * sizeof(struct point));
+	TEST(murmur_fetch_cost(mmr, 940, 1000, 60) == 1 * sizeof(struct point));
+	TEST(murmur_fetch_cost(mmr, 400, 1000, 0) == 10 * sizeof(struct point));
+	TEST(murmur_fetch_cost(mmr, 1000, 900, 0) == 0);
+	
+	struct murmur_series series;
+	TEST(murmur_fetch_step(mmr, 940, 1000, 30, &series) == 0);
+	TEST(series.step == 60 && series.count == 1);
+	murmur_series_free(&series);
+	
+	murmur_store_close(store);
+	murmur_schemas_free(schemas);
+	
+	// Budgets are shared by everything reading at once
+	struct _murmur_server server;
+	memset(&server, 0, sizeof(server));
+	server.opts.max_inflight_bytes = 100;
+	server.opts.queue_timeout_ms = 10;
+	pthread_mutex_init(&server.lock, NULL);
+	pthread_cond_init(&server.budget, NULL);
+	
+	TEST(_murmur_http_admit(&server, 60) == 0);
+	TEST(_murmur_http_admit(&server, 60) == -1);
+	TEST(_murmur_http_admit(&server, 40) == 0);
+	_murmur_http_release(&server, 100);
+	TEST(_murmur_http_admit(&server, 500) == 0);
+	TEST(_murmur_http_admit(&server, 1) == -1);
+	_murmur_http_release(&server, 500);
+	TEST(server.inflight_bytes == 0);
+	
+	pthread_cond_destroy(&server.budget);
+	pthread_mutex_destroy(&server.lock);
+	
+	struct murmur_serve_opts opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.workers = 2;
+	opts.max_series = 2;
+	opts.downsample_bytes = 100;
+	opts.max_query_bytes = 300;
+	
+	uint16_t port = 20000 + ((getpid() % 4000) * 4) + 1;
+	int fd = murmur_tcp_listen("127.0.0.1", port);
+	TEST(fd != -1);
+	
+	pid_t pid = serve_start(fd, &opts);
+	
+	const char *requests =
+		"GET /render?target=adm.*&from=-60s&format=raw HTTP/1.1\r\n\r\n"
+		"GET /render?target=adm.*&from=-600s&format=raw HTTP/1.1\r\n\r\n"
+		"GET /render?target=adm.*&target=other.x&format=raw HTTP/1.1\r\nConnection: close\r\n\r\n";
+	
+	char *resp = serve_request(port, requests);
+	
+	int status;
+	kill(pid, SIGTERM);
+	TEST(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	TEST(resp != NULL);
+	
+	// Too much at full precision, but fine from the coarser archive
+	char *downsampled = strstr(resp, "X-Murmur-Cost: 40\r\nX-Murmur-Step: 60\r\n");
+	char *expensive = strstr(resp, "HTTP/1.1 413 Query Too Expensive");
+	char *too_many = strstr(resp, "HTTP/1.1 413 Too Many Series");
+	
+	TEST(downsampled != NULL);
+	TEST(strstr(resp, "adm.a,960,1020,60|") != NULL);
+	TEST(strstr(resp, "adm.b,960,1020,60|") != NULL);
+	TEST(expensive != NULL && expensive > downsampled);
+	TEST(too_many != NULL && too_many > expensive);
+	
+	free(resp);
+	
+	return 0;
+}
+
+static int test_index() {
+	TEST(system("rm -rf " STORE) == 0);
+	
+	mmr_test_time = 1000;
+	
+	struct murmur_schemas *schemas = murmur_schemas_parse("[all]\npattern = **\nretentions = 10s:1m\n");
+	struct murmur_store *store = murmur_store_open(STORE, schemas);
+	TEST(store != NULL);
+	TEST(access(STORE "/" MURMUR_INDEX_FILE, F_OK) == 0);
+	
+	TEST(murmur_store_set(store, "a.b.c", 1000, 1) == 0);
+	TEST(murmur_store_set(store, "a.b.d", 1000, 1) == 0);
+	TEST(murmur_store_set(store, "a.e", 1000, 1) == 0);
+	TEST(murmur_store_set(store, "x.y", 1000, 1) == 0);
+	
+	// Everything so far only lives in the journal
+	struct found found;
+	memset(&found, 0, sizeof(found));
+	TEST(murmur_store_find(store, "a.*", on_found, &found) == 0);
+	TEST(found.count == 2 && found.leaves == 1);
+	
+	// Another store on the same root (as if in another process) sees the same
+	struct murmur_store *other = murmur_store_open(STORE, NULL);
+	TEST(other != NULL);
+	
+	memset(&found, 0, sizeof(found));
+	TEST(murmur_store_find(other, "*.b.{c,d}", on_found, &found) == 0);
+	TEST(found.count == 2 && found.leaves == 2);
+	
+	// Closing folds the journal into the index, which the other store picks up
+	murmur_store_close(store);
+	
+	struct stat st;
+	TEST(stat(STORE "/" MURMUR_INDEX_JOURNAL, &st) == 0 && st.st_size == 0);
+	
+	memset(&found, 0, sizeof(found));
+	TEST(murmur_store_find(other, "a.b.*", on_found, &found) == 0);
+	TEST(found.count == 2 && found.leaves == 2);
+	
+	memset(&found, 0, sizeof(found));
+	TEST(murmur_store_find(other, "x", on_found, &found) == 0);
+	TEST(found.count == 1 && found.leaves == 0);
+	
+	TEST(murmur_store_delete(other, "a.b.c") == 0);
+	TEST(access(STORE "/a/b/c.mmr", F_OK) != 0);
+	
+	memset(&found, 0, sizeof(found));
+	TEST(murmur_store_find(other, "a.b.*", on_found, &found) == 0);
+	TEST(found.count == 1 && strcmp(found.names, "a.b.d") == 0);
+	
+	// Files made under the root by hand are journaled too, but not those that can't be names
+	char *specv[] = { "10s:1m" };
+	TEST(murmur_create(STORE "/a/b/z.mmr", 1, specv, agg_average, 50) == 0);
+	TEST(murmur_create(STORE "/a/b.c.mmr", 1, specv, agg_average, 50) == 0);
+	
+	memset(&found, 0, sizeof(found));
+	TEST(murmur_store_find(other, "a.b.z", on_found, &found) == 0);
+	TEST(found.count == 1 && found.leaves == 1);
+	
+	memset(&found, 0, sizeof(found));
+	TEST(murmur_store_find(other, "a.b.c", on_found, &found) == 0);
+	TEST(found.count == 0);
+	TEST(unlink(STORE "/a/b.c.mmr") == 0);
+	
+	// Anything else put there behind the store's back needs a reindex
+	TEST(system("cp " STORE "/a/b/z.mmr " STORE "/a/b/w.mmr") == 0);
+	
+	memset(&found, 0, sizeof(found));
+	TEST(murmur_store_find(other, "a.b.w", on_found, &found) == 0);
+	TEST(found.count == 0);
+	
+	TEST(murmur_store_reindex(other) == 0);
+	
+	memset(&found, 0, sizeof(found));
+	TEST(murmur_store_find(other, "a.b.w", on_found, &found) == 0);
+	TEST(found.count == 1 && found.leaves == 1);
+	
+	TEST(murmur_store_delete(other, "a.b.w") == 0);
+	
+	murmur_store_close(other);
+	
+	store = murmur_store_open(STORE, schemas);
+	TEST(store != NULL);
+	
+	memset(&found, 0, sizeof(found));
+	TEST(murmur_store_find(store, "a.b.*", on_found, &found) == 0);
+	TEST(found.count == 2);
+	TEST(strcmp(found.names, "a.b.da.b.z") == 0);
+	
+	// A branch with everything under it deleted is gone, from the index and the disk
+	TEST(murmur_store_delete(store, "a.b.d") == 0);
+	TEST(murmur_store_delete(store, "a.b.z") == 0);
+	TEST(access(STORE "/a/b", F_OK) != 0);
+	TEST(access(STORE "/a", F_OK) == 0);
+	
+	memset(&found, 0, sizeof(found));
+	TEST(murmur_store_find(store, "a.*", on_found, &found) == 0);
+	TEST(found.count == 1 && found.leaves == 1 && strcmp(found.names, "a.e") == 0);
+	
+	// And comes back with anything new under it
+	TEST(murmur_store_set(store, "a.b.n", 1000, 1) == 0);
+	
+	memset(&found, 0, sizeof(found));
+	TEST(murmur_store_find(store, "a.*", on_found, &found) == 0);
+	TEST(found.count == 2 && found.leaves == 1);
+	
+	murmur_store_close(store);
+	murmur_schemas_free(schemas);
+	
+	return 0;
+}
+
+/**
+ * Counts what a scan turned up.
+ */
+struct scanned {
+	uint32_t count;
+	uint32_t readable;
+	uint64_t disk_usage;
+};
+
+static int on_scanned(void *ctx, const struct murmur_scan_entry *entry) {
+	struct scanned *s = ctx;
+	
+	s->count++;
+	s->readable += entry->mmr != NULL && entry->mmr->archive_count == 1;
+	s->disk_usage += entry->disk_usage;
+	
+	return 0;
+}
+
+static int test_scan() {
+	TEST(system("rm -rf " STORE " " STORE "_archive") == 0);
+	
+	struct murmur_schemas *schemas = murmur_schemas_parse("[all]\npattern = **\nretentions = 10s:1m\n");
+	struct murmur_store *store = murmur_store_open(STORE, schemas);
+	
+	char name[64];
+	for (uint32_t i = 0; i < 100; i++) {
+		snprintf(name, sizeof(name), "hosts.h%02u.m%u", i % 20, i / 20);
+		TEST(murmur_store_set(store, name, 1000, i) == 0);
+	}
+	TEST(murmur_store_flush(store) == 0);
+	
+	struct scanned scanned;
+	memset(&scanned, 0, sizeof(scanned));
+	TEST(murmur_scan(STORE, 4, on_scanned, &scanned) == 0);
+	TEST(scanned.count == 100 && scanned.readable == 100);
+	TEST(scanned.disk_usage > 0);
+	
+	// Everything under h00 and h01 hasn't been touched in a long time
+	struct timespec times[2] = { { 1000, 0 }, { 1000, 0 } };
+	for (uint32_t i = 0; i < 5; i++) {
+		char path[128];
+		snprintf(path, sizeof(path), STORE "/hosts/h00/m%u.mmr", i);
+		TEST(utimensat(AT_FDCWD, path, times, 0) == 0);
+		snprintf(path, sizeof(path), STORE "/hosts/h01/m%u.mmr", i);
+		TEST(utimensat(AT_FDCWD, path, times, 0) == 0);
+	}
+	
+	TEST(murmur_store_clean(store, 2000, STORE "_archive", 4, NULL, NULL) == 10);
+	TEST(access(STORE "/hosts/h00/m0.mmr", F_OK) != 0);
+	TEST(access(STORE "_archive/hosts/h00/m0.mmr", F_OK) == 0);
+	TEST(access(STORE "/hosts/h02/m0.mmr", F_OK) == 0);
+	
+	struct found found;
+	memset(&found, 0, sizeof(found));
+	TEST(murmur_store_find(store, "hosts.h0[01].*", on_found, &found) == 0);
+	TEST(found.count == 0);
+	
+	memset(&scanned, 0, sizeof(scanned));
+	TEST(murmur_scan(STORE "_archive", 1, on_scanned, &scanned) == 0);
+	TEST(scanned.count == 10);
+	
+	// Writing to a removed metric brings it back, fresh
+	TEST(murmur_store_set(store, "hosts.h00.m0", 1000, 1) == 0);
+	TEST(murmur_store_clean(store, 2000, NULL, 4, NULL, NULL) == 0);
+	
+	memset(&scanned, 0, sizeof(scanned));
+	TEST(murmur_scan(STORE, 4, on_scanned, &scanned) == 0);
+	TEST(scanned.count == 91);
+	
+	murmur_store_close(store);
+	murmur_schemas_free(schemas);
+	
+	return 0;
+}
+
+static int test_io() {
+	char *spec[] = {
+		"10s:1m",
+		"1m:5m",
+	};
+	TEST(murmur_create(PATH, NUM_ELEMS(spec), spec, agg_average, 0) == 0);
+	
+	struct murmur *mmr = murmur_open(PATH);
+	TEST(mmr != NULL);
+	
+	struct murmur_io_stats before[MURMUR_IO_CLASSES], after[MURMUR_IO_CLASSES];
+	murmur_io_stats(before);
+	
+	// Each operation is classed by what it's doing: a set writes, then propogates
+	mmr_test_time = mmr->archives->retention * 5;
+	TEST(murmur_set(mmr, mmr_test_time, 1) == 0);
+	
+	struct murmur_series series;
+	TEST(murmur_fetch(mmr, mmr_test_time - 30, mmr_test_time, &series) == 0);
+	murmur_series_free(&series);
+	
+	murmur_io_stats(after);
+	// Just the point: unprotected writes don't record intents
+	TEST(after[io_ingest].ops == before[io_ingest].ops + 1);
+	TEST(after[io_ingest].bytes == before[io_ingest].bytes + sizeof(struct point));
+	TEST(after[io_propagation].ops == before[io_propagation].ops + 2);
+	TEST(after[io_query].ops > before[io_query].ops);
+	
+	// Unless the thread says otherwise
+	TEST(murmur_io_set_class(io_maintenance) == -1);
+	TEST(murmur_set(mmr, mmr_test_time, 2) == 0);
+	TEST(murmur_io_set_class(-1) == io_maintenance);
+	
+	murmur_io_stats(before);
+	TEST(before[io_maintenance].ops == after[io_maintenance].ops + 3);
+	TEST(before[io_ingest].ops == after[io_ingest].ops);
+	
+	struct murmur_io_class_opts classes[MURMUR_IO_CLASSES] = {
+		[io_ingest] = { 4, 0 },
+		[io_propagation] = { 2, 0 },
+		[io_query] = { 1, 1 },
+		[io_maintenance] = { 1, 0 },
+	};
+	TEST(murmur_io_configure(2, NULL) == -1);
+	TEST(murmur_io_configure(2, classes) == 0);
+	
+	// Everything still works with scheduling on
+	double val;
+	TEST(murmur_set(mmr, mmr_test_time, 3) == 0);
+	TEST(murmur_get(mmr, mmr_test_time, &val) == 0);
+	TEST(val == 3);
+	TEST(_murmur_io.inflight_total == 0);
+	
+	// Whoever has been given the least goes first, ties to ingest
+	pthread_mutex_lock(&_murmur_io.lock);
+	memset(_murmur_io.vtime, 0, sizeof(_murmur_io.vtime));
+	_murmur_io.waiting[io_ingest] = 1;
+	_murmur_io.waiting[io_query] = 1;
+	TEST(_murmur_io_next() == io_ingest);
+	
+	_murmur_io.vtime[io_ingest] = 100;
+	TEST(_murmur_io_next() == io_query);
+	
+	// A class at its own depth steps aside for the others
+	_murmur_io.inflight[io_query] = 1;
+	_murmur_io.inflight_total = 1;
+	TEST(_murmur_io_next() == io_ingest);
+	
+	// And nothing goes past the overall depth
+	_murmur_io.inflight_total = 2;
+	TEST(_murmur_io_next() == -1);
+	
+	memset(_murmur_io.waiting, 0, sizeof(_murmur_io.waiting));
+	memset(_murmur_io.inflight, 0, sizeof(_murmur_io.inflight));
+	_murmur_io.inflight_total = 0;
+	pthread_mutex_unlock(&_murmur_io.lock);
+	
+	// Charging is by bytes over weight, and an idle class starts from where everyone else is
+	memset(_murmur_io.vtime, 0, sizeof(_murmur_io.vtime));
+	_murmur_io.vclock = 10;
+	_murmur_io_end(_murmur_io_begin(io_propagation, 64));
+	TEST(_murmur_io.vtime[io_propagation] == 42);
+	
+	TEST(murmur_io_configure(0, NULL) == 0);
+	murmur_close(mmr);
+	
+	return 0;
+}
+
+static int test_aggregate() {
+	struct point points[7];
+	
+	// Intervals out of order, so the last point isn't the last written
+	int64_t intervals[] = { 30, 10, 70, 20, 60, 40, 50 };
+	double values[] = { 3, 1, 7, 2, 6, 4, 5 };
+	for (uint32_t i = 0; i < NUM_ELEMS(points); i++) {
+		_murmur_make_point(points + i, intervals[i], values[i]);
+	}
+	
+	// 6 has its own functions, 7 doesn't
+	murmur_aggregate_fn fn = _murmur_agg_select(agg_average, 6);
+	TEST(fn == _murmur_agg_average_6);
+	TEST(fn(points, 6) == 23.0 / 6);
+	TEST(_murmur_agg_select(agg_average, 7) == _murmur_agg_average_any);
+	TEST(_murmur_agg_select(agg_average, 7)(points, 7) == 28.0 / 7);
+	
+	TEST(_murmur_agg_select(agg_sum, 6)(points, 6) == 23);
+	TEST(_murmur_agg_select(agg_sum, 7)(points, 7) == 28);
+	TEST(_murmur_agg_select(agg_last, 6)(points, 6) == 7);
+	TEST(_murmur_agg_select(agg_last, 7)(points, 7) == 7);
+	TEST(_murmur_agg_select(agg_max, 6)(points, 6) == 7);
+	TEST(_murmur_agg_select(agg_min, 7)(points, 7) == 1);
+	
+	// Nothing unknown is fatal
+	TEST(_murmur_agg_select(0, 5) == _murmur_agg_average_5);
+	
+	char *spec[] = {
+		"10s:1m",
+		"1m:5m",
+		"5m:1h",
+	};
+	TEST(murmur_create(PATH, NUM_ELEMS(spec), spec, agg_max, 0) == 0);
+	
+	struct murmur *mmr = murmur_open(PATH);
+	TEST(mmr != NULL);
+	TEST(mmr->archives[0].ratio == 6 && mmr->archives[0].aggregate == _murmur_agg_max_6);
+	TEST(mmr->archives[1].ratio == 5 && mmr->archives[1].aggregate == _murmur_agg_max_5);
+	TEST(mmr->archives[2].ratio == 0 && mmr->archives[2].aggregate == NULL);
+	murmur_close(mmr);
+	
+	return 0;
+}
+
+static int test_shapes() {
+	char *spec[] = {
+		"10s:1m",
+		"1m:5m",
+	};
+	TEST(murmur_create(PATH, NUM_ELEMS(spec), spec, agg_sum, 0) == 0);
+	TEST(murmur_create(PATH2, NUM_ELEMS(spec), spec, agg_sum, 0) == 0);
+	
+	struct murmur *a = murmur_open(PATH);
+	struct murmur *b = murmur_open(PATH2);
+	TEST(a != NULL && b != NULL);
+	
+	// Files of the same kind share their archives
+	TEST(a->archives == b->archives);
+	uint32_t shapes = _murmur_shapes.count;
+	
+	murmur_close(b);
+	TEST(murmur_create(PATH2, NUM_ELEMS(spec), spec, agg_max, 0) == 0);
+	b = murmur_open(PATH2);
+	TEST(b != NULL);
+	TEST(a->archives != b->archives);
+	TEST(b->archives->aggregate == _murmur_agg_max_6);
+	
+	// And they outlive the files that use them
+	murmur_close(a);
+	a = murmur_open(PATH);
+	TEST(a != NULL);
+	TEST(_murmur_shapes.count == shapes + 1);
+	
+	murmur_close(a);
+	murmur_close(b);
+	
+	return 0;
+}
+
+static int test_mem() {
+	char *spec[] = {
+		"10s:1d",
+		"1m:5d",
+	};
+	TEST(murmur_create(PATH, NUM_ELEMS(spec), spec, agg_average, 0) == 0);
+	
+	struct murmur *mmr = murmur_open(PATH);
+	TEST(mmr != NULL);
+	
+	mmr_test_time = 86400;
+	
+	// The arena hands out aligned pieces, and gets them all back at once
+	struct _murmur_arena_mark mark = _murmur_arena_mark();
+	char *a = _murmur_arena_alloc(10);
+	char *b = _murmur_arena_alloc(MURMUR_ARENA_CHUNK * 3);
+	TEST(a != NULL && b != NULL);
+	TEST(((uintptr_t)a & 15) == 0 && ((uintptr_t)b & 15) == 0);
+	memset(b, 1, MURMUR_ARENA_CHUNK * 3);
+	_murmur_arena_release(mark);
+	TEST(_murmur_arena.in_use == mark.in_use);
+	TEST(_murmur_arena.high_water >= MURMUR_ARENA_CHUNK * 3);
+	
+	struct murmur_mem_stats before, after;
+	murmur_mem_stats(&before);
+	TEST(before.arena_high_water >= MURMUR_ARENA_CHUNK * 3);
+	
+	// The same again reuses the chunks
+	TEST(_murmur_arena_alloc(10) == a);
+	TEST(_murmur_arena_alloc(MURMUR_ARENA_CHUNK * 3) == b);
+	_murmur_arena_release(mark);
+	
+	murmur_mem_stats(&after);
+	TEST(after.arena_chunks == before.arena_chunks);
+	
+	// Once warmed up, fetches don't allocate anything
+	struct murmur_series series;
+	TEST(murmur_fetch(mmr, mmr_test_time - 3600, mmr_test_time, &series) == 0);
+	TEST(series.count == 360);
+	murmur_series_free(&series);
+	
+	murmur_mem_stats(&before);
+	for (int i = 0; i < 100; i++) {
+		TEST(murmur_fetch(mmr, mmr_test_time - 3600 + i, mmr_test_time, &series) == 0);
+		murmur_series_free(&series);
+	}
+	murmur_mem_stats(&after);
+	
+	TEST(after.arena_chunks == before.arena_chunks);
+	TEST(after.pool_misses == before.pool_misses);
+	TEST(after.pool_hits == before.pool_hits + 100);
+	TEST(after.pool_free_bytes == before.pool_free_bytes && after.pool_free_bytes > 0);
+	
+	// Huge series aren't pooled
+	uint64_t huge = (uint64_t)1 << (MURMUR_POOL_MIN_SHIFT + MURMUR_POOL_CLASSES);
+	TEST(_murmur_series_alloc(&series, huge) == 0);
+	series.values[huge - 1] = 1;
+	murmur_series_free(&series);
+	murmur_mem_stats(&before);
+	TEST(before.pool_free_bytes == after.pool_free_bytes);
+	
+	murmur_close(mmr);
+	
+	return 0;
+}
+
+static int test_recover() {
+	char *spec[] = {
+		"10s:1m",
+		"1m:5m",
+	};
+	TEST(murmur_create(PATH, NUM_ELEMS(spec), spec, agg_sum, 0) == 0);
+	
+	struct murmur *mmr = murmur_open(PATH);
+	TEST(mmr != NULL);
+	TEST(mmr->flags & MURMUR_FLAG_EXT);
+	
+	mmr_test_time = mmr->archives->retention * 5;
+	int64_t bucket = mmr_test_time - 60;
+	
+	// Die right after writing the top archive, before anything propogates
+	struct murmur_archive *arch = mmr->archives;
+	TEST(_murmur_intent_mark(mmr, arch, bucket, bucket + 10) == 0);
+	for (int64_t at = bucket; at <= bucket + 10; at += 10) {
+		int64_t interval;
+		struct point pt;
+		uint64_t offset = _murmur_point_offset(arch, at, &interval);
+		_murmur_make_point(&pt, interval, 5);
+		TEST(pwrite(mmr->fd, &pt, sizeof(pt), offset) == sizeof(pt));
+	}
+	
+	// Nothing has made it to the lower archive
+	double val;
+	TEST(_murmur_arch_get(mmr, arch->lower, bucket, &val) != 0);
+	murmur_close(mmr);
+	
+	// Opening finishes the job, once
+	mmr = murmur_open(PATH);
+	TEST(mmr != NULL);
+	TEST(_murmur_arch_get(mmr, mmr->archives->lower, bucket, &val) == 0);
+	TEST(val == 10);
+	TEST(_murmur_recover(mmr) == 0);
+	
+	// Protected writes clear up after themselves
+	murmur_protect(mmr, 1);
+	TEST(mmr->flags & MURMUR_FLAG_PROTECT);
+	TEST(murmur_set(mmr, bucket + 20, 5) == 0);
+	TEST(_murmur_recover(mmr) == 0);
+	
+	// A write at 0 isn't mistaken for there being nothing to repair
+	TEST(_murmur_intent_mark(mmr, mmr->archives, 0, 0) == 0);
+	TEST(_murmur_recover(mmr) == 1);
+	
+	murmur_close(mmr);
+	
+	// Files from before extension blocks still work, without the protection
+	struct stat st;
+	TEST(stat(PATH, &st) == 0);
+	TEST(truncate(PATH, st.st_size - sizeof(struct murmur_ext_header) - (2 * sizeof(struct murmur_ext_archive))) == 0);
+	
+	mmr = murmur_open(PATH);
+	TEST(mmr != NULL);
+	TEST(!(mmr->flags & MURMUR_FLAG_EXT));
+	TEST(murmur_set(mmr, mmr_test_time, 1) == 0);
+	TEST(stat(PATH, &st) == 0);
+	TEST((uint64_t)st.st_size == _murmur_ext_offset(mmr));
+	murmur_close(mmr);
+	
+	return 0;
+}
+
+static int test_recover_flush() {
+	char *spec[] = {
+		"10s:1m",
+		"1m:5m",
+	};
+	
+	// A flush that fails leaves its range behind, however the next flush goes
+	TEST(murmur_create(PATH, NUM_ELEMS(spec), spec, agg_sum, 0) == 0);
+	TEST(murmur_create(PATH2, NUM_ELEMS(spec), spec, agg_sum, 0) == 0);
+	
+	struct murmur *mmr = murmur_open(PATH);
+	struct murmur *other = murmur_open(PATH2);
+	TEST(mmr != NULL);
+	TEST(other != NULL);
+	
+	int saved = dup(other->fd);
+	int ro = open(PATH2, O_RDONLY);
+	TEST(saved != -1 && ro != -1);
+	TEST(dup2(ro, other->fd) == other->fd);
+	
+	struct murmur_sched *sched = murmur_sched_new();
+	mmr_test_time = mmr->archives->retention * 5;
+	int64_t bucket = mmr_test_time - 60;
+	TEST(murmur_sched_set(sched, mmr, bucket + 10, 3) == 0);
+	TEST(murmur_sched_set(sched, mmr, bucket + 20, 4) == 0);
+	TEST(murmur_sched_set(sched, other, bucket + 10, 1) == 0);
+	TEST(murmur_sched_flush(sched) == -1);
+	TEST(mmr->intent_count == 1);
+	
+	TEST(dup2(saved, other->fd) == other->fd);
+	close(saved);
+	close(ro);
+	
+	// As if the propagation had never landed
+	int64_t interval;
+	struct point pt;
+	uint64_t offset = _murmur_point_offset(mmr->archives->lower, bucket, &interval);
+	_murmur_make_point(&pt, interval, 1);
+	TEST(pwrite(mmr->fd, &pt, sizeof(pt), offset) == sizeof(pt));
+	
+	// While the writer has it marked, nobody else takes it for a crash
+	struct murmur *reader = murmur_open(PATH);
+	TEST(reader != NULL);
+	double val;
+	TEST(_murmur_arch_get(reader, reader->archives->lower, bucket, &val) == 0);
+	TEST(val == 1);
+	murmur_close(reader);
+	
+	mmr_test_time += 30;
+	TEST(murmur_sched_set(sched, mmr, bucket + 90, 5) == 0);
+	TEST(murmur_sched_flush(sched) == 0);
+	TEST(mmr->intent_count == 0);
+	murmur_sched_free(sched);
+	murmur_close(other);
+	murmur_close(mmr);
+	
+	mmr = murmur_open(PATH);
+	TEST(mmr != NULL);
+	TEST(_murmur_recover(mmr) == 0);
+	TEST(_murmur_arch_get(mmr, mmr->archives->lower, bucket, &val) == 0);
+	TEST(val == 7);
+	murmur_close(mmr);
+	
+	return 0;
+}
+
+static int test_partition() {
+	TEST(system("rm -rf " STORE) == 0);
+	
+	struct murmur_schemas *schemas = murmur_schemas_parse(
+		"[cpu]\n"
+		"pattern = servers.*.cpu\n"
+		"retentions = 10s:1h,1m:1d\n"
+		"aggregation = sum\n");
+	TEST(schemas != NULL);
+	
+	struct murmur_store *store = murmur_store_open(STORE, schemas);
+	TEST(store != NULL);
+	TEST(murmur_store_partition(store, "10s:1m", 10) == 0);
+	
+	mmr_test_time = 36000;
+	int64_t start = mmr_test_time - 60;
+	
+	TEST(murmur_store_set(store, "servers.a.cpu", start + 10, 5) == 0);
+	TEST(murmur_store_set(store, "servers.b.cpu", start + 20, 7) == 0);
+	TEST(murmur_store_set(store, "servers.a.memory", start + 10, 1) == -1);
+	TEST(murmur_store_flush(store) == 0);
+	
+	// One file for the span, holding both metrics, and nothing in theirs yet
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), STORE "/" MURMUR_PARTS_DIR "/%ld.part", start);
+	
+	struct stat st;
+	TEST(stat(path, &st) == 0);
+	TEST((size_t)st.st_size == sizeof(struct _murmur_part_header) + (6 * MURMUR_PARTS_MIN_WIDTH * sizeof(double)));
+	
+	double val;
+	struct murmur *mmr = murmur_store_handle(store, "servers.a.cpu", 0);
+	TEST(mmr != NULL);
+	TEST(_murmur_arch_get(mmr, mmr->archives, start + 10, &val) != 0);
+	
+	struct murmur_series series;
+	TEST(murmur_store_fetch(store, "servers.a.cpu", start, mmr_test_time, &series) == 0);
+	TEST(series.from == start + 10);
+	TEST(series.values[0] == 5);
+	TEST(isnan(series.values[1]));
+	murmur_series_free(&series);
+	
+	// Partitions outlive the store
+	murmur_store_close(store);
+	store = murmur_store_open(STORE, schemas);
+	TEST(store != NULL);
+	TEST(murmur_store_partition(store, "10s:1m", 10) == 0);
+	
+	TEST(murmur_store_fetch(store, "servers.b.cpu", start, mmr_test_time, &series) == 0);
+	TEST(series.values[1] == 7);
+	murmur_series_free(&series);
+	
+	// Late, but within the grace
+	mmr_test_time += 5;
+	TEST(murmur_store_set(store, "servers.a.cpu", start + 30, 3) == 0);
+	TEST(murmur_store_flush(store) == 0);
+	TEST(stat(path, &st) == 0);
+	
+	// Past it, the partition is rolled up into each metric's file, but only once they can
+	// all be written
+	mmr_test_time += 5;
+	mmr = murmur_store_handle(store, "servers.a.cpu", 0);
+	int saved = dup(mmr->fd);
+	int ro = open(STORE "/servers/a/cpu.mmr", O_RDONLY);
+	TEST(saved != -1 && ro != -1);
+	TEST(dup2(ro, mmr->fd) == mmr->fd);
+	
+	TEST(murmur_store_flush(store) == -1);
+	TEST(stat(path, &st) == 0);
+	
+	TEST(dup2(saved, mmr->fd) == mmr->fd);
+	close(saved);
+	close(ro);
+	
+	TEST(murmur_store_flush(store) == 0);
+	TEST(stat(path, &st) != 0);
+	
+	TEST(_murmur_arch_get(mmr, mmr->archives, start + 10, &val) == 0);
+	TEST(val == 5);
+	TEST(_murmur_arch_get(mmr, mmr->archives + 1, start, &val) == 0);
+	TEST(val == 8);
+	
+	// Anything older goes straight to the file
+	TEST(murmur_store_set(store, "servers.b.cpu", start + 40, 2) == 0);
+	TEST(store->sched->count == 1);
+	
+	murmur_store_close(store);
+	murmur_schemas_free(schemas);
+	
+	return 0;
+}
+
+static int test_memtable() {
+	TEST(system("rm -rf " STORE) == 0);
+	
+	struct murmur_schemas *schemas = murmur_schemas_parse(
+		"[cpu]\n"
+		"pattern = servers.*.cpu\n"
+		"retentions = 10s:1h,1m:1d\n"
+		"aggregation = sum\n");
+	TEST(schemas != NULL);
+	
+	struct murmur_store *store = murmur_store_open(STORE, schemas);
+	TEST(store != NULL);
+	TEST(murmur_store_memtable(store, 4, 1000, 60) == 0);
+	TEST(murmur_store_partition(store, "10s:1m", 10) == -1);
+	
+	mmr_test_time = 36000;
+	int64_t bucket = mmr_test_time - 60;
+	
+	TEST(murmur_store_set(store, "servers.a.cpu", bucket + 20, 5) == 0);
+	TEST(murmur_store_set(store, "servers.a.cpu", bucket + 30, 6) == 0);
+	TEST(murmur_store_set(store, "servers.a.cpu", bucket + 10, 4) == 0);
+	TEST(murmur_store_set(store, "servers.a.cpu", bucket + 30, 7) == 0);
+	TEST(murmur_store_set(store, "servers.a.memory", bucket + 10, 1) == -1);
+	TEST(store->mem->points == 3);
+	TEST(store->sched->count == 0);
+	
+	// Read from memory, with nothing on disk yet
+	double val;
+	struct murmur *mmr = murmur_store_handle(store, "servers.a.cpu", 0);
+	TEST(mmr != NULL);
+	TEST(_murmur_arch_get(mmr, mmr->archives, bucket + 10, &val) != 0);
+	
+	struct murmur_series series;
+	TEST(murmur_store_fetch(store, "servers.a.cpu", bucket, mmr_test_time, &series) == 0);
+	TEST(series.from == bucket + 10);
+	TEST(series.values[0] == 4);
+	TEST(series.values[1] == 5);
+	TEST(series.values[2] == 7);
+	TEST(isnan(series.values[3]));
+	murmur_series_free(&series);
+	
+	// Everything logged can be gotten back, as if this store had died
+	TEST(_murmur_mem_log_sync(store->mem) == 0);
+	
+	struct stat st;
+	TEST(stat(STORE "/" MURMUR_MEM_LOG, &st) == 0);
+	TEST((size_t)st.st_size == 4 * (sizeof(struct _murmur_mem_record) + strlen("servers.a.cpu")));
+	
+	struct murmur_store *other = murmur_store_open(STORE, schemas);
+	TEST(other != NULL);
+	TEST(murmur_store_memtable(other, 2, 1000, 60) == 0);
+	TEST(other->mem->points == 3);
+	TEST(murmur_store_fetch(other, "servers.a.cpu", bucket, mmr_test_time, &series) == 0);
+	TEST(series.values[2] == 7);
+	murmur_series_free(&series);
+	murmur_store_close(other);
+	
+	// Flushed in bulk, with the log emptied
+	TEST(murmur_store_flush(store) == 0);
+	TEST(store->mem->points == 0);
+	TEST(stat(STORE "/" MURMUR_MEM_LOG, &st) == 0);
+	TEST(st.st_size == 0);
+	
+	TEST(_murmur_arch_get(mmr, mmr->archives, bucket + 30, &val) == 0);
+	TEST(val == 7);
+	TEST(_murmur_arch_get(mmr, mmr->archives + 1, bucket, &val) == 0);
+	TEST(val == 16);
+	
+	// A flush that can't write keeps its points, under anything newer, and the log
+	int saved = dup(mmr->fd);
+	int ro = open(STORE "/servers/a/cpu.mmr", O_RDONLY);
+	TEST(saved != -1 && ro != -1);
+	TEST(dup2(ro, mmr->fd) == mmr->fd);
+	
+	TEST(murmur_store_set(store, "servers.a.cpu", bucket + 40, 8) == 0);
+	TEST(murmur_store_set(store, "servers.a.cpu", bucket + 50, 9) == 0);
+	TEST(murmur_store_flush(store) == -1);
+	TEST(store->mem->points == 2);
+	TEST(stat(STORE "/" MURMUR_MEM_LOG, &st) == 0);
+	TEST(st.st_size > 0);
+	
+	TEST(murmur_store_set(store, "servers.a.cpu", bucket + 50, 10) == 0);
+	TEST(store->mem->points == 2);
+	
+	TEST(dup2(saved, mmr->fd) == mmr->fd);
+	close(saved);
+	close(ro);
+	
+	TEST(murmur_store_flush(store) == 0);
+	TEST(store->mem->points == 0);
+	TEST(_murmur_arch_get(mmr, mmr->archives, bucket + 40, &val) == 0);
+	TEST(val == 8);
+	TEST(_murmur_arch_get(mmr, mmr->archives, bucket + 50, &val) == 0);
+	TEST(val == 10);
+	TEST(stat(STORE "/" MURMUR_MEM_LOG, &st) == 0);
+	TEST(st.st_size == 0);
+	
+	murmur_store_close(store);
+	murmur_schemas_free(schemas);
+	
+	return 0;
+}
+
+static void test_subscribe_count(void *ctx, const char *name, const int64_t timestamp, const double value) {
+	*(double*)ctx += value;
+}
+
+static int test_subscribe() {
+	TEST(system("rm -rf " STORE) == 0);
+	
+	struct murmur_schemas *schemas = murmur_schemas_parse(
+		"[servers]\n"
+		"pattern = servers.**\n"
+		"retentions = 10s:1h\n");
+	TEST(schemas != NULL);
+	
+	struct murmur_store *store = murmur_store_open(STORE, schemas);
+	TEST(store != NULL);
+	
+	double cpu = 0;
+	double all = 0;
+	int cpu_id = murmur_store_subscribe(store, "servers.*.cpu", test_subscribe_count, &cpu);
+	TEST(cpu_id > 0);
+	TEST(murmur_store_subscribe(store, "servers.**", test_subscribe_count, &all) > 0);
+	TEST(murmur_store_subscribe(store, "servers.**.cpu", test_subscribe_count, &all) == -1);
+	
+	int sv[2];
+	TEST(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	TEST(murmur_store_subscribe_fd(store, "servers.a.*", sv[0]) > 0);
+	
+	mmr_test_time = 36000;
+	
+	TEST(murmur_store_set(store, "servers.a.cpu", mmr_test_time, 1) == 0);
+	TEST(murmur_store_set(store, "servers.b.cpu", mmr_test_time, 2) == 0);
+	TEST(murmur_store_set(store, "servers.a.memory", mmr_test_time, 4) == 0);
+	TEST(murmur_store_set(store, "other.a.cpu", mmr_test_time, 8) == -1);
+	TEST(cpu == 3);
+	TEST(all == 7);
+	
+	// Socket subscribers get their points in a batch, on flush
+	char buff[256];
+	TEST(recv(sv[1], buff, sizeof(buff), MSG_DONTWAIT) == -1);
+	TEST(murmur_store_flush(store) == 0);
+	
+	ssize_t got = recv(sv[1], buff, sizeof(buff) - 1, MSG_DONTWAIT);
+	TEST(got > 0);
+	buff[got] = '\0';
+	TEST(strcmp(buff, "servers.a.cpu 1 36000\nservers.a.memory 4 36000\n") == 0);
+	
+	TEST(murmur_store_unsubscribe(store, cpu_id) == 0);
+	TEST(murmur_store_unsubscribe(store, cpu_id) == -1);
+	TEST(murmur_store_set(store, "servers.a.cpu", mmr_test_time, 16) == 0);
+	TEST(cpu == 3);
+	TEST(all == 23);
+	
+	// Once the consumer is gone, so is its subscription
+	close(sv[1]);
+	TEST(murmur_store_flush(store) == 0);
+	TEST(store->subs->count == 1);
+	
+	murmur_store_close(store);
+	murmur_schemas_free(schemas);
+	
+	return 0;
+}
+
+/**
+ * Checks a range sum against reading every point.
+ */
+static int test_prefix_range(struct murmur *mmr, const int64_t from, const int64_t until) {
+	double sum;
+	uint64_t count;
+	TEST(murmur_range_sum(mmr, from, until, &sum, &count) == 0);
+	
+	struct murmur_series series;
+	TEST(murmur_fetch(mmr, from, until, &series) == 0);
+	
+	double want_sum = 0;
+	uint64_t want_count = 0;
+	for (uint32_t i = 0; i < series.count; i++) {
+		if (!isnan(series.values[i])) {
+			want_sum += series.values[i];
+			want_count++;
+		}
+	}
+	murmur_series_free(&series);
+	
+	TEST(sum == want_sum);
+	TEST(count == want_count);
+	
+	return 0;
+}
+
+static int test_prefix() {
+	char *spec[] = {
+		"10s:1m",
+		"1m:5m",
+	};
+	TEST(murmur_create(PATH, NUM_ELEMS(spec), spec, agg_sum, 0) == 0);
+	
+	mmr_test_time = 600;
+	int64_t now = mmr_test_time;
+	
+	struct murmur *mmr = murmur_open(PATH);
+	TEST(mmr != NULL);
+	TEST(!(mmr->flags & MURMUR_FLAG_PREFIX));
+	TEST(murmur_set(mmr, now - 50, 1) == 0);
+	TEST(murmur_set(mmr, now - 40, 2) == 0);
+	murmur_close(mmr);
+	
+	// Built from what's already there
+	TEST(murmur_prefix_enable(PATH) == 0);
+	TEST(murmur_prefix_enable(PATH) == 0);
+	
+	mmr = murmur_open(PATH);
+	TEST(mmr != NULL);
+	TEST(mmr->flags & MURMUR_FLAG_PREFIX);
+	
+	double sum;
+	uint64_t count;
+	TEST(murmur_range_sum(mmr, now - 60, now, &sum, &count) == 0);
+	TEST(sum == 3);
+	TEST(count == 2);
+	
+	// Newer, skipping an interval, then replacing and going back before the oldest
+	TEST(murmur_set(mmr, now - 30, 3) == 0);
+	TEST(murmur_set(mmr, now - 10, 5) == 0);
+	TEST(murmur_set(mmr, now - 40, 4) == 0);
+	TEST(murmur_set(mmr, now - 60, 6) == 0);
+	
+	TEST(murmur_range_sum(mmr, now - 60, now, &sum, &count) == 0);
+	TEST(sum == 13);
+	TEST(count == 4);
+	
+	for (int64_t from = now - 70; from < now; from += 5) {
+		for (int64_t until = from; until <= now; until += 10) {
+			TEST(test_prefix_range(mmr, from, until) == 0);
+		}
+	}
+	
+	// Around the end of the ring, through the scheduler
+	mmr_test_time = now + 30;
+	
+	struct murmur_sched *sched = murmur_sched_new();
+	TEST(sched != NULL);
+	TEST(murmur_sched_set(sched, mmr, now, 7) == 0);
+	TEST(murmur_sched_set(sched, mmr, now + 20, 8) == 0);
+	TEST(murmur_sched_flush(sched) == 0);
+	murmur_sched_free(sched);
+	
+	TEST(murmur_range_sum(mmr, now - 30, now + 30, &sum, &count) == 0);
+	TEST(sum == 20);
+	TEST(count == 3);
+	
+	for (int64_t from = now - 30; from < now + 30; from += 10) {
+		TEST(test_prefix_range(mmr, from, now + 30) == 0);
+	}
+	
+	// The lower archive keeps its own
+	TEST(test_prefix_range(mmr, now - 240, now + 30) == 0);
+	TEST(murmur_range_sum(mmr, now - 240, now + 30, &sum, &count) == 0);
+	TEST(count == 2);
+	
+	murmur_close(mmr);
+	
+	return 0;
+}
+
+static int test_downsample() {
+	char *spec[] = {
+		"1s:10m",
+	};
+	TEST(murmur_create(PATH, NUM_ELEMS(spec), spec, agg_average, 0) == 0);
+	
+	mmr_test_time = 1000;
+	int64_t now = mmr_test_time;
+	
+	struct murmur *mmr = murmur_open(PATH);
+	TEST(mmr != NULL);
+	
+	// A sawtooth with one spike in each direction, and a gap
+	struct murmur_sched *sched = murmur_sched_new();
+	TEST(sched != NULL);
+	for (int64_t t = now - 599; t <= now; t++) {
+		double v = 100 + (t % 50);
+		if (t == now - 333) {
+			v = 1000;
+		} else if (t == now - 111) {
+			v = 0;
+		} else if (t > now - 200 && t <= now - 180) {
+			continue;
+		}
+		TEST(murmur_sched_set(sched, mmr, t, v) == 0);
+	}
+	TEST(murmur_sched_flush(sched) == 0);
+	murmur_sched_free(sched);
+	
+	struct murmur_points points;
+	TEST(murmur_fetch_downsample(mmr, now - 600, now, 0, ds_m4, 10, &points) == 0);
+	TEST(points.count > 10 && points.count <= 40);
+	TEST(points.timestamps[0] == now - 599);
+	TEST(points.timestamps[points.count - 1] == now);
+	
+	int spikes = 0;
+	for (uint32_t i = 0; i < points.count; i++) {
+		TEST(i == 0 || points.timestamps[i] > points.timestamps[i - 1]);
+		TEST(!isnan(points.values[i]));
+		spikes += points.values[i] == 1000 || points.values[i] == 0;
+	}
+	TEST(spikes == 2);
+	murmur_points_free(&points);
+	
+	TEST(murmur_fetch_downsample(mmr, now - 600, now, 0, ds_lttb, 20, &points) == 0);
+	TEST(points.count == 20);
+	TEST(points.timestamps[0] == now - 599);
+	TEST(points.timestamps[points.count - 1] == now);
+	
+	spikes = 0;
+	for (uint32_t i = 0; i < points.count; i++) {
+		TEST(i == 0 || points.timestamps[i] > points.timestamps[i - 1]);
+		TEST(points.timestamps[i] <= now - 200 || points.timestamps[i] > now - 180);
+		spikes += points.values[i] == 1000 || points.values[i] == 0;
+	}
+	TEST(spikes == 2);
+	murmur_points_free(&points);
+	
+	// Fewer points than pixels are all kept, less the missing ones
+	TEST(murmur_fetch_downsample(mmr, now - 210, now - 170, 0, ds_lttb, 100, &points) == 0);
+	TEST(points.count == 20);
+	murmur_points_free(&points);
+	
+	TEST(murmur_fetch_downsample(mmr, now - 210, now - 170, 0, ds_m4, 100, &points) == 0);
+	TEST(points.count == 20);
+	murmur_points_free(&points);
+	
+	// Room is made for the points there are, not for however many pixels are asked for
+	TEST(murmur_fetch_downsample(mmr, now - 210, now - 170, 0, ds_m4, UINT32_MAX, &points) == 0);
+	TEST(points.count == 20);
+	murmur_points_free(&points);
+	
+	TEST(murmur_fetch_downsample(mmr, now - 600, now, 0, ds_m4, 0, &points) != 0);
+	murmur_points_free(&points);
+	
+	// Infinities aren't JSON, so they go out as missing
+	double values[] = { 1, INFINITY, -INFINITY, NAN };
+	struct murmur_series series = { .from = 10, .step = 10, .count = 4, .values = values };
+	struct _murmur_buff b = { NULL, 0, 0 };
+	TEST(_murmur_format_json(&b, "a", &series) == 0);
+	TEST(_murmur_buff_append(&b, "", 1) == 0);
+	TEST(strcmp(b.data, "{\"target\":\"a\",\"datapoints\":[[1,10],[null,20],[null,30],[null,40]]}") == 0);
+	
+	int64_t timestamps[] = { 10, 20 };
+	points = (struct murmur_points){ .count = 2, .timestamps = timestamps, .values = values };
+	b.len = 0;
+	TEST(_murmur_format_json_points(&b, "a", &points) == 0);
+	TEST(_murmur_buff_append(&b, "", 1) == 0);
+	TEST(strcmp(b.data, "{\"target\":\"a\",\"datapoints\":[[1,10],[null,20]]}") == 0);
+	free(b.data);
+	
+	murmur_close(mmr);
+	
+	return 0;
+}
+
+/**
+ * Records the passes of a progressive fetch.
+ */
+struct test_progress {
+	uint32_t passes;
+	uint32_t steps[4];
+	uint32_t finals;
+	uint32_t stop_after;
+	double last;
+};
+
+static int test_on_progress(void *ctx, const struct murmur_series *series, const int final) {
+	struct test_progress *p = ctx;
+	
+	p->steps[p->passes++] = series->step;
+	p->finals += final != 0;
+	p->last = series->values[series->count - 1];
+	
+	return p->passes == p->stop_after;
+}
+
+static int test_progressive() {
+	char *spec[] = {
+		"10s:1m",
+		"1m:5m",
+		"5m:1h",
+	};
+	TEST(murmur_create(PATH, NUM_ELEMS(spec), spec, agg_max, 0) == 0);
+	
+	mmr_test_time = 3600;
+	int64_t now = mmr_test_time;
+	
+	struct murmur *mmr = murmur_open(PATH);
+	TEST(mmr != NULL);
+	TEST(murmur_set(mmr, now - 10, 5) == 0);
+	TEST(murmur_set(mmr, now, 7) == 0);
+	
+	// Coarsest first, down to the most precise
+	struct test_progress p = { 0 };
+	TEST(murmur_fetch_progressive(mmr, now - 60, now, 0, test_on_progress, &p) == 0);
+	TEST(p.passes == 3);
+	TEST(p.steps[0] == 300);
+	TEST(p.steps[1] == 60);
+	TEST(p.steps[2] == 10);
+	TEST(p.finals == 1);
+	TEST(p.last == 7);
+	
+	// Only as fine as asked for, or as the range allows
+	memset(&p, 0, sizeof(p));
+	TEST(murmur_fetch_progressive(mmr, now - 60, now, 60, test_on_progress, &p) == 0);
+	TEST(p.passes == 2);
+	TEST(p.finals == 1);
+	
+	memset(&p, 0, sizeof(p));
+	TEST(murmur_fetch_progressive(mmr, now - 600, now, 0, test_on_progress, &p) == 0);
+	TEST(p.passes == 1);
+	TEST(p.steps[0] == 300);
+	TEST(p.finals == 1);
+	
+	// The callback can stop early
+	memset(&p, 0, sizeof(p));
+	p.stop_after = 1;
+	TEST(murmur_fetch_progressive(mmr, now - 60, now, 0, test_on_progress, &p) == 0);
+	TEST(p.passes == 1);
+	TEST(p.finals == 0);
+	
+	murmur_close(mmr);
+	
+	return 0;
+}
+
+static int test_stats() {
+	char *spec[] = {
+		"1s:20m",
+	};
+	TEST(murmur_create(PATH, NUM_ELEMS(spec), spec, agg_average, 0) == 0);
+	
+	mmr_test_time = 2000;
+	int64_t now = mmr_test_time;
+	
+	struct murmur *mmr = murmur_open(PATH);
+	TEST(mmr != NULL);
+	
+	// 1 to 1000, shuffled in time, with a gap around them
+	struct murmur_sched *sched = murmur_sched_new();
+	TEST(sched != NULL);
+	for (int64_t i = 0; i < 1000; i++) {
+		TEST(murmur_sched_set(sched, mmr, now - 1000 + i, ((i * 7) % 1000) + 1) == 0);
+	}
+	TEST(murmur_sched_flush(sched) == 0);
+	murmur_sched_free(sched);
+	
+	double quantiles[] = { 0, 0.5, 0.9, 0.99, 1 };
+	double values[NUM_ELEMS(quantiles)];
+	struct murmur_stats stats;
+	
+	TEST(murmur_range_stats(mmr, now - 1100, now, quantiles, NUM_ELEMS(quantiles), &stats, values) == 0);
+	TEST(stats.count == 1000);
+	TEST(stats.min == 1);
+	TEST(stats.max == 1000);
+	TEST(stats.sum == 500500);
+	TEST(fabs(stats.mean - 500.5) < 1e-9);
+	TEST(fabs(stats.stddev - sqrt((1000.0 * 1000 - 1) / 12)) < 1e-9);
+	
+	TEST(values[0] == 1);
+	TEST(fabs(values[1] - 500) <= 500 * 0.01);
+	TEST(fabs(values[2] - 900) <= 900 * 0.01);
+	TEST(fabs(values[3] - 990) <= 990 * 0.01);
+	TEST(values[4] == 1000);
+	
+	// Nothing in the range
+	TEST(murmur_range_stats(mmr, now - 1100, now - 1001, quantiles, NUM_ELEMS(quantiles), &stats, values) == 0);
+	TEST(stats.count == 0);
+	TEST(isnan(stats.mean));
+	TEST(isnan(values[1]));
+	
+	// Quantiles are optional, and a wide spread still keeps the large ones accurate
+	TEST(murmur_set(mmr, now - 1001, 1e15) == 0);
+	TEST(murmur_range_stats(mmr, now - 1100, now, NULL, 0, &stats, NULL) == 0);
+	TEST(stats.count == 1001);
+	TEST(stats.max == 1e15);
+	
+	struct _murmur_sketch *sk = malloc(sizeof(*sk));
+	TEST(sk != NULL);
+	_murmur_sketch_init(sk);
+	for (int i = 0; i < 100; i++) {
+		_murmur_sketch_add(sk, 1e-8);
+		_murmur_sketch_add(sk, 1e12);
+		_murmur_sketch_add(sk, -5);
+	}
+	TEST(fabs(_murmur_sketch_quantile(sk, 0) + 5) <= 5 * 0.01);
+	TEST(fabs(_murmur_sketch_quantile(sk, 1) - 1e12) <= 1e12 * 0.01);
+	
+	// A large value first leaves room below it for small ones that come later
+	_murmur_sketch_init(sk);
+	_murmur_sketch_add(sk, 1e15);
+	_murmur_sketch_add(sk, 1);
+	TEST(fabs(_murmur_sketch_quantile(sk, 0) - 1) <= 0.01);
+	TEST(fabs(_murmur_sketch_quantile(sk, 1) - 1e15) <= 1e15 * 0.01);
+	free(sk);
+	
+	murmur_close(mmr);
+	
+	return 0;
+}
+
+/**
+ * Reads the one point at 3540 from the archive at 1m with the given aggregation, 0 for the default.
+ */
+static int test_archive_aggregation_read(struct murmur *mmr, const enum aggregation_method aggregation, double *value) {
+	struct murmur_series series;
+	int ret = aggregation == 0 ?
+		murmur_fetch_step(mmr, 3539, 3595, 60, &series) :
+		murmur_fetch_aggregation(mmr, 3539, 3595, 60, aggregation, &series);
+	
+	TEST(ret == 0);
+	TEST(series.count == 1);
+	TEST(series.from == 3540);
+	*value = series.values[0];
+	murmur_series_free(&series);
+	
+	return 0;
+}
+
+static int test_archive_aggregation() {
+	// The most precise archive can't have siblings, and siblings need their own methods
+	char *top[] = { "10s:1m", "10s:1m:max" };
+	TEST(murmur_create(PATH, NUM_ELEMS(top), top, agg_average, 0) != 0);
+	char *same[] = { "10s:1m", "1m:5m", "1m:5m" };
+	TEST(murmur_create(PATH, NUM_ELEMS(same), same, agg_average, 0) != 0);
+	char *same_method[] = { "10s:1m", "1m:5m", "1m:5m:average" };
+	TEST(murmur_create(PATH, NUM_ELEMS(same_method), same_method, agg_average, 0) != 0);
+	char *longer[] = { "10s:1m", "1m:5m", "1m:10m:max" };
+	TEST(murmur_create(PATH, NUM_ELEMS(longer), longer, agg_average, 0) != 0);
+	char *unknown[] = { "10s:1m", "1m:5m:median" };
+	TEST(murmur_create(PATH, NUM_ELEMS(unknown), unknown, agg_average, 0) != 0);
+	
+	char *spec[] = {
+		"5m:1h:sum",
+		"1m:5m",
+		"10s:1m",
+		"1m:5m:max",
+	};
+	TEST(murmur_create(PATH, NUM_ELEMS(spec), spec, agg_average, 0) == 0);
+	
+	mmr_test_time = 3595;
+	
+	struct murmur *mmr = murmur_open(PATH);
+	TEST(mmr != NULL);
+	TEST(mmr->flags & MURMUR_FLAG_AGGREGATION);
+	TEST(mmr->archive_count == 4);
+	TEST(mmr->archives[1].aggregation == agg_average);
+	TEST(mmr->archives[1].sibling == mmr->archives + 2);
+	TEST(mmr->archives[2].aggregation == agg_max);
+	TEST(mmr->archives[1].lower == mmr->archives + 3);
+	TEST(mmr->archives[2].lower == NULL);
+	TEST(mmr->archives[3].aggregation == agg_sum);
+	
+	// One write feeds every rollup
+	for (int64_t i = 0; i < 6; i++) {
+		TEST(murmur_set(mmr, 3540 + (i * 10), i + 1) == 0);
+	}
+	
+	double value;
+	TEST(test_archive_aggregation_read(mmr, 0, &value) == 0);
+	TEST(fabs(value - 3.5) < 1e-6);
+	TEST(test_archive_aggregation_read(mmr, agg_average, &value) == 0);
+	TEST(fabs(value - 3.5) < 1e-6);
+	TEST(test_archive_aggregation_read(mmr, agg_max, &value) == 0);
+	TEST(value == 6);
+	
+	struct murmur_series series;
+	TEST(murmur_fetch_aggregation(mmr, 3539, 3595, 60, agg_min, &series) != 0);
+	murmur_series_free(&series);
+	
+	// Found further down, and the most precise archive counts as anything
+	TEST(murmur_fetch_aggregation(mmr, 3295, 3595, 60, agg_sum, &series) == 0);
+	TEST(series.step == 300);
+	TEST(fabs(series.values[series.count - 1] - 3.5) < 1e-6);
+	murmur_series_free(&series);
+	
+	TEST(murmur_fetch_aggregation(mmr, 3539, 3595, 0, agg_min, &series) == 0);
+	TEST(series.step == 10);
+	murmur_series_free(&series);
+	
+	// Too old for the most precise archive, so written straight to every archive at 1m
+	TEST(murmur_set(mmr, 3480, 20) == 0);
+	TEST(murmur_fetch_aggregation(mmr, 3479, 3535, 60, agg_max, &series) == 0);
+	TEST(series.from == 3480);
+	TEST(series.values[0] == 20);
+	murmur_series_free(&series);
+	
+	murmur_close(mmr);
+	
+	// The same through the scheduler, after opening again
+	mmr = murmur_open(PATH);
+	TEST(mmr != NULL);
+	TEST(mmr->archives[2].aggregation == agg_max);
+	
+	struct murmur_sched *sched = murmur_sched_new();
+	TEST(sched != NULL);
+	TEST(murmur_sched_set(sched, mmr, 3540, 10) == 0);
+	TEST(murmur_sched_flush(sched) == 0);
+	murmur_sched_free(sched);
+	
+	TEST(test_archive_aggregation_read(mmr, 0, &value) == 0);
+	TEST(value == 5);
+	TEST(test_archive_aggregation_read(mmr, agg_max, &value) == 0);
+	TEST(value == 10);
+	
+	sched = murmur_sched_new();
+	TEST(sched != NULL);
+	TEST(murmur_sched_set(sched, mmr, 3420, 30) == 0);
+	TEST(murmur_sched_flush(sched) == 0);
+	murmur_sched_free(sched);
+	
+	TEST(murmur_fetch_aggregation(mmr, 3419, 3475, 60, agg_max, &series) == 0);
+	TEST(series.from == 3420);
+	TEST(series.values[0] == 30);
+	murmur_series_free(&series);
+	
+	murmur_close(mmr);
+	
+	// Prefix sums go after the methods
+	TEST(murmur_prefix_enable(PATH) == 0);
+	mmr = murmur_open(PATH);
+	TEST(mmr != NULL);
+	TEST(mmr->flags & MURMUR_FLAG_PREFIX);
+	TEST(mmr->flags & MURMUR_FLAG_AGGREGATION);
+	TEST(mmr->archives[2].aggregation == agg_max);
+	TEST(test_prefix_range(mmr, 3535, 3595) == 0);
+	
+	double sum;
+	uint64_t count;
+	TEST(murmur_range_sum(mmr, 3535, 3595, &sum, &count) == 0);
+	TEST(sum == 30);
+	TEST(count == 6);
+	
+	TEST(murmur_set(mmr, 3550, 4) == 0);
+	TEST(test_archive_aggregation_read(mmr, agg_max, &value) == 0);
+	TEST(value == 10);
+	TEST(test_prefix_range(mmr, 3535, 3595) == 0);
+	
+	murmur_close(mmr);
+	
+	return 0;
+}
+
+static int test_import() {
+	TEST(system("rm -rf " STORE) == 0);
+	
+	mmr_test_time = 1000;
+	
+	struct murmur_schemas *schemas = murmur_schemas_parse("[all]\npattern = **\nretentions = 10s:1m,1m:5m\n");
+	struct murmur_store *store = murmur_store_open(STORE, schemas);
+	TEST(store != NULL);
+	
+	// Fewer files may stay open than there are metrics
+	store->handles_max = 2;
+	
+	FILE *f = fopen(STORE "_import.csv", "w");
+	TEST(f != NULL);
+	
+	fprintf(f, "name,timestamp,value\n");
+	for (uint32_t i = 0; i < 5; i++) {
+		for (uint32_t m = 0; m < 8; m++) {
+			fprintf(f, m % 2 ? "imp.m%u\t%u\t%u\r\n" : "imp.m%u,%u,%u\n", m, 1000 - (i * 10), (m * 10) + i);
+		}
+	}
+	fprintf(f, "\n");
+	fprintf(f, "imp.m0,1000\n");
+	fprintf(f, "imp.m0,abc,1\n");
+	fprintf(f, "imp.m0,1,1\n");
+	fprintf(f, "imp.x,990.75,1.5e1\n");
+	fprintf(f, "imp.y,980,2.25");
+	TEST(fclose(f) == 0);
+	
+	struct murmur_import_stats stats;
+	TEST(murmur_store_import(store, STORE "_import.csv", 3, &stats) == 0);
+	TEST(stats.lines == 46);
+	TEST(stats.points == 42);
+	TEST(stats.skipped == 4);
+	TEST(stats.bytes > 0);
+	
+	double val;
+	struct murmur *mmr = murmur_store_handle(store, "imp.m3", 0);
+	TEST(mmr != NULL);
+	TEST(murmur_get(mmr, 1000, &val) == 0 && val == 30);
+	TEST(murmur_get(mmr, 960, &val) == 0 && val == 34);
+	
+	mmr = murmur_store_handle(store, "imp.x", 0);
+	TEST(mmr != NULL);
+	TEST(murmur_get(mmr, 990, &val) == 0 && val == 15);
+	
+	mmr = murmur_store_handle(store, "imp.y", 0);
+	TEST(mmr != NULL);
+	TEST(murmur_get(mmr, 980, &val) == 0 && fabs(val - 2.25) < 1e-6);
+	
+	// Lower archives are propagated just like any other write
+	for (uint32_t i = 0; i < 5; i++) {
+		TEST(murmur_store_set(store, "imp.ref", 1000 - (i * 10), 40 + i) == 0);
+	}
+	TEST(murmur_store_flush(store) == 0);
+	
+	double ref;
+	mmr = murmur_store_handle(store, "imp.ref", 0);
+	TEST(_murmur_arch_get(mmr, mmr->archives + 1, 960, &ref) == 0);
+	mmr = murmur_store_handle(store, "imp.m4", 0);
+	TEST(_murmur_arch_get(mmr, mmr->archives + 1, 960, &val) == 0 && val == ref);
+	
+	TEST(murmur_store_import(store, STORE "_missing.csv", 2, &stats) == -1);
+	
+	unlink(STORE "_import.csv");
+	murmur_store_close(store);
+	murmur_schemas_free(schemas);
+	
+	return 0;
+}
+
 static void test(test_fn fn) {
 	total_tests++;
 	
@@ -170,6 +2358,32 @@ int main(int argc, char **argv) {
 	test(test_sane);
 	test(test_high_precision_full);
 	test(test_full);
+	test(test_sched);
+	test(test_schemas);
+	test(test_store_create);
+	test(test_rules);
+	test(test_ring);
+	test(test_relay);
+	test(test_cluster_fetch);
+	test(test_serve);
+	test(test_admission);
+	test(test_index);
+	test(test_scan);
+	test(test_io);
+	test(test_aggregate);
+	test(test_shapes);
+	test(test_mem);
+	test(test_recover);
+	test(test_recover_flush);
+	test(test_partition);
+	test(test_memtable);
+	test(test_subscribe);
+	test(test_prefix);
+	test(test_downsample);
+	test(test_progressive);
+	test(test_stats);
+	test(test_archive_aggregation);
+	test(test_import);
 	
 	printf("\nResults: %u/%u passing (%u/%u conditions passing)\n",
 		total_tests - failed_tests,
@@ -0,0 +1,235 @@
+/**
+ * Checks the C++ interface. The library itself is tested by murmur_test.c.
+ */
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+#include <sys/stat.h>
+
+#include "murmur_async.hpp"
+
+extern "C" time_t mmr_test_time;
+
+#define PATH "murmur_test_cpp.mmr"
+#define ASYNC_DIR "murmur_test_cpp_async"
+
+/**
+ * A test assertion
+ */
+#define TEST(expr) \
+	total++; \
+	if (!(expr)) { \
+		failed++; \
+		printf("Fail (line %d): %s\n", __LINE__, #expr); \
+		return 1; \
+	}
+
+/**
+ * Counters for tests.
+ */
+static unsigned int total = 0;
+static unsigned int failed = 0;
+static unsigned int total_tests = 0;
+static unsigned int failed_tests = 0;
+
+typedef int (*test_fn)();
+
+static int test_handle() {
+	const char *spec[] = {
+		"10s:1m",
+		"1m:5m",
+	};
+	TEST(libmurmur::Murmur::create(PATH, spec, agg_average));
+	
+	TEST(libmurmur::Murmur::open("murmur_test_cpp_missing.mmr").error() == libmurmur::Error::io);
+	
+	auto opened = libmurmur::Murmur::open(PATH);
+	TEST(opened.has_value());
+	
+	libmurmur::Murmur mmr = std::move(*opened);
+	TEST(mmr && !opened.value());
+	
+	mmr_test_time = 600;
+	TEST(mmr.set(600, 1));
+	TEST(*mmr.get(600) == 1);
+	
+	// Out of order, and one too old to keep
+	libmurmur::Point points[] = {
+		{ 590, 2 },
+		{ 570, 4 },
+		{ 580, 3 },
+		{ 10, 99 },
+	};
+	TEST(mmr.set_many(points).error() == libmurmur::Error::out_of_range);
+	TEST(mmr.set_many(std::span(points, 3)));
+	
+	auto size = mmr.fetch_size(560, 600);
+	TEST(size && *size == 4);
+	
+	double small[2];
+	TEST(mmr.fetch(560, 600, small).error() == libmurmur::Error::buffer_too_small);
+	
+	double buff[16];
+	auto series = mmr.fetch(560, 600, buff);
+	TEST(series.has_value());
+	TEST(series->from == 570 && series->step == 10 && series->values.size() == 4);
+	TEST(series->values.data() == buff);
+	TEST(buff[0] == 4 && buff[1] == 3 && buff[2] == 2 && buff[3] == 1);
+	
+	// Asking for a coarser step reads the coarser archive, which the writes propogated to
+	series = mmr.fetch(0, 600, buff, 60);
+	TEST(series && series->step == 60);
+	TEST(!std::isnan(series->values.back()));
+	
+	libmurmur::Murmur moved(std::move(mmr));
+	TEST(moved && !mmr);
+	TEST(mmr.set(600, 1).error() == libmurmur::Error::closed);
+	
+	moved = libmurmur::Murmur(nullptr);
+	TEST(!moved);
+	
+	return 0;
+}
+
+/**
+ * A coroutine that nobody waits on.
+ */
+struct Detached {
+	struct promise_type {
+		Detached get_return_object() { return {}; }
+		std::suspend_never initial_suspend() { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+/**
+ * How the coroutines in test_async got on.
+ */
+struct Outcomes {
+	std::atomic<int> finished;
+	std::atomic<int> ok;
+};
+
+/**
+ * Where each coroutine in test_async keeps its file, so that none of them share buckets.
+ */
+static std::string async_path(const int i) {
+	return ASYNC_DIR "/" + std::to_string(i) + ".mmr";
+}
+
+static Detached fetch_one(libmurmur::Engine &engine, const std::string path, const int64_t at, Outcomes &outcomes) {
+	auto opened = co_await engine.open(path.c_str());
+	if (opened) {
+		libmurmur::Murmur mmr = std::move(*opened);
+		
+		libmurmur::Point pt = { at, 1 };
+		auto set = co_await engine.set_many(mmr, std::span(&pt, 1));
+		
+		double buff[8];
+		auto series = co_await engine.fetch(mmr, at - 10, at, buff);
+		
+		if (set && series && series->values.size() == 1 && buff[0] == 1) {
+			outcomes.ok++;
+		}
+	}
+	
+	outcomes.finished++;
+}
+
+static int test_async() {
+	const char *spec[] = {
+		"10s:1d",
+		"1m:5d",
+	};
+	
+	TEST(system("rm -rf " ASYNC_DIR) == 0);
+	TEST(mkdir(ASYNC_DIR, S_IRWXU) == 0);
+	
+	// Far more in flight than there are threads
+	const int count = 500;
+	for (int i = 0; i < count; i++) {
+		TEST(libmurmur::Murmur::create(async_path(i).c_str(), spec, agg_sum));
+	}
+	
+	mmr_test_time = 86400;
+	
+	Outcomes outcomes;
+	outcomes.finished = 0;
+	outcomes.ok = 0;
+	
+	{
+		libmurmur::Engine engine(4);
+		TEST(engine);
+		
+		for (int i = 0; i < count; i++) {
+			fetch_one(engine, async_path(i), mmr_test_time - (i * 10), outcomes);
+		}
+		
+		for (int i = 0; i < 1000 && outcomes.finished < count; i++) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		
+		TEST(outcomes.finished == count);
+		TEST(outcomes.ok == count);
+	}
+	
+	// Asking for no threads still gets one
+	libmurmur::Engine gone(0);
+	TEST(gone);
+	
+	// With the engine moved away, awaits fail rather than hang
+	libmurmur::Engine moved(std::move(gone));
+	TEST(!gone);
+	fetch_one(gone, async_path(0), mmr_test_time, outcomes);
+	TEST(outcomes.finished == count + 1 && outcomes.ok == count);
+	
+	// Everything written made it to disk, and down to the coarser archive
+	for (int i = 0; i < count; i++) {
+		auto mmr = libmurmur::Murmur::open(async_path(i).c_str());
+		TEST(mmr);
+		
+		int64_t at = mmr_test_time - (i * 10);
+		double buff[8];
+		auto series = mmr->fetch(at - 10, at, buff);
+		TEST(series && series->step == 10 && series->values.size() == 1 && buff[0] == 1);
+		
+		series = mmr->fetch(at - 60, at, buff, 60);
+		TEST(series && series->step == 60);
+		
+		double sum = 0;
+		for (double v : series->values) {
+			sum += std::isnan(v) ? 0 : v;
+		}
+		TEST(sum == 1);
+	}
+	
+	return 0;
+}
+
+static void test(test_fn fn) {
+	total_tests++;
+	
+	failed_tests += fn() != 0;
+}
+
+int main(int argc, char **argv) {
+	printf("Running C++ tests...\n\n");
+	
+	test(test_handle);
+	test(test_async);
+	
+	printf("\nResults: %u/%u passing (%u/%u conditions passing)\n",
+		total_tests - failed_tests,
+		total_tests,
+		total - failed,
+		total
+	);
+	
+	return failed_tests != 0;
+}